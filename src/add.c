@@ -862,9 +862,9 @@ void addremove_cmd(void){
   /* step 2: search for missing files */
   db_prepare(&q,
       "SELECT pathname, %Q || pathname, deleted FROM vfile"
-      " WHERE NOT deleted"
+      " WHERE NOT deleted AND NOT %s"
       " ORDER BY 1",
-      g.zLocalRoot
+      g.zLocalRoot, sparse_hidden_sql()
   );
   while( db_step(&q)==SQLITE_ROW ){
     const char *zFile;
@@ -1473,6 +1473,89 @@ void compress2_cmd(void){
   blob_write_to_file(&f1, g.argv[4]);
 }
 
+#if INTERFACE
+/*
+** Set in the 4-byte size header of compressed content if the content
+** was compressed by blob_compress_dict() using the preset dictionary
+** of the repository.
+*/
+#define BLOB_COMPRESS_DICT 0x80000000
+#endif
+
+/*
+** Compress blob pIn into pOut like blob_compress(), but using the zlib
+** preset dictionary pDict.  This helps for small inputs that have a lot
+** in common with the dictionary.  The BLOB_COMPRESS_DICT bit is set in
+** the size header so that blob_uncompress() knows to use the dictionary
+** returned by content_compress_dict().
+**
+** pOut must either be the same as pIn or else uninitialized.
+*/
+void blob_compress_dict(Blob *pIn, Blob *pOut, Blob *pDict){
+  unsigned int nIn = blob_size(pIn);
+  unsigned int nOut = 13 + nIn + (nIn+999)/1000;
+  unsigned char *outBuf;
+  z_stream stream;
+  Blob temp;
+  blob_zero(&temp);
+  blob_resize(&temp, nOut+4);
+  outBuf = (unsigned char*)blob_buffer(&temp);
+  outBuf[0] = (nIn>>24 & 0xff) | (BLOB_COMPRESS_DICT>>24);
+  outBuf[1] = nIn>>16 & 0xff;
+  outBuf[2] = nIn>>8 & 0xff;
+  outBuf[3] = nIn & 0xff;
+  stream.zalloc = (alloc_func)0;
+  stream.zfree = (free_func)0;
+  stream.opaque = 0;
+  stream.avail_out = nOut;
+  stream.next_out = &outBuf[4];
+  deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+  deflateSetDictionary(&stream, (unsigned char*)blob_buffer(pDict),
+                       blob_size(pDict));
+  stream.avail_in = nIn;
+  stream.next_in = (unsigned char*)blob_buffer(pIn);
+  deflate(&stream, Z_FINISH);
+  blob_resize(&temp, stream.total_out + 4);
+  deflateEnd(&stream);
+  if( pOut==pIn ) blob_reset(pOut);
+  assert_blob_is_reset(pOut);
+  *pOut = temp;
+}
+
+/*
+** Uncompress nIn bytes of zlib data in inBuf that were compressed using
+** the repository dictionary into nOut bytes in pOut.  Return the number
+** of bytes of output, or -1 on an error.
+*/
+static long int blob_uncompress_dict(
+  unsigned char *inBuf,
+  unsigned int nIn,
+  unsigned char *outBuf,
+  unsigned int nOut
+){
+  Blob *pDict = content_compress_dict();
+  z_stream stream;
+  long int nResult = -1;
+  int rc;
+  if( pDict==0 ) return -1;
+  memset(&stream, 0, sizeof(stream));
+  stream.next_in = inBuf;
+  stream.avail_in = nIn;
+  stream.next_out = outBuf;
+  stream.avail_out = nOut;
+  if( inflateInit(&stream)!=Z_OK ) return -1;
+  rc = inflate(&stream, Z_FINISH);
+  if( rc==Z_NEED_DICT
+   && inflateSetDictionary(&stream, (unsigned char*)blob_buffer(pDict),
+                           blob_size(pDict))==Z_OK
+  ){
+    rc = inflate(&stream, Z_FINISH);
+  }
+  if( rc==Z_STREAM_END ) nResult = stream.total_out;
+  inflateEnd(&stream);
+  return nResult;
+}
+
 /*
 ** Uncompress blob pIn and store the result in pOut.  It is ok for pIn and
 ** pOut to be the same blob.
@@ -1491,6 +1574,23 @@ int blob_uncompress(Blob *pIn, Blob *pOut){
   }
   inBuf = (unsigned char*)blob_buffer(pIn);
   nOut = (inBuf[0]<<24) + (inBuf[1]<<16) + (inBuf[2]<<8) + inBuf[3];
+  if( nOut & BLOB_COMPRESS_DICT ){
+    long int n;
+    nOut &= ~BLOB_COMPRESS_DICT;
+    blob_zero(&temp);
+    blob_resize(&temp, nOut+1);
+    n = blob_uncompress_dict(&inBuf[4], nIn - 4,
+                             (unsigned char*)blob_buffer(&temp), nOut);
+    if( n<0 ){
+      blob_reset(&temp);
+      return 1;
+    }
+    blob_resize(&temp, n);
+    if( pOut==pIn ) blob_reset(pOut);
+    assert_blob_is_reset(pOut);
+    *pOut = temp;
+    return 0;
+  }
   blob_zero(&temp);
   blob_resize(&temp, nOut+1);
   nOut2 = (long int)nOut;
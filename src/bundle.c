@@ -320,7 +320,8 @@ static void bundle_export_cmd(void){
 
   /* Directly copy content from the repository into the bundle as long
   ** as the repository content is a delta from some other artifact that
-  ** is also in the bundle.
+  ** is also in the bundle, and is not compressed using the repository
+  ** dictionary (the first byte of such content is 0x80 or more).
   */
   db_multi_exec(
     "REPLACE INTO bblob(blobid,uuid,sz,delta,data,notes) "
@@ -334,7 +335,8 @@ static void bundle_export_cmd(void){
     " FROM tobundle, blob, delta"
     " WHERE blob.rid=tobundle.rid"
     "   AND delta.rid=tobundle.rid"
-    "   AND delta.srcid IN tobundle;"
+    "   AND delta.srcid IN tobundle"
+    "   AND blob.content<x'80';"
   );
 
   /* For all the remaining artifacts, we need to construct their deltas
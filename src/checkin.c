@@ -21,6 +21,9 @@
 #include "config.h"
 #include "checkin.h"
 #include <assert.h>
+#ifdef FOSSIL_HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 /*
 ** Change filter options.
@@ -159,13 +162,13 @@ static void status_report(
     blob_append_sql(&sql,
       "SELECT pathname, %s as mtime, %s as size, deleted, chnged, rid,"
       "       coalesce(origname!=pathname,0) AS renamed, 1 AS managed,"
-      "       origname"
+      "       origname, %s AS sparse"
       "  FROM vfile LEFT JOIN blob USING (rid)"
       " WHERE is_selected(id)%s",
       flags & C_MTIME ? "datetime(checkin_mtime(:vid, rid), "
                         "'unixepoch', toLocal())" : "''" /*safe-for-%s*/,
       flags & C_SIZE ? "coalesce(blob.size, 0)" : "0" /*safe-for-%s*/,
-      blob_sql_text(&where));
+      sparse_hidden_sql() /*safe-for-%s*/, blob_sql_text(&where));
 
     /* Exclude unchanged files unless requested. */
     if( !(flags & C_UNCHANGED) ){
@@ -180,7 +183,7 @@ static void status_report(
       blob_append_sql(&sql, " UNION ALL");
     }
     blob_append_sql(&sql,
-      " SELECT pathname, %s, %s, 0, 0, 0, 0, 0, NULL"
+      " SELECT pathname, %s, %s, 0, 0, 0, 0, 0, NULL, 0"
       " FROM sfile WHERE pathname NOT IN (%s)%s",
       flags & C_MTIME ? "datetime(mtime, 'unixepoch', toLocal())" : "''",
       flags & C_SIZE ? "size" : "0",
@@ -220,7 +223,7 @@ static void status_report(
     int isRenamed = db_column_int(&q, 6);
     const char *zOrigName = 0;
     char *zFullName = mprintf("%s%s", g.zLocalRoot, zPathname);
-    int isMissing = !file_isfile_or_link(zFullName);
+    int isMissing = !db_column_int(&q, 9) && !file_isfile_or_link(zFullName);
 
     /* Determine the file change classification, if any. */
     if( isDeleted ){
@@ -873,9 +876,11 @@ void ls_cmd_rev(
 **   -R|--repository REPO  Extract info from repository REPO
 **   -t                    Sort output in time order
 **   --tree                Tree format
-**   -v|--verbose          Provide extra information about each file
+**   -v|--verbose          Provide extra information about each file.
+**                         Files outside of a sparse check-out are
+**                         shown as SPARSE.
 **
-** See also: [[changes]], [[extras]], [[status]], [[tree]]
+** See also: [[changes]], [[extras]], [[sparse]], [[status]], [[tree]]
 */
 void ls_cmd(void){
   int vid;
@@ -957,17 +962,19 @@ void ls_cmd(void){
   if( showAge ){
     db_prepare(&q,
        "SELECT pathname, deleted, rid, chnged, coalesce(origname!=pathname,0),"
-       "       datetime(checkin_mtime(%d,rid),'unixepoch',toLocal())"
+       "       datetime(checkin_mtime(%d,rid),'unixepoch',toLocal()), %s"
        "  FROM vfile %s"
        " ORDER BY %s",
-       vid, blob_sql_text(&where), zOrderBy /*safe-for-%s*/
+       vid, sparse_hidden_sql(), blob_sql_text(&where),
+       zOrderBy /*safe-for-%s*/
     );
   }else{
     db_prepare(&q,
        "SELECT pathname, deleted, rid, chnged,"
-       "       coalesce(origname!=pathname,0), islink"
+       "       coalesce(origname!=pathname,0), islink, %s"
        "  FROM vfile %s"
-       " ORDER BY %s", blob_sql_text(&where), zOrderBy /*safe-for-%s*/
+       " ORDER BY %s", sparse_hidden_sql(), blob_sql_text(&where),
+       zOrderBy /*safe-for-%s*/
     );
   }
   blob_reset(&where);
@@ -978,6 +985,7 @@ void ls_cmd(void){
     int chnged = db_column_int(&q,3);
     int renamed = db_column_int(&q,4);
     int isLink = db_column_int(&q,5);
+    int isSparse = db_column_int(&q,6);
     char *zFullName = mprintf("%s%s", g.zLocalRoot, zPathname);
     const char *type = "";
     if( verboseFlag ){
@@ -985,6 +993,8 @@ void ls_cmd(void){
         type = "ADDED      ";
       }else if( isDeleted ){
         type = "DELETED    ";
+      }else if( isSparse ){
+        type = "SPARSE     ";
       }else if( !file_isfile_or_link(zFullName) ){
         if( file_access(zFullName, F_OK)==0 ){
           type = "NOT_A_FILE ";
@@ -1937,12 +1947,12 @@ static void create_manifest(
   zDate[10] = ' ';
   db_prepare(&q,
     "SELECT pathname, uuid, origname, blob.rid, isexe, islink,"
-    "       is_selected(vfile.id)"
+    "       is_selected(vfile.id) AND NOT %s"
     "  FROM vfile JOIN blob ON vfile.mrid=blob.rid"
     " WHERE (NOT deleted OR NOT is_selected(vfile.id))"
     "   AND vfile.vid=%d"
     " ORDER BY if_selected(vfile.id, pathname, origname)",
-    vid);
+    sparse_hidden_sql(), vid);
   blob_zero(&filename);
   blob_appendf(&filename, "%s", g.zLocalRoot);
   nBasename = blob_size(&filename);
@@ -1964,7 +1974,8 @@ static void create_manifest(
     /* For unix, extract the "executable" and "symlink" permissions
     ** directly from the filesystem.  On windows, permissions are
     ** unchanged from the original.  However, only do this if the file
-    ** itself is actually selected to be part of this check-in.
+    ** itself is actually selected to be part of this check-in, and is
+    ** not an unchanged file outside of a sparse check-out.
     */
     if( isSelected ){
       int mPerm;
@@ -2446,6 +2457,396 @@ int verify_comment(Blob *pComment, int mFlags){
   return rc;
 } 
 
+/*
+** One changed file being committed.  The first group of fields is set
+** by the main thread from the VFILE and BLOB tables.  The second group
+** is filled in by commit_prepare_file(), possibly in a worker thread.
+*/
+typedef struct CommitFile CommitFile;
+struct CommitFile {
+  int id;               /* VFILE.ID */
+  int rid;              /* VFILE.MRID.  The artifact being replaced */
+  int crlfOk;           /* True if CR/LF warnings are disabled */
+  int binOk;            /* True if binary warnings are disabled */
+  int encodingOk;       /* True if encoding warnings are disabled */
+  int wantSha1;         /* True if the SHA1 hash might be needed */
+  char *zFullname;      /* Full pathname of the file */
+  Blob parent;          /* Compressed full text of rid, or empty */
+
+  int eStatus;          /* One of the CFILE_* values below */
+  int isDone;           /* True once commit_prepare_file() has finished */
+  int deltaFallback;    /* Leave the delta against rid to content_deltify() */
+  i64 iNow;             /* Time taken before info was filled in */
+  FileStatInfo info;    /* The file as seen by file_stat_info() */
+  Blob content;         /* Content of the file */
+  Blob sha1;            /* SHA1 hash of content, if wantSha1 */
+  Blob sha3;            /* SHA3-256 hash of content */
+  Blob cmpr;            /* content, compressed by content_compress() */
+  Blob delta;           /* Compressed delta from content to rid, or empty */
+};
+
+/*
+** Allowed values for CommitFile.eStatus
+*/
+#define CFILE_OK        0   /* Content read, hashed and compressed */
+#define CFILE_MISSING   1   /* The file could not be read */
+#define CFILE_CORRUPT   2   /* The compressed content does not round-trip */
+
+/*
+** Read, hash and compress the file described by p, and if the full text
+** of the artifact it replaces is in p->parent, compute the delta that
+** content_deltify() would store for that artifact.  Every result is
+** checked to reproduce its input, so that verify_before_commit() need
+** not check it again.  This routine does not touch the database or any
+** other shared state, so it may run in a worker thread.
+*/
+static void commit_prepare_file(CommitFile *p){
+  Blob x;
+
+  p->iNow = file_current_time_ns();
+  file_stat_info(p->zFullname, RepoFILE, &p->info);
+  blob_zero(&p->content);
+  if( p->info.size<0 ){
+    p->eStatus = CFILE_MISSING;
+    return;
+  }
+#if !defined(_WIN32)
+  if( p->info.perm==PERM_LNK ){
+    char zBuf[1024];
+    ssize_t n = readlink(p->zFullname, zBuf, sizeof(zBuf)-1);
+    if( n<0 ){
+      p->eStatus = CFILE_MISSING;
+      return;
+    }
+    blob_append(&p->content, zBuf, (int)n);
+  }else
+#endif
+  {
+    FILE *in = fossil_fopen(p->zFullname, "rb");
+    if( in==0 ){
+      p->eStatus = CFILE_MISSING;
+      return;
+    }
+    blob_read_from_channel(&p->content, in, -1);
+    fclose(in);
+  }
+  sha3sum_blob(&p->content, 256, &p->sha3);
+  if( p->wantSha1 ) sha1sum_blob(&p->content, &p->sha1);
+  content_compress(&p->content, &p->cmpr);
+  blob_zero(&x);
+  if( blob_size(&p->content)>0
+   && (blob_uncompress(&p->cmpr, &x) || blob_compare(&x, &p->content)!=0)
+  ){
+    p->eStatus = CFILE_CORRUPT;
+  }
+  blob_reset(&x);
+
+  if( blob_size(&p->parent)>0 ){
+    Blob old, delta;
+    blob_zero(&old);
+    blob_zero(&delta);
+    if( blob_uncompress(&p->parent, &old) ){
+      p->deltaFallback = 1;
+    }else if( blob_size(&old)>=50 && blob_size(&p->content)>=50 ){
+      blob_delta_create(&p->content, &old, &delta);
+      if( blob_size(&delta) < blob_size(&old)*0.75 ){
+        if( blob_delta_apply(&p->content, &delta, &x)<0
+         || blob_compare(&x, &old)!=0
+        ){
+          p->deltaFallback = 1;
+        }else{
+          content_compress(&delta, &p->delta);
+        }
+        blob_reset(&x);
+      }
+    }
+    blob_reset(&delta);
+    blob_reset(&old);
+    blob_reset(&p->parent);
+  }
+}
+
+/*
+** Read the compressed full text of the artifact that the file p
+** replaces into p->parent, if content_deltify() would make that
+** artifact a delta of the new content.
+*/
+static void commit_read_parent(CommitFile *p){
+  blob_zero(&p->parent);
+  if( p->rid>0 ){
+    db_blob(&p->parent,
+      "SELECT content FROM blob"
+      " WHERE rid=%d AND size>=50"
+      "   AND NOT EXISTS(SELECT 1 FROM delta WHERE rid=%d)",
+      p->rid, p->rid
+    );
+  }
+}
+
+/*
+** Insert the content of file p into the repository and return its
+** record ID.  The hash is chosen as content_put() would choose it.
+*/
+static int commit_put_content(CommitFile *p){
+  Blob *pPrimary;       /* The preferred hash */
+  Blob *pAux = 0;       /* The alternative hash, if allowed */
+  Blob *pHash;
+  int nByte = blob_size(&p->content);
+  int rid;
+
+  if( nByte==0 ) return content_put(&p->content);
+  switch( g.eHashPolicy ){
+    case HPOLICY_AUTO:
+    case HPOLICY_SHA1:   pPrimary = &p->sha1;  pAux = &p->sha3;  break;
+    case HPOLICY_SHA3:   pPrimary = &p->sha3;  pAux = &p->sha1;  break;
+    default:             pPrimary = &p->sha3;                    break;
+  }
+  pHash = pAux && fast_uuid_to_rid(blob_str(pAux))>0 ? pAux : pPrimary;
+  rid = content_put_ex(&p->cmpr, blob_str(pHash), 0, nByte, 0);
+  verify_before_commit_checked(rid, blob_size(&p->cmpr));
+  return rid;
+}
+
+/*
+** Finish committing the file p, prepared by commit_prepare_file(): issue
+** warnings, insert the content into the repository, deltify the artifact
+** that it replaces, and update the VFILE table.
+*/
+static void commit_finish_file(
+  CommitFile *p,         /* The file to commit */
+  i64 mxSize,            /* Files larger than this are oversize.  0 for none */
+  int noWarningFlag,     /* True if skipping all warnings */
+  int noPrompt,          /* True if skipping all prompts */
+  int *pAbortCommit,     /* Set if a file was converted on request */
+  int *pnConflict        /* Incremented for each unresolved merge conflict */
+){
+  int nrid;
+  int sizeOk;
+  char *zFileUuid;
+
+  if( p->eStatus==CFILE_MISSING ){
+    fossil_fatal("cannot read %s", p->zFullname);
+  }else if( p->eStatus==CFILE_CORRUPT ){
+    fossil_panic("compression of %s does not reproduce its content",
+                 p->zFullname);
+  }
+  sizeOk = mxSize<=0 || file_size(p->zFullname, ExtFILE)<=mxSize;
+  /* Do not emit any warnings when they are disabled. */
+  if( !noWarningFlag ){
+    *pAbortCommit |= commit_warning(&p->content, p->crlfOk, p->binOk,
+                                    p->encodingOk, sizeOk, noPrompt,
+                                    p->zFullname, 0);
+  }
+  if( contains_merge_marker(&p->content) ){
+    Blob fname; /* Relative pathname of the file */
+
+    (*pnConflict)++;
+    file_relative_name(p->zFullname, &fname, 0);
+    fossil_print("possible unresolved merge conflict in %s\n",
+                 blob_str(&fname));
+    blob_reset(&fname);
+  }
+  nrid = commit_put_content(p);
+  if( nrid!=p->rid ){
+    if( p->rid>0 ){
+      if( blob_size(&p->delta)>0 ){
+        content_deltify_precomputed(p->rid, nrid, &p->delta);
+      }else if( p->deltaFallback ){
+        content_deltify(p->rid, &nrid, 1, 0);
+      }
+    }
+    db_multi_exec("UPDATE vfile SET mrid=%d, rid=%d, mhash=NULL WHERE id=%d",
+                  nrid, nrid, p->id);
+    db_add_unsent(nrid);
+  }
+  zFileUuid = rid_to_uuid(nrid);
+  vfile_set_fstat(p->id, zFileUuid, p->iNow, &p->info);
+  fossil_free(zFileUuid);
+}
+
+/*
+** Release the memory held by p.
+*/
+static void commit_file_reset(CommitFile *p){
+  fossil_free(p->zFullname);
+  blob_reset(&p->parent);
+  blob_reset(&p->content);
+  blob_reset(&p->sha1);
+  blob_reset(&p->sha3);
+  blob_reset(&p->cmpr);
+  blob_reset(&p->delta);
+}
+
+#ifdef FOSSIL_HAVE_PTHREAD
+/*
+** Work shared by the threads of commit_changed_files().  Files a[0]
+** through a[nQueued-1] have their parent content read and may be
+** claimed by any thread.
+*/
+typedef struct CommitPool CommitPool;
+struct CommitPool {
+  pthread_mutex_t mutex;     /* Protects the fields below */
+  pthread_cond_t workCond;   /* Signaled when files are queued */
+  pthread_cond_t doneCond;   /* Signaled when a worker finishes a file */
+  CommitFile *a;             /* The files being committed */
+  int nQueued;               /* Files that may be claimed */
+  int iNext;                 /* First file not yet claimed */
+  int isShutdown;            /* True to make the workers exit */
+};
+
+/*
+** Body of each worker thread.
+*/
+static void *commit_worker(void *pArg){
+  CommitPool *pPool = (CommitPool*)pArg;
+  pthread_mutex_lock(&pPool->mutex);
+  for(;;){
+    CommitFile *p;
+    while( pPool->iNext>=pPool->nQueued && !pPool->isShutdown ){
+      pthread_cond_wait(&pPool->workCond, &pPool->mutex);
+    }
+    if( pPool->iNext>=pPool->nQueued ) break;
+    p = &pPool->a[pPool->iNext++];
+    pthread_mutex_unlock(&pPool->mutex);
+    commit_prepare_file(p);
+    pthread_mutex_lock(&pPool->mutex);
+    p->isDone = 1;
+    pthread_cond_broadcast(&pPool->doneCond);
+  }
+  pthread_mutex_unlock(&pPool->mutex);
+  return 0;
+}
+#endif /* FOSSIL_HAVE_PTHREAD */
+
+/*
+** Insert every changed and selected file of the check-out into the
+** repository, as the second step of "fossil commit".
+**
+** Reading, hashing and compressing the files, and computing the deltas
+** for the artifacts they replace, is done by the number of threads given
+** by the checkout-threads setting.  The main thread does all database
+** work, and handles the files in VFILE order so that warnings and the
+** resulting repository are the same for any number of threads.
+*/
+static void commit_changed_files(
+  i64 mxSize,            /* Files larger than this are oversize.  0 for none */
+  int noWarningFlag,     /* True if skipping all warnings */
+  int noPrompt,          /* True if skipping all prompts */
+  int *pAbortCommit,     /* Set if a file was converted on request */
+  int *pnConflict        /* Incremented for each unresolved merge conflict */
+){
+  Stmt q;
+  CommitFile *a = 0;
+  int n = 0;
+  int nAlloc = 0;
+  int nThread = vfile_thread_count();
+  int wantSha1;
+  int i;
+
+  wantSha1 = g.eHashPolicy!=HPOLICY_SHA3_ONLY
+          && g.eHashPolicy!=HPOLICY_SHUN_SHA1;
+  db_prepare(&q,
+    "SELECT id, %Q || pathname, mrid, %s, %s, %s FROM vfile "
+    "WHERE chnged<>0 AND NOT deleted AND is_selected(id)",
+    g.zLocalRoot,
+    glob_expr("pathname", db_get("crlf-glob",db_get("crnl-glob",""))),
+    glob_expr("pathname", db_get("binary-glob","")),
+    glob_expr("pathname", db_get("encoding-glob",""))
+  );
+  while( db_step(&q)==SQLITE_ROW ){
+    CommitFile *p;
+    if( n>=nAlloc ){
+      nAlloc = nAlloc*2 + 100;
+      a = fossil_realloc(a, nAlloc*sizeof(a[0]));
+    }
+    p = &a[n++];
+    memset(p, 0, sizeof(*p));
+    p->id = db_column_int(&q, 0);
+    p->zFullname = fossil_strdup(db_column_text(&q, 1));
+    p->rid = db_column_int(&q, 2);
+    p->crlfOk = db_column_int(&q, 3);
+    p->binOk = db_column_int(&q, 4);
+    p->encodingOk = db_column_int(&q, 5);
+    p->wantSha1 = wantSha1;
+    blob_zero(&p->parent);
+    blob_zero(&p->content);
+    blob_zero(&p->sha1);
+    blob_zero(&p->sha3);
+    blob_zero(&p->cmpr);
+    blob_zero(&p->delta);
+  }
+  db_finalize(&q);
+
+  /* The workers need the compression dictionary, which must be read
+  ** from the database before any of them starts. */
+  content_compress_dict();
+#ifdef FOSSIL_HAVE_PTHREAD
+  if( nThread>1 && n>1 ){
+    CommitPool pool;
+    pthread_t aThread[64];
+    int nStarted = 0;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.mutex, 0);
+    pthread_cond_init(&pool.workCond, 0);
+    pthread_cond_init(&pool.doneCond, 0);
+    pool.a = a;
+    while( nStarted<nThread-1
+        && pthread_create(&aThread[nStarted], 0, commit_worker, &pool)==0
+    ){
+      nStarted++;
+    }
+    for(i=0; i<n; i++){
+      CommitFile *p = &a[i];
+      int iQueued = pool.nQueued;
+      int isMine = 0;
+
+      /* Keep a bounded number of files ahead of the main thread queued */
+      while( iQueued<n && iQueued<i+4*nThread ){
+        commit_read_parent(&a[iQueued++]);
+      }
+      pthread_mutex_lock(&pool.mutex);
+      pool.nQueued = iQueued;
+      pthread_cond_broadcast(&pool.workCond);
+
+      /* Wait for p, or prepare it here if no worker has claimed it yet */
+      if( pool.iNext==i ){
+        pool.iNext++;
+        isMine = 1;
+      }else{
+        while( !p->isDone ){
+          pthread_cond_wait(&pool.doneCond, &pool.mutex);
+        }
+      }
+      pthread_mutex_unlock(&pool.mutex);
+      if( isMine ) commit_prepare_file(p);
+      commit_finish_file(p, mxSize, noWarningFlag, noPrompt,
+                         pAbortCommit, pnConflict);
+      commit_file_reset(p);
+    }
+    pthread_mutex_lock(&pool.mutex);
+    pool.isShutdown = 1;
+    pthread_cond_broadcast(&pool.workCond);
+    pthread_mutex_unlock(&pool.mutex);
+    for(i=0; i<nStarted; i++){
+      pthread_join(aThread[i], 0);
+    }
+    pthread_cond_destroy(&pool.doneCond);
+    pthread_cond_destroy(&pool.workCond);
+    pthread_mutex_destroy(&pool.mutex);
+    fossil_free(a);
+    return;
+  }
+#endif
+  for(i=0; i<n; i++){
+    commit_read_parent(&a[i]);
+    commit_prepare_file(&a[i]);
+    commit_finish_file(&a[i], mxSize, noWarningFlag, noPrompt,
+                       pAbortCommit, pnConflict);
+    commit_file_reset(&a[i]);
+  }
+  fossil_free(a);
+}
+
 /*
 ** COMMAND: ci#
 ** COMMAND: commit
@@ -2542,7 +2943,6 @@ int verify_comment(Blob *pComment, int mFlags){
 void commit_cmd(void){
   int hasChanges;        /* True if unsaved changes exist */
   int vid;               /* blob-id of parent version */
-  int nrid;              /* blob-id of a modified file */
   int nvid;              /* Blob-id of the new check-in */
   Blob comment;          /* Check-in comment */
   const char *zComment;  /* Check-in comment */
@@ -3081,63 +3481,14 @@ void commit_cmd(void){
   ** The resulting checksum is the same as is expected on the R-card
   ** of a manifest.
   */
-  if( useCksum ) vfile_aggregate_checksum_disk(vid, &cksum1);
+  if( useCksum ) vfile_aggregate_checksum_disk(vid, &cksum1, 1);
 
   /* Step 2: Insert records for all modified files into the blob
   ** table. If there were arguments passed to this command, only
   ** the identified files are inserted (if they have been modified).
   */
-  db_prepare(&q,
-    "SELECT id, %Q || pathname, mrid, %s, %s, %s FROM vfile "
-    "WHERE chnged<>0 AND NOT deleted AND is_selected(id)",
-    g.zLocalRoot,
-    glob_expr("pathname", db_get("crlf-glob",db_get("crnl-glob",""))),
-    glob_expr("pathname", db_get("binary-glob","")),
-    glob_expr("pathname", db_get("encoding-glob",""))
-  );
-  while( db_step(&q)==SQLITE_ROW ){
-    int id, rid;
-    const char *zFullname;
-    Blob content;
-    int crlfOk, binOk, encodingOk, sizeOk;
-
-    id = db_column_int(&q, 0);
-    zFullname = db_column_text(&q, 1);
-    rid = db_column_int(&q, 2);
-    crlfOk = db_column_int(&q, 3);
-    binOk = db_column_int(&q, 4);
-    encodingOk = db_column_int(&q, 5);
-    sizeOk = mxSize<=0 || file_size(zFullname, ExtFILE)<=mxSize;
-
-    blob_zero(&content);
-    blob_read_from_file(&content, zFullname, RepoFILE);
-    /* Do not emit any warnings when they are disabled. */
-    if( !noWarningFlag ){
-      abortCommit |= commit_warning(&content, crlfOk, binOk,
-                                    encodingOk, sizeOk, noPrompt,
-                                    zFullname, 0);
-    }
-    if( contains_merge_marker(&content) ){
-      Blob fname; /* Relative pathname of the file */
-
-      nConflict++;
-      file_relative_name(zFullname, &fname, 0);
-      fossil_print("possible unresolved merge conflict in %s\n",
-                   blob_str(&fname));
-      blob_reset(&fname);
-    }
-    nrid = content_put(&content);
-    blob_reset(&content);
-    if( nrid!=rid ){
-      if( rid>0 ){
-        content_deltify(rid, &nrid, 1, 0);
-      }
-      db_multi_exec("UPDATE vfile SET mrid=%d, rid=%d, mhash=NULL WHERE id=%d",
-                    nrid,nrid,id);
-      db_add_unsent(nrid);
-    }
-  }
-  db_finalize(&q);
+  commit_changed_files(mxSize, noWarningFlag, noPrompt,
+                       &abortCommit, &nConflict);
   if( nConflict && !allowConflict ){
     fossil_fatal("abort due to unresolved merge conflicts; "
                  "use --allow-conflict to override");
@@ -3302,7 +3653,7 @@ void commit_cmd(void){
     }
 
     /* Verify that the commit did not modify any disk images. */
-    vfile_aggregate_checksum_disk(nvid, &cksum2);
+    vfile_aggregate_checksum_disk(nvid, &cksum2, 0);
     if( blob_compare(&cksum1, &cksum2) ){
       fossil_fatal("working check-out before and after commit does not match");
     }
@@ -366,7 +366,7 @@ void checkout_cmd(void){
   db_multi_exec("DELETE FROM vmerge");
   if( !keepFlag && db_get_boolean("repo-cksum",1) ){
     vfile_aggregate_checksum_manifest(vid, &cksum1, &cksum1b);
-    vfile_aggregate_checksum_disk(vid, &cksum2);
+    vfile_aggregate_checksum_disk(vid, &cksum2, 0);
     if( blob_compare(&cksum1, &cksum2) ){
       fossil_print("WARNING: manifest checksum does not agree with disk\n");
     }
@@ -20,21 +20,56 @@
 #include "config.h"
 #include "content.h"
 #include <assert.h>
+#include <zlib.h>
 
 /*
-** The artifact retrieval cache
+** SETTING: content-cache-entries      width=10 default=500
+**
+** The maximum number of reconstructed artifacts that are held in
+** memory for reuse while a single Fossil command or web request is
+** running.  Larger values help commands like "fossil zip" and
+** "fossil annotate" that reconstruct many artifacts that share
+** delta chains.
+*/
+/*
+** SETTING: content-cache-bytes        width=16 default=50000000
+**
+** The maximum number of bytes of reconstructed artifact content that
+** are held in memory at once by the artifact cache.  See also the
+** "content-cache-entries" setting.
+*/
+
+/*
+** The artifact retrieval cache.
+**
+** Cache entries live in slots of the a[] array.  Each in-use slot is on
+** a hash chain rooted in aHash[] so that lookup by rid takes constant
+** time, and on a doubly-linked list ordered by most recent use so that
+** the least-recently used entry can be found without a scan.  Unused
+** slots are kept on a free list threaded through the iHash field.
+** Slot links are array indexes with -1 meaning "none".
 */
 static struct {
   i64 szTotal;         /* Total size of all entries in the cache */
   int n;               /* Current number of cache entries */
   int nAlloc;          /* Number of slots allocated in a[] */
-  int nextAge;         /* Age counter for implementing LRU */
+  int nHash;           /* Number of buckets in aHash[].  A power of 2 */
+  int *aHash;          /* Hash buckets.  Index of first slot in the chain */
+  int iNewest;         /* Most recently used slot */
+  int iOldest;         /* Least recently used slot */
+  int iFree;           /* First slot on the free list */
+  int mxEntry;         /* Maximum number of entries.  0 if not yet known */
+  i64 mxByte;          /* Maximum total size of all entries */
+  i64 nHit;            /* Number of lookups satisfied from the cache */
+  i64 nMiss;           /* Number of lookups not satisfied from the cache */
+  i64 nEvict;          /* Number of entries expired to make room */
   struct cacheLine {   /* One instance of this for each cache entry */
     int rid;                  /* Artifact id */
-    int age;                  /* Age.  Newer is larger */
+    int iHash;                /* Next slot on the same hash chain */
+    int iNewer;               /* Next more recently used slot */
+    int iOlder;               /* Next less recently used slot */
     Blob content;             /* Content of the artifact */
   } *a;                /* The positive cache */
-  Bag inCache;         /* Set of artifacts currently in cache */
 
   /*
   ** The missing artifact cache.
@@ -49,25 +84,116 @@ static struct {
   Bag available;       /* Cache of artifacts that are complete */
 } contentCache;
 
+/*
+** Return the hash bucket for rid
+*/
+#define CONTENT_CACHE_HASH(RID) \
+   (((unsigned)(RID)*2654435761u) & (contentCache.nHash-1))
+
+/*
+** Load the cache size limits from the repository settings, if that
+** has not been done already.
+*/
+static void content_cache_limits(void){
+  if( contentCache.mxEntry>0 ) return;
+  contentCache.mxEntry = db_get_int("content-cache-entries", 500);
+  contentCache.mxByte = db_get_int64("content-cache-bytes", 50000000);
+  if( contentCache.mxEntry<1 ) contentCache.mxEntry = 1;
+  if( contentCache.mxByte<0 ) contentCache.mxByte = 0;
+}
+
+/*
+** Unlink slot i from the recently-used list.
+*/
+static void content_cache_unlink(int i){
+  struct cacheLine *p = &contentCache.a[i];
+  if( p->iNewer>=0 ){
+    contentCache.a[p->iNewer].iOlder = p->iOlder;
+  }else{
+    contentCache.iNewest = p->iOlder;
+  }
+  if( p->iOlder>=0 ){
+    contentCache.a[p->iOlder].iNewer = p->iNewer;
+  }else{
+    contentCache.iOldest = p->iNewer;
+  }
+}
+
+/*
+** Make slot i the most recently used entry.
+*/
+static void content_cache_push(int i){
+  struct cacheLine *p = &contentCache.a[i];
+  p->iNewer = -1;
+  p->iOlder = contentCache.iNewest;
+  if( contentCache.iNewest>=0 ){
+    contentCache.a[contentCache.iNewest].iNewer = i;
+  }else{
+    contentCache.iOldest = i;
+  }
+  contentCache.iNewest = i;
+}
+
+/*
+** Return the slot holding rid, or -1 if rid is not in the cache.
+*/
+static int content_cache_find(int rid){
+  int i;
+  if( contentCache.n==0 ) return -1;
+  i = contentCache.aHash[CONTENT_CACHE_HASH(rid)];
+  while( i>=0 && contentCache.a[i].rid!=rid ){
+    i = contentCache.a[i].iHash;
+  }
+  return i;
+}
+
 /*
 ** Remove the oldest element from the content cache
 */
 static void content_cache_expire_oldest(void){
-  int i;
-  int mnAge = contentCache.nextAge;
-  int mn = -1;
-  for(i=0; i<contentCache.n; i++){
-    if( contentCache.a[i].age<mnAge ){
-      mnAge = contentCache.a[i].age;
-      mn = i;
-    }
+  int mn = contentCache.iOldest;
+  int *pi;
+  if( mn<0 ) return;
+  pi = &contentCache.aHash[CONTENT_CACHE_HASH(contentCache.a[mn].rid)];
+  while( *pi!=mn ) pi = &contentCache.a[*pi].iHash;
+  *pi = contentCache.a[mn].iHash;
+  content_cache_unlink(mn);
+  contentCache.szTotal -= blob_size(&contentCache.a[mn].content);
+  blob_reset(&contentCache.a[mn].content);
+  contentCache.a[mn].iHash = contentCache.iFree;
+  contentCache.iFree = mn;
+  contentCache.n--;
+  contentCache.nEvict++;
+}
+
+/*
+** Grow the slot array and rebuild the hash table so that there is
+** at least one free slot.
+*/
+static void content_cache_grow(void){
+  int i, nNew;
+  if( contentCache.nAlloc==0 ){
+    contentCache.iNewest = contentCache.iOldest = contentCache.iFree = -1;
+  }
+  nNew = contentCache.nAlloc*2 + 10;
+  contentCache.a = fossil_realloc(contentCache.a,
+                                  nNew*sizeof(contentCache.a[0]));
+  for(i=nNew-1; i>=contentCache.nAlloc; i--){
+    blob_zero(&contentCache.a[i].content);
+    contentCache.a[i].rid = 0;
+    contentCache.a[i].iHash = contentCache.iFree;
+    contentCache.iFree = i;
   }
-  if( mn>=0 ){
-    bag_remove(&contentCache.inCache, contentCache.a[mn].rid);
-    contentCache.szTotal -= blob_size(&contentCache.a[mn].content);
-    blob_reset(&contentCache.a[mn].content);
-    contentCache.n--;
-    contentCache.a[mn] = contentCache.a[contentCache.n];
+  contentCache.nAlloc = nNew;
+  fossil_free(contentCache.aHash);
+  contentCache.nHash = 64;
+  while( contentCache.nHash<nNew ) contentCache.nHash *= 2;
+  contentCache.aHash = fossil_malloc(contentCache.nHash*sizeof(int));
+  memset(contentCache.aHash, 0xff, contentCache.nHash*sizeof(int));
+  for(i=contentCache.iOldest; i>=0; i=contentCache.a[i].iNewer){
+    int h = CONTENT_CACHE_HASH(contentCache.a[i].rid);
+    contentCache.a[i].iHash = contentCache.aHash[h];
+    contentCache.aHash[h] = i;
   }
 }
 
@@ -79,25 +205,33 @@ static void content_cache_expire_oldest(void){
 */
 void content_cache_insert(int rid, Blob *pBlob){
   struct cacheLine *p;
-  if( contentCache.n>500 || contentCache.szTotal>50000000 ){
-    i64 szBefore;
-    do{
-      szBefore = contentCache.szTotal;
-      content_cache_expire_oldest();
-    }while( contentCache.szTotal>50000000 && contentCache.szTotal<szBefore );
-  }
-  if( contentCache.n>=contentCache.nAlloc ){
-    contentCache.nAlloc = contentCache.nAlloc*2 + 10;
-    contentCache.a = fossil_realloc(contentCache.a,
-                             contentCache.nAlloc*sizeof(contentCache.a[0]));
-  }
-  p = &contentCache.a[contentCache.n++];
+  int i, h;
+  content_cache_limits();
+  if( content_cache_find(rid)>=0 ){
+    blob_reset(pBlob);
+    return;
+  }
+  while( contentCache.n>0
+   && (contentCache.n>=contentCache.mxEntry
+        || contentCache.szTotal+blob_size(pBlob)>contentCache.mxByte)
+  ){
+    content_cache_expire_oldest();
+  }
+  if( contentCache.iFree<0 || contentCache.nHash==0 ){
+    content_cache_grow();
+  }
+  i = contentCache.iFree;
+  p = &contentCache.a[i];
+  contentCache.iFree = p->iHash;
+  h = CONTENT_CACHE_HASH(rid);
   p->rid = rid;
-  p->age = contentCache.nextAge++;
+  p->iHash = contentCache.aHash[h];
+  contentCache.aHash[h] = i;
+  content_cache_push(i);
+  contentCache.n++;
   contentCache.szTotal += blob_size(pBlob);
   p->content = *pBlob;
   blob_zero(pBlob);
-  bag_insert(&contentCache.inCache, rid);
 }
 
 /*
@@ -107,21 +241,242 @@ void content_cache_insert(int rid, Blob *pBlob){
 */
 void content_clear_cache(int bFreeIt){
   int i;
-  for(i=0; i<contentCache.n; i++){
-    blob_reset(&contentCache.a[i].content);
+  if( contentCache.n>0 ){
+    for(i=contentCache.iOldest; i>=0; i=contentCache.a[i].iNewer){
+      blob_reset(&contentCache.a[i].content);
+    }
   }
   bag_clear(&contentCache.missing);
   bag_clear(&contentCache.available);
-  bag_clear(&contentCache.inCache);
   contentCache.n = 0;
   contentCache.szTotal = 0;
+  contentCache.iNewest = contentCache.iOldest = -1;
+  contentCache.iFree = -1;
   if(bFreeIt){
+    contentCache.mxEntry = 0;
     fossil_free(contentCache.a);
     contentCache.a = 0;
     contentCache.nAlloc = 0;
+    fossil_free(contentCache.aHash);
+    contentCache.aHash = 0;
+    contentCache.nHash = 0;
+  }else{
+    for(i=contentCache.nAlloc-1; i>=0; i--){
+      contentCache.a[i].iHash = contentCache.iFree;
+      contentCache.iFree = i;
+    }
+    if( contentCache.nHash ){
+      memset(contentCache.aHash, 0xff, contentCache.nHash*sizeof(int));
+    }
+  }
+}
+
+/*
+** Write a one-line summary of artifact cache usage for the current
+** process into pOut.
+*/
+void content_cache_stats(Blob *pOut){
+  i64 nLookup = contentCache.nHit + contentCache.nMiss;
+  content_cache_limits();
+  blob_appendf(pOut,
+     "%,lld hits, %,lld misses (%d%% hit rate), %,lld evictions, "
+     "%,d of %,d entries, %,lld of %,lld bytes",
+     contentCache.nHit, contentCache.nMiss,
+     nLookup>0 ? (int)(contentCache.nHit*100/nLookup) : 0,
+     contentCache.nEvict, contentCache.n, contentCache.mxEntry,
+     contentCache.szTotal, contentCache.mxByte);
+}
+
+/*
+** In-memory map of the DELTA table.
+**
+** Walking a delta chain normally costs one query against the DELTA
+** table per link.  Once a process has done enough of those lookups, the
+** entire DELTA table is loaded into aSrc[] (indexed by rid) so that
+** further chain walks need no SQL at all.  The map is kept coherent
+** with the DELTA table by TEMP triggers that call back into
+** delta_map_sql_update() on every change, and it is discarded on
+** ROLLBACK.
+**
+** The aFirst[]/aChild[] arrays hold the reverse mapping (from srcid to
+** the list of artifacts that are deltas of srcid) in compressed form.
+** They are computed from aSrc[] on demand and are discarded whenever
+** aSrc[] changes.
+*/
+static struct {
+  int isLoaded;        /* True if aSrc[] reflects the DELTA table */
+  int disabled;        /* Never load the map */
+  int nLookup;         /* SQL lookups done while the map is not loaded */
+  int nNextCheck;      /* Value of nLookup at which to consider loading */
+  int nRid;            /* Number of entries allocated in aSrc[] */
+  int *aSrc;           /* aSrc[rid] is the srcid of rid, or 0 */
+  int nChildRid;       /* Number of entries in aFirst[] less one */
+  int *aFirst;         /* Children of X are aChild[aFirst[X]..aFirst[X+1]] */
+  int *aChild;         /* Reverse delta mapping */
+} deltaMap;
+
+/*
+** Discard the in-memory delta map.  It will be reloaded on demand.
+*/
+void delta_map_reset(void){
+  fossil_free(deltaMap.aSrc);
+  fossil_free(deltaMap.aFirst);
+  fossil_free(deltaMap.aChild);
+  deltaMap.aSrc = deltaMap.aFirst = deltaMap.aChild = 0;
+  deltaMap.nRid = deltaMap.nChildRid = 0;
+  deltaMap.isLoaded = 0;
+  deltaMap.nLookup = 0;
+  deltaMap.nNextCheck = 0;
+}
+
+/*
+** Turn use of the in-memory delta map on or off.
+*/
+void delta_map_enable(int onoff){
+  deltaMap.disabled = !onoff;
+  if( !onoff ) delta_map_reset();
+}
+
+/*
+** Record that artifact rid is a delta from srcid, or is not a delta
+** if srcid==0.
+*/
+static void delta_map_set(int rid, int srcid){
+  if( rid<=0 ) return;
+  if( rid>=deltaMap.nRid ){
+    int nNew = rid*2 + 100;
+    deltaMap.aSrc = fossil_realloc(deltaMap.aSrc, nNew*sizeof(int));
+    memset(deltaMap.aSrc+deltaMap.nRid, 0,
+           (nNew-deltaMap.nRid)*sizeof(int));
+    deltaMap.nRid = nNew;
+  }
+  deltaMap.aSrc[rid] = srcid;
+  if( deltaMap.aFirst ){
+    fossil_free(deltaMap.aFirst);
+    fossil_free(deltaMap.aChild);
+    deltaMap.aFirst = deltaMap.aChild = 0;
+    deltaMap.nChildRid = 0;
+  }
+}
+
+/*
+** Implementation of the delta_map_update(RID,SRCID) SQL function, which
+** is called by TEMP triggers on the DELTA table while the map is loaded.
+*/
+static void delta_map_sql_update(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  if( deltaMap.isLoaded ){
+    delta_map_set(sqlite3_value_int(argv[0]), sqlite3_value_int(argv[1]));
   }
 }
 
+/*
+** Return true if any prepared statement on the repository connection
+** is part-way through its result set.
+*/
+static int delta_map_stmt_busy(void){
+  sqlite3_stmt *pStmt = 0;
+  while( (pStmt = sqlite3_next_stmt(g.db, pStmt))!=0 ){
+    if( sqlite3_stmt_busy(pStmt) ) return 1;
+  }
+  return 0;
+}
+
+/*
+** Load the entire DELTA table into memory.
+**
+** This creates TEMP triggers to keep the map current, so it must not
+** be called while some other statement is in the middle of a scan
+** (doing so aborts that statement).
+*/
+void delta_map_load(void){
+  Stmt q;
+  int mx;
+  if( deltaMap.isLoaded || deltaMap.disabled ) return;
+  sqlite3_create_function(g.db, "delta_map_update", 2, SQLITE_UTF8, 0,
+                          delta_map_sql_update, 0, 0);
+  /* The triggers are TEMP, but because they are attached to a repository
+  ** table the authorizer sees a change to the repository schema, which
+  ** is blocked for read-only web requests. */
+  db_unprotect(PROTECT_READONLY);
+  db_multi_exec(
+    "CREATE TEMP TRIGGER IF NOT EXISTS delta_map_ins AFTER INSERT ON delta"
+    " BEGIN SELECT delta_map_update(new.rid, new.srcid); END;"
+    "CREATE TEMP TRIGGER IF NOT EXISTS delta_map_upd AFTER UPDATE ON delta"
+    " BEGIN SELECT delta_map_update(old.rid, 0),"
+                 " delta_map_update(new.rid, new.srcid); END;"
+    "CREATE TEMP TRIGGER IF NOT EXISTS delta_map_del AFTER DELETE ON delta"
+    " BEGIN SELECT delta_map_update(old.rid, 0); END;"
+  );
+  db_protect_pop();
+  mx = db_int(0, "SELECT max(rid) FROM delta");
+  deltaMap.nRid = mx+1;
+  deltaMap.aSrc = fossil_malloc(deltaMap.nRid*sizeof(int));
+  memset(deltaMap.aSrc, 0, deltaMap.nRid*sizeof(int));
+  db_prepare(&q, "SELECT rid, srcid FROM delta");
+  while( db_step(&q)==SQLITE_ROW ){
+    int rid = db_column_int(&q, 0);
+    if( rid>0 && rid<deltaMap.nRid ){
+      deltaMap.aSrc[rid] = db_column_int(&q, 1);
+    }
+  }
+  db_finalize(&q);
+  deltaMap.isLoaded = 1;
+}
+
+/*
+** Return the number of artifacts that are deltas off of srcid and
+** set *paChild to point to an array holding their rids.  The array
+** belongs to the delta map and is only valid until the next change
+** to the DELTA table.
+**
+** Return -1 if the delta map is not loaded.  The caller must then
+** query the DELTA table itself.
+*/
+int delta_map_children(int srcid, const int **paChild){
+  if( !deltaMap.isLoaded ) return -1;
+  if( deltaMap.aFirst==0 ){
+    int i, n = 0;
+    int nSrc = 0;      /* One more than the largest srcid */
+    int *aPos;
+    for(i=1; i<deltaMap.nRid; i++){
+      if( deltaMap.aSrc[i]>=nSrc ) nSrc = deltaMap.aSrc[i]+1;
+    }
+    deltaMap.nChildRid = nSrc;
+    deltaMap.aFirst = fossil_malloc((nSrc+1)*sizeof(int));
+    memset(deltaMap.aFirst, 0, (nSrc+1)*sizeof(int));
+    for(i=1; i<deltaMap.nRid; i++){
+      int s = deltaMap.aSrc[i];
+      if( s>0 ){
+        deltaMap.aFirst[s+1]++;
+        n++;
+      }
+    }
+    for(i=1; i<=nSrc; i++){
+      deltaMap.aFirst[i] += deltaMap.aFirst[i-1];
+    }
+    deltaMap.aChild = fossil_malloc((n+1)*sizeof(int));
+    aPos = fossil_malloc((nSrc+1)*sizeof(int));
+    memcpy(aPos, deltaMap.aFirst, (nSrc+1)*sizeof(int));
+    for(i=1; i<deltaMap.nRid; i++){
+      int s = deltaMap.aSrc[i];
+      if( s>0 ){
+        deltaMap.aChild[aPos[s]++] = i;
+      }
+    }
+    fossil_free(aPos);
+  }
+  if( srcid<=0 || srcid>=deltaMap.nChildRid ){
+    *paChild = 0;
+    return 0;
+  }
+  *paChild = &deltaMap.aChild[deltaMap.aFirst[srcid]];
+  return deltaMap.aFirst[srcid+1] - deltaMap.aFirst[srcid];
+}
+
 /*
 ** Return the srcid associated with rid.  Or return 0 if rid is
 ** original content and not a delta.
@@ -129,6 +484,31 @@ void content_clear_cache(int bFreeIt){
 int delta_source_rid(int rid){
   static Stmt q;
   int srcid;
+  if( deltaMap.isLoaded ){
+    return rid>0 && rid<deltaMap.nRid ? deltaMap.aSrc[rid] : 0;
+  }
+  deltaMap.nLookup++;
+  if( deltaMap.nLookup>=100 && deltaMap.nLookup>=deltaMap.nNextCheck
+   && !deltaMap.disabled
+  ){
+    /* Loading the map costs about as much as one lookup per 16 rows of
+    ** the DELTA table.  Load it once this process has done that many,
+    ** but only between statements, as the triggers cannot be created
+    ** safely while a scan is in progress.
+    **
+    ** If some statement is busy, lookups simply continue to use the
+    ** DELTA table and the check is repeated after twice as many lookups.
+    ** A command that does all of its chain walks from inside one long
+    ** scan never gets the map this way, so such commands (rebuild,
+    ** deconstruct and repack) call delta_map_load() before they start. */
+    if( deltaMap.nLookup*16>=db_int(0, "SELECT max(rid) FROM delta")
+     && !delta_map_stmt_busy()
+    ){
+      delta_map_load();
+      return delta_source_rid(rid);
+    }
+    deltaMap.nNextCheck = deltaMap.nLookup*2;
+  }
   db_static_prepare(&q, "SELECT srcid FROM delta WHERE rid=:rid");
   db_bind_int(&q, ":rid", rid);
   if( db_step(&q)==SQLITE_ROW ){
@@ -140,6 +520,80 @@ int delta_source_rid(int rid){
   return srcid;
 }
 
+/*
+** COMMAND: test-content-get-timing
+**
+** Usage: %fossil test-content-get-timing ?OPTIONS?
+**
+** Reconstruct every artifact that is stored as a delta, starting from
+** an empty artifact cache each time, and report the average CPU time
+** per artifact.  Use this to measure the cost of walking long delta
+** chains.
+**
+** Options:
+**    --limit N            Only reconstruct the first N qualifying artifacts
+**    --min-depth N        Only reconstruct artifacts whose delta chain is
+**                         at least N links long
+**    --no-delta-map       Look up each link of the delta chain using SQL
+**                         rather than the in-memory delta map
+**    -R REPO              Use repository REPO
+*/
+void test_content_get_timing_cmd(void){
+  Stmt q;
+  int *aRid = 0;
+  int nRid = 0, nAlloc = 0;
+  int i;
+  const char *zLimit, *zDepth;
+  int nLimit, mnDepth;
+  int bNoMap;
+  i64 nLink = 0;
+  i64 nByte = 0;
+  sqlite3_uint64 elapsed;
+  int iTimer;
+
+  zLimit = find_option("limit",0,1);
+  nLimit = zLimit ? atoi(zLimit) : 0;
+  zDepth = find_option("min-depth",0,1);
+  mnDepth = zDepth ? atoi(zDepth) : 1;
+  bNoMap = find_option("no-delta-map",0,0)!=0;
+  db_find_and_open_repository(0, 0);
+  verify_all_options();
+  delta_map_enable(!bNoMap);
+  db_prepare(&q, "SELECT rid FROM delta ORDER BY rid");
+  while( db_step(&q)==SQLITE_ROW ){
+    int rid = db_column_int(&q, 0);
+    int n = 0, r = rid;
+    while( (r = delta_source_rid(r))>0 ) n++;
+    if( n<mnDepth ) continue;
+    if( nRid>=nAlloc ){
+      nAlloc = nAlloc*2 + 100;
+      aRid = fossil_realloc(aRid, nAlloc*sizeof(aRid[0]));
+    }
+    aRid[nRid++] = rid;
+    nLink += n;
+    if( nLimit>0 && nRid>=nLimit ) break;
+  }
+  db_finalize(&q);
+  iTimer = fossil_timer_start();
+  for(i=0; i<nRid; i++){
+    Blob content;
+    content_clear_cache(0);
+    content_get(aRid[i], &content);
+    nByte += blob_size(&content);
+    blob_reset(&content);
+  }
+  elapsed = fossil_timer_stop(iTimer);
+  fossil_print("artifacts:      %d\n", nRid);
+  if( nRid>0 ){
+    fossil_print("average-depth:  %.1f\n", (double)nLink/nRid);
+    fossil_print("average-size:   %lld bytes\n", nByte/nRid);
+    fossil_print("time-per-get:   %.1f microseconds\n", (double)elapsed/nRid);
+  }
+  fossil_print("delta-map:      %s\n",
+               deltaMap.isLoaded ? "loaded" : "not used");
+  fossil_free(aRid);
+}
+
 /*
 ** Return the blob.size field given blob.rid
 */
@@ -249,15 +703,17 @@ int content_get(int rid, Blob *pBlob){
   }
 
   /* Look for the artifact in the cache first */
-  if( bag_find(&contentCache.inCache, rid) ){
-    for(i=0; i<contentCache.n; i++){
-      if( contentCache.a[i].rid==rid ){
-        blob_copy(pBlob, &contentCache.a[i].content);
-        contentCache.a[i].age = contentCache.nextAge++;
-        return 1;
-      }
+  i = content_cache_find(rid);
+  if( i>=0 ){
+    blob_copy(pBlob, &contentCache.a[i].content);
+    if( contentCache.iNewest!=i ){
+      content_cache_unlink(i);
+      content_cache_push(i);
     }
+    contentCache.nHit++;
+    return 1;
   }
+  contentCache.nMiss++;
 
   nextRid = delta_source_rid(rid);
   if( nextRid==0 ){
@@ -273,7 +729,7 @@ int content_get(int rid, Blob *pBlob){
     a[0] = rid;
     a[1] = nextRid;
     n = 1;
-    while( !bag_find(&contentCache.inCache, nextRid)
+    while( content_cache_find(nextRid)<0
         && (nextRid = delta_source_rid(nextRid))>0 ){
       n++;
       if( n>=nAlloc ){
@@ -316,6 +772,128 @@ int content_get(int rid, Blob *pBlob){
   return rc;
 }
 
+/*
+** Pass the content of the full-text (not delta) artifact rid to xSink(),
+** reading and uncompressing it a piece at a time.  Return 1 on success
+** and 0 on any error.
+*/
+static int content_stream_of_blob(int rid, DeltaSink xSink, void *pArg){
+  sqlite3_blob *pBlob;
+  z_stream stream;
+  unsigned char aIn[16384];
+  unsigned char aOut[65536];
+  int nBlob, iOfst;
+  unsigned int nExpect;
+  sqlite3_uint64 nTotal = 0;
+  int rc = Z_OK;
+
+  if( db_int(-1, "SELECT size FROM blob WHERE rid=%d", rid)<0 ) return 0;
+  if( sqlite3_blob_open(g.db, "repository", "blob", "content", rid, 0,
+                        &pBlob)!=SQLITE_OK ){
+    return 0;
+  }
+  nBlob = sqlite3_blob_bytes(pBlob);
+  if( nBlob<=4 || sqlite3_blob_read(pBlob, aIn, 4, 0)!=SQLITE_OK ){
+    sqlite3_blob_close(pBlob);
+    return 0;
+  }
+  nExpect = (aIn[0]<<24) + (aIn[1]<<16) + (aIn[2]<<8) + aIn[3];
+  if( nExpect & BLOB_COMPRESS_DICT ){
+    /* A small artifact compressed using the dictionary.  Not worth
+    ** streaming. */
+    Blob x;
+    sqlite3_blob_close(pBlob);
+    rc = content_of_blob(rid, &x);
+    if( rc && xSink(pArg, blob_buffer(&x), blob_size(&x)) ) rc = 0;
+    blob_reset(&x);
+    return rc;
+  }
+  memset(&stream, 0, sizeof(stream));
+  if( inflateInit(&stream)!=Z_OK ){
+    sqlite3_blob_close(pBlob);
+    return 0;
+  }
+  iOfst = 4;
+  while( rc==Z_OK ){
+    if( stream.avail_in==0 ){
+      int n = nBlob - iOfst;
+      if( n<=0 ) break;
+      if( n>(int)sizeof(aIn) ) n = sizeof(aIn);
+      if( sqlite3_blob_read(pBlob, aIn, n, iOfst)!=SQLITE_OK ) break;
+      iOfst += n;
+      stream.next_in = aIn;
+      stream.avail_in = n;
+    }
+    stream.next_out = aOut;
+    stream.avail_out = sizeof(aOut);
+    rc = inflate(&stream, Z_NO_FLUSH);
+    if( rc!=Z_OK && rc!=Z_STREAM_END ) break;
+    if( stream.avail_out<sizeof(aOut) ){
+      int n = sizeof(aOut) - stream.avail_out;
+      nTotal += n;
+      if( xSink(pArg, (const char*)aOut, n) ) break;
+    }
+  }
+  inflateEnd(&stream);
+  sqlite3_blob_close(pBlob);
+  return rc==Z_STREAM_END && nTotal==nExpect;
+}
+
+/*
+** Extract the content for ID rid and pass it to xSink(), without ever
+** holding all of it in memory at once.  Return 1 on success or 0 if
+** the record is a phantom, if the content cannot be reconstructed, or
+** if xSink() asks to stop.  Some of the content might have been passed
+** to xSink() even when 0 is returned.
+**
+** Full-text artifacts are read and uncompressed a piece at a time.  For
+** a delta, the delta source is reconstructed using content_get() as
+** usual, but the final delta is applied straight into xSink(), so that
+** peak memory is the source and the delta rather than the source and
+** the delta and the target.  This matters for very large artifacts.
+*/
+int content_stream(int rid, DeltaSink xSink, void *pArg){
+  int rc;
+  int srcid;
+  Blob src, delta;
+
+  assert( g.repositoryOpen );
+  if( rid==0 || bag_find(&contentCache.missing, rid) ) return 0;
+  if( content_cache_find(rid)>=0 ){
+    rc = content_get(rid, &src);
+    if( rc && xSink(pArg, blob_buffer(&src), blob_size(&src)) ) rc = 0;
+    blob_reset(&src);
+    return rc;
+  }
+  srcid = delta_source_rid(rid);
+  if( srcid==0 ){
+    rc = content_stream_of_blob(rid, xSink, pArg);
+  }else{
+    if( delta_source_rid(srcid)==0 && content_cache_find(srcid)<0 ){
+      /* Uncompress a full-text source straight into its final buffer,
+      ** rather than holding both the compressed and uncompressed copies */
+      blob_zero(&src);
+      blob_reserve(&src, db_int(0, "SELECT size FROM blob WHERE rid=%d",
+                                srcid)+1);
+      rc = content_stream_of_blob(srcid, delta_sink_blob, &src);
+    }else{
+      rc = content_get(srcid, &src);
+    }
+    if( rc ){
+      rc = content_of_blob(rid, &delta);
+      if( rc ){
+        if( blob_delta_apply_sink(&src, &delta, xSink, pArg)<0 ) rc = 0;
+        blob_reset(&delta);
+      }
+    }
+    blob_reset(&src);
+  }
+  if( rc ){
+    bag_insert(&contentCache.available, rid);
+  }
+  return rc;
+}
+
 /*
 ** COMMAND: artifact*
 **
@@ -482,6 +1060,72 @@ void content_rcvid_init(const char *zSrc){
   }
 }
 
+/*
+** SETTING: compress-dictionary        width=10 default=0
+**
+** If this setting is a positive number N, then new artifacts and deltas
+** smaller than N bytes are compressed using a zlib preset dictionary
+** trained on this repository.  Small control artifacts (manifests,
+** tickets, wiki, forum posts, clusters) share a lot of text and compress
+** much better this way.  Use "fossil repack --dictionary" to train the
+** dictionary and to convert existing content.  Zero means do not use
+** a dictionary.
+**
+** Versions of Fossil that do not know about the dictionary cannot read
+** content compressed with it.  "fossil repack --no-dictionary" converts
+** such content back.
+*/
+
+/*
+** The compression dictionary of the repository, loaded on demand from
+** the "compress-dict" entry of the CONFIG table.
+*/
+static struct {
+  int isLoaded;        /* True if dict and mxSize are valid */
+  int mxSize;          /* The compress-dictionary setting */
+  Blob dict;           /* The dictionary.  Empty if there is none */
+} compressDict = { 0, 0, BLOB_INITIALIZER };
+
+/*
+** Forget the compression dictionary.  It will be reloaded on demand.
+*/
+void content_compress_dict_reset(void){
+  blob_reset(&compressDict.dict);
+  compressDict.isLoaded = 0;
+}
+
+/*
+** Return the compression dictionary of the repository, or NULL if it
+** does not have one.
+*/
+Blob *content_compress_dict(void){
+  if( !compressDict.isLoaded ){
+    if( !g.repositoryOpen ) return 0;
+    blob_reset(&compressDict.dict);
+    db_blob(&compressDict.dict,
+            "SELECT value FROM config WHERE name='compress-dict'");
+    compressDict.mxSize = db_get_int("compress-dictionary", 0);
+    compressDict.isLoaded = 1;
+  }
+  return blob_size(&compressDict.dict)>0 ? &compressDict.dict : 0;
+}
+
+/*
+** Compress pIn into pOut for storage in the BLOB table.  Use the
+** compression dictionary if pIn is small enough, as determined by the
+** compress-dictionary setting.
+**
+** pOut must either be the same as pIn or else uninitialized.
+*/
+void content_compress(Blob *pIn, Blob *pOut){
+  Blob *pDict = content_compress_dict();
+  if( pDict && (int)blob_size(pIn)<compressDict.mxSize ){
+    blob_compress_dict(pIn, pOut, pDict);
+  }else{
+    blob_compress(pIn, pOut);
+  }
+}
+
 /*
 ** Write content into the database.  Return the record ID.  If the
 ** content is already in the database, just return the record ID.
@@ -576,7 +1220,7 @@ int content_put_ex(
   if( nBlob ){
     cmpr = pBlob[0];
   }else{
-    blob_compress(pBlob, &cmpr);
+    content_compress(pBlob, &cmpr);
   }
   if( rid>0 ){
     /* We are just adding data to a phantom */
@@ -759,7 +1403,7 @@ void content_undelta(int rid){
       Stmt s;
       db_prepare(&s, "UPDATE blob SET content=:c, size=%d WHERE rid=%d",
                      blob_size(&x), rid);
-      blob_compress(&x, &x);
+      content_compress(&x, &x);
       db_bind_blob(&s, ":c", &x);
       db_exec(&s);
       db_finalize(&s);
@@ -821,6 +1465,33 @@ void content_make_private(int rid){
   db_exec(&s1);
 }
 
+/*
+** SETTING: max-delta-chain            width=10 default=0
+**
+** If this setting is a positive number N, then new deltas are never
+** created that would require more than N delta applications to
+** reconstruct any artifact.  Smaller values make old versions of
+** files faster to extract at the cost of a larger repository.  Zero
+** means there is no limit.  Use "fossil repack --rebalance" to
+** shorten delta chains that already exist.
+*/
+
+/*
+** Return the number of delta links below rid.  That is, the length of
+** the longest delta chain that passes through rid, measured from rid
+** down to the artifact at the end of the chain.  Return 0 if nothing
+** is a delta off of rid.
+*/
+static int content_delta_height(int rid){
+  return db_int(0,
+    "WITH RECURSIVE sub(rid,n) AS ("
+    "  SELECT rid, 1 FROM delta WHERE srcid=%d"
+    "  UNION ALL"
+    "  SELECT delta.rid, sub.n+1 FROM delta, sub WHERE delta.srcid=sub.rid"
+    ") SELECT max(n) FROM sub", rid
+  );
+}
+
 /*
 ** Try to change the storage of rid so that it is a delta from one
 ** of the artifacts given in aSrc[0]..aSrc[nSrc-1].  The aSrc[*] that
@@ -828,7 +1499,10 @@ void content_make_private(int rid){
 **
 ** If rid is already a delta from some other place then no
 ** conversion occurs and this is a no-op unless force==1.  If force==1,
-** then nSrc must also be 1.
+** then rid is recomputed as a delta from whichever aSrc[*] is best.
+**
+** Unless force==1, a source is not used if that would make some delta
+** chain longer than the "max-delta-chain" setting allows.
 **
 ** If rid refers to a phantom, no delta is created.
 **
@@ -858,6 +1532,8 @@ int content_deltify(int rid, int *aSrc, int nSrc, int force){
   int bestSrc = 0;     /* Which aSrc is the source of the best delta */
   int rc = 0;          /* Value to return */
   int i;               /* Loop variable for aSrc[] */
+  int mxChain;         /* Maximum delta chain length.  0 for no limit */
+  int nBelow = 0;      /* Delta links below rid */
 
   /*
   ** Historically this routine gracefully ignored the rid 0, but the
@@ -887,10 +1563,13 @@ int content_deltify(int rid, int *aSrc, int nSrc, int force){
     return 0;
   }
   blob_init(&bestDelta, 0, 0);
+  mxChain = force ? 0 : db_get_int("max-delta-chain", 0);
+  if( mxChain>0 ) nBelow = content_delta_height(rid);
 
   /* Loop over all candidate delta sources */
   for(i=0; i<nSrc; i++){
     int srcid = aSrc[i];
+    int nAbove = 0;
     if( srcid==rid ) continue;
     if( content_is_private(srcid) && !content_is_private(rid) ) continue;
 
@@ -899,6 +1578,7 @@ int content_deltify(int rid, int *aSrc, int nSrc, int force){
     ** would create a delta loop. */
     s = srcid;
     while( (s = delta_source_rid(s))>0 ){
+      nAbove++;
       if( s==rid ){
         content_undelta(srcid);
         break;
@@ -906,6 +1586,9 @@ int content_deltify(int rid, int *aSrc, int nSrc, int force){
     }
     if( s!=0 ) continue;
 
+    /* Do not let the delta chains through rid grow beyond the limit */
+    if( mxChain>0 && nAbove+1+nBelow>mxChain ) continue;
+
     content_get(srcid, &src);
     if( blob_size(&src)<50 ){
       /* The source is smaller then 50 bytes, so don't bother trying to use it*/
@@ -931,7 +1614,7 @@ int content_deltify(int rid, int *aSrc, int nSrc, int force){
   ** make that candidate the new parent now */
   if( bestSrc>0 ){
     Stmt s1, s2;  /* Statements used to create the delta */
-    blob_compress(&bestDelta, &bestDelta);
+    content_compress(&bestDelta, &bestDelta);
     db_prepare(&s1, "UPDATE blob SET content=:data WHERE rid=%d", rid);
     db_prepare(&s2, "REPLACE INTO delta(rid,srcid)VALUES(%d,%d)", rid, bestSrc);
     db_bind_blob(&s1, ":data", &bestDelta);
@@ -950,6 +1633,47 @@ int content_deltify(int rid, int *aSrc, int nSrc, int force){
   return rc;
 }
 
+/*
+** Make rid a delta of srcid, like content_deltify(rid, &srcid, 1, 0), but
+** using a delta that the caller has already computed, possibly in another
+** thread.  pDelta is a delta from the content of srcid to the content of
+** rid, compressed by content_compress().  The caller is responsible for
+** deciding that the delta is worthwhile and for checking that it
+** reproduces the content of rid.
+**
+** If srcid is itself a delta, the delta might create a loop, so the work
+** is handed to content_deltify() instead.
+**
+** Return the number of bytes by which the storage associated with rid
+** is reduced.
+*/
+int content_deltify_precomputed(int rid, int srcid, Blob *pDelta){
+  Stmt s1, s2;
+  int mxChain;
+  int rc;
+
+  if( rid==0 || srcid==rid ) return 0;
+  if( delta_source_rid(rid)>0 ) return 0;
+  if( 0==content_is_available(rid) ) return 0;
+  if( content_is_private(srcid) && !content_is_private(rid) ) return 0;
+  if( delta_source_rid(srcid)>0 ) return content_deltify(rid, &srcid, 1, 0);
+  mxChain = db_get_int("max-delta-chain", 0);
+  if( mxChain>0 && 1+content_delta_height(rid)>mxChain ) return 0;
+  db_prepare(&s1, "UPDATE blob SET content=:data WHERE rid=%d", rid);
+  db_prepare(&s2, "REPLACE INTO delta(rid,srcid)VALUES(%d,%d)", rid, srcid);
+  db_bind_blob(&s1, ":data", pDelta);
+  db_begin_transaction();
+  rc = db_int(0, "SELECT octet_length(content) FROM blob WHERE rid=%d", rid);
+  db_exec(&s1);
+  db_exec(&s2);
+  db_end_transaction(0);
+  db_finalize(&s1);
+  db_finalize(&s2);
+  verify_before_commit(rid);
+  verify_before_commit_checked(rid, blob_size(pDelta));
+  return rc - blob_size(pDelta);
+}
+
 /*
 ** COMMAND: test-content-deltify
 **
@@ -318,6 +318,7 @@ void db_end_transaction(int rollbackFlag){
     while( db.pAllStmt ){
       db_finalize(db.pAllStmt);
     }
+    if( db.doRollback ) delta_map_reset();
     db_multi_exec("%s", db.doRollback ? "ROLLBACK" : "COMMIT");
     db.doRollback = 0;
   }
@@ -343,6 +344,7 @@ void db_force_rollback(void){
     sqlite3_exec(g.db, "ROLLBACK", 0, 0, 0);
     db.nBegin = 0;
   }
+  delta_map_reset();
   busy = 0;
   db_close(0);
   for(i=0; i<db.nDeleteOnFail; i++){
@@ -2218,6 +2220,9 @@ LOCAL sqlite3 *db_open(const char *zDbName){
   sqlite3_create_function(
     db, "if_selected", 3, SQLITE_UTF8, 0, file_is_selected,0,0
   );
+  sqlite3_create_function(
+    db, "sparse_excluded", 1, SQLITE_UTF8, 0, sparse_excluded_sql_func,0,0
+  );
   if( g.fSqlTrace ) sqlite3_trace_v2(db, SQLITE_TRACE_PROFILE, db_sql_trace, 0);
   db_add_aux_functions(db);
   re_add_sql_func(db);  /* The REGEXP operator */
@@ -2535,11 +2540,13 @@ static int isValidLocalDb(const char *zDbName){
   db_open_or_attach(zDbName, "localdb");
 
   /* Check to see if the check-out database has the latest schema changes.
-  ** The most recent schema change (2019-01-19) is the addition of the
-  ** vmerge.mhash and vfile.mhash fields.  If the schema has the vmerge.mhash
-  ** column, assume everything else is up-to-date.
+  ** The most recent schema change is the addition of the vfile.cksum
+  ** field.  If the schema has both that and the vmerge.mhash column
+  ** (2019-01-19), assume everything else is up-to-date.
   */
-  if( db_table_has_column("localdb","vmerge","mhash") ){
+  if( db_table_has_column("localdb","vfile","cksum")
+   && db_table_has_column("localdb","vmerge","mhash")
+  ){
     return 1;   /* This is a check-out database with the latest schema */
   }
 
@@ -2574,6 +2581,25 @@ static int isValidLocalDb(const char *zDbName){
     }
   }
 
+  /* If the "fstat" column is missing from the vfile table, then add it
+  ** now.  The undo_vfile table is a copy of vfile, so it must gain the
+  ** column too or else "fossil undo" will fail.
+  */
+  if( !db_table_has_column("localdb","vfile","fstat") ){
+    db_multi_exec("ALTER TABLE vfile ADD COLUMN fstat TEXT");
+    if( db_local_table_exists_but_lacks_column("undo_vfile", "fstat") ){
+      db_multi_exec("ALTER TABLE undo_vfile ADD COLUMN fstat TEXT");
+    }
+  }
+
+  /* Likewise for the "cksum" column */
+  if( !db_table_has_column("localdb","vfile","cksum") ){
+    db_multi_exec("ALTER TABLE vfile ADD COLUMN cksum TEXT");
+    if( db_local_table_exists_but_lacks_column("undo_vfile", "cksum") ){
+      db_multi_exec("ALTER TABLE undo_vfile ADD COLUMN cksum TEXT");
+    }
+  }
+
   /* The design of the check-out database changed on 2019-01-19 adding the mhash
   ** column to vfile and vmerge and changing the UNIQUE index on vmerge into
   ** a PRIMARY KEY that includes the new mhash column.  However, we must have
@@ -3035,10 +3061,23 @@ void db_close(int reportErrors){
     sqlite3_status(SQLITE_STATUS_PAGECACHE_OVERFLOW, &cur, &hiwtr, 0);
     fprintf(stderr, "-- PCACHE_OVFLOW          %10d %10d\n", cur, hiwtr);
     fprintf(stderr, "-- prepared statements    %10d\n", db.nPrepare);
+    if( g.repositoryOpen ){
+      Blob cache;
+      blob_init(&cache, 0, 0);
+      content_cache_stats(&cache);
+      fprintf(stderr, "-- artifact cache: %s\n", blob_str(&cache));
+      blob_reset(&cache);
+      manifest_mcache_stats(&cache);
+      fprintf(stderr, "-- manifest cache: %s\n", blob_str(&cache));
+      blob_reset(&cache);
+    }
   }
   while( db.pAllStmt ){
     db_finalize(db.pAllStmt);
   }
+  delta_map_reset();
+  content_compress_dict_reset();
+  manifest_mcache_reset();
   if( db.nBegin ){
     if( reportErrors ){
       fossil_warning("Transaction started at %s:%d never commits",
@@ -3916,6 +3955,13 @@ int db_get_int(const char *zName, int dflt){
   }
   return v;
 }
+i64 db_get_int64(const char *zName, i64 dflt){
+  /* Like db_get_int() but for values that might not fit in 32 bits */
+  char *z = db_get(zName, 0);
+  i64 v = z ? strtoll(z,0,0) : dflt;
+  fossil_free(z);
+  return v;
+}
 i64 db_large_file_size(void){
   /* Return size of the largest file that is not considered oversized */
   return strtoll(db_get("large-file-size","20000000"),0,0);
@@ -4264,12 +4310,14 @@ void db_record_repository_filename(const char *zName){
 **   --setmtime        Set timestamps of all files to match their SCM-side
 **                     times (the timestamp of the last check-in which modified
 **                     them).
+**   --sparse GLOBS    Only write files that match the comma-separated list
+**                     of GLOBS.  See the [[sparse]] command.
 **   --verbose         If passed a URI then this flag is passed on to the clone
 **                     operation, otherwise it has no effect
 **   --workdir DIR     Use DIR as the working directory instead of ".". The DIR
 **                     directory is created if it does not exist.
 **
-** See also: [[close]], [[clone]]
+** See also: [[close]], [[clone]], [[sparse]]
 */
 void cmd_open(void){
   int emptyFlag;
@@ -4287,6 +4335,7 @@ void cmd_open(void){
   int isUri = 0;                 /* True if REPOSITORY is a URI */
   int nLocal;                    /* Number of preexisting files in cwd */
   int bVerbose = 0;              /* --verbose option for clone */
+  const char *zSparse;           /* --sparse GLOBS */
 
   zReopen = find_option("reopen",0,1);
   if( 0!=zReopen ){
@@ -4307,6 +4356,7 @@ void cmd_open(void){
   bForce = find_option("force","f",0)!=0;
   if( find_option("nosync",0,0) ) g.fNoSync = 1;
   bVerbose = find_option("verbose",0,0)!=0;
+  zSparse = find_option("sparse",0,1);
   zPwd = file_getcwd(0,0);
 
   /* We should be done with options.. */
@@ -4429,6 +4479,7 @@ void cmd_open(void){
   db_delete_on_failure(LOCALDB_NAME);
   db_open_local(0);
   db_lset("repository", zRepo);
+  if( zSparse ) db_lset("sparse-include", zSparse);
   db_record_repository_filename(zRepo);
   db_set_checkout(0, 0); /* manifest files handled by checkout_cmd */
   azNewArgv[0] = g.argv[0];
@@ -4818,6 +4869,15 @@ struct Setting {
 ** Administration of the HTTP UI.
 */
 /*
+** SETTING: diff-algorithm  width=16 default=classic
+** The algorithm used for diffs shown by the web interface.  Either
+** "classic" or "histogram".  The histogram algorithm anchors on lines
+** that are rare in the file, which is faster and gives more readable
+** output for files whose contents have been reordered.  The diff
+** commands use the --algorithm option instead of this setting.  Any
+** other value is an error.
+*/
+/*
 ** SETTING: diff-binary     boolean default=on
 ** If enabled, permit files that may be binary
 ** or that match the "binary-glob" setting to be used with
@@ -5374,6 +5434,9 @@ void setting_cmd(void){
       if( unsetFlag ){
         db_unset(pSetting->name/*works-like:"x"*/, globalFlag);
       }else{
+        if( fossil_strcmp(pSetting->name, "diff-algorithm")==0 ){
+          diff_algorithm_flag(g.argv[3]);  /* Fatal if not a known name */
+        }
         db_protect_only(PROTECT_NONE);
         db_set(pSetting->name/*works-like:"x"*/, g.argv[3], globalFlag);
         db_protect_pop();
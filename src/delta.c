@@ -29,6 +29,23 @@
 #include <string.h>
 #include "delta.h"
 
+/*
+** Vectorized kernels for the landmark hash and for match extension in
+** delta_create().  These are chosen at compile-time from whatever the
+** compiler targets (SSE2 is always available on x86-64).  AVX2 is only
+** used if the build enables it, for example with -mavx2.  The scalar
+** code is used everywhere else and produces exactly the same deltas.
+*/
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define DELTA_SSE2 1
+# define DELTA_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) \
+   || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+# include <emmintrin.h>
+# define DELTA_SSE2 1
+#endif
+
 /*
 ** Macros for turning debugging printfs on and off
 */
@@ -72,6 +89,12 @@ typedef unsigned int u32;
 typedef short int s16;
 typedef unsigned short int u16;
 
+/*
+** A sink receives the output of delta_apply_sink() a piece at a time.
+** It returns non-zero to stop the delta from being applied any further.
+*/
+typedef int (*DeltaSink)(void *pArg, const char *z, int n);
+
 #endif /* INTERFACE */
 
 /*
@@ -151,6 +174,133 @@ static u32 hash_once(const char *z){
   return a | (((u32)b)<<16);
 }
 
+/*
+** When false, delta_create() uses only the scalar code even if the
+** vectorized kernels are available.
+*/
+static int deltaUseSimd = 1;
+
+/*
+** Enable or disable the vectorized kernels in delta_create().  Return
+** true if vectorized kernels are compiled in.  The output is the same
+** either way.  This exists so that the two can be compared.
+*/
+int delta_enable_simd(int onOff){
+  deltaUseSimd = onOff;
+#ifdef DELTA_SSE2
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+#ifdef DELTA_SSE2
+/*
+** Compute hash_once() on NHASH bytes using SSE2.
+**
+** The "a" sum is the sum of all NHASH bytes and the "b" sum is
+** z[0]*16 + z[1]*15 + ... + z[15]*1.  Bytes are signed, as with the
+** "char" arithmetic in hash_once(), and the results are the same after
+** truncating to 16 bits.
+*/
+static u32 hash_once_sse2(const char *z){
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i wLo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+  const __m128i wHi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+  __m128i v, sign, lo, hi, sa, sb;
+  u32 a, b;
+  v = _mm_loadu_si128((const __m128i*)z);
+  sign = _mm_cmpgt_epi8(_mm_setzero_si128(), v);
+  lo = _mm_unpacklo_epi8(v, sign);
+  hi = _mm_unpackhi_epi8(v, sign);
+  sa = _mm_add_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones));
+  sb = _mm_add_epi32(_mm_madd_epi16(lo, wLo), _mm_madd_epi16(hi, wHi));
+  /* Fold the four 32-bit lanes of sa and sb */
+  sa = _mm_add_epi32(sa, _mm_shuffle_epi32(sa, _MM_SHUFFLE(1,0,3,2)));
+  sb = _mm_add_epi32(sb, _mm_shuffle_epi32(sb, _MM_SHUFFLE(1,0,3,2)));
+  sa = _mm_add_epi32(sa, _mm_shuffle_epi32(sa, _MM_SHUFFLE(2,3,0,1)));
+  sb = _mm_add_epi32(sb, _mm_shuffle_epi32(sb, _MM_SHUFFLE(2,3,0,1)));
+  a = (u32)_mm_cvtsi128_si32(sa);
+  b = (u32)_mm_cvtsi128_si32(sb);
+  return (a & 0xffff) | ((b & 0xffff)<<16);
+}
+
+/*
+** Return the index of the least (or most) significant set bit in
+** a non-zero value.
+*/
+static int lowest_bit(unsigned int m){
+#if defined(__GNUC__)
+  return __builtin_ctz(m);
+#else
+  int i = 0;
+  while( (m&1)==0 ){ m >>= 1; i++; }
+  return i;
+#endif
+}
+static int highest_bit(unsigned int m){
+#if defined(__GNUC__)
+  return 31 - __builtin_clz(m);
+#else
+  int i = 31;
+  while( (m&0x80000000)==0 ){ m <<= 1; i--; }
+  return i;
+#endif
+}
+#endif /* DELTA_SSE2 */
+
+/*
+** Return the number of bytes at the start of z1[] and z2[] that are the
+** same, looking at no more than n bytes.
+*/
+static int match_forward(const char *z1, const char *z2, int n){
+  int i = 0;
+#ifdef DELTA_SSE2
+  if( deltaUseSimd ){
+#ifdef DELTA_AVX2
+    while( i+32<=n ){
+      __m256i x = _mm256_loadu_si256((const __m256i*)&z1[i]);
+      __m256i y = _mm256_loadu_si256((const __m256i*)&z2[i]);
+      unsigned int m = ~(unsigned int)_mm256_movemask_epi8(
+                                          _mm256_cmpeq_epi8(x, y));
+      if( m ) return i + lowest_bit(m);
+      i += 32;
+    }
+#endif
+    while( i+16<=n ){
+      __m128i x = _mm_loadu_si128((const __m128i*)&z1[i]);
+      __m128i y = _mm_loadu_si128((const __m128i*)&z2[i]);
+      unsigned int m = 0xffff & ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+      if( m ) return i + lowest_bit(m);
+      i += 16;
+    }
+  }
+#endif
+  while( i<n && z1[i]==z2[i] ) i++;
+  return i;
+}
+
+/*
+** Return the number of bytes immediately before z1[0] and z2[0] that
+** are the same, looking at no more than n bytes.
+*/
+static int match_backward(const char *z1, const char *z2, int n){
+  int i = 0;
+#ifdef DELTA_SSE2
+  if( deltaUseSimd ){
+    while( i+16<=n ){
+      __m128i x = _mm_loadu_si128((const __m128i*)&z1[-i-16]);
+      __m128i y = _mm_loadu_si128((const __m128i*)&z2[-i-16]);
+      unsigned int m = 0xffff & ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+      if( m ) return i + 15 - highest_bit(m);
+      i += 16;
+    }
+  }
+#endif
+  while( i<n && z1[-i-1]==z2[-i-1] ) i++;
+  return i;
+}
+
 /*
 ** Write an base-64 integer into the given buffer.
 */
@@ -393,6 +543,15 @@ int delta_create(
   collide = fossil_malloc( nHash*2*sizeof(int) );
   memset(collide, -1, nHash*2*sizeof(int));
   landmark = &collide[nHash];
+#ifdef DELTA_SSE2
+  if( deltaUseSimd ){
+    for(i=0; i<(int)lenSrc-NHASH; i+=NHASH){
+      int hv = hash_once_sse2(&zSrc[i]) % nHash;
+      collide[i/NHASH] = landmark[hv];
+      landmark[hv] = i/NHASH;
+    }
+  }else
+#endif
   for(i=0; i<(int)lenSrc-NHASH; i+=NHASH){
     int hv = hash_once(&zSrc[i]) % nHash;
     collide[i/NHASH] = landmark[hv];
@@ -433,26 +592,22 @@ int delta_create(
         ** copy command is less than the amount of literal text to be copied.
         */
         int cnt, ofst, litsz;
-        int j, k, x, y;
+        int j, k, y;
         int sz;
         int limitX;
 
         /* Beginning at iSrc, match forwards as far as we can.  j counts
-        ** the number of characters that match */
+        ** the number of characters that match, less one */
         iSrc = iBlock*NHASH;
         y = base+i;
         limitX = ( lenSrc-iSrc <= lenOut-y ) ? lenSrc : iSrc + lenOut - y;
-        for(x=iSrc; x<limitX; x++, y++){
-          if( zSrc[x]!=zOut[y] ) break;
-        }
-        j = x - iSrc - 1;
+        j = match_forward(&zSrc[iSrc], &zOut[y], limitX-iSrc) - 1;
 
-        /* Beginning at iSrc-1, match backwards as far as we can.  k counts
-        ** the number of characters that match */
-        for(k=1; k<iSrc && k<=i; k++){
-          if( zSrc[iSrc-k]!=zOut[base+i-k] ) break;
-        }
-        k--;
+        /* Beginning at iSrc-1, match backwards as far as we can, but not
+        ** as far as zSrc[0] nor past zOut[base].  k counts the number of
+        ** characters that match */
+        k = iSrc-1<i ? iSrc-1 : i;
+        k = k>0 ? match_backward(&zSrc[iSrc], &zOut[y], k) : 0;
 
         /* Compute the offset and size of the matching region */
         ofst = iSrc-k;
@@ -666,6 +821,114 @@ int delta_apply(
   return -1;
 }
 
+/*
+** Apply a delta, like delta_apply(), but instead of writing the output
+** into a buffer, pass it to xSink() piece by piece.  Copies from the
+** source and inserts from the delta are passed straight through, so
+** the target is never held in memory all at once.
+**
+** Return the size of the output or -1 if the delta is malformed or the
+** sink asked to stop.  The output is passed to xSink() as it is
+** generated, so some of it might have been written even if -1 is
+** returned.
+*/
+int delta_apply_sink(
+  const char *zSrc,      /* The source or pattern file */
+  int lenSrc,            /* Length of the source file */
+  const char *zDelta,    /* Delta to apply to the pattern */
+  int lenDelta,          /* Length of the delta */
+  DeltaSink xSink,       /* Send output here */
+  void *pArg             /* First argument to xSink */
+){
+  sqlite3_uint64 limit;
+  sqlite3_uint64 total = 0;
+#ifdef FOSSIL_ENABLE_DELTA_CKSUM_TEST
+  unsigned int sum = 0;
+#endif
+
+  limit = getInt(&zDelta, &lenDelta);
+  if( lenDelta<=0 || *zDelta!='\n' ){
+    /* ERROR: size integer not terminated by "\n" */
+    return -1;
+  }
+  zDelta++; lenDelta--;  /* Skip the \n */
+  while( lenDelta>0 && zDelta[0] ){
+    unsigned int cnt, ofst;
+    const char *zChunk;
+    cnt = getInt(&zDelta, &lenDelta);
+    if( lenDelta<=0 ) return -1;
+    switch( zDelta[0] ){
+      case '@': {
+        zDelta++; lenDelta--;
+        ofst = getInt(&zDelta, &lenDelta);
+        if( lenDelta>0 && zDelta[0]!=',' ){
+          /* ERROR: copy command not terminated by ',' */
+          return -1;
+        }
+        zDelta++; lenDelta--;
+        total += cnt;
+        if( total>limit ){
+          /* ERROR: copy exceeds output file size */
+          return -1;
+        }
+        if( (u64)ofst+(u64)cnt > (u64)lenSrc ){
+          /* ERROR: copy extends past end of input */
+          return -1;
+        }
+        zChunk = &zSrc[ofst];
+        break;
+      }
+      case ':': {
+        zDelta++; lenDelta--;
+        total += cnt;
+        if( total>limit ){
+          /* ERROR:  insert command gives an output larger than predicted */
+          return -1;
+        }
+        if( cnt>lenDelta ){
+          /* ERROR: insert count exceeds size of delta */
+          return -1;
+        }
+        zChunk = zDelta;
+        zDelta += cnt;
+        lenDelta -= cnt;
+        break;
+      }
+      case ';': {
+        zDelta++; lenDelta--;
+#ifdef FOSSIL_ENABLE_DELTA_CKSUM_TEST
+        if( cnt!=sum ){
+          /* ERROR:  bad checksum */
+          return -1;
+        }
+#endif
+        if( total!=limit ){
+          /* ERROR: generated size does not match predicted size */
+          return -1;
+        }
+        return total;
+      }
+      default: {
+        /* ERROR: unknown delta operator */
+        return -1;
+      }
+    }
+#ifdef FOSSIL_ENABLE_DELTA_CKSUM_TEST
+    {
+      /* Accumulate checksum() a byte at a time */
+      sqlite3_uint64 iPos = total - cnt;
+      unsigned int k;
+      for(k=0; k<cnt; k++, iPos++){
+        sum += ((unsigned char)zChunk[k]) << (24 - 8*(iPos&3));
+      }
+    }
+#endif
+    if( cnt>0 && xSink(pArg, zChunk, cnt) ) return -1;
+  }
+  /* ERROR: unterminated delta */
+  return -1;
+}
+
 /*
 ** Analyze a delta.  Figure out the total number of bytes copied from
 ** source to target, and the total number of bytes inserted by the delta,
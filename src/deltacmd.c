@@ -142,6 +142,41 @@ int blob_delta_apply(Blob *pOriginal, Blob *pDelta, Blob *pTarget){
   return len;
 }
 
+/*
+** Apply the delta in pDelta to the original file pOriginal and pass the
+** target to xSink() as it is generated, rather than building it up in
+** a blob.  Return the length of the target, or -1 on an error.
+*/
+int blob_delta_apply_sink(
+  Blob *pOriginal,
+  Blob *pDelta,
+  DeltaSink xSink,
+  void *pArg
+){
+  return delta_apply_sink(
+     blob_buffer(pOriginal), blob_size(pOriginal),
+     blob_buffer(pDelta), blob_size(pDelta),
+     xSink, pArg);
+}
+
+/*
+** A DeltaSink that appends to the Blob in pArg.
+*/
+int delta_sink_blob(void *pArg, const char *z, int n){
+  blob_append((Blob*)pArg, z, n);
+  return 0;
+}
+
+/*
+** A DeltaSink that writes to the FILE in pArg.
+*/
+int delta_sink_file(void *pArg, const char *z, int n){
+  if( fwrite(z, 1, n, (FILE*)pArg)!=(size_t)n ){
+    fossil_fatal("short write");
+  }
+  return 0;
+}
+
 /*
 ** COMMAND: test-delta-apply
 **
@@ -171,28 +206,141 @@ void delta_apply_cmd(void){
 }
 
 
+/*
+** Create deltas in both directions between pA and pB and verify that
+** applying them recovers the originals.  If nRepeat>0, also time the
+** creation of the deltas, repeated nRepeat times, adding the elapsed
+** CPU microseconds to *pnUsec.
+**
+** When vectorized kernels are compiled in, also verify that the deltas
+** are byte-for-byte the same as those of the scalar code.
+**
+** Return the number of failures.
+*/
+static int test_delta_pair(
+  Blob *pA, Blob *pB,       /* The two files */
+  int nRepeat,              /* Number of times to create each delta */
+  int bScalar,              /* Time the scalar code */
+  sqlite3_uint64 *pnUsec    /* Add creation time here */
+){
+  Blob d12, d21;   /* Deltas from A->B and B->A */
+  Blob a1, a2;     /* Recovered file content */
+  int nErr = 0;
+  int i;
+  delta_enable_simd(!bScalar);
+  blob_delta_create(pA, pB, &d12);
+  blob_delta_create(pB, pA, &d21);
+  blob_delta_apply(pA, &d12, &a2);
+  blob_delta_apply(pB, &d21, &a1);
+  if( blob_compare(pA,&a1) || blob_compare(pB, &a2) ) nErr++;
+  blob_reset(&a1);
+  blob_reset(&a2);
+  if( delta_enable_simd(bScalar) ){
+    /* Recreate both deltas using the other encoder and compare */
+    blob_delta_create(pA, pB, &a2);
+    blob_delta_create(pB, pA, &a1);
+    if( blob_compare(&d12,&a2) || blob_compare(&d21, &a1) ) nErr++;
+    blob_reset(&a1);
+    blob_reset(&a2);
+  }
+  blob_reset(&d12);
+  blob_reset(&d21);
+  delta_enable_simd(!bScalar);
+  if( nRepeat>0 ){
+    int iTimer = fossil_timer_start();
+    for(i=0; i<nRepeat; i++){
+      blob_delta_create(pA, pB, &d12);
+      blob_reset(&d12);
+      blob_delta_create(pB, pA, &d21);
+      blob_reset(&d21);
+    }
+    *pnUsec += fossil_timer_stop(iTimer);
+  }
+  delta_enable_simd(1);
+  return nErr;
+}
+
 /*
 ** COMMAND: test-delta
 **
-** Usage: %fossil test-delta FILE1 FILE2
+** Usage: %fossil test-delta ?OPTIONS? FILE1 FILE2
+**    or: %fossil test-delta --corpus ?OPTIONS?
 **
 ** Read two files named on the command-line.  Create and apply deltas
 ** going in both directions.  Verify that the original files are
-** correctly recovered.
+** correctly recovered, and that the vectorized delta encoder (when
+** there is one) gives exactly the same deltas as the scalar encoder.
+**
+** With --corpus, do the same for pairs of artifacts taken from the
+** DELTA table of the current repository (each artifact and its delta
+** source) instead of for two files.
+**
+** Options:
+**    --corpus        Use artifact pairs from the current repository
+**    --limit N       Use at most N pairs from the repository.  Default 500
+**    --repeat N      Also report the time to create each delta N times
+**    --scalar        Time the scalar encoder rather than the vectorized one
 */
 void cmd_test_delta(void){
   Blob f1, f2;     /* Original file content */
-  Blob d12, d21;   /* Deltas from f1->f2 and f2->f1 */
-  Blob a1, a2;     /* Recovered file content */
-  if( g.argc!=4 ) usage("FILE1 FILE2");
-  blob_read_from_file(&f1, g.argv[2], ExtFILE);
-  blob_read_from_file(&f2, g.argv[3], ExtFILE);
-  blob_delta_create(&f1, &f2, &d12);
-  blob_delta_create(&f2, &f1, &d21);
-  blob_delta_apply(&f1, &d12, &a2);
-  blob_delta_apply(&f2, &d21, &a1);
-  if( blob_compare(&f1,&a1) || blob_compare(&f2, &a2) ){
+  int bCorpus = find_option("corpus",0,0)!=0;
+  int bScalar = find_option("scalar",0,0)!=0;
+  const char *zLimit = find_option("limit",0,1);
+  const char *zRepeat = find_option("repeat",0,1);
+  int nLimit = zLimit ? atoi(zLimit) : 500;
+  int nRepeat = zRepeat ? atoi(zRepeat) : 0;
+  int nPair = 0;
+  int nErr = 0;
+  i64 nByte = 0;
+  sqlite3_uint64 nUsec = 0;
+  if( bCorpus ){
+    Stmt q;
+    db_find_and_open_repository(0, 0);
+    verify_all_options();
+    if( g.argc!=2 ) usage("--corpus ?OPTIONS?");
+    db_prepare(&q,
+      "SELECT rid, srcid FROM delta"
+      " WHERE rid NOT IN phantom AND srcid NOT IN phantom"
+      " ORDER BY rid LIMIT %d", nLimit
+    );
+    while( db_step(&q)==SQLITE_ROW ){
+      int rid = db_column_int(&q, 0);
+      int srcid = db_column_int(&q, 1);
+      if( !content_get(rid, &f1) || !content_get(srcid, &f2) ){
+        fossil_fatal("cannot read artifacts %d and %d", rid, srcid);
+      }
+      if( test_delta_pair(&f1, &f2, nRepeat, bScalar, &nUsec) ){
+        fossil_print("delta test failed for artifacts %d and %d\n",
+                     rid, srcid);
+        nErr++;
+      }
+      nByte += blob_size(&f1) + blob_size(&f2);
+      nPair++;
+      blob_reset(&f1);
+      blob_reset(&f2);
+    }
+    db_finalize(&q);
+  }else{
+    verify_all_options();
+    if( g.argc!=4 ) usage("?OPTIONS? FILE1 FILE2");
+    blob_read_from_file(&f1, g.argv[2], ExtFILE);
+    blob_read_from_file(&f2, g.argv[3], ExtFILE);
+    nErr = test_delta_pair(&f1, &f2, nRepeat, bScalar, &nUsec);
+    nByte = blob_size(&f1) + blob_size(&f2);
+    nPair = 1;
+    blob_reset(&f1);
+    blob_reset(&f2);
+  }
+  if( nErr ){
     fossil_fatal("delta test failed");
   }
+  if( nRepeat>0 ){
+    fossil_print("%d pair%s, %,lld bytes, %d repetitions, %s encoder: "
+                 "%.3f seconds, %.1f MB/s\n",
+                 nPair, nPair==1 ? "" : "s", nByte, nRepeat,
+                 (bScalar || !delta_enable_simd(1)) ? "scalar" : "vector",
+                 nUsec/1e6,
+                 nUsec ? (double)nByte*nRepeat/nUsec : 0.0);
+  }
   fossil_print("ok\n");
 }
@@ -22,6 +22,21 @@
 #include "diff.h"
 #include <assert.h>
 #include <errno.h>
+#ifdef FOSSIL_HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+/*
+** Vectorized kernels for splitting text into lines.  As in delta.c,
+** these are chosen at compile-time from whatever the compiler targets
+** (SSE2 is always available on x86-64).  The scalar code is used
+** everywhere else and gives exactly the same lines and hashes.
+*/
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) \
+   || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+# include <emmintrin.h>
+# define DIFF_SSE2 1
+#endif
 
 
 #if INTERFACE
@@ -53,6 +68,7 @@
 #define DIFF_SHOW_VERS         0x00200000 /* Show compared versions */
 #define DIFF_DARKMODE          0x00400000 /* Use dark mode for HTML */
 #define DIFF_BY_TOKEN          0x01000000 /* Split on tokens, not lines */
+#define DIFF_HISTOGRAM         0x02000000 /* Use the histogram algorithm */
 
 /*
 ** Per file information that may influence output.
@@ -179,6 +195,7 @@ struct DContext {
   DLine *aTo;        /* File on right side of the diff */
   int nTo;           /* Number of lines in aTo[] */
   int (*xDiffer)(const DLine *,const DLine *); /* comparison function */
+  int useHistogram;  /* Use histogram_step() rather than diff_step() */
 };
 
 /* Fast isspace for use by diff */
@@ -203,6 +220,42 @@ static const char diffIsSpace[] = {
 };
 #define diff_isspace(X)  (diffIsSpace[(unsigned char)(X)])
 
+#ifdef DIFF_SSE2
+/*
+** Return the index of the least significant set bit in a non-zero value.
+*/
+static int diff_lowest_bit(unsigned int m){
+#if defined(__GNUC__)
+  return __builtin_ctz(m);
+#else
+  int i = 0;
+  while( (m&1)==0 ){ m >>= 1; i++; }
+  return i;
+#endif
+}
+#endif /* DIFF_SSE2 */
+
+/*
+** When false, break_into_lines() and count_lines() use only the scalar
+** code even if the vectorized kernels are available.
+*/
+static int diffUseSimd = 1;
+
+/*
+** Enable or disable the vectorized kernels used to split text into
+** lines.  Return true if vectorized kernels are compiled in.  The
+** results are the same either way.  This exists so that the two can
+** be compared.
+*/
+int diff_enable_simd(int onOff){
+  diffUseSimd = onOff;
+#ifdef DIFF_SSE2
+  return 1;
+#else
+  return 0;
+#endif
+}
+
 /*
 ** Count the number of lines in the input string.  Include the last line
 ** in the count even if it lacks the \n terminator.  If an empty string
@@ -221,6 +274,43 @@ int count_lines(
 ){
   int nLine;
   const char *zNL, *z2;
+#ifdef DIFF_SSE2
+  if( diffUseSimd ){
+    /* Count the newlines in z[0..n-1] and check for NUL characters,
+    ** 16 bytes at a time.  The per-lane counters in vCnt are folded
+    ** into nLine before they can overflow. */
+    const __m128i vNL = _mm_set1_epi8('\n');
+    const __m128i vZero = _mm_setzero_si128();
+    __m128i vNul = vZero;
+    int i = 0;
+    nLine = 0;
+    while( i+16<=n ){
+      __m128i vCnt = vZero;
+      int iEnd = i + 255*16;
+      if( iEnd>n ) iEnd = n;
+      for(; i+16<=iEnd; i+=16){
+        __m128i v = _mm_loadu_si128((const __m128i*)&z[i]);
+        vCnt = _mm_sub_epi8(vCnt, _mm_cmpeq_epi8(v, vNL));
+        vNul = _mm_or_si128(vNul, _mm_cmpeq_epi8(v, vZero));
+      }
+      vCnt = _mm_sad_epu8(vCnt, vZero);
+      nLine += _mm_cvtsi128_si32(vCnt)
+             + _mm_cvtsi128_si32(_mm_srli_si128(vCnt, 8));
+    }
+    if( _mm_movemask_epi8(vNul) ) return 0;
+    for(; i<n; i++){
+      if( z[i]=='\n' ){
+        nLine++;
+      }else if( z[i]==0 ){
+        return 0;
+      }
+    }
+    if( z[n]!=0 ) return 0;
+    if( n>0 && z[n-1]!='\n' ) nLine++;
+    if( pnLine ) *pnLine = nLine;
+    return 1;
+  }
+#endif
   for(nLine=0, z2=z; (zNL = strchr(z2,'\n'))!=0; z2=zNL+1, nLine++){}
   if( z2[0]!='\0' ){
     nLine++;
@@ -231,6 +321,107 @@ int count_lines(
   return 1;
 }
 
+/*
+** Fill in a[i] for the nn-byte line z, which is one of the nLine lines
+** of a file, and add it to the hash table in a[].  zBuf is scratch space
+** of at least LENGTH_MASK+16 bytes.  Return zero if the line is too long.
+**
+** When whitespace is ignored, the non-space characters of the line are
+** first copied into zBuf, so that they can be hashed 8 bytes at a time
+** in the same way as a line in which whitespace matters.
+*/
+static int dline_init(
+  DLine *a,
+  int i,
+  const char *z,
+  int nn,
+  int nLine,
+  u64 diffFlags,
+  char *zBuf
+){
+  int k, s, x;
+  u64 h, h2, m;
+  const char *zHash = z;
+
+  if( nn>LENGTH_MASK ) return 0;
+  a[i].z = z;
+  k = nn;
+  if( diffFlags & DIFF_STRIP_EOLCR ){
+    if( k>0 && z[k-1]=='\r' ){ k--; }
+  }
+  a[i].n = k;
+  if( diffFlags & DIFF_IGNORE_EOLWS ){
+    while( k>0 && diff_isspace(z[k-1]) ){ k--; }
+  }
+  s = 0;
+  if( (diffFlags & DIFF_IGNORE_ALLWS)==DIFF_IGNORE_ALLWS ){
+    int j = 0;
+    for(s=0; s<k && z[s]<=' '; s++){}
+    a[i].indent = s;
+    a[i].nw = k - s;
+    x = s;
+#ifdef DIFF_SSE2
+    if( diffUseSimd ){
+      /* Classify 16 characters at a time and copy each run of
+      ** non-space characters with a single 16-byte move.  The whitespace
+      ** characters of diffIsSpace[] are ' ' and 0x08 through 0x0d,
+      ** except for 0x0b. */
+      const __m128i vSpace = _mm_set1_epi8(' ');
+      const __m128i vBS = _mm_set1_epi8(0x08);
+      const __m128i vFive = _mm_set1_epi8(5);
+      const __m128i vVT = _mm_set1_epi8(0x0b);
+      const __m128i vZero = _mm_setzero_si128();
+      unsigned char aBlk[32];
+      _mm_storeu_si128((__m128i*)&aBlk[16], vZero);
+      for(; x+16<=k; x+=16){
+        __m128i v = _mm_loadu_si128((const __m128i*)&z[x]);
+        __m128i vCtl = _mm_cmpeq_epi8(
+                 _mm_subs_epu8(_mm_sub_epi8(v, vBS), vFive), vZero);
+        __m128i vWs = _mm_or_si128(_mm_cmpeq_epi8(v, vSpace),
+                 _mm_andnot_si128(_mm_cmpeq_epi8(v, vVT), vCtl));
+        unsigned int mKeep = ~_mm_movemask_epi8(vWs) & 0xffff;
+        if( mKeep==0xffff ){
+          _mm_storeu_si128((__m128i*)&zBuf[j], v);
+          j += 16;
+          continue;
+        }
+        _mm_storeu_si128((__m128i*)aBlk, v);
+        while( mKeep ){
+          int iRun = diff_lowest_bit(mKeep);
+          int nRun = diff_lowest_bit(~(mKeep>>iRun));
+          _mm_storeu_si128((__m128i*)&zBuf[j],
+                           _mm_loadu_si128((const __m128i*)&aBlk[iRun]));
+          j += nRun;
+          mKeep &= ~((1u<<(iRun+nRun))-1);
+        }
+      }
+    }
+#endif
+    for(; x<k; x++){
+      zBuf[j] = z[x];
+      j += !diff_isspace(z[x]);
+    }
+    zHash = zBuf;
+    k = s + j;
+  }
+  {
+    int k2 = (k-s) & ~0x7;
+    if( zHash==z ) zHash += s;
+    for(h=x=0; x<k2; x += 8){
+      memcpy(&m, zHash+x, 8);
+      h = (h^m)*9000000000000000041LL;
+    }
+    m = 0;
+    memcpy(&m, zHash+x, (k-s)-k2);
+    h ^= m;
+  }
+  a[i].h = h = ((h%281474976710597LL)<<LENGTH_MASK_SZ) | (k-s);
+  h2 = h % nLine;
+  a[i].iNext = a[h2].iHash;
+  a[h2].iHash = i+1;
+  return 1;
+}
+
 /*
 ** Return an array of DLine objects containing a pointer to the
 ** start of each line and a hash of that line.  The lower
@@ -244,7 +435,8 @@ int count_lines(
 ** too long.
 **
 ** Profiling show that in most cases this routine consumes the bulk of
-** the CPU time on a diff.
+** the CPU time on a diff.  So when vectorized kernels are available,
+** the newlines are found 16 bytes at a time.
 */
 static DLine *break_into_lines(
   const char *z,
@@ -252,10 +444,10 @@ static DLine *break_into_lines(
   int *pnLine,
   u64 diffFlags
 ){
-  int nLine, i, k, nn, s, x;
-  u64 h, h2;
+  int nLine, i, nn;
   DLine *a;
   const char *zNL;
+  char *zBuf = 0;
 
   if( count_lines(z, n, &nLine)==0 ){
     return 0;
@@ -267,61 +459,63 @@ static DLine *break_into_lines(
     *pnLine = 0;
     return a;
   }
+  if( (diffFlags & DIFF_IGNORE_ALLWS)==DIFF_IGNORE_ALLWS ){
+    zBuf = fossil_malloc( LENGTH_MASK+16 );
+  }
   i = 0;
+#ifdef DIFF_SSE2
+  if( diffUseSimd ){
+    const __m128i vNL = _mm_set1_epi8('\n');
+    int iStart = 0;      /* Offset of the start of the next line */
+    int iBlk;            /* Offset of the block of 16 bytes examined */
+    for(iBlk=0; iBlk+16<=n; iBlk+=16){
+      __m128i v = _mm_loadu_si128((const __m128i*)&z[iBlk]);
+      unsigned int mNL = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vNL));
+      while( mNL ){
+        int iEnd = iBlk + diff_lowest_bit(mNL);
+        mNL &= mNL-1;
+        if( !dline_init(a, i++, z+iStart, iEnd-iStart, nLine, diffFlags,
+                        zBuf) ){
+          goto too_long;
+        }
+        iStart = iEnd+1;
+      }
+    }
+    while( iStart<n ){
+      zNL = memchr(z+iStart, '\n', n-iStart);
+      nn = zNL ? (int)(zNL - (z+iStart)) : n-iStart;
+      if( !dline_init(a, i++, z+iStart, nn, nLine, diffFlags, zBuf) ){
+        goto too_long;
+      }
+      iStart += nn+1;
+    }
+    assert( i==nLine );
+    fossil_free(zBuf);
+    *pnLine = nLine;
+    return a;
+  }
+#endif
   do{
     zNL = strchr(z,'\n');
     if( zNL==0 ) zNL = z+n;
     nn = (int)(zNL - z);
-    if( nn>LENGTH_MASK ){
-      fossil_free(a);
-      return 0;
-    }
-    a[i].z = z;
-    k = nn;
-    if( diffFlags & DIFF_STRIP_EOLCR ){
-      if( k>0 && z[k-1]=='\r' ){ k--; }
-    }
-    a[i].n = k;
-    if( diffFlags & DIFF_IGNORE_EOLWS ){
-      while( k>0 && diff_isspace(z[k-1]) ){ k--; }
-    }
-    if( (diffFlags & DIFF_IGNORE_ALLWS)==DIFF_IGNORE_ALLWS ){
-      int numws = 0;
-      for(s=0; s<k && z[s]<=' '; s++){}
-      a[i].indent = s;
-      a[i].nw = k - s;
-      for(h=0, x=s; x<k; x++){
-        char c = z[x];
-        if( diff_isspace(c) ){
-          ++numws;
-        }else{
-          h = (h^c)*9000000000000000041LL;
-        }
-      }
-      k -= numws;
-    }else{
-      int k2 = k & ~0x7;
-      u64 m;
-      for(h=x=s=0; x<k2; x += 8){
-        memcpy(&m, z+x, 8);
-        h = (h^m)*9000000000000000041LL;
-      }
-      m = 0;
-      memcpy(&m, z+x, k-k2);
-      h ^= m;
+    if( !dline_init(a, i, z, nn, nLine, diffFlags, zBuf) ){
+      goto too_long;
     }
-    a[i].h = h = ((h%281474976710597LL)<<LENGTH_MASK_SZ) | (k-s);
-    h2 = h % nLine;
-    a[i].iNext = a[h2].iHash;
-    a[h2].iHash = i+1;
     z += nn+1; n -= nn+1;
     i++;
   }while( zNL[0]!='\0' && zNL[1]!='\0' );
   assert( i==nLine );
+  fossil_free(zBuf);
 
   /* Return results */
   *pnLine = nLine;
   return a;
+
+too_long:
+  fossil_free(zBuf);
+  fossil_free(a);
+  return 0;
 }
 
 /*
@@ -1009,6 +1203,85 @@ void test_line_diff(void){
   if( x ) fossil_print("\n");
 }
 
+/*
+** COMMAND: test-break-lines
+**
+** Usage: %fossil test-break-lines FILE ?OPTIONS?
+**
+** Split FILE into lines and compute the hash of each line, the way the
+** diff engine does before comparing two files.  Verify that the
+** vectorized kernels (when there are any) find exactly the same lines
+** and hashes as the scalar code.
+**
+** Options:
+**   --repeat N                  Also report the time to split the file
+**                               N times
+**   --scalar                    Time the scalar code rather than the
+**                               vectorized code
+**   -w|--ignore-all-space       Ignore all whitespace
+**   -Z|--ignore-trailing-space  Ignore whitespace at line end
+*/
+void test_break_lines_cmd(void){
+  Blob f;
+  DLine *a, *b;
+  int nA = 0, nB = 0;
+  int i, nErr = 0;
+  u64 diffFlags = DIFF_STRIP_EOLCR;
+  int bScalar = find_option("scalar",0,0)!=0;
+  const char *zRepeat = find_option("repeat",0,1);
+  int nRepeat = zRepeat ? atoi(zRepeat) : 0;
+
+  if( find_option("ignore-trailing-space","Z",0)!=0 ){
+    diffFlags |= DIFF_IGNORE_EOLWS;
+  }
+  if( find_option("ignore-all-space","w",0)!=0 ){
+    diffFlags |= DIFF_IGNORE_ALLWS;
+  }
+  verify_all_options();
+  if( g.argc!=3 ) usage("FILE ?OPTIONS?");
+  blob_read_from_file(&f, g.argv[2], ExtFILE);
+  diff_enable_simd(0);
+  a = break_into_lines(blob_str(&f), blob_size(&f), &nA, diffFlags);
+  diff_enable_simd(1);
+  b = break_into_lines(blob_str(&f), blob_size(&f), &nB, diffFlags);
+  if( (a==0)!=(b==0) || nA!=nB ){
+    nErr++;
+  }else if( a ){
+    for(i=0; i<nA; i++){
+      if( a[i].z!=b[i].z || a[i].h!=b[i].h || a[i].n!=b[i].n
+       || a[i].indent!=b[i].indent || a[i].nw!=b[i].nw
+       || a[i].iNext!=b[i].iNext || a[i].iHash!=b[i].iHash
+      ){
+        fossil_print("line %d differs\n", i+1);
+        nErr++;
+        break;
+      }
+    }
+  }
+  fossil_free(a);
+  fossil_free(b);
+  if( nErr ) fossil_fatal("line splitting test failed");
+  if( nRepeat>0 ){
+    sqlite3_uint64 nUsec;
+    int iTimer;
+    diff_enable_simd(!bScalar);
+    iTimer = fossil_timer_start();
+    for(i=0; i<nRepeat; i++){
+      fossil_free(break_into_lines(blob_str(&f), blob_size(&f), &nA,
+                                   diffFlags));
+    }
+    nUsec = fossil_timer_stop(iTimer);
+    fossil_print("%d lines, %,d bytes, %d repetitions, %s code: "
+                 "%.3f seconds, %.1f MB/s\n",
+                 nA, blob_size(&f), nRepeat,
+                 (bScalar || !diff_enable_simd(1)) ? "scalar" : "vector",
+                 nUsec/1e6,
+                 nUsec ? (double)blob_size(&f)*nRepeat/nUsec : 0.0);
+  }
+  blob_reset(&f);
+  fossil_print("ok\n");
+}
+
 /*
 ** Minimum of two values
 */
@@ -1971,20 +2244,13 @@ void test_dline_match(void){
   fossil_print("%d\n", x);
 }
 
-/* Forward declarations for recursion */
+/* Forward declaration for recursion */
 static unsigned char *diffBlockAlignment(
   DLine *aLeft, int nLeft,     /* Text on the left */
   DLine *aRight, int nRight,   /* Text on the right */
   DiffConfig *pCfg,            /* Configuration options */
   int *pNResult                /* OUTPUT: Bytes of result */
 );
-static void longestCommonSequence(
-  DContext *p,               /* Two files being compared */
-  int iS1, int iE1,          /* Range of lines in p->aFrom[] */
-  int iS2, int iE2,          /* Range of lines in p->aTo[] */
-  int *piSX, int *piEX,      /* Write p->aFrom[] common segment here */
-  int *piSY, int *piEY       /* Write p->aTo[] common segment here */
-);
 
 /*
 ** Make a copy of a list of nLine DLine objects from one array to
@@ -2021,11 +2287,32 @@ static void diffDLineXfer(
 }
 
 
+/*
+** Lines whose text, ignoring whitespace, is this long or shorter, such
+** as "}" or "{", are never used as anchors by
+** diffBlockAlignmentIgnoreSpace().
+*/
+#define DIFF_ALIGN_TRIVIAL  2
+
+/*
+** Upper bound on the number of 64-bit words of working memory used
+** by diffBlockAlignmentIgnoreSpace().
+*/
+#define DIFF_ALIGN_MXWORD  4000000
+
 /*
 ** For a difficult diff-block alignment that was originally for
-** the default consider-all-whitespace algorithm, try to find the
-** longest common subsequence between the two blocks that involves
-** only whitespace changes.
+** the default consider-all-whitespace algorithm, find the longest
+** common subsequence of lines between the two blocks that differ only
+** in whitespace.  Those lines are aligned with each other and the gaps
+** between them are aligned by diffBlockAlignment().  Return NULL if
+** there is no such line.
+**
+** The LCS is computed exactly with the bit-parallel algorithm of
+** Allison, Dix and Hyyro: the lines of aLeft[] are packed 64 to a word
+** and each line of aRight[] is processed with a few word operations per
+** word, for O(nLeft*nRight/64) time.  One bit-vector is kept per line of
+** aRight[] so that the alignment can be recovered afterwards.
 */
 static unsigned char *diffBlockAlignmentIgnoreSpace(
   DLine *aLeft, int nLeft,     /* Text on the left */
@@ -2033,45 +2320,131 @@ static unsigned char *diffBlockAlignmentIgnoreSpace(
   DiffConfig *pCfg,            /* Configuration options */
   int *pNResult                /* OUTPUT: Bytes of result */
 ){
-  DContext dc;
-  int iSX, iEX;                /* Start and end of LCS on the left */
-  int iSY, iEY;                /* Start and end of the LCS on the right */
-  unsigned char *a1, *a2;
-  int n1, n2, nLCS;
-
-  dc.aEdit = 0;
-  dc.nEdit = 0;
-  dc.nEditAlloc = 0;
-  dc.nFrom = nLeft;
-  dc.nTo = nRight;
-  dc.xDiffer = compare_dline_ignore_allws;
-  dc.aFrom = fossil_malloc( sizeof(DLine)*(nLeft+nRight) );
-  dc.aTo = &dc.aFrom[dc.nFrom];
-  diffDLineXfer(dc.aFrom, aLeft, nLeft);
-  diffDLineXfer(dc.aTo, aRight, nRight);
-  longestCommonSequence(&dc,0,nLeft,0,nRight,&iSX,&iEX,&iSY,&iEY);
-  fossil_free(dc.aFrom);
-  nLCS = iEX - iSX;
-  if( nLCS<5 ) return 0;   /* No good LCS was found */
+  DLine *aL, *aR;              /* Lines with whitespace removed */
+  int *aClass;                 /* Class of each line.  -1 for no match */
+  u64 *aPeq;                   /* Bitmask of the left lines in each class */
+  u64 *aV;                     /* Bit-vector after each line on the right */
+  unsigned char *aOp;          /* Alignment of the LCS, built backwards */
+  unsigned char *aRes;         /* The result */
+  int nWord = (nLeft+63)/64;   /* Words per bit-vector */
+  int nClass = 0;              /* Number of classes */
+  int nLCS = 0;                /* Length of the LCS */
+  int nOp, nRes;
+  int i, j, k, w;
+
+  if( (i64)nWord*(nLeft+nRight)>DIFF_ALIGN_MXWORD ) return 0;
+
+  /* Give identical lines on the left the same class number, and lines
+  ** on the right the class of the left lines that they match */
+  aL = fossil_malloc( sizeof(DLine)*(nLeft+nRight) );
+  aR = &aL[nLeft];
+  diffDLineXfer(aL, aLeft, nLeft);
+  diffDLineXfer(aR, aRight, nRight);
+  aClass = fossil_malloc( sizeof(int)*(nLeft+nRight) );
+  for(i=0; i<nLeft+nRight; i++) aClass[i] = -1;
+  for(i=0; i<nLeft+nRight; i++){
+    const DLine *pX = &aL[i];
+    if( pX->n<=DIFF_ALIGN_TRIVIAL ) continue;
+    for(k=aL[pX->h % nLeft].iHash; k; k=aL[k-1].iNext){
+      if( compare_dline_ignore_allws(&aL[k-1], pX)==0 ) break;
+    }
+    if( k==0 ) continue;
+    if( aClass[k-1]<0 ) aClass[k-1] = nClass++;
+    aClass[i] = aClass[k-1];
+  }
+  fossil_free(aL);
+  aPeq = fossil_malloc( sizeof(u64)*nWord*(nClass+nRight) );
+  memset(aPeq, 0, sizeof(u64)*nWord*nClass);
+  for(i=0; i<nLeft; i++){
+    if( aClass[i]>=0 ) aPeq[aClass[i]*nWord + i/64] |= ((u64)1)<<(i%64);
+  }
+
+  /* The LCS computation proper.  Bit i of aV[] for line j is clear if
+  ** the LCS of aLeft[0..i] and aRight[0..j] is one longer than the LCS
+  ** of aLeft[0..i-1] and aRight[0..j] */
+  aV = &aPeq[nWord*nClass];
+  for(j=0; j<nRight; j++){
+    u64 *pV = &aV[j*nWord];
+    const u64 *pPrev = j ? pV - nWord : 0;
+    const u64 *pM = aClass[nLeft+j]>=0 ? &aPeq[aClass[nLeft+j]*nWord] : 0;
+    u64 carry = 0;
+    for(w=0; w<nWord; w++){
+      u64 v = pPrev ? pPrev[w] : ~(u64)0;
+      u64 m = pM ? pM[w] : 0;
+      u64 u = v & m;
+      u64 sum = v + u;
+      u64 c = sum<v;
+      sum += carry;
+      carry = c | (sum<carry);
+      pV[w] = sum | (v & ~m);
+    }
+  }
 
-  if( pCfg->diffFlags & DIFF_DEBUG ){
-     fossil_print("   LCS size=%d\n"
-                  "     [%.*s]\n"
-                  "     [%.*s]\n",
-                  nLCS, aLeft[iSX].n, aLeft[iSX].z,
-                  aLeft[iEX-1].n, aLeft[iEX-1].z);
+  /* Walk back through the bit-vectors to recover the alignment */
+  aOp = fossil_malloc( nLeft+nRight );
+  nOp = 0;
+  i = nLeft;
+  j = nRight;
+  while( i>0 && j>0 ){
+    if( aClass[i-1]>=0 && aClass[i-1]==aClass[nLeft+j-1] ){
+      aOp[nOp++] = 3;
+      nLCS++;
+      i--;
+      j--;
+    }else if( (aV[(j-1)*nWord + (i-1)/64]>>((i-1)%64)) & 1 ){
+      aOp[nOp++] = 1;
+      i--;
+    }else{
+      aOp[nOp++] = 2;
+      j--;
+    }
+  }
+  while( i>0 ){ aOp[nOp++] = 1; i--; }
+  while( j>0 ){ aOp[nOp++] = 2; j--; }
+  fossil_free(aPeq);
+  fossil_free(aClass);
+  if( nLCS==0 ){
+    fossil_free(aOp);
+    return 0;
   }
 
-  a1 = diffBlockAlignment(aLeft,iSX,aRight,iSY,pCfg,&n1);
-  a2 = diffBlockAlignment(aLeft+iEX, nLeft-iEX,
-                          aRight+iEY, nRight-iEY,
-                          pCfg, &n2);
-  a1 = fossil_realloc(a1, n1+nLCS+n2);
-  memcpy(a1+n1+nLCS,a2,n2);
-  memset(a1+n1,3,nLCS);
-  fossil_free(a2);
-  *pNResult = n1+n2+nLCS;
-  return a1;
+  if( pCfg->diffFlags & DIFF_DEBUG ){
+    fossil_print("   LCS size=%d\n", nLCS);
+  }
+
+  /* Align the gaps between the lines of the LCS */
+  aRes = fossil_malloc( nLeft+nRight );
+  nRes = 0;
+  i = j = 0;
+  while( nOp>0 ){
+    int nDel = 0, nIns = 0;
+    while( nOp>0 && aOp[nOp-1]!=3 ){
+      if( aOp[--nOp]==1 ){
+        nDel++;
+      }else{
+        nIns++;
+      }
+    }
+    if( nDel+nIns>0 ){
+      int nGap;
+      unsigned char *aGap;
+      aGap = diffBlockAlignment(aLeft+i, nDel, aRight+j, nIns, pCfg, &nGap);
+      memcpy(&aRes[nRes], aGap, nGap);
+      fossil_free(aGap);
+      nRes += nGap;
+      i += nDel;
+      j += nIns;
+    }
+    while( nOp>0 && aOp[nOp-1]==3 ){
+      nOp--;
+      aRes[nRes++] = 3;
+      i++;
+      j++;
+    }
+  }
+  fossil_free(aOp);
+  *pNResult = nRes;
+  return aRes;
 }
 
 
@@ -2846,6 +3219,178 @@ static void diff_step(DContext *p, int iS1, int iE1, int iS2, int iE2){
   }
 }
 
+/*
+** The histogram algorithm only anchors on lines that occur at most
+** this many times in the left-hand segment.
+*/
+#define HISTOGRAM_MX_CNT  64
+
+/*
+** This is an alternative to diff_step() that implements the "histogram"
+** diff algorithm.  It computes the copy/delete/insert steps that convert
+** lines iS1 through iE1-1 of the input into lines iS2 through iE2-1 of
+** the output.
+**
+** Rather than looking for the longest common block, as diff_step()
+** does, the histogram algorithm anchors on the lines that are as rare
+** as possible in the input.  Among all pairs of equal lines of that
+** rarity, one from each segment, it takes the longest chain of pairs
+** that are in the same order on both sides, found in a single pass as
+** for a longest increasing subsequence.  The gaps between the anchors
+** are then diffed in turn, after any lines they have in common at their
+** start and end are removed.  When there are lines that occur only once
+** in each segment, this is the same as "patience" diff.  Anchoring on
+** rare lines keeps lines such as "}" or blank lines from pairing up
+** across moved blocks of text, which gives more readable output for
+** reordered files.
+**
+** Each segment is hashed once.  The cost is proportional to the number
+** of lines, plus N*log(N) for N pairs of anchor lines, at each level of
+** the recursion.
+**
+** If no line of the input segment that also occurs in the output
+** segment is rarer than HISTOGRAM_MX_CNT, the segment is handed to
+** diff_step() instead.
+*/
+static void histogram_step(DContext *p, int iS1, int iE1, int iS2, int iE2){
+  int nHead = 0;         /* Lines in common at the start */
+  int nTail = 0;         /* Lines in common at the end */
+  int n, m;              /* Number of lines in the two segments */
+  int nHash;             /* Number of hash table slots.  A power of 2 */
+  int *aHash;            /* 1+(first line) of each distinct line, by hash */
+  int *aCnt;             /* Number of occurrences of each distinct line */
+  int *aNext;            /* 1+(next line) with the same text, or 0 */
+  int *aSlotB;           /* Hash table slot of each output line, or -1 */
+  int *aPair;            /* Input and output line of each candidate pair */
+  int *aPrev;            /* Previous pair in the chain ending at each pair */
+  int *aTail;            /* Last pair of the best chain of each length */
+  int aChain[HISTOGRAM_MX_CNT];  /* Input lines with the same text */
+  int nPair = 0;         /* Number of candidate pairs */
+  int nLen = 0;          /* Length of the longest chain */
+  int i, j, h, k;
+  int mnCnt = HISTOGRAM_MX_CNT+1;  /* Occurrences of the rarest line */
+
+  /* Remove the lines in common at the start and end */
+  while( iS1<iE1 && iS2<iE2
+      && p->xDiffer(&p->aFrom[iS1], &p->aTo[iS2])==0 ){
+    iS1++;
+    iS2++;
+    nHead++;
+  }
+  while( iE1>iS1 && iE2>iS2
+      && p->xDiffer(&p->aFrom[iE1-1], &p->aTo[iE2-1])==0 ){
+    iE1--;
+    iE2--;
+    nTail++;
+  }
+  if( nHead ) appendTriple(p, nHead, 0, 0);
+  n = iE1 - iS1;
+  m = iE2 - iS2;
+  if( n==0 || m==0 ){
+    if( n || m ) appendTriple(p, 0, n, m);
+    if( nTail ) appendTriple(p, nTail, 0, 0);
+    return;
+  }
+
+  /* Build a hash table of the lines of the input segment.  Lines are
+  ** inserted from last to first so that each chain of identical lines
+  ** runs in increasing order. */
+  for(nHash=16; nHash<2*n; nHash*=2){}
+  aHash = fossil_malloc( sizeof(int)*(2*nHash + n + m) );
+  memset(aHash, 0, sizeof(int)*2*nHash);
+  aCnt = &aHash[nHash];
+  aNext = &aCnt[nHash];
+  aSlotB = &aNext[n];
+  for(i=iE1-1; i>=iS1; i--){
+    DLine *pA = &p->aFrom[i];
+    for(h=(int)(pA->h ^ (pA->h>>32))&(nHash-1);
+        aHash[h] && p->xDiffer(&p->aFrom[aHash[h]-1], pA);
+        h=(h+1)&(nHash-1)){}
+    aNext[i-iS1] = aHash[h];
+    aHash[h] = i+1;
+    aCnt[h]++;
+  }
+
+  /* Find the slot of each output line, and the rarest count among the
+  ** lines that are on both sides */
+  for(j=iS2; j<iE2; j++){
+    DLine *pB = &p->aTo[j];
+    for(h=(int)(pB->h ^ (pB->h>>32))&(nHash-1);
+        aHash[h] && p->xDiffer(&p->aFrom[aHash[h]-1], pB);
+        h=(h+1)&(nHash-1)){}
+    if( aHash[h]==0 ){
+      aSlotB[j-iS2] = -1;
+    }else{
+      aSlotB[j-iS2] = h;
+      if( aCnt[h]<mnCnt ) mnCnt = aCnt[h];
+    }
+  }
+  if( mnCnt>HISTOGRAM_MX_CNT ){
+    /* No anchor.  Let the classic algorithm deal with this segment */
+    fossil_free(aHash);
+    diff_step(p, iS1, iE1, iS2, iE2);
+    if( nTail ) appendTriple(p, nTail, 0, 0);
+    return;
+  }
+
+  /* Every pair of equal lines of the rarest count is a candidate, in
+  ** order of the output line.  The pairs of one output line are taken
+  ** in decreasing order of the input line, so that no chain of pairs
+  ** with increasing input lines uses an output line twice. */
+  for(j=0; j<m; j++){
+    if( aSlotB[j]>=0 && aCnt[aSlotB[j]]==mnCnt ) nPair++;
+  }
+  nPair *= mnCnt;
+  aPair = fossil_malloc( sizeof(int)*4*nPair );
+  aPrev = &aPair[2*nPair];
+  aTail = &aPrev[nPair];
+  nPair = 0;
+  for(j=iS2; j<iE2; j++){
+    h = aSlotB[j-iS2];
+    if( h<0 || aCnt[h]!=mnCnt ) continue;
+    for(i=0, k=aHash[h]; k; k=aNext[k-1-iS1]) aChain[i++] = k-1;
+    while( i>0 ){
+      aPair[nPair*2] = aChain[--i];
+      aPair[nPair*2+1] = j;
+      nPair++;
+    }
+  }
+  fossil_free(aHash);
+
+  /* Find the longest chain of pairs with increasing input lines.
+  ** aTail[L] is the pair with the smallest input line that ends a chain
+  ** of L+1 pairs. */
+  for(k=0; k<nPair; k++){
+    int lwr = 0, upr = nLen;
+    while( lwr<upr ){
+      int mid = (lwr+upr)/2;
+      if( aPair[aTail[mid]*2]<aPair[k*2] ){
+        lwr = mid+1;
+      }else{
+        upr = mid;
+      }
+    }
+    aPrev[k] = lwr>0 ? aTail[lwr-1] : -1;
+    aTail[lwr] = k;
+    if( lwr==nLen ) nLen++;
+  }
+
+  /* Diff the gaps between the anchors, first to last.  The chain is
+  ** reversed in place, in aTail[], to get the anchors in order. */
+  for(i=nLen-1, k=aTail[nLen-1]; i>=0; i--, k=aPrev[k]) aTail[i] = k;
+  for(i=0; i<nLen; i++){
+    int iX = aPair[aTail[i]*2];
+    int iY = aPair[aTail[i]*2+1];
+    histogram_step(p, iS1, iX, iS2, iY);
+    appendTriple(p, 1, 0, 0);
+    iS1 = iX+1;
+    iS2 = iY+1;
+  }
+  fossil_free(aPair);
+  histogram_step(p, iS1, iE1, iS2, iE2);
+  if( nTail ) appendTriple(p, nTail, 0, 0);
+}
+
 /*
 ** Compute the differences between two files already loaded into
 ** the DContext structure.
@@ -2878,7 +3423,11 @@ static void diff_all(DContext *p){
   if( iS>0 ){
     appendTriple(p, iS, 0, 0);
   }
-  diff_step(p, iS, iE1, iS, iE2);
+  if( p->useHistogram ){
+    histogram_step(p, iS, iE1, iS, iE2);
+  }else{
+    diff_step(p, iS, iE1, iS, iE2);
+  }
   if( iE1<p->nFrom ){
     appendTriple(p, p->nFrom - iE1, 0, 0);
   }
@@ -2992,6 +3541,25 @@ static void diff_optimize(DContext *p){
     lnFrom += del;
     lnTo += ins;
   }
+
+  /* Shifting can leave a triple that copies no lines, which happens most
+  ** often after the one-line anchors of the histogram algorithm.  Fold
+  ** the deletes and inserts of such a triple into the previous one. */
+  if( p->nEdit>3 ){
+    int w = 3;
+    for(r=3; r<p->nEdit; r+=3){
+      if( p->aEdit[r]==0 && (p->aEdit[r+1] || p->aEdit[r+2]) ){
+        p->aEdit[w-2] += p->aEdit[r+1];
+        p->aEdit[w-1] += p->aEdit[r+2];
+      }else{
+        p->aEdit[w] = p->aEdit[r];
+        p->aEdit[w+1] = p->aEdit[r+1];
+        p->aEdit[w+2] = p->aEdit[r+2];
+        w += 3;
+      }
+    }
+    p->nEdit = w;
+  }
 }
 
 /*
@@ -3058,120 +3626,115 @@ void diff_errmsg(Blob *pOut, const char *msg, int diffFlags){
 }
 
 /*
-** Generate a report of the differences between files pA_Blob and pB_Blob.
+** Break the texts pA_Blob and pB_Blob into lines (or tokens) and compute
+** the edits that transform one into the other, leaving the results in
+** *pC.  This is the part of text_diff() that does not depend on any
+** global state, so that it can be run by a worker thread.
 **
-** If pOut!=NULL then append text to pOut that will be the difference,
-** formatted according to flags in diffFlags.  The pOut Blob must have
-** already been initialized.
-**
-** If pOut==NULL then no formatting occurs.  Instead, this routine
-** returns a pointer to an array of integers.  The integers come in
-** triples.  The elements of each triple are:
-**
-**   1.  The number of lines to copy
-**   2.  The number of lines to delete
-**   3.  The number of lines to insert
-**
-** The return vector is terminated by a triple of all zeros.  The caller
-** should free the returned vector using fossil_free().
-**
-** This diff utility does not work on binary files.  If a binary
-** file is encountered, 0 is returned and pOut is written with
-** text "cannot compute difference between binary files".
+** Return 0 on success.  If no diff can be shown, free everything and
+** return the message that text_diff() shows instead.
 */
-int *text_diff(
+static const char *diff_prepare(
   Blob *pA_Blob,   /* FROM file */
   Blob *pB_Blob,   /* TO file */
-  Blob *pOut,      /* Write diff here if not NULL */
-  DiffConfig *pCfg /* Configuration options */
+  DContext *pC,    /* Write the lines and the edits here */
+  u64 diffFlags    /* DIFF_* flags */
 ){
   int ignoreWs; /* Ignore whitespace */
-  DContext c;
-  int nDel = 0, nIns = 0;
 
-  if( pCfg->diffFlags & DIFF_INVERT ){
+  if( diffFlags & DIFF_INVERT ){
     Blob *pTemp = pA_Blob;
     pA_Blob = pB_Blob;
     pB_Blob = pTemp;
   }
-  ignoreWs = (pCfg->diffFlags & DIFF_IGNORE_ALLWS)!=0;
+  ignoreWs = (diffFlags & DIFF_IGNORE_ALLWS)!=0;
   blob_to_utf8_no_bom(pA_Blob, 0);
   blob_to_utf8_no_bom(pB_Blob, 0);
 
   /* Prepare the input files */
-  memset(&c, 0, sizeof(c));
-  if( (pCfg->diffFlags & DIFF_IGNORE_ALLWS)==DIFF_IGNORE_ALLWS ){
-    c.xDiffer = compare_dline_ignore_allws;
+  memset(pC, 0, sizeof(*pC));
+  if( (diffFlags & DIFF_IGNORE_ALLWS)==DIFF_IGNORE_ALLWS ){
+    pC->xDiffer = compare_dline_ignore_allws;
   }else{
-    c.xDiffer = compare_dline;
-  }
-  if( pCfg->diffFlags & DIFF_BY_TOKEN ){
-    c.aFrom = break_into_tokens(blob_str(pA_Blob), blob_size(pA_Blob),
-                               &c.nFrom, pCfg->diffFlags);
-    c.aTo = break_into_tokens(blob_str(pB_Blob), blob_size(pB_Blob),
-                             &c.nTo, pCfg->diffFlags);
+    pC->xDiffer = compare_dline;
+  }
+  pC->useHistogram = (diffFlags & DIFF_HISTOGRAM)!=0;
+  if( diffFlags & DIFF_BY_TOKEN ){
+    pC->aFrom = break_into_tokens(blob_str(pA_Blob), blob_size(pA_Blob),
+                                  &pC->nFrom, diffFlags);
+    pC->aTo = break_into_tokens(blob_str(pB_Blob), blob_size(pB_Blob),
+                                &pC->nTo, diffFlags);
   }else{
-    c.aFrom = break_into_lines(blob_str(pA_Blob), blob_size(pA_Blob),
-                               &c.nFrom, pCfg->diffFlags);
-    c.aTo = break_into_lines(blob_str(pB_Blob), blob_size(pB_Blob),
-                             &c.nTo, pCfg->diffFlags);
+    pC->aFrom = break_into_lines(blob_str(pA_Blob), blob_size(pA_Blob),
+                                 &pC->nFrom, diffFlags);
+    pC->aTo = break_into_lines(blob_str(pB_Blob), blob_size(pB_Blob),
+                               &pC->nTo, diffFlags);
   }
-  if( c.aFrom==0 || c.aTo==0 ){
-    fossil_free(c.aFrom);
-    fossil_free(c.aTo);
-    if( pOut ){
-      diff_errmsg(pOut, DIFF_CANNOT_COMPUTE_BINARY, pCfg->diffFlags);
-    }
-    return 0;
+  if( pC->aFrom==0 || pC->aTo==0 ){
+    fossil_free(pC->aFrom);
+    fossil_free(pC->aTo);
+    return DIFF_CANNOT_COMPUTE_BINARY;
   }
 
   /* Compute the difference */
-  diff_all(&c);
-  if( ignoreWs && c.nEdit==6 && c.aEdit[1]==0 && c.aEdit[2]==0 ){
-    fossil_free(c.aFrom);
-    fossil_free(c.aTo);
-    fossil_free(c.aEdit);
-    if( pOut ) diff_errmsg(pOut, DIFF_WHITESPACE_ONLY, pCfg->diffFlags);
-    return 0;
-  }
-  if( (pCfg->diffFlags & DIFF_NOTTOOBIG)!=0 ){
+  diff_all(pC);
+  if( ignoreWs && pC->nEdit==6 && pC->aEdit[1]==0 && pC->aEdit[2]==0 ){
+    fossil_free(pC->aFrom);
+    fossil_free(pC->aTo);
+    fossil_free(pC->aEdit);
+    return DIFF_WHITESPACE_ONLY;
+  }
+  if( (diffFlags & DIFF_NOTTOOBIG)!=0 ){
     int i, m, n;
-    int *a = c.aEdit;
-    int mx = c.nEdit;
+    int *a = pC->aEdit;
+    int mx = pC->nEdit;
     for(i=m=n=0; i<mx; i+=3){ m += a[i]; n += a[i+1]+a[i+2]; }
     if( n>10000 ){
-      fossil_free(c.aFrom);
-      fossil_free(c.aTo);
-      fossil_free(c.aEdit);
-      if( pOut ) diff_errmsg(pOut, DIFF_TOO_MANY_CHANGES, pCfg->diffFlags);
-      return 0;
+      fossil_free(pC->aFrom);
+      fossil_free(pC->aTo);
+      fossil_free(pC->aEdit);
+      return DIFF_TOO_MANY_CHANGES;
     }
   }
-  if( (pCfg->diffFlags & DIFF_NOOPT)==0 ){
-    diff_optimize(&c);
+  if( (diffFlags & DIFF_NOOPT)==0 ){
+    diff_optimize(pC);
   }
-  if( (pCfg->diffFlags & DIFF_BY_TOKEN)!=0 ){
+  if( (diffFlags & DIFF_BY_TOKEN)!=0 ){
     /* Convert token counts into byte counts. */
     int i;
     int iA = 0;
     int iB = 0;
-    for(i=0; c.aEdit[i] || c.aEdit[i+1] || c.aEdit[i+2]; i+=3){
+    for(i=0; pC->aEdit[i] || pC->aEdit[i+1] || pC->aEdit[i+2]; i+=3){
       int k, sum;
-      for(k=0, sum=0; k<c.aEdit[i]; k++) sum += c.aFrom[iA++].n;
-      iB += c.aEdit[i];
-      c.aEdit[i] = sum;
-      for(k=0, sum=0; k<c.aEdit[i+1]; k++) sum += c.aFrom[iA++].n;
-      c.aEdit[i+1] = sum;
-      for(k=0, sum=0; k<c.aEdit[i+2]; k++) sum += c.aTo[iB++].n;
-      c.aEdit[i+2] = sum;
+      for(k=0, sum=0; k<pC->aEdit[i]; k++) sum += pC->aFrom[iA++].n;
+      iB += pC->aEdit[i];
+      pC->aEdit[i] = sum;
+      for(k=0, sum=0; k<pC->aEdit[i+1]; k++) sum += pC->aFrom[iA++].n;
+      pC->aEdit[i+1] = sum;
+      for(k=0, sum=0; k<pC->aEdit[i+2]; k++) sum += pC->aTo[iB++].n;
+      pC->aEdit[i+2] = sum;
     }
   }
+  return 0;
+}
+
+/*
+** Finish the work of text_diff() on the edits computed by diff_prepare():
+** update the --numstat counters and format the diff into pOut, or return
+** the array of edits if pOut is NULL.  The DContext is freed.
+*/
+static int *diff_finish(
+  DContext *pC,    /* Result of a successful diff_prepare() */
+  Blob *pOut,      /* Write diff here if not NULL */
+  DiffConfig *pCfg /* Configuration options */
+){
+  int nDel = 0, nIns = 0;
 
   if( pCfg->diffFlags & DIFF_NUMSTAT ){
     int i;
-    for(i=0; c.aEdit[i] || c.aEdit[i+1] || c.aEdit[i+2]; i+=3){
-      nDel += c.aEdit[i+1];
-      nIns += c.aEdit[i+2];
+    for(i=0; pC->aEdit[i] || pC->aEdit[i+1] || pC->aEdit[i+2]; i+=3){
+      nDel += pC->aEdit[i+1];
+      nIns += pC->aEdit[i+2];
     }
     g.diffCnt[1] += nIns;
     g.diffCnt[2] += nDel;
@@ -3188,7 +3751,7 @@ int *text_diff(
         }
       }
     }else if( pCfg->diffFlags & (DIFF_RAW|DIFF_BY_TOKEN) ){
-      const int *R = c.aEdit;
+      const int *R = pC->aEdit;
       unsigned int r;
       for(r=0; R[r] || R[r+1] || R[r+2]; r += 3){
         blob_appendf(pOut, " copy %6d  delete %6d  insert %6d\n",
@@ -3196,11 +3759,11 @@ int *text_diff(
       }
     }else if( pCfg->diffFlags & DIFF_JSON ){
       DiffBuilder *pBuilder = dfjsonNew(pOut);
-      formatDiff(&c, pCfg, pBuilder);
+      formatDiff(pC, pCfg, pBuilder);
       blob_append_char(pOut, '\n');
     }else if( pCfg->diffFlags & DIFF_TCL ){
       DiffBuilder *pBuilder = dftclNew(pOut);
-      formatDiff(&c, pCfg, pBuilder);
+      formatDiff(pC, pCfg, pBuilder);
     }else if( pCfg->diffFlags & DIFF_SIDEBYSIDE ){
       DiffBuilder *pBuilder;
       if( pCfg->diffFlags & DIFF_HTML ){
@@ -3208,28 +3771,407 @@ int *text_diff(
       }else{
         pBuilder = dfsbsNew(pOut, pCfg);
       }
-      formatDiff(&c, pCfg, pBuilder);
+      formatDiff(pC, pCfg, pBuilder);
     }else if( pCfg->diffFlags & DIFF_DEBUG ){
       DiffBuilder *pBuilder = dfdebugNew(pOut);
-      formatDiff(&c, pCfg, pBuilder);
+      formatDiff(pC, pCfg, pBuilder);
     }else if( pCfg->diffFlags & DIFF_HTML ){
       DiffBuilder *pBuilder = dfunifiedNew(pOut, pCfg);
-      formatDiff(&c, pCfg, pBuilder);
+      formatDiff(pC, pCfg, pBuilder);
     }else{
-      contextDiff(&c, pOut, pCfg);
+      contextDiff(pC, pOut, pCfg);
     }
-    fossil_free(c.aFrom);
-    fossil_free(c.aTo);
-    fossil_free(c.aEdit);
+    fossil_free(pC->aFrom);
+    fossil_free(pC->aTo);
+    fossil_free(pC->aEdit);
     return 0;
   }else{
     /* If a context diff is not requested, then return the
     ** array of COPY/DELETE/INSERT triples.
     */
-    free(c.aFrom);
-    free(c.aTo);
-    return c.aEdit;
+    free(pC->aFrom);
+    free(pC->aTo);
+    return pC->aEdit;
+  }
+}
+
+/*
+** Generate a report of the differences between files pA_Blob and pB_Blob.
+**
+** If pOut!=NULL then append text to pOut that will be the difference,
+** formatted according to flags in diffFlags.  The pOut Blob must have
+** already been initialized.
+**
+** If pOut==NULL then no formatting occurs.  Instead, this routine
+** returns a pointer to an array of integers.  The integers come in
+** triples.  The elements of each triple are:
+**
+**   1.  The number of lines to copy
+**   2.  The number of lines to delete
+**   3.  The number of lines to insert
+**
+** The return vector is terminated by a triple of all zeros.  The caller
+** should free the returned vector using fossil_free().
+**
+** This diff utility does not work on binary files.  If a binary
+** file is encountered, 0 is returned and pOut is written with
+** text "cannot compute difference between binary files".
+*/
+int *text_diff(
+  Blob *pA_Blob,   /* FROM file */
+  Blob *pB_Blob,   /* TO file */
+  Blob *pOut,      /* Write diff here if not NULL */
+  DiffConfig *pCfg /* Configuration options */
+){
+  DContext c;
+  const char *zErr;
+
+  zErr = diff_prepare(pA_Blob, pB_Blob, &c, pCfg->diffFlags);
+  if( zErr ){
+    if( pOut ) diff_errmsg(pOut, zErr, pCfg->diffFlags);
+    return 0;
+  }
+  return diff_finish(&c, pOut, pCfg);
+}
+
+/*
+** SETTING: diff-threads          width=8 default=1
+** The number of threads that "fossil diff" uses to compute the
+** differences of several files at once.  The output is the same for
+** any number of threads.  Values are limited to the range 1 through 64.
+*/
+/*
+** SETTING: diff-web-threads      width=8 default=1
+** The largest number of threads that a single web request, such as
+** the /info, /vdiff and /vpatch pages, uses to compute the differences
+** of several files at once.  Keep this small on a busy server, where
+** each request already has its own process.  Values are limited to the
+** range 1 through 64.
+*/
+
+/*
+** Return the number of threads to use to diff the files of a check-in,
+** according to the diff-threads or diff-web-threads setting.
+*/
+int diff_thread_count(void){
+  int n;
+  if( g.isHTTP ){
+    n = db_get_int("diff-web-threads", 1);
+  }else{
+    n = db_get_int("diff-threads", 1);
   }
+  if( n<1 ) n = 1;
+  if( n>64 ) n = 64;
+  return n;
+}
+
+#if INTERFACE
+/*
+** Callback used to turn the output of text_diff() for one file into the
+** output for that file, for example by adding the file names.  The
+** arguments are the text_diff() output, the configuration, two names,
+** and the Blob to which the result is appended.
+*/
+typedef void (*DiffDoneFunc)(Blob*,DiffConfig*,const char*,const char*,Blob*);
+#endif /* INTERFACE */
+
+/*
+** One file being diffed by the threads of a parallel diff.
+*/
+typedef struct DiffJob DiffJob;
+struct DiffJob {
+  Blob a, b;               /* The texts to compare */
+  DiffConfig cfg;          /* Private copy of the diff configuration */
+  char *zLeftHash;         /* Private copy of cfg.zLeftHash */
+  char *zName;             /* First name passed to xDone */
+  char *zName2;            /* Second name passed to xDone */
+  DiffDoneFunc xDone;      /* Finishes the output.  May be NULL */
+  u32 iOfst;               /* Output goes this far into the pending text */
+  DContext c;              /* Lines and edits from diff_prepare() */
+  const char *zErr;        /* Message from diff_prepare(), or NULL */
+  int isDone;              /* True when diff_prepare() has finished */
+};
+
+/*
+** State of the parallel diff started by diff_parallel_begin().
+**
+** The lines of the files of a check-in are split and compared by
+** worker threads.  The main thread does everything else, in the order
+** in which the files were queued: it formats each diff, which updates
+** global state such as the --numstat totals and the chunk numbers of
+** HTML diffs, and places the result at the point of the output where
+** a serial diff would have written it.
+**
+** Output written while jobs are outstanding collects in pText, which is
+** the CGI reply or the captured standard output.  Each job remembers
+** how far into the pending part of pText, which begins at iBase, its
+** own output belongs.
+*/
+#define DIFF_MX_JOB 4         /* Jobs queued per thread */
+static struct {
+  int isActive;            /* True between begin and end */
+  int nThread;             /* Number of threads, including the main thread */
+  int nSlot;               /* Number of entries in a[] */
+  DiffJob *a;              /* Ring buffer of jobs.  Job i is a[i%nSlot] */
+  int nQueued;             /* Jobs queued so far */
+  int iFinish;             /* Next job to be finished by the main thread */
+  Blob *pText;             /* Output being produced */
+  u32 iBase;               /* Start of the pending part of pText */
+  Blob capture;            /* Captured standard output for the CLI */
+  Blob done;               /* Finished output of a web page */
+#ifdef FOSSIL_HAVE_PTHREAD
+  pthread_mutex_t mutex;   /* Protects iNext, isDone and isShutdown */
+  pthread_cond_t workCond; /* Signaled when jobs are queued */
+  pthread_cond_t doneCond; /* Signaled when a worker finishes a job */
+  int iNext;               /* First job not yet claimed */
+  int isShutdown;          /* True to make the workers exit */
+  int nStarted;            /* Number of workers started */
+  pthread_t aThread[64];   /* The workers */
+#endif
+} diffPool;
+
+#ifdef FOSSIL_HAVE_PTHREAD
+/*
+** Body of each worker thread of a parallel diff.
+*/
+static void *diff_worker(void *pArg){
+  (void)pArg;
+  pthread_mutex_lock(&diffPool.mutex);
+  for(;;){
+    DiffJob *p;
+    while( diffPool.iNext>=diffPool.nQueued && !diffPool.isShutdown ){
+      pthread_cond_wait(&diffPool.workCond, &diffPool.mutex);
+    }
+    if( diffPool.iNext>=diffPool.nQueued ) break;
+    p = &diffPool.a[(diffPool.iNext++)%diffPool.nSlot];
+    pthread_mutex_unlock(&diffPool.mutex);
+    p->zErr = diff_prepare(&p->a, &p->b, &p->c, p->cfg.diffFlags);
+    pthread_mutex_lock(&diffPool.mutex);
+    p->isDone = 1;
+    pthread_cond_broadcast(&diffPool.doneCond);
+  }
+  pthread_mutex_unlock(&diffPool.mutex);
+  return 0;
+}
+#endif /* FOSSIL_HAVE_PTHREAD */
+
+/*
+** Write output that is in its final place.
+*/
+static void diff_parallel_emit(const char *z, int n){
+  if( n<=0 ) return;
+  if( g.cgiOutput ){
+    blob_append(&diffPool.done, z, n);
+  }else{
+    fossil_capture_stdout(0);
+    fossil_puts(z, 0, n);
+    fossil_capture_stdout(&diffPool.capture);
+  }
+}
+
+/*
+** Wait for the oldest outstanding job, format its diff and write its
+** output, preceded by the output that came before it.
+*/
+static void diff_parallel_finish_one(void){
+  DiffJob *p = &diffPool.a[diffPool.iFinish%diffPool.nSlot];
+  Blob diff, out;
+  char *zPending;
+  int i;
+#ifdef FOSSIL_HAVE_PTHREAD
+  int isMine = 0;
+  pthread_mutex_lock(&diffPool.mutex);
+  if( diffPool.iNext==diffPool.iFinish ){
+    diffPool.iNext++;
+    isMine = 1;
+  }else{
+    while( !p->isDone ){
+      pthread_cond_wait(&diffPool.doneCond, &diffPool.mutex);
+    }
+  }
+  pthread_mutex_unlock(&diffPool.mutex);
+  if( isMine ){
+    p->zErr = diff_prepare(&p->a, &p->b, &p->c, p->cfg.diffFlags);
+  }
+#endif
+  blob_init(&diff, 0, 0);
+  if( p->zErr ){
+    diff_errmsg(&diff, p->zErr, p->cfg.diffFlags);
+  }else{
+    diff_finish(&p->c, &diff, &p->cfg);
+  }
+  if( p->xDone ){
+    blob_init(&out, 0, 0);
+    p->xDone(&diff, &p->cfg, p->zName, p->zName2, &out);
+    blob_reset(&diff);
+  }else{
+    out = diff;
+  }
+  zPending = blob_buffer(diffPool.pText) + diffPool.iBase;
+  diff_parallel_emit(zPending, p->iOfst);
+  diff_parallel_emit(blob_buffer(&out), blob_size(&out));
+  blob_reset(&out);
+  memmove(zPending, zPending + p->iOfst,
+          blob_size(diffPool.pText) - diffPool.iBase - p->iOfst);
+  blob_truncate(diffPool.pText, blob_size(diffPool.pText) - p->iOfst);
+  for(i=diffPool.iFinish+1; i<diffPool.nQueued; i++){
+    diffPool.a[i%diffPool.nSlot].iOfst -= p->iOfst;
+  }
+  blob_reset(&p->a);
+  blob_reset(&p->b);
+  fossil_free(p->zLeftHash);
+  fossil_free(p->zName);
+  fossil_free(p->zName2);
+  diffPool.iFinish++;
+}
+
+/*
+** Begin a diff of many files that uses the number of threads given by
+** diff_thread_count().  Until the matching diff_parallel_end(), callers
+** such as diff_file_mem() hand their work to text_diff_deferred() rather
+** than calling text_diff().
+**
+** Diffs that use an external diff command, and JSON diffs, whose output
+** depends on the order in which the file names are written, are always
+** done serially.
+*/
+void diff_parallel_begin(DiffConfig *pCfg){
+#ifdef FOSSIL_HAVE_PTHREAD
+  int nThread;
+  if( diffPool.isActive ) return;
+  if( pCfg->zDiffCmd || (pCfg->diffFlags & DIFF_JSON)!=0 ) return;
+  nThread = diff_thread_count();
+  if( nThread<2 ) return;
+  memset(&diffPool, 0, sizeof(diffPool));
+  diffPool.nThread = nThread;
+  diffPool.nSlot = nThread*DIFF_MX_JOB;
+  diffPool.a = fossil_malloc(sizeof(DiffJob)*diffPool.nSlot);
+  blob_init(&diffPool.done, 0, 0);
+  blob_init(&diffPool.capture, 0, 0);
+  if( g.cgiOutput ){
+    diffPool.pText = cgi_output_blob();
+  }else{
+    diffPool.pText = &diffPool.capture;
+    fossil_capture_stdout(&diffPool.capture);
+  }
+  diffPool.iBase = blob_size(diffPool.pText);
+  pthread_mutex_init(&diffPool.mutex, 0);
+  pthread_cond_init(&diffPool.workCond, 0);
+  pthread_cond_init(&diffPool.doneCond, 0);
+  while( diffPool.nStarted<nThread-1
+      && pthread_create(&diffPool.aThread[diffPool.nStarted], 0,
+                        diff_worker, 0)==0
+  ){
+    diffPool.nStarted++;
+  }
+  diffPool.isActive = 1;
+#else
+  (void)pCfg;
+#endif
+}
+
+/*
+** Return true if a parallel diff is in progress.
+*/
+int diff_parallel_active(void){
+  return diffPool.isActive;
+}
+
+/*
+** Queue a diff of pA and pB, to be done in the same way as text_diff()
+** with the configuration pCfg.  When it is done, its output is passed
+** through xDone, if that is not NULL, and then written at the point of
+** the output that was reached when this routine was called.
+**
+** This routine takes over the content of pA and pB, and leaves them
+** empty.  Only call it when diff_parallel_active() is true.
+*/
+void text_diff_deferred(
+  Blob *pA,                 /* FROM file */
+  Blob *pB,                 /* TO file */
+  DiffConfig *pCfg,         /* Configuration options */
+  DiffDoneFunc xDone,       /* Finishes the output, or NULL */
+  const char *zName,        /* First name passed to xDone */
+  const char *zName2        /* Second name passed to xDone */
+){
+  DiffJob *p;
+  assert( diffPool.isActive );
+  if( diffPool.nQueued - diffPool.iFinish >= diffPool.nSlot ){
+    diff_parallel_finish_one();
+  }
+  p = &diffPool.a[diffPool.nQueued%diffPool.nSlot];
+  memset(p, 0, sizeof(*p));
+  p->a = *pA;
+  p->b = *pB;
+  blob_zero(pA);
+  blob_zero(pB);
+  p->cfg = *pCfg;
+  p->zLeftHash = fossil_strdup(pCfg->zLeftHash);
+  p->cfg.zLeftHash = p->zLeftHash;
+  p->zName = fossil_strdup(zName);
+  p->zName2 = fossil_strdup(zName2);
+  p->xDone = xDone;
+  p->iOfst = blob_size(diffPool.pText) - diffPool.iBase;
+#ifdef FOSSIL_HAVE_PTHREAD
+  pthread_mutex_lock(&diffPool.mutex);
+  diffPool.nQueued++;
+  pthread_cond_signal(&diffPool.workCond);
+  pthread_mutex_unlock(&diffPool.mutex);
+#endif
+}
+
+/*
+** Finish all outstanding jobs of a parallel diff, write the remaining
+** output and stop the threads.
+*/
+void diff_parallel_end(void){
+#ifdef FOSSIL_HAVE_PTHREAD
+  int i;
+  u32 nRest;
+  if( !diffPool.isActive ) return;
+  while( diffPool.iFinish<diffPool.nQueued ){
+    diff_parallel_finish_one();
+  }
+  pthread_mutex_lock(&diffPool.mutex);
+  diffPool.isShutdown = 1;
+  pthread_cond_broadcast(&diffPool.workCond);
+  pthread_mutex_unlock(&diffPool.mutex);
+  for(i=0; i<diffPool.nStarted; i++){
+    pthread_join(diffPool.aThread[i], 0);
+  }
+  pthread_mutex_destroy(&diffPool.mutex);
+  pthread_cond_destroy(&diffPool.workCond);
+  pthread_cond_destroy(&diffPool.doneCond);
+  nRest = blob_size(diffPool.pText) - diffPool.iBase;
+  if( g.cgiOutput ){
+    blob_append(&diffPool.done,
+                blob_buffer(diffPool.pText)+diffPool.iBase, nRest);
+    blob_truncate(diffPool.pText, diffPool.iBase);
+    blob_append(diffPool.pText, blob_buffer(&diffPool.done),
+                blob_size(&diffPool.done));
+  }else{
+    fossil_capture_stdout(0);
+    fossil_puts(blob_buffer(&diffPool.capture), 0, nRest);
+  }
+  blob_reset(&diffPool.done);
+  blob_reset(&diffPool.capture);
+  fossil_free(diffPool.a);
+  diffPool.a = 0;
+  diffPool.isActive = 0;
+#endif
+}
+
+/*
+** Return the DIFF_* flag that selects the diff algorithm named zAlg,
+** which is "classic" or "histogram".  Raise an error for any other name.
+*/
+u64 diff_algorithm_flag(const char *zAlg){
+  if( fossil_strcmp(zAlg, "histogram")==0 ) return DIFF_HISTOGRAM;
+  if( fossil_strcmp(zAlg, "classic")!=0 ){
+    fossil_fatal("unknown diff algorithm \"%s\" - should be"
+                 " \"classic\" or \"histogram\"", zAlg);
+  }
+  return 0;
 }
 
 /*
@@ -3238,6 +4180,7 @@ int *text_diff(
 ** Process diff-related command-line options and return an appropriate
 ** "diffFlags" integer.
 **
+**   --algorithm NAME             "classic" or "histogram"   DIFF_HISTOGRAM
 **   -b|--browser                 Show the diff output in a web-browser
 **   --brief                      Show filenames only        DIFF_BRIEF
 **   --by                         Shorthand for "--browser -y"
@@ -3277,6 +4220,9 @@ void diff_options(DiffConfig *pCfg, int isGDiff, int bUnifiedTextOnly){
   if( find_option("strip-trailing-cr",0,0)!=0 ){
     diffFlags |= DIFF_STRIP_EOLCR;
   }
+  if( (z = find_option("algorithm",0,1))!=0 ){
+    diffFlags |= diff_algorithm_flag(z);
+  }
   if( !bUnifiedTextOnly ){
     if( find_option("side-by-side","y",0)!=0 ) diffFlags |= DIFF_SIDEBYSIDE;
     if( find_option("yy",0,0)!=0 ){
@@ -3450,6 +4396,89 @@ void fdiff_cmd(void){
   re_free(DCfg.pRe);
 }
 
+/*
+** COMMAND: test-diff-algorithm
+**
+** Usage: %fossil test-diff-algorithm FILE1 FILE2 ?OPTIONS?
+**    or: %fossil test-diff-algorithm --alternating N ?OPTIONS?
+**
+** Compute the difference between FILE1 and FILE2 using each of the
+** diff algorithms in turn.  For each, report the time taken, the number
+** of changed regions, and the number of lines deleted and inserted.
+**
+** Options:
+**   --alternating N         Instead of FILE1 and FILE2, use two generated
+**                           files of N lines that differ on every other line
+**   -n|--repeat N           Compute each diff N times.  Default: 1
+**   -w|--ignore-all-space   Ignore all whitespace
+*/
+void test_diff_algorithm_cmd(void){
+  static const struct {
+    const char *zName;
+    u64 diffFlag;
+  } aAlg[] = {
+    { "classic",    0              },
+    { "histogram",  DIFF_HISTOGRAM },
+  };
+  Blob a, b;
+  DiffConfig DCfg;
+  const char *zRepeat;
+  const char *zAlternating;
+  int nRepeat = 1;
+  int i, j, k;
+
+  diff_config_init(&DCfg, 0);
+  if( find_option("ignore-all-space","w",0)!=0 ){
+    DCfg.diffFlags |= DIFF_IGNORE_ALLWS;
+  }
+  zRepeat = find_option("repeat","n",1);
+  if( zRepeat ) nRepeat = atoi(zRepeat);
+  if( nRepeat<1 ) nRepeat = 1;
+  zAlternating = find_option("alternating",0,1);
+  verify_all_options();
+  if( zAlternating ){
+    int nLine = atoi(zAlternating);
+    if( g.argc!=2 ) usage("--alternating N ?OPTIONS?");
+    blob_zero(&a);
+    blob_zero(&b);
+    for(i=0; i<nLine; i++){
+      blob_appendf(&a, "line %d of the file\n", i);
+      if( i%2 ){
+        blob_appendf(&b, "line %d of the file\n", i);
+      }else{
+        blob_appendf(&b, "edited line %d\n", i);
+      }
+    }
+  }else{
+    if( g.argc!=4 ) usage("FILE1 FILE2 ?OPTIONS?");
+    blob_read_from_file(&a, g.argv[2], ExtFILE);
+    blob_read_from_file(&b, g.argv[3], ExtFILE);
+  }
+  for(i=0; i<count(aAlg); i++){
+    int *aEdit = 0;
+    int nHunk = 0, nDel = 0, nIns = 0;
+    i64 iStart;
+    DCfg.diffFlags = (DCfg.diffFlags & ~DIFF_HISTOGRAM) | aAlg[i].diffFlag;
+    iStart = file_current_time_ns();
+    for(j=0; j<nRepeat; j++){
+      fossil_free(aEdit);
+      aEdit = text_diff(&a, &b, 0, &DCfg);
+    }
+    iStart = file_current_time_ns() - iStart;
+    if( aEdit==0 ) fossil_fatal("cannot compute difference");
+    for(k=0; aEdit[k] || aEdit[k+1] || aEdit[k+2]; k+=3){
+      if( aEdit[k+1] || aEdit[k+2] ) nHunk++;
+      nDel += aEdit[k+1];
+      nIns += aEdit[k+2];
+    }
+    fossil_free(aEdit);
+    fossil_print("%-10s %10.3f ms %8d changes %8d deleted %8d inserted\n",
+                 aAlg[i].zName, iStart/(1000000.0*nRepeat), nHunk, nDel, nIns);
+  }
+  blob_reset(&a);
+  blob_reset(&b);
+}
+
 /**************************************************************************
 ** The basic difference engine is above.  What follows is the annotation
 ** engine.  Both are in the same file since they share many components.
@@ -3579,6 +4608,295 @@ static sqlite3_int64 current_time_in_milliseconds(void){
   return t;
 }
 
+/*
+** SETTING: annotation-cache       boolean default=off
+**
+** If enabled, the origin of each line of a file, as computed by the
+** "fossil annotate" and "fossil blame" commands, is saved in the
+** ANNCACHE table of the repository.  The annotation of a later version
+** of the file is then derived from the saved annotation of the version
+** before it and a single diff.  So the whole history of the file is
+** analyzed, rather than only as much of it as the time limit allows,
+** and annotating a file that was annotated before is fast.  With this
+** setting, the origin of a line is found by diffing each version of the
+** file against the one before it, rather than against the version being
+** annotated.  The /annotate and /blame pages use the saved annotations
+** but never add to them.  The ANNCACHE table holds only derived data.
+** It is emptied by "fossil purge" and by shunning, and discarded by
+** "fossil rebuild".
+*/
+
+/*
+** Flags that change the result of an annotation, and which are part of
+** the key of the ANNCACHE table.
+*/
+#define ANNCACHE_FLAGS  (DIFF_IGNORE_ALLWS|DIFF_STRIP_EOLCR)
+
+/*
+** An entry of the ANNCACHE table records, for file version FID as it
+** appears in check-in MID, the check-in in which each of its lines
+** originated.  The origins are stored as runs of lines that share an
+** origin, each run being two 32-bit big-endian integers, the number of
+** lines and the RID of the check-in, and the result is compressed.
+*/
+static void anncache_put_int(Blob *pOut, unsigned int v){
+  char a[4];
+  a[0] = (v>>24)&0xff;
+  a[1] = (v>>16)&0xff;
+  a[2] = (v>>8)&0xff;
+  a[3] = v&0xff;
+  blob_append(pOut, a, 4);
+}
+
+/*
+** True if the ANNCACHE table is known to exist.  Negative if unknown.
+*/
+static int anncacheExists = -1;
+
+/*
+** Return true if annotations may be saved in the ANNCACHE table.  They
+** are not saved while a web request is being handled, since web pages
+** that only show information should not write to the repository.
+*/
+static int anncache_can_save(void){
+  return !g.isHTTP && db_is_writeable("repository");
+}
+
+/*
+** Look up the origins of the nLine lines of file version fid in
+** check-in mid, and write them into aMid[].  Return non-zero on success
+** and zero if there is no usable entry.  If aMid is NULL, only check
+** whether there is an entry.
+*/
+static int anncache_find(int mid, int fid, u64 annFlags, int *aMid, int nLine){
+  Stmt q;
+  int rc = 0;
+  if( anncacheExists<0 ){
+    anncacheExists = db_table_exists("repository","anncache");
+  }
+  if( !anncacheExists ) return 0;
+  db_prepare(&q,
+    "SELECT origin FROM repository.anncache"
+    " WHERE mid=%d AND fid=%d AND flags=%lld",
+    mid, fid, (sqlite3_int64)(annFlags & ANNCACHE_FLAGS)
+  );
+  if( db_step(&q)==SQLITE_ROW ){
+    Blob x;
+    if( aMid==0 ){
+      rc = 1;
+    }else{
+      blob_zero(&x);
+      db_column_blob(&q, 0, &x);
+      if( blob_uncompress(&x, &x)==0 && blob_size(&x)%8==0 ){
+        const unsigned char *a = (const unsigned char*)blob_buffer(&x);
+        int n = blob_size(&x)/8;
+        int i, j, k = 0;
+        for(i=0; i<n; i++, a+=8){
+          unsigned int cnt = (a[0]<<24) | (a[1]<<16) | (a[2]<<8) | a[3];
+          int iMid = (a[4]<<24) | (a[5]<<16) | (a[6]<<8) | a[7];
+          if( cnt>(unsigned int)(nLine-k) ) break;
+          for(j=0; j<(int)cnt; j++) aMid[k++] = iMid;
+        }
+        rc = i==n && k==nLine;
+      }
+      blob_reset(&x);
+    }
+  }
+  db_finalize(&q);
+  return rc;
+}
+
+/*
+** Save the origins aMid[] of the nLine lines of file version fid in
+** check-in mid.  This is a no-op unless anncache_can_save() is true.
+*/
+static void anncache_insert(int mid, int fid, u64 annFlags,
+                            const int *aMid, int nLine){
+  Blob x;
+  Stmt q;
+  int i, j;
+  if( !anncache_can_save() ) return;
+  schema_anncache();
+  anncacheExists = 1;
+  blob_init(&x, 0, 0);
+  for(i=0; i<nLine; i=j){
+    for(j=i+1; j<nLine && aMid[j]==aMid[i]; j++){}
+    anncache_put_int(&x, j-i);
+    anncache_put_int(&x, aMid[i]);
+  }
+  blob_compress(&x, &x);
+  db_prepare(&q,
+    "REPLACE INTO repository.anncache(mid,fid,flags,origin)"
+    " VALUES(%d,%d,%lld,:origin)",
+    mid, fid, (sqlite3_int64)(annFlags & ANNCACHE_FLAGS)
+  );
+  db_bind_blob(&q, ":origin", &x);
+  db_step(&q);
+  db_finalize(&q);
+  blob_reset(&x);
+}
+
+/*
+** Remove all saved annotations.  Used when artifacts are purged or
+** shunned, since the saved origins of lines may refer to them.
+*/
+void annotation_cache_clear(void){
+  if( db_table_exists("repository","anncache") ){
+    db_multi_exec("DELETE FROM repository.anncache");
+  }
+}
+
+/*
+** Load the text of artifact rid and break it into lines for an
+** annotation.  Return the lines, or NULL if the artifact is binary.
+** The text is left in pText, into which the lines point.
+*/
+static DLine *annotation_lines(int rid, Blob *pText, int *pnLine,
+                               u64 annFlags){
+  DLine *a;
+  if( !content_get(rid, pText) ){
+    fossil_fatal("unable to retrieve content of artifact #%d", rid);
+  }
+  blob_to_utf8_no_bom(pText, 0);
+  a = break_into_lines(blob_str(pText), blob_size(pText), pnLine, annFlags);
+  if( a==0 ) blob_reset(pText);
+  return a;
+}
+
+/*
+** Compare two (check-in, version index) pairs by check-in
+*/
+static int annotation_idx_cmp(const void *pA, const void *pB){
+  const int *a = (const int*)pA;
+  const int *b = (const int*)pB;
+  return a[0]<b[0] ? -1 : a[0]>b[0];
+}
+
+/*
+** Compute the annotation of the file version aFid[0] in check-in
+** aMid[0] using the ANNCACHE table.  Versions aFid[1] through
+** aFid[nVers-1] are its ancestors, most recent first, and aMid[] holds
+** the check-ins in which they appear.  The annotation of the most recent
+** version found in the table, or else of the oldest version, all of
+** whose lines originate in its own check-in, is extended one version at
+** a time toward aFid[0], and each new annotation is saved.
+**
+** On success, initialize p, record in p->aOrig[].iVers the index of the
+** version in which each line originates, and return non-zero.  Return
+** zero if the time limit mxTime is passed first, or if some version is
+** binary.  The annotations saved so far are kept either way.
+*/
+static int annotation_from_cache(
+  Annotator *p,          /* The annotator to initialize */
+  const int *aMid,       /* Check-in in which each version appears */
+  const int *aFid,       /* Versions of the file, most recent first */
+  int nVers,             /* Number of entries in aMid[] and aFid[] */
+  u64 annFlags,          /* Flags to alter the annotation */
+  sqlite3_int64 mxTime   /* Give up at this time.  0 for no limit */
+){
+  Blob prior, text;      /* Texts of the versions being compared */
+  DContext c;            /* Lines and differences of two versions */
+  int *aOrigin;          /* Origin check-in of each line of version k */
+  int *aNew;             /* Origin check-in of each line of version k-1 */
+  int *aIdx;             /* Pairs of check-in and version index */
+  int k;                 /* The version most recently annotated */
+  int i, j, lnFrom, lnTo;
+
+  memset(&c, 0, sizeof(c));
+  if( (annFlags & DIFF_IGNORE_ALLWS)==DIFF_IGNORE_ALLWS ){
+    c.xDiffer = compare_dline_ignore_allws;
+  }else{
+    c.xDiffer = compare_dline;
+  }
+
+  /* Start from the most recent version that is already annotated, or
+  ** else from the oldest version */
+  for(k=0; k<nVers-1 && !anncache_find(aMid[k], aFid[k], annFlags, 0, 0); k++){}
+  if( !anncache_can_save()
+   && !anncache_find(aMid[k], aFid[k], annFlags, 0, 0)
+  ){
+    /* Nothing to start from, and the work could not be saved */
+    return 0;
+  }
+  c.aTo = annotation_lines(aFid[k], &text, &c.nTo, annFlags);
+  if( c.aTo==0 ) return 0;
+  aOrigin = fossil_malloc( sizeof(int)*(c.nTo+1) );
+  if( !anncache_find(aMid[k], aFid[k], annFlags, aOrigin, c.nTo) ){
+    if( k<nVers-1 ){
+      /* Unusable entry.  Start over from the oldest version */
+      fossil_free(aOrigin);
+      fossil_free(c.aTo);
+      blob_reset(&text);
+      k = nVers-1;
+      c.aTo = annotation_lines(aFid[k], &text, &c.nTo, annFlags);
+      if( c.aTo==0 ) return 0;
+      aOrigin = fossil_malloc( sizeof(int)*(c.nTo+1) );
+    }
+    for(i=0; i<c.nTo; i++) aOrigin[i] = aMid[k];
+    anncache_insert(aMid[k], aFid[k], annFlags, aOrigin, c.nTo);
+  }
+
+  /* Derive the annotation of each more recent version from the one
+  ** before it */
+  blob_zero(&prior);
+  while( k>0 ){
+    if( mxTime>0 && current_time_in_milliseconds()>mxTime ) break;
+    k--;
+    blob_reset(&prior);
+    prior = text;
+    c.aFrom = c.aTo;
+    c.nFrom = c.nTo;
+    c.aTo = annotation_lines(aFid[k], &text, &c.nTo, annFlags);
+    if( c.aTo==0 ){
+      c.aTo = c.aFrom;
+      blob_zero(&text);
+      k = -1;
+      break;
+    }
+    diff_all(&c);
+    aNew = fossil_malloc( sizeof(int)*(c.nTo+1) );
+    for(i=lnFrom=lnTo=0; i<c.nEdit; i+=3){
+      for(j=0; j<c.aEdit[i]; j++) aNew[lnTo++] = aOrigin[lnFrom++];
+      lnFrom += c.aEdit[i+1];
+      for(j=0; j<c.aEdit[i+2]; j++) aNew[lnTo++] = aMid[k];
+    }
+    fossil_free(c.aEdit);
+    c.aEdit = 0;
+    c.nEdit = 0;
+    c.nEditAlloc = 0;
+    fossil_free(c.aFrom);
+    fossil_free(aOrigin);
+    aOrigin = aNew;
+    anncache_insert(aMid[k], aFid[k], annFlags, aOrigin, c.nTo);
+  }
+  fossil_free(c.aTo);
+  blob_reset(&prior);
+  if( k!=0 ){
+    fossil_free(aOrigin);
+    blob_reset(&text);
+    return 0;
+  }
+
+  /* Translate the origin check-ins into version indexes */
+  annotation_start(p, &text, annFlags);
+  aIdx = fossil_malloc( sizeof(int)*2*nVers );
+  for(i=0; i<nVers; i++){
+    aIdx[i*2] = aMid[i];
+    aIdx[i*2+1] = i;
+  }
+  qsort(aIdx, nVers, sizeof(int)*2, annotation_idx_cmp);
+  for(i=0; i<p->nOrig; i++){
+    int key[2];
+    int *pFound;
+    key[0] = aOrigin[i];
+    pFound = bsearch(key, aIdx, nVers, sizeof(int)*2, annotation_idx_cmp);
+    p->aOrig[i].iVers = pFound ? pFound[1] : -1;
+  }
+  fossil_free(aIdx);
+  fossil_free(aOrigin);
+  return 1;
+}
+
 /*
 ** Compute a complete annotation on a file.  The file is identified by its
 ** filename and check-in name (NULL for current check-in).
@@ -3601,8 +4919,11 @@ static void annotate_file(
   int cnt = 0;           /* Number of versions analyzed */
   int iLimit;            /* Maximum number of versions to analyze */
   sqlite3_int64 mxTime;  /* Halt at this time if not already complete */
+  sqlite3_int64 iStart;  /* Time at which the analysis began */
+  int bCached = 0;       /* True if computed with the annotation-cache */
 
   memset(p, 0, sizeof(*p));
+  iStart = current_time_in_milliseconds();
 
   if( zLimit ){
     if( strcmp(zLimit,"none")==0 ){
@@ -3653,7 +4974,8 @@ static void annotate_file(
     "   (SELECT uuid FROM blob WHERE rid=mlink.mid),"
     "   date(event.mtime),"
     "   coalesce(event.euser,event.user),"
-    "   mlink.fid"
+    "   mlink.fid,"
+    "   mlink.mid"
     "  FROM mlink, event, ancestor"
     " WHERE mlink.fnid=%d"
     "   AND ancestor.rid=mlink.mid"
@@ -3663,7 +4985,54 @@ static void annotate_file(
     fnid
   );
 
-  while( db_step(&q)==SQLITE_ROW ){
+  /* With the annotation-cache setting, analyze every version unless
+  ** a number of versions or an origin is given */
+  if( iLimit==0 && origid==0 && db_get_boolean("annotation-cache", 0) ){
+    int *aMid = 0;       /* Check-in in which each version appears */
+    int *aFid = 0;       /* Each version of the file */
+    struct AnnVers *aVers;
+    int nVers;
+    while( db_step(&q)==SQLITE_ROW ){
+      p->aVers = fossil_realloc(p->aVers, (p->nVers+1)*sizeof(p->aVers[0]));
+      p->aVers[p->nVers].zFUuid = fossil_strdup(db_column_text(&q, 0));
+      p->aVers[p->nVers].zMUuid = fossil_strdup(db_column_text(&q, 1));
+      p->aVers[p->nVers].zDate = fossil_strdup(db_column_text(&q, 2));
+      p->aVers[p->nVers].zUser = fossil_strdup(db_column_text(&q, 3));
+      aFid = fossil_realloc(aFid, (p->nVers+1)*sizeof(int));
+      aMid = fossil_realloc(aMid, (p->nVers+1)*sizeof(int));
+      aFid[p->nVers] = db_column_int(&q, 4);
+      aMid[p->nVers] = db_column_int(&q, 5);
+      p->nVers++;
+    }
+    aVers = p->aVers;
+    nVers = p->nVers;
+    if( nVers>0
+     && annotation_from_cache(p, aMid, aFid, nVers, annFlags, mxTime)
+    ){
+      p->aVers = aVers;
+      p->nVers = nVers;
+      p->showId = cid;
+      bCached = 1;
+    }else{
+      /* Do as much as the time limit allows without the cache.  The
+      ** annotations saved so far let a later request go further. */
+      int i;
+      for(i=0; i<nVers; i++){
+        fossil_free((char*)aVers[i].zFUuid);
+        fossil_free((char*)aVers[i].zMUuid);
+        fossil_free((char*)aVers[i].zDate);
+        fossil_free((char*)aVers[i].zUser);
+      }
+      fossil_free(aVers);
+      memset(p, 0, sizeof(*p));
+      if( mxTime>0 ) mxTime += current_time_in_milliseconds() - iStart;
+      db_reset(&q);
+    }
+    fossil_free(aMid);
+    fossil_free(aFid);
+  }
+
+  while( !bCached && db_step(&q)==SQLITE_ROW ){
     if( cnt>=3 ){  /* Process at least 3 rows before imposing limits */
       if( (iLimit>0 && cnt>=iLimit)
        || (cnt>0 && mxTime>0 && current_time_in_milliseconds()>mxTime)
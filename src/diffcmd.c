@@ -561,6 +561,30 @@ void diff_end(DiffConfig *pCfg, int nErr){
   }
 }
 
+/*
+** Write the output for a file of diff_file(), given the output pDiff
+** of text_diff() for it, into pOut, or onto standard output if pOut
+** is NULL.
+*/
+static void diff_file_done(
+  Blob *pDiff,              /* Output of text_diff() */
+  DiffConfig *pCfg,         /* Flags to control the diff */
+  const char *zName,        /* Display name of the file */
+  const char *zName2,       /* Name of the file on disk for display */
+  Blob *pOut                /* Blob to store diff output */
+){
+  if( blob_size(pDiff) ){
+    if( pCfg->diffFlags & DIFF_NUMSTAT ){
+      if( !(pCfg->diffFlags & DIFF_BRIEF) ){
+        blob_appendf(pOut, "%s %s\n", blob_str(pDiff), zName);
+      }
+    }else{
+      diff_print_filenames(zName, zName2, pCfg, pOut);
+      blob_appendf(pOut, "%s\n", blob_str(pDiff));
+    }
+  }
+}
+
 /*
 ** Show the difference between two files, one in memory and one on disk.
 **
@@ -593,19 +617,12 @@ void diff_file(
       if( blob_compare(pFile1, &file2) ){
         fossil_print("CHANGED  %s\n", zName);
       }
+    }else if( pOut==0 && diff_parallel_active() ){
+      text_diff_deferred(pFile1, &file2, pCfg, diff_file_done, zName, zName2);
     }else{
       blob_zero(&out);
       text_diff(pFile1, &file2, &out, pCfg);
-      if( blob_size(&out) ){
-        if( pCfg->diffFlags & DIFF_NUMSTAT ){
-          if( !(pCfg->diffFlags & DIFF_BRIEF) ){
-            blob_appendf(pOut, "%s %s\n", blob_str(&out), zName);
-          }
-        }else{
-          diff_print_filenames(zName, zName2, pCfg, pOut);
-          blob_appendf(pOut, "%s\n", blob_str(&out));
-        }
-      }
+      diff_file_done(&out, pCfg, zName, zName2, pOut);
       blob_reset(&out);
     }
 
@@ -678,6 +695,29 @@ void diff_file(
   }
 }
 
+/*
+** Write the output for a file of diff_file_mem(), given the output pDiff
+** of text_diff() for it, into pOut, or onto standard output if pOut is
+** NULL.
+*/
+static void diff_file_mem_done(
+  Blob *pDiff,              /* Output of text_diff() */
+  DiffConfig *pCfg,         /* Diff flags */
+  const char *zName,        /* Display name of the file */
+  const char *zName2,       /* Not used */
+  Blob *pOut                /* Blob to store diff output */
+){
+  (void)zName2;
+  if( pCfg->diffFlags & DIFF_NUMSTAT ){
+    if( !(pCfg->diffFlags & DIFF_BRIEF) ){
+      blob_appendf(pOut, "%s %s\n", blob_str(pDiff), zName);
+    }
+  }else{
+    diff_print_filenames(zName, zName, pCfg, pOut);
+    blob_appendf(pOut, "%s\n", blob_str(pDiff));
+  }
+}
+
 /*
 ** Show the difference between two files, both in memory.
 **
@@ -700,19 +740,14 @@ void diff_file_mem(
   if( (pCfg->diffFlags & DIFF_BRIEF) && !(pCfg->diffFlags & DIFF_NUMSTAT) ){
     return;
   }
-  if( pCfg->zDiffCmd==0 ){
+  if( pCfg->zDiffCmd==0 && diff_parallel_active() ){
+    text_diff_deferred(pFile1, pFile2, pCfg, diff_file_mem_done, zName, 0);
+  }else if( pCfg->zDiffCmd==0 ){
     Blob out;      /* Diff output text */
 
     blob_zero(&out);
     text_diff(pFile1, pFile2, &out, pCfg);
-    if( pCfg->diffFlags & DIFF_NUMSTAT ){
-      if( !(pCfg->diffFlags & DIFF_BRIEF) ){
-        fossil_print("%s %s\n", blob_str(&out), zName);
-      }
-    }else{
-      diff_print_filenames(zName, zName, pCfg, 0);
-      fossil_print("%s\n", blob_str(&out));
-    }
+    diff_file_mem_done(&out, pCfg, zName, zName, 0);
 
     /* Release memory resources */
     blob_reset(&out);
@@ -954,7 +989,7 @@ static void diff_undo_to_checkout(
 ){
   Stmt q;
   Blob content;
-  db_prepare(&q, "SELECT pathname, content FROM undo");
+  db_prepare(&q, "SELECT pathname FROM undo");
   blob_init(&content, 0, 0);
   if( (pCfg->diffFlags & DIFF_SHOW_VERS)!=0 ){
     diff_print_versions("(undo)", "(workdir)", pCfg);
@@ -964,7 +999,7 @@ static void diff_undo_to_checkout(
     const char *zFile = (const char*)db_column_text(&q, 0);
     if( !file_dir_match(pFileDir, zFile) ) continue;
     zFullName = mprintf("%s%s", g.zLocalRoot, zFile);
-    db_column_blob(&q, 1, &content);
+    undo_get_content(zFile, &content);
     diff_file(&content, zFullName, zFile, pCfg, 0);
     fossil_free(zFullName);
     blob_reset(&content);
@@ -1403,6 +1438,8 @@ const char *diff_get_binary_glob(void){
 ** command to see differences in unmanaged files.
 **
 ** Options:
+**   --algorithm NAME            Diff algorithm: "classic" (the default) or
+**                               "histogram"
 **   --binary PATTERN            Treat files that match the glob PATTERN
 **                               as binary
 **   --branch BRANCH             Show diff of all changes on BRANCH
@@ -1538,20 +1575,22 @@ void diff_cmd(void){
       fossil_fatal("check-in %s has no parent", zTo);
     }
   }
+  if( againstUndo && db_lget_int("undo_available",0)==0 ){
+    fossil_print("No undo or redo is available\n");
+    return;
+  }
   diff_begin(&DCfg);
+  diff_parallel_begin(&DCfg);
   if( bFromIsDir ){
     diff_externbase_to_checkout(zFrom, &DCfg, pFileDir);
   }else if( againstUndo ){
-    if( db_lget_int("undo_available",0)==0 ){
-      fossil_print("No undo or redo is available\n");
-      return;
-    }
     diff_undo_to_checkout(&DCfg, pFileDir);
   }else if( zTo==0 ){
     diff_version_to_checkout(zFrom, &DCfg, pFileDir, 0);
   }else{
     diff_two_versions(zFrom, zTo, &DCfg, pFileDir);
   }
+  diff_parallel_end();
   if( pFileDir ){
     int i;
     for(i=0; pFileDir[i].zName; i++){
@@ -1591,5 +1630,7 @@ void vpatch_page(void){
   fossil_nice_default();
   cgi_set_content_type("text/plain");
   diff_config_init(&DCfg, DIFF_VERBOSE);
+  diff_parallel_begin(&DCfg);
   diff_two_versions(zFrom, zTo, &DCfg, 0);
+  diff_parallel_end();
 }
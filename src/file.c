@@ -325,6 +325,189 @@ int file_perm(const char *zFilename, int eFType){
   return PERM_REG;
 }
 
+#if INTERFACE
+/*
+** Information about a file gathered by file_stat_info()
+*/
+struct FileStatInfo {
+  i64 size;             /* Size in bytes.  -1 if the file does not exist */
+  i64 mtime;            /* Modification time in seconds.  -1 if missing */
+  i64 iNewestNs;        /* The later of mtime and ctime, in nanoseconds */
+  int perm;             /* PERM_REG, PERM_EXE, or PERM_LNK */
+  int isFileOrLink;     /* True for a file or an allowed symlink */
+  int isDir;            /* True for a directory */
+  char zSig[100];       /* Device, inode, mode, size, mtime and ctime */
+};
+#endif
+
+/*
+** Fill *p with information about zFilename, using a single stat() and
+** without using or changing the cached file status, so that it is safe
+** to call from several threads at once.
+**
+** p->zSig is a text summary of everything stat() says about the file
+** that changes when the file is written or replaced: the device and
+** inode numbers, the mode, the size, and the mtime and ctime in
+** nanoseconds where the platform provides them.
+**
+** Return 0 on success.  If the file does not exist, return non-zero
+** and set p->size and p->mtime to -1 and p->zSig to an empty string.
+*/
+int file_stat_info(const char *zFilename, int eFType, FileStatInfo *p){
+  struct fossilStat buf;
+  int rc = fossil_stat(zFilename, &buf, eFType);
+  i64 iMtimeNs, iCtimeNs;
+  if( rc ){
+    file_stat_info_fill(p, 0, -1, 0, 0, 0, 0, 0);
+    return rc;
+  }
+#if defined(_WIN32)
+  iMtimeNs = (i64)buf.st_mtime*1000000000;
+  iCtimeNs = (i64)buf.st_ctime*1000000000;
+#elif defined(__APPLE__)
+  iMtimeNs = (i64)buf.st_mtimespec.tv_sec*1000000000
+                + buf.st_mtimespec.tv_nsec;
+  iCtimeNs = (i64)buf.st_ctimespec.tv_sec*1000000000
+                + buf.st_ctimespec.tv_nsec;
+#else
+  iMtimeNs = (i64)buf.st_mtim.tv_sec*1000000000 + buf.st_mtim.tv_nsec;
+  iCtimeNs = (i64)buf.st_ctim.tv_sec*1000000000 + buf.st_ctim.tv_nsec;
+#endif
+  file_stat_info_fill(p, buf.st_mode, buf.st_size, buf.st_mtime,
+                      iMtimeNs, iCtimeNs, buf.st_dev, buf.st_ino);
+  return 0;
+}
+
+/*
+** Fill *p from the results of a stat() or equivalent call.  If iSize
+** is negative, the file does not exist and the other arguments are
+** ignored.  This routine is thread-safe.
+*/
+void file_stat_info_fill(
+  FileStatInfo *p,          /* Write results here */
+  unsigned mode,            /* st_mode */
+  i64 iSize,                /* st_size, or -1 if the file does not exist */
+  i64 iMtime,               /* st_mtime, in seconds */
+  i64 iMtimeNs,             /* Modification time, in nanoseconds */
+  i64 iCtimeNs,             /* Status change time, in nanoseconds */
+  sqlite3_uint64 iDev,      /* st_dev */
+  sqlite3_uint64 iIno       /* st_ino */
+){
+  memset(p, 0, sizeof(*p));
+  p->perm = PERM_REG;
+  if( iSize<0 ){
+    p->size = -1;
+    p->mtime = -1;
+    return;
+  }
+  p->size = iSize;
+  p->mtime = iMtime;
+  p->isFileOrLink = S_ISREG(mode) || S_ISLNK(mode);
+  p->isDir = S_ISDIR(mode);
+#if !defined(_WIN32)
+  if( S_ISREG(mode) && ((S_IXUSR)&mode)!=0 ){
+    p->perm = PERM_EXE;
+  }else if( db_allow_symlinks() && S_ISLNK(mode) ){
+    p->perm = PERM_LNK;
+  }
+#endif
+  p->iNewestNs = iMtimeNs>iCtimeNs ? iMtimeNs : iCtimeNs;
+  sqlite3_snprintf(sizeof(p->zSig), p->zSig, "%llx:%llx:%x:%lld:%lld:%lld",
+                   iDev, iIno, mode, iSize, iMtimeNs, iCtimeNs);
+}
+
+/*
+** Return true if file_stat_info_batch() and file_read_batch() can do
+** better than one system call per file.
+*/
+int file_batch_available(void){
+  return uring_available();
+}
+
+/*
+** Fill aInfo[] with information about each of the n files named in
+** azName[], exactly as file_stat_info() would.  Where io_uring is
+** available, the stat requests are all submitted at once, with many in
+** flight, instead of one system call per file.  See uring.c.
+*/
+void file_stat_info_batch(
+  int n,                    /* Number of files */
+  const char **azName,      /* Names of the files */
+  int eFType,               /* ExtFILE, RepoFILE, or SymFILE */
+  FileStatInfo *aInfo       /* Write results here */
+){
+  int i;
+  if( n>1 && uring_stat_batch(n, azName, eFType, aInfo)==0 ) return;
+  for(i=0; i<n; i++) file_stat_info(azName[i], eFType, &aInfo[i]);
+}
+
+/*
+** Read the complete content of each of the n files named in azName[]
+** into aContent[], following symbolic links.  The blobs in aContent[]
+** must be uninitialized.  Set aRc[i] to 0 if file i was read or to -1
+** if it could not be.  Where io_uring is available, the files are
+** opened and read with many requests in flight at once.  See uring.c.
+*/
+void file_read_batch(
+  int n,                    /* Number of files */
+  const char **azName,      /* Names of the files */
+  Blob *aContent,           /* Write file content here */
+  int *aRc                  /* Write result codes here */
+){
+  int i;
+  for(i=0; i<n; i++) blob_zero(&aContent[i]);
+  if( n>1 && uring_read_batch(n, azName, aContent, aRc)==0 ) return;
+  for(i=0; i<n; i++){
+    FILE *in = fossil_fopen(azName[i], "rb");
+    if( in==0 ){
+      aRc[i] = -1;
+    }else{
+      blob_read_from_channel(&aContent[i], in, -1);
+      fclose(in);
+      aRc[i] = 0;
+    }
+  }
+}
+
+/*
+** Return the current time in nanoseconds since 1970, to the precision
+** that the platform allows.
+*/
+i64 file_current_time_ns(void){
+#if defined(_WIN32)
+  return (i64)time(0)*1000000000;
+#else
+  struct timespec ts;
+  if( clock_gettime(CLOCK_REALTIME, &ts) ) return (i64)time(0)*1000000000;
+  return (i64)ts.tv_sec*1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+** Gather the same information as file_size(), file_mtime(), file_perm()
+** and file_isfile_or_link() for zFilename, like file_stat_info().  Any
+** of the output pointers may be NULL.
+**
+** Return 0 on success.  If the file does not exist, return non-zero
+** and set the size and mtime to -1.
+*/
+int file_stat_r(
+  const char *zFilename,  /* Name of the file to inspect */
+  int eFType,             /* ExtFILE, RepoFILE, or SymFILE */
+  i64 *pSize,             /* OUT: Size of the file */
+  i64 *pMtime,            /* OUT: Modification time */
+  int *pPerm,             /* OUT: PERM_REG, PERM_EXE, or PERM_LNK */
+  int *pIsFileOrLink      /* OUT: True for a file or an allowed symlink */
+){
+  FileStatInfo x;
+  int rc = file_stat_info(zFilename, eFType, &x);
+  if( pSize ) *pSize = x.size;
+  if( pMtime ) *pMtime = x.mtime;
+  if( pPerm ) *pPerm = x.perm;
+  if( pIsFileOrLink ) *pIsFileOrLink = x.isFileOrLink;
+  return rc;
+}
+
 /*
 ** Return TRUE if the named file is an executable.  Return false
 ** for directories, devices, fifos, symlinks, etc.
@@ -284,7 +284,7 @@ void finfo_cmd(void){
 */
 void cat_cmd(void){
   int i;
-  Blob content, fname;
+  Blob fname;
   const char *zRev;
   const char *zFileName;
   db_find_and_open_repository(0, 0);
@@ -300,15 +300,48 @@ void cat_cmd(void){
 
   for(i=2; i<g.argc; i++){
     file_tree_name(g.argv[i], &fname, 0, 1);
-    blob_zero(&content);
-    historical_blob(zRev, blob_str(&fname), &content, 1);
-    if ( g.argc==3 && zFileName ){
-      blob_write_to_file(&content, zFileName);
+    if( g.argc==3 && zFileName && !(zFileName[0]=='-' && zFileName[1]==0) ){
+      /* Stream the content into the file so that very large files are
+      ** never held in memory all at once.  Find the artifact before
+      ** touching OUTFILE, and write to a temporary file that replaces
+      ** OUTFILE only on success, so that OUTFILE is left as it was if
+      ** anything goes wrong. */
+      FILE *out;
+      char *zTemp;
+      int rid = historical_rid(zRev, blob_str(&fname), 1);
+      int rc;
+      file_mkfolder(zFileName, ExtFILE, 1, 0);
+      zTemp = mprintf("%s-cat-%llx", zFileName, (i64)getpid());
+      out = fossil_fopen(zTemp, "wb");
+      if( out==0 ){
+        fossil_fatal("unable to open file \"%s\" for writing", zTemp);
+      }
+      rc = content_stream(rid, delta_sink_file, out);
+      if( fclose(out)!=0 ) rc = 0;
+      if( rc ){
+#if defined(_WIN32)
+        file_delete(zFileName);
+#endif
+        rc = file_rename(zTemp, zFileName, 0, 0)==0;
+      }
+      if( !rc ){
+        file_delete(zTemp);
+        fossil_fatal("cannot write %s", zFileName);
+      }
+      fossil_free(zTemp);
     }else{
+#if !defined(_WIN32)
+      historical_stream(zRev, blob_str(&fname), delta_sink_file, stdout, 1);
+#else
+      /* blob_write_to_file() knows how to write to the Windows console */
+      Blob content;
+      blob_zero(&content);
+      historical_blob(zRev, blob_str(&fname), &content, 1);
       blob_write_to_file(&content, "-");
+      blob_reset(&content);
+#endif
     }
     blob_reset(&fname);
-    blob_reset(&content);
   }
 }
 
@@ -0,0 +1,671 @@
+/*
+** Copyright (c) 2026 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*******************************************************************************
+**
+** This module implements the "fossil fsmonitor" command.  That command
+** starts a daemon which uses the Linux inotify interface to keep track
+** of which files in a check-out change, so that commands like "status",
+** "changes", and "commit" only need to examine those files instead of
+** every file in the check-out.
+**
+** The daemon listens on a unix-domain socket.  A client connects and
+** sends a single line:
+**
+**      since TOKEN
+**
+** The daemon replies with a line "ok NEWTOKEN" followed by the names of
+** all files that have changed since TOKEN, relative to the root of the
+** check-out.  Each name is terminated by a zero byte.  The names of
+** directories that were deleted or renamed end with "/" and stand for
+** every file underneath them.  If the daemon cannot say what changed
+** since TOKEN, because TOKEN came from a different daemon or because
+** the kernel dropped events, it replies "full NEWTOKEN" and the client
+** must examine every file.
+**
+** A token has the form EPOCH:SEQ.  EPOCH is a random value chosen when
+** the daemon starts and again whenever it loses track of changes.  SEQ
+** counts changes seen in the current epoch.  When the kernel drops
+** events, the daemon watches every directory of the check-out again
+** before it starts the new epoch.
+**
+** This module is a no-op unless compiled with FOSSIL_HAVE_INOTIFY.
+*/
+#include "config.h"
+#include "fsmonitor.h"
+#ifdef FOSSIL_HAVE_INOTIFY
+# include <sys/inotify.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <sys/stat.h>
+# include <dirent.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <poll.h>
+# include <signal.h>
+# include <unistd.h>
+#endif
+
+#ifdef FOSSIL_HAVE_INOTIFY
+
+/*
+** The inotify events that the daemon watches for on each directory
+*/
+#define FSMON_MASK (IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE\
+                    |IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF\
+                    |IN_ONLYDIR|IN_DONT_FOLLOW)
+
+/*
+** State of the daemon
+*/
+static struct {
+  int fdNotify;         /* The inotify file descriptor */
+  int fdListen;         /* The listening socket */
+  char *zRoot;          /* Root of the check-out, with a trailing "/" */
+  char *zSocket;        /* Name of the listening socket */
+  char zEpoch[17];      /* Current epoch, as 16 hexadecimal digits */
+  i64 iSeq;             /* Sequence number of the most recent change */
+  int rootWd;           /* Watch descriptor of the check-out root */
+  int nWatch;           /* Number of slots in azWatch[] */
+  int nActive;          /* Number of directories being watched */
+  char **azWatch;       /* Directory name for each watch descriptor */
+} fsmon;
+
+/*
+** Return true if zDir is a directory, not a symbolic link, that belongs
+** to the current user and that no other user can enter or write.
+*/
+static int fsmonitor_dir_is_private(const char *zDir){
+  struct stat st;
+  return lstat(zDir, &st)==0
+      && S_ISDIR(st.st_mode)
+      && st.st_uid==getuid()
+      && (st.st_mode & 077)==0;
+}
+
+/*
+** Return the name of the socket used by the fsmonitor daemon for the
+** check-out rooted at zRoot.  The name depends only on zRoot and the
+** user, so that the daemon and its clients agree on it.
+**
+** The socket is in $XDG_RUNTIME_DIR if that is a private directory, or
+** else in a directory /tmp/fossil-fsmonitor-UID which is created, with
+** no access for other users, if bCreate is true.  Return NULL if there
+** is no such private directory, so that a directory made by some other
+** user is never used.  The caller must free the returned string.
+*/
+static char *fsmonitor_socket_name(const char *zRoot, int bCreate){
+  const char *zRuntime = fossil_getenv("XDG_RUNTIME_DIR");
+  char *zDir;
+  Blob root, hash;
+  char *z;
+  if( zRuntime && zRuntime[0] && fsmonitor_dir_is_private(zRuntime) ){
+    zDir = fossil_strdup(zRuntime);
+  }else{
+    zDir = mprintf("/tmp/fossil-fsmonitor-%d", (int)getuid());
+    if( bCreate ) mkdir(zDir, 0700);
+    if( !fsmonitor_dir_is_private(zDir) ){
+      fossil_free(zDir);
+      return 0;
+    }
+  }
+  blob_init(&root, zRoot, -1);
+  sha1sum_blob(&root, &hash);
+  z = mprintf("%s/fossil-fsmonitor-%.16s", zDir, blob_str(&hash));
+  blob_reset(&root);
+  blob_reset(&hash);
+  fossil_free(zDir);
+  return z;
+}
+
+/*
+** Connect to the daemon listening on zSocket.  Return the connected
+** socket, or -1 if there is no daemon.  Sockets that do not belong to
+** the current user are never trusted.
+*/
+static int fsmonitor_connect(const char *zSocket){
+  struct sockaddr_un addr;
+  struct stat st;
+  struct timeval tv;
+  int fd;
+  if( lstat(zSocket, &st)!=0 || !S_ISSOCK(st.st_mode)
+   || st.st_uid!=getuid() || strlen(zSocket)>=sizeof(addr.sun_path)
+  ){
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if( fd<0 ) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, zSocket, strlen(zSocket));
+  if( connect(fd, (struct sockaddr*)&addr, sizeof(addr))!=0 ){
+    close(fd);
+    return -1;
+  }
+  tv.tv_sec = 10;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+/*
+** Send the request zReq to the daemon on zSocket and read the complete
+** reply into pReply, which must be uninitialized.  Return 0 on success
+** or non-zero if there is no daemon or it did not answer.
+*/
+static int fsmonitor_request(const char *zSocket, const char *zReq,
+                             Blob *pReply){
+  char zBuf[8192];
+  int fd;
+  int n = (int)strlen(zReq);
+  blob_zero(pReply);
+  if( zSocket==0 ) return 1;
+  fd = fsmonitor_connect(zSocket);
+  if( fd<0 ) return 1;
+  if( write(fd, zReq, n)!=n ){
+    close(fd);
+    return 1;
+  }
+  shutdown(fd, SHUT_WR);
+  while( (n = read(fd, zBuf, sizeof(zBuf)))>0 ){
+    blob_append(pReply, zBuf, n);
+  }
+  close(fd);
+  if( n<0 ){
+    blob_reset(pReply);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+** Record that zPath, relative to the check-out root, has changed.
+*/
+static void fsmonitor_mark(const char *zPath){
+  static Stmt q;
+  if( file_is_reserved_name(zPath, -1) ) return;
+  db_static_prepare(&q, "REPLACE INTO chng(name,seq) VALUES(:name,:seq)");
+  db_bind_text(&q, ":name", zPath);
+  db_bind_int64(&q, ":seq", ++fsmon.iSeq);
+  db_step(&q);
+  db_reset(&q);
+}
+
+/*
+** Start a new epoch.  All tokens handed out so far become invalid, so
+** the next request from each client will cause a full scan.
+*/
+static void fsmonitor_new_epoch(void){
+  unsigned char a[8];
+  int i;
+  sqlite3_randomness(sizeof(a), a);
+  for(i=0; i<8; i++){
+    sqlite3_snprintf(3, &fsmon.zEpoch[i*2], "%02x", a[i]);
+  }
+  fsmon.iSeq = 0;
+  db_multi_exec("DELETE FROM chng");
+}
+
+/*
+** Begin watching the directory zDir, relative to the check-out root,
+** and all of its subdirectories.  zDir is "" for the root itself and
+** otherwise ends with "/".  If bMark is true, also mark every file
+** found as changed.  This is used for directories that appear while
+** the daemon is running, since their content was never seen.
+*/
+static void fsmonitor_watch_tree(const char *zDir, int bMark){
+  char *zFull = mprintf("%s%s", fsmon.zRoot, zDir);
+  DIR *d;
+  struct dirent *pEntry;
+  int wd;
+
+  wd = inotify_add_watch(fsmon.fdNotify, zFull, FSMON_MASK);
+  if( wd<0 ){
+    if( errno==ENOSPC ){
+      fossil_fatal("too many directories to watch - consider raising "
+                   "fs.inotify.max_user_watches");
+    }
+    fossil_free(zFull);
+    return;
+  }
+  if( wd>=fsmon.nWatch ){
+    int nNew = wd*2 + 100;
+    fsmon.azWatch = fossil_realloc(fsmon.azWatch, nNew*sizeof(char*));
+    memset(&fsmon.azWatch[fsmon.nWatch], 0,
+           (nNew-fsmon.nWatch)*sizeof(char*));
+    fsmon.nWatch = nNew;
+  }
+  if( fsmon.azWatch[wd]==0 ){
+    fsmon.nActive++;
+  }else{
+    fossil_free(fsmon.azWatch[wd]);
+  }
+  fsmon.azWatch[wd] = fossil_strdup(zDir);
+  if( zDir[0]==0 ) fsmon.rootWd = wd;
+  d = opendir(zFull);
+  if( d ){
+    while( (pEntry = readdir(d))!=0 ){
+      const char *zName = pEntry->d_name;
+      int isDir;
+      char *zPath;
+      if( zName[0]=='.' && (zName[1]==0 || (zName[1]=='.' && zName[2]==0)) ){
+        continue;
+      }
+      zPath = mprintf("%s%s", zDir, zName);
+      if( pEntry->d_type==DT_UNKNOWN ){
+        struct stat st;
+        char *zX = mprintf("%s%s", fsmon.zRoot, zPath);
+        isDir = lstat(zX, &st)==0 && S_ISDIR(st.st_mode);
+        fossil_free(zX);
+      }else{
+        isDir = pEntry->d_type==DT_DIR;
+      }
+      if( isDir ){
+        char *zSub = mprintf("%s/", zPath);
+        fsmonitor_watch_tree(zSub, bMark);
+        fossil_free(zSub);
+      }else if( bMark ){
+        fsmonitor_mark(zPath);
+      }
+      fossil_free(zPath);
+    }
+    closedir(d);
+  }
+  fossil_free(zFull);
+}
+
+/*
+** Remove every watch, then watch the whole check-out again.  This is
+** done after the kernel drops events, since directories may have been
+** created, renamed or deleted without the daemon knowing.  Events
+** still queued for the old watches are ignored.
+*/
+static void fsmonitor_rewatch(void){
+  int wd;
+  for(wd=0; wd<fsmon.nWatch; wd++){
+    if( fsmon.azWatch[wd] ){
+      inotify_rm_watch(fsmon.fdNotify, wd);
+      fossil_free(fsmon.azWatch[wd]);
+      fsmon.azWatch[wd] = 0;
+    }
+  }
+  fsmon.nActive = 0;
+  fsmon.rootWd = -1;
+  fsmonitor_watch_tree("", 0);
+}
+
+/*
+** Read and record all pending inotify events.  Return non-zero if the
+** check-out root itself has gone away.
+*/
+static int fsmonitor_read_events(void){
+  char aBuf[65536];
+  int n;
+  int rootGone = 0;
+  db_begin_transaction();
+  while( (n = read(fsmon.fdNotify, aBuf, sizeof(aBuf)))>0 ){
+    int i = 0;
+    while( i+(int)sizeof(struct inotify_event)<=n ){
+      struct inotify_event ev;
+      const char *zName;
+      const char *zDir;
+      char *zPath;
+      memcpy(&ev, &aBuf[i], sizeof(ev));
+      zName = &aBuf[i+sizeof(ev)];
+      i += sizeof(ev) + ev.len;
+      if( ev.mask & IN_Q_OVERFLOW ){
+        /* Events were lost.  Watch every directory again before handing
+        ** out any token of the new epoch. */
+        fsmonitor_rewatch();
+        if( fsmon.nActive==0 ) rootGone = 1;
+        fsmonitor_new_epoch();
+        continue;
+      }
+      if( ev.wd<0 || ev.wd>=fsmon.nWatch || fsmon.azWatch[ev.wd]==0 ){
+        continue;
+      }
+      zDir = fsmon.azWatch[ev.wd];
+      if( ev.mask & IN_IGNORED ){
+        fossil_free(fsmon.azWatch[ev.wd]);
+        fsmon.azWatch[ev.wd] = 0;
+        fsmon.nActive--;
+        if( ev.wd==fsmon.rootWd ) rootGone = 1;
+        continue;
+      }
+      if( ev.mask & (IN_DELETE_SELF|IN_MOVE_SELF) ){
+        if( ev.wd==fsmon.rootWd ) rootGone = 1;
+        continue;
+      }
+      if( ev.len==0 ) continue;
+      if( ev.mask & IN_ISDIR ){
+        zPath = mprintf("%s%s/", zDir, zName);
+        if( ev.mask & (IN_CREATE|IN_MOVED_TO) ){
+          fsmonitor_watch_tree(zPath, 1);
+        }
+        if( ev.mask & (IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO) ){
+          fsmonitor_mark(zPath);
+        }
+      }else{
+        zPath = mprintf("%s%s", zDir, zName);
+        fsmonitor_mark(zPath);
+      }
+      fossil_free(zPath);
+    }
+  }
+  db_end_transaction(0);
+  return rootGone;
+}
+
+/*
+** Answer one client connection.  Return non-zero if the daemon
+** should shut down.
+*/
+static int fsmonitor_serve(int fd){
+  char zReq[200];
+  int n = 0, k;
+  int rc = 0;
+  struct timeval tv;
+  Blob reply;
+
+  tv.tv_sec = 2;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  while( n<(int)sizeof(zReq)-1
+      && (k = read(fd, &zReq[n], sizeof(zReq)-1-n))>0 ){
+    n += k;
+    if( memchr(zReq, '\n', n) ) break;
+  }
+  zReq[n] = 0;
+  blob_init(&reply, 0, 0);
+  if( strncmp(zReq, "since ", 6)==0 ){
+    const char *zToken = &zReq[6];
+    int nEpoch = (int)strlen(fsmon.zEpoch);
+    i64 iSince = -1;
+    fsmonitor_read_events();
+    if( strncmp(zToken, fsmon.zEpoch, nEpoch)==0 && zToken[nEpoch]==':' ){
+      iSince = strtoll(&zToken[nEpoch+1], 0, 10);
+    }
+    if( iSince<0 || iSince>fsmon.iSeq ){
+      blob_appendf(&reply, "full %s:%lld\n", fsmon.zEpoch, fsmon.iSeq);
+    }else{
+      Stmt q;
+      blob_appendf(&reply, "ok %s:%lld\n", fsmon.zEpoch, fsmon.iSeq);
+      db_prepare(&q, "SELECT name FROM chng WHERE seq>%lld", iSince);
+      while( db_step(&q)==SQLITE_ROW ){
+        blob_append(&reply, db_column_text(&q,0), db_column_bytes(&q,0)+1);
+      }
+      db_finalize(&q);
+    }
+  }else if( strncmp(zReq, "status", 6)==0 ){
+    fsmonitor_read_events();
+    blob_appendf(&reply,
+       "ok\nroot: %s\npid: %d\ndirectories: %d\nchanged: %d\ntoken: %s:%lld\n",
+       fsmon.zRoot, (int)getpid(), fsmon.nActive,
+       db_int(0, "SELECT count(*) FROM chng"), fsmon.zEpoch, fsmon.iSeq);
+  }else if( strncmp(zReq, "stop", 4)==0 ){
+    blob_append(&reply, "ok\n", 3);
+    rc = 1;
+  }else{
+    blob_append(&reply, "error\n", 6);
+  }
+  k = 0;
+  while( k<blob_size(&reply) ){
+    n = write(fd, blob_buffer(&reply)+k, blob_size(&reply)-k);
+    if( n<=0 ) break;
+    k += n;
+  }
+  blob_reset(&reply);
+  return rc;
+}
+
+/*
+** The main loop of the daemon.  Runs until told to stop or until the
+** check-out goes away.
+*/
+static void fsmonitor_loop(void){
+  for(;;){
+    struct pollfd a[2];
+    a[0].fd = fsmon.fdNotify;
+    a[0].events = POLLIN;
+    a[1].fd = fsmon.fdListen;
+    a[1].events = POLLIN;
+    if( poll(a, 2, 60000)<0 && errno!=EINTR ) break;
+    if( (a[0].revents & POLLIN)!=0 && fsmonitor_read_events() ) break;
+    if( a[1].revents & POLLIN ){
+      int fd = accept(fsmon.fdListen, 0, 0);
+      if( fd>=0 ){
+        int bStop = fsmonitor_serve(fd);
+        close(fd);
+        if( bStop ) break;
+      }
+    }
+    if( a[0].revents==0 && a[1].revents==0 ){
+      /* Stop once the check-out has been closed */
+      char *z = mprintf("%s.fslckout", fsmon.zRoot);
+      char *z2 = mprintf("%s_FOSSIL_", fsmon.zRoot);
+      int bClosed = !file_isfile(z, ExtFILE) && !file_isfile(z2, ExtFILE);
+      fossil_free(z);
+      fossil_free(z2);
+      if( bClosed ) break;
+    }
+  }
+  unlink(fsmon.zSocket);
+}
+
+/*
+** Create the listening socket and the inotify watches for the check-out
+** rooted at zRoot.
+*/
+static void fsmonitor_init(const char *zRoot, const char *zSocket){
+  struct sockaddr_un addr;
+  mode_t oldMask;
+
+  memset(&fsmon, 0, sizeof(fsmon));
+  fsmon.zRoot = fossil_strdup(zRoot);
+  fsmon.zSocket = fossil_strdup(zSocket);
+  if( strlen(zSocket)>=sizeof(addr.sun_path) ){
+    fossil_fatal("socket name too long: %s", zSocket);
+  }
+  fsmon.fdListen = socket(AF_UNIX, SOCK_STREAM, 0);
+  if( fsmon.fdListen<0 ) fossil_fatal("cannot create a socket");
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, zSocket, strlen(zSocket));
+  unlink(zSocket);
+  oldMask = umask(0077);
+  if( bind(fsmon.fdListen, (struct sockaddr*)&addr, sizeof(addr))!=0 ){
+    umask(oldMask);
+    fossil_fatal("cannot bind to %s", zSocket);
+  }
+  umask(oldMask);
+  if( listen(fsmon.fdListen, 16)!=0 ){
+    unlink(zSocket);
+    fossil_fatal("cannot listen on %s", zSocket);
+  }
+  fsmon.fdNotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if( fsmon.fdNotify<0 ){
+    unlink(zSocket);
+    fossil_fatal("inotify is not available");
+  }
+  sqlite3_open(":memory:", &g.db);
+  db_multi_exec("CREATE TABLE chng(name TEXT PRIMARY KEY, seq INT)");
+  fsmonitor_new_epoch();
+  fsmonitor_watch_tree("", 0);
+  if( fsmon.nActive==0 ){
+    unlink(zSocket);
+    fossil_fatal("cannot watch %s", zRoot);
+  }
+}
+#endif /* FOSSIL_HAVE_INOTIFY */
+
+/*
+** Ask the fsmonitor daemon for the current check-out, if one is running,
+** which files have changed since zToken.  zToken may be NULL.
+**
+** Return 0 if no daemon answered.  Otherwise write the daemon's new
+** token into *pzNewToken and return 1 if every file must be examined,
+** or 2 if only the files listed in pList need to be examined.  The
+** names in pList are relative to the check-out root and are each
+** terminated by a zero byte.  Names that end with "/" are directories,
+** and stand for every file underneath.  The caller must free
+** *pzNewToken and reset pList.
+*/
+int fsmonitor_query(const char *zToken, Blob *pList, char **pzNewToken){
+  blob_zero(pList);
+  *pzNewToken = 0;
+#ifdef FOSSIL_HAVE_INOTIFY
+  if( g.localOpen && g.zLocalRoot ){
+    char *zSocket = fsmonitor_socket_name(g.zLocalRoot, 0);
+    char *zReq = mprintf("since %s\n", zToken ? zToken : "-");
+    Blob reply;
+    int rc = 0;
+    if( fsmonitor_request(zSocket, zReq, &reply)==0 ){
+      const char *z = blob_buffer(&reply);
+      const char *zEol = memchr(z, '\n', blob_size(&reply));
+      int iBody = zEol ? (int)(zEol - z) + 1 : 0;
+      if( zEol && strncmp(z, "ok ", 3)==0 ){
+        rc = 2;
+        *pzNewToken = fossil_strndup(&z[3], iBody-4);
+      }else if( zEol && strncmp(z, "full ", 5)==0 ){
+        rc = 1;
+        *pzNewToken = fossil_strndup(&z[5], iBody-6);
+      }
+      if( rc==2 ){
+        blob_append(pList, &z[iBody], blob_size(&reply)-iBody);
+      }
+    }
+    blob_reset(&reply);
+    fossil_free(zReq);
+    fossil_free(zSocket);
+    return rc;
+  }
+#endif
+  return 0;
+}
+
+/*
+** COMMAND: fsmonitor*
+**
+** Usage: %fossil fsmonitor start|stop|status ?OPTIONS?
+**
+** Manage a daemon that watches the current check-out for changes,
+** using the inotify interface of Linux.  While the daemon runs, the
+** "status", "changes", "commit" and similar commands ask it which
+** files have changed instead of examining every file in the check-out,
+** which is much faster for large check-outs.
+**
+** The daemon keeps no state on disk.  When it is not running, or when
+** it cannot say what changed (for example because it was restarted or
+** because the kernel dropped events), commands fall back to examining
+** every file.  The --hash option of commands that have one also
+** bypasses the daemon.  The "extras" command is not affected.
+**
+** > fossil fsmonitor start ?--foreground?
+**
+**       Start watching the current check-out.  The daemon runs in the
+**       background and stops by itself when the check-out is closed.
+**       With --foreground, it runs in the current process instead.
+**
+** > fossil fsmonitor stop
+**
+**       Stop the daemon for the current check-out.
+**
+** > fossil fsmonitor status
+**
+**       Report whether or not the daemon is running, and what it is
+**       watching.
+**
+** This command is only available on Linux.
+*/
+void fsmonitor_cmd(void){
+#ifdef FOSSIL_HAVE_INOTIFY
+  const char *zCmd;
+  char *zSocket;
+  char *zRoot;
+  int bForeground;
+  Blob reply;
+
+  bForeground = find_option("foreground",0,0)!=0;
+  db_must_be_within_tree();
+  verify_all_options();
+  if( g.argc!=3 ) usage("start|stop|status");
+  zCmd = g.argv[2];
+  zRoot = fossil_strdup(g.zLocalRoot);
+  zSocket = fsmonitor_socket_name(zRoot, strcmp(zCmd,"start")==0);
+  if( strcmp(zCmd,"status")==0 ){
+    if( fsmonitor_request(zSocket, "status\n", &reply)==0
+     && strncmp(blob_str(&reply), "ok\n", 3)==0
+    ){
+      fossil_print("%s", blob_str(&reply)+3);
+    }else{
+      fossil_print("not running\n");
+    }
+    blob_reset(&reply);
+  }else if( strcmp(zCmd,"stop")==0 ){
+    if( fsmonitor_request(zSocket, "stop\n", &reply)!=0 ){
+      fossil_print("not running\n");
+    }
+    blob_reset(&reply);
+  }else if( strcmp(zCmd,"start")==0 ){
+    pid_t pid;
+    if( zSocket==0 ){
+      fossil_fatal("cannot find a private directory for the socket:"
+                   " /tmp/fossil-fsmonitor-%d must belong to you and"
+                   " be inaccessible to other users", (int)getuid());
+    }
+    if( fsmonitor_request(zSocket, "status\n", &reply)==0
+     && blob_size(&reply)>0
+    ){
+      fossil_fatal("already running");
+    }
+    blob_reset(&reply);
+    db_close(1);
+    fsmonitor_init(zRoot, zSocket);
+    signal(SIGPIPE, SIG_IGN);
+    if( bForeground ){
+      fossil_print("watching %d directories of %s\n", fsmon.nActive, zRoot);
+      fsmonitor_loop();
+      return;
+    }
+    pid = fork();
+    if( pid<0 ){
+      unlink(zSocket);
+      fossil_fatal("fork() failed");
+    }
+    if( pid>0 ){
+      fossil_print("watching %d directories of %s (pid %d)\n",
+                   fsmon.nActive, zRoot, (int)pid);
+      return;
+    }else{
+      int i;
+      setsid();
+      for(i=0; i<=2; i++){
+        close(i);
+        open("/dev/null", O_RDWR);
+      }
+      fsmonitor_loop();
+      exit(0);
+    }
+  }else{
+    usage("start|stop|status");
+  }
+  fossil_free(zSocket);
+  fossil_free(zRoot);
+#else
+  fossil_fatal("this build of Fossil does not support fsmonitor");
+#endif
+}
@@ -367,7 +367,11 @@ static void append_diff(
   }else{
     pCfg->diffFlags |= DIFF_LINENO | DIFF_HTML | DIFF_NOTTOOBIG;
   }
-  text_diff(&from, &to, cgi_output_blob(), pCfg);
+  if( diff_parallel_active() ){
+    text_diff_deferred(&from, &to, pCfg, 0, 0, 0);
+  }else{
+    text_diff(&from, &to, cgi_output_blob(), pCfg);
+  }
   pCfg->zLeftHash = 0;
   blob_reset(&from);
   blob_reset(&to);
@@ -508,9 +512,13 @@ DiffConfig *construct_diff_flags(int diffType, DiffConfig *pCfg){
   u64 diffFlags = 0;  /* Zero means do not show any diff */
   if( diffType>0 ){
     int x;
+    char *zAlg;
     if( diffType==2 ) diffFlags = DIFF_SIDEBYSIDE;
     if( P_NoBot("w") )  diffFlags |= DIFF_IGNORE_ALLWS;
     if( PD_NoBot("noopt",0)!=0 ) diffFlags |= DIFF_NOOPT;
+    zAlg = db_get("diff-algorithm", 0);
+    if( zAlg && zAlg[0] ) diffFlags |= diff_algorithm_flag(zAlg);
+    fossil_free(zAlg);
     diffFlags |= DIFF_STRIP_EOLCR;
     diff_config_init(pCfg, diffFlags);
 
@@ -1328,6 +1336,7 @@ void ci_page(void){
     " ORDER BY name /*sort*/",
     rid, rid
   );
+  if( pCfg ) diff_parallel_begin(pCfg);
   while( db_step(&q3)==SQLITE_ROW ){
     const char *zName = db_column_text(&q3,0);
     int mperm = db_column_int(&q3, 1);
@@ -1337,6 +1346,7 @@ void ci_page(void){
     append_file_change_line(zUuid, zName, zOld, zNew, zOldName,
                             pCfg,mperm,aChng);
   }
+  diff_parallel_end();
   db_finalize(&q3);
   @ </div>
   if( diffType!=0 ){
@@ -1661,6 +1671,7 @@ void vdiff_page(void){
   manifest_file_rewind(pTo);
   pFileTo = manifest_file_next(pTo, 0);
   DCfg.pRe = pRe;
+  if( pCfg ) diff_parallel_begin(pCfg);
   while( pFileFrom || pFileTo ){
     int cmp;
     if( pFileFrom==0 ){
@@ -1698,6 +1709,7 @@ void vdiff_page(void){
       pFileTo = manifest_file_next(pTo, 0);
     }
   }
+  diff_parallel_end();
   glob_free(pGlob);
   manifest_destroy(pFrom);
   manifest_destroy(pTo);
@@ -64,6 +64,7 @@ SRC = \
   $(SRCDIR)/foci.c \
   $(SRCDIR)/forum.c \
   $(SRCDIR)/fshell.c \
+  $(SRCDIR)/fsmonitor.c \
   $(SRCDIR)/fusefs.c \
   $(SRCDIR)/fuzz.c \
   $(SRCDIR)/glob.c \
@@ -135,6 +136,7 @@ SRC = \
   $(SRCDIR)/sitemap.c \
   $(SRCDIR)/skins.c \
   $(SRCDIR)/smtp.c \
+  $(SRCDIR)/sparse.c \
   $(SRCDIR)/sqlcmd.c \
   $(SRCDIR)/stash.c \
   $(SRCDIR)/stat.c \
@@ -152,6 +154,7 @@ SRC = \
   $(SRCDIR)/unicode.c \
   $(SRCDIR)/unversioned.c \
   $(SRCDIR)/update.c \
+  $(SRCDIR)/uring.c \
   $(SRCDIR)/url.c \
   $(SRCDIR)/user.c \
   $(SRCDIR)/utf8.c \
@@ -335,6 +338,7 @@ TRANS_SRC = \
   $(OBJDIR)/foci_.c \
   $(OBJDIR)/forum_.c \
   $(OBJDIR)/fshell_.c \
+  $(OBJDIR)/fsmonitor_.c \
   $(OBJDIR)/fusefs_.c \
   $(OBJDIR)/fuzz_.c \
   $(OBJDIR)/glob_.c \
@@ -406,6 +410,7 @@ TRANS_SRC = \
   $(OBJDIR)/sitemap_.c \
   $(OBJDIR)/skins_.c \
   $(OBJDIR)/smtp_.c \
+  $(OBJDIR)/sparse_.c \
   $(OBJDIR)/sqlcmd_.c \
   $(OBJDIR)/stash_.c \
   $(OBJDIR)/stat_.c \
@@ -423,6 +428,7 @@ TRANS_SRC = \
   $(OBJDIR)/unicode_.c \
   $(OBJDIR)/unversioned_.c \
   $(OBJDIR)/update_.c \
+  $(OBJDIR)/uring_.c \
   $(OBJDIR)/url_.c \
   $(OBJDIR)/user_.c \
   $(OBJDIR)/utf8_.c \
@@ -487,6 +493,7 @@ OBJ = \
  $(OBJDIR)/foci.o \
  $(OBJDIR)/forum.o \
  $(OBJDIR)/fshell.o \
+ $(OBJDIR)/fsmonitor.o \
  $(OBJDIR)/fusefs.o \
  $(OBJDIR)/fuzz.o \
  $(OBJDIR)/glob.o \
@@ -558,6 +565,7 @@ OBJ = \
  $(OBJDIR)/sitemap.o \
  $(OBJDIR)/skins.o \
  $(OBJDIR)/smtp.o \
+ $(OBJDIR)/sparse.o \
  $(OBJDIR)/sqlcmd.o \
  $(OBJDIR)/stash.o \
  $(OBJDIR)/stat.o \
@@ -575,6 +583,7 @@ OBJ = \
  $(OBJDIR)/unicode.o \
  $(OBJDIR)/unversioned.o \
  $(OBJDIR)/update.o \
+ $(OBJDIR)/uring.o \
  $(OBJDIR)/url.o \
  $(OBJDIR)/user.o \
  $(OBJDIR)/utf8.o \
@@ -835,6 +844,7 @@ $(OBJDIR)/headers:	$(OBJDIR)/page_index.h $(OBJDIR)/builtin_data.h $(OBJDIR)/mak
 	$(OBJDIR)/foci_.c:$(OBJDIR)/foci.h \
 	$(OBJDIR)/forum_.c:$(OBJDIR)/forum.h \
 	$(OBJDIR)/fshell_.c:$(OBJDIR)/fshell.h \
+	$(OBJDIR)/fsmonitor_.c:$(OBJDIR)/fsmonitor.h \
 	$(OBJDIR)/fusefs_.c:$(OBJDIR)/fusefs.h \
 	$(OBJDIR)/fuzz_.c:$(OBJDIR)/fuzz.h \
 	$(OBJDIR)/glob_.c:$(OBJDIR)/glob.h \
@@ -906,6 +916,7 @@ $(OBJDIR)/headers:	$(OBJDIR)/page_index.h $(OBJDIR)/builtin_data.h $(OBJDIR)/mak
 	$(OBJDIR)/sitemap_.c:$(OBJDIR)/sitemap.h \
 	$(OBJDIR)/skins_.c:$(OBJDIR)/skins.h \
 	$(OBJDIR)/smtp_.c:$(OBJDIR)/smtp.h \
+	$(OBJDIR)/sparse_.c:$(OBJDIR)/sparse.h \
 	$(OBJDIR)/sqlcmd_.c:$(OBJDIR)/sqlcmd.h \
 	$(OBJDIR)/stash_.c:$(OBJDIR)/stash.h \
 	$(OBJDIR)/stat_.c:$(OBJDIR)/stat.h \
@@ -923,6 +934,7 @@ $(OBJDIR)/headers:	$(OBJDIR)/page_index.h $(OBJDIR)/builtin_data.h $(OBJDIR)/mak
 	$(OBJDIR)/unicode_.c:$(OBJDIR)/unicode.h \
 	$(OBJDIR)/unversioned_.c:$(OBJDIR)/unversioned.h \
 	$(OBJDIR)/update_.c:$(OBJDIR)/update.h \
+	$(OBJDIR)/uring_.c:$(OBJDIR)/uring.h \
 	$(OBJDIR)/url_.c:$(OBJDIR)/url.h \
 	$(OBJDIR)/user_.c:$(OBJDIR)/user.h \
 	$(OBJDIR)/utf8_.c:$(OBJDIR)/utf8.h \
@@ -1329,6 +1341,14 @@ $(OBJDIR)/fshell.o:	$(OBJDIR)/fshell_.c $(OBJDIR)/fshell.h $(SRCDIR)/config.h
 
 $(OBJDIR)/fshell.h:	$(OBJDIR)/headers
 
+$(OBJDIR)/fsmonitor_.c:	$(SRCDIR)/fsmonitor.c $(OBJDIR)/translate
+	$(OBJDIR)/translate $(SRCDIR)/fsmonitor.c >$@
+
+$(OBJDIR)/fsmonitor.o:	$(OBJDIR)/fsmonitor_.c $(OBJDIR)/fsmonitor.h $(SRCDIR)/config.h
+	$(XTCC) -o $(OBJDIR)/fsmonitor.o -c $(OBJDIR)/fsmonitor_.c
+
+$(OBJDIR)/fsmonitor.h:	$(OBJDIR)/headers
+
 $(OBJDIR)/fusefs_.c:	$(SRCDIR)/fusefs.c $(OBJDIR)/translate
 	$(OBJDIR)/translate $(SRCDIR)/fusefs.c >$@
 
@@ -1897,6 +1917,14 @@ $(OBJDIR)/smtp.o:	$(OBJDIR)/smtp_.c $(OBJDIR)/smtp.h $(SRCDIR)/config.h
 
 $(OBJDIR)/smtp.h:	$(OBJDIR)/headers
 
+$(OBJDIR)/sparse_.c:	$(SRCDIR)/sparse.c $(OBJDIR)/translate
+	$(OBJDIR)/translate $(SRCDIR)/sparse.c >$@
+
+$(OBJDIR)/sparse.o:	$(OBJDIR)/sparse_.c $(OBJDIR)/sparse.h $(SRCDIR)/config.h
+	$(XTCC) -o $(OBJDIR)/sparse.o -c $(OBJDIR)/sparse_.c
+
+$(OBJDIR)/sparse.h:	$(OBJDIR)/headers
+
 $(OBJDIR)/sqlcmd_.c:	$(SRCDIR)/sqlcmd.c $(OBJDIR)/translate
 	$(OBJDIR)/translate $(SRCDIR)/sqlcmd.c >$@
 
@@ -2033,6 +2061,14 @@ $(OBJDIR)/update.o:	$(OBJDIR)/update_.c $(OBJDIR)/update.h $(SRCDIR)/config.h
 
 $(OBJDIR)/update.h:	$(OBJDIR)/headers
 
+$(OBJDIR)/uring_.c:	$(SRCDIR)/uring.c $(OBJDIR)/translate
+	$(OBJDIR)/translate $(SRCDIR)/uring.c >$@
+
+$(OBJDIR)/uring.o:	$(OBJDIR)/uring_.c $(OBJDIR)/uring.h $(SRCDIR)/config.h
+	$(XTCC) -o $(OBJDIR)/uring.o -c $(OBJDIR)/uring_.c
+
+$(OBJDIR)/uring.h:	$(OBJDIR)/headers
+
 $(OBJDIR)/url_.c:	$(SRCDIR)/url.c $(OBJDIR)/translate
 	$(OBJDIR)/translate $(SRCDIR)/url.c >$@
 
@@ -70,6 +70,7 @@ struct Manifest {
   Blob content;         /* The original content blob */
   int type;             /* Type of artifact.  One of CFTYPE_xxxxx */
   int rid;              /* The blob-id for this manifest */
+  int bArena;           /* Arrays are part of the same allocation as this */
   const char *zBaseline;/* Baseline manifest.  The B card. */
   Manifest *pBaseline;  /* The actual baseline manifest */
   char *zComment;       /* Decoded comment.  The C card. */
@@ -96,6 +97,7 @@ struct Manifest {
   int nParentAlloc;     /* Slots allocated in azParent[] */
   char **azParent;      /* Hashes of parents.  One for each P card argument */
   int nCherrypick;      /* Number of entries in aCherrypick[] */
+  int nCherrypickAlloc; /* Slots allocated in aCherrypick[] */
   struct {
     char *zCPTarget;    /* Hash for cherry-picked version w/ +|- prefix */
     char *zCPBase;      /* Hash for cherry-pick baseline. NULL for singletons */
@@ -201,12 +203,14 @@ static int manifest_event_triggers_are_enabled = 0;
 void manifest_destroy(Manifest *p){
   if( p ){
     blob_reset(&p->content);
-    fossil_free(p->aFile);
-    fossil_free(p->azParent);
-    fossil_free(p->azCChild);
-    fossil_free(p->aTag);
-    fossil_free(p->aField);
-    fossil_free(p->aCherrypick);
+    if( !p->bArena ){
+      fossil_free(p->aFile);
+      fossil_free(p->azParent);
+      fossil_free(p->azCChild);
+      fossil_free(p->aTag);
+      fossil_free(p->aField);
+      fossil_free(p->aCherrypick);
+    }
     if( p->pBaseline ) manifest_destroy(p->pBaseline);
     memset(p, 0, sizeof(*p));
     fossil_free(p);
@@ -297,6 +301,473 @@ void manifest_cache_clear(void){
   memset(&manifestCache, 0, sizeof(manifestCache));
 }
 
+/*
+** SETTING: manifest-cache         width=10 default=0
+**
+** If this setting has an integer value of N greater than zero, then up
+** to N check-in manifests are saved in parsed form in the MCACHE table
+** of the repository, so that later processes, such as the separate CGI
+** requests of a busy server, need neither reconstruct them from deltas
+** nor parse them again.  Manifests are saved as they are added to the
+** repository, by "fossil rebuild", and when a command loads one that is
+** not saved yet.  Web pages use the saved manifests but never add to
+** them.  Only the N manifests most recently received are kept.  Each
+** takes about 40 bytes per file of the check-in, most of which is the
+** hash of the file.  The MCACHE table holds only derived data.
+*/
+
+/*
+** State of the on-disk manifest cache for the current process
+*/
+static struct {
+  int eState;          /* 0: not yet checked.  1: enabled.  -1: disabled */
+  int nKeep;           /* Number of manifests to keep in the MCACHE table */
+  int hasTable;        /* True if the MCACHE table is known to exist */
+  int nHit;            /* Number of manifests loaded from the cache */
+  int nMiss;           /* Number of cache misses */
+} mcache;
+
+/*
+** Forget the manifest-cache setting and whether or not the MCACHE table
+** exists.  Called when the repository is closed, and by "fossil rebuild"
+** after it drops the MCACHE table.
+*/
+void manifest_mcache_reset(void){
+  mcache.eState = 0;
+  mcache.hasTable = 0;
+}
+
+/*
+** Return true if the on-disk manifest cache is enabled.
+*/
+static int mcache_enabled(void){
+  if( mcache.eState==0 ){
+    mcache.nKeep = g.repositoryOpen ? db_get_int("manifest-cache", 0) : 0;
+    if( mcache.nKeep>0 ){
+      mcache.eState = 1;
+      mcache.hasTable = db_table_exists("repository","mcache");
+    }else{
+      mcache.eState = -1;
+    }
+  }
+  return mcache.eState>0;
+}
+
+/*
+** The MCACHE table holds a compact serialization of each saved manifest,
+** compressed with blob_compress().  It does not contain the text of the
+** artifact.  Integers are stored as varints of 7 bits per byte, least
+** significant group first.  The serialization is:
+**
+**    *  The format number MCACHE_FORMAT, and the artifact type.
+**    *  The rDate and rEventDate values, as 64-bit big-endian integers.
+**    *  The total number of bytes in all strings, including their
+**       zero terminators.
+**    *  The strings of the Manifest object, and each array as a count
+**       followed by the strings of its entries.
+**
+** A string is a varint V followed by data.  V is 0 for NULL, 2*N+1 for
+** N bytes of text, and 2*N+2 for a lower-case hexadecimal string, such
+** as an artifact hash, stored as its N-byte binary value.  The name of
+** each F-card is preceded by the number of bytes it shares with the name
+** of the F-card before it, and only the rest of the name is stored.
+*/
+#define MCACHE_FORMAT  1
+
+/*
+** A serializer or deserializer for the on-disk manifest cache
+*/
+typedef struct McacheBuf McacheBuf;
+struct McacheBuf {
+  Blob *pOut;          /* Output when encoding */
+  u64 nStr;            /* Bytes of string data when encoding */
+  const unsigned char *a;  /* Input when decoding */
+  int n;               /* Bytes of input */
+  int i;               /* Bytes of input consumed */
+  char *zStr;          /* Space for the strings when decoding */
+  int nStrAlloc;       /* Bytes of space in zStr[] */
+  int iStr;            /* Bytes of zStr[] used */
+  int bad;             /* True if the input is not valid */
+};
+
+static void mcache_put_varint(McacheBuf *pBuf, u64 v){
+  char a[10];
+  int n = 0;
+  while( v>=0x80 ){
+    a[n++] = (char)((v&0x7f)|0x80);
+    v >>= 7;
+  }
+  a[n++] = (char)v;
+  blob_append(pBuf->pOut, a, n);
+}
+static void mcache_put_double(McacheBuf *pBuf, double r){
+  u64 x;
+  char a[8];
+  int i;
+  memcpy(&x, &r, sizeof(x));
+  for(i=7; i>=0; i--, x>>=8) a[i] = (char)(x&0xff);
+  blob_append(pBuf->pOut, a, 8);
+}
+static void mcache_put_str(McacheBuf *pBuf, const char *z){
+  int n, i;
+  if( z==0 ){
+    mcache_put_varint(pBuf, 0);
+    return;
+  }
+  n = (int)strlen(z);
+  pBuf->nStr += n+1;
+  for(i=0; i<n && ((z[i]>='0' && z[i]<='9') || (z[i]>='a' && z[i]<='f')); i++){}
+  if( i==n && n>0 && (n&1)==0 ){
+    char *a = fossil_malloc( n/2 );
+    decode16((const unsigned char*)z, (unsigned char*)a, n);
+    mcache_put_varint(pBuf, n+2);
+    blob_append(pBuf->pOut, a, n/2);
+    fossil_free(a);
+  }else{
+    mcache_put_varint(pBuf, 2*(u64)n+1);
+    blob_append(pBuf->pOut, z, n);
+  }
+}
+static u64 mcache_get_varint(McacheBuf *pBuf){
+  u64 v = 0;
+  int shift = 0;
+  while( pBuf->i<pBuf->n && shift<64 ){
+    unsigned char c = pBuf->a[pBuf->i++];
+    v |= (u64)(c&0x7f)<<shift;
+    if( (c&0x80)==0 ) return v;
+    shift += 7;
+  }
+  pBuf->bad = 1;
+  return 0;
+}
+static double mcache_get_double(McacheBuf *pBuf){
+  u64 x = 0;
+  double r;
+  int i;
+  if( pBuf->i+8>pBuf->n ){
+    pBuf->bad = 1;
+    return 0.0;
+  }
+  for(i=0; i<8; i++) x = (x<<8) | pBuf->a[pBuf->i++];
+  memcpy(&r, &x, sizeof(r));
+  return r;
+}
+
+/*
+** Decode a string whose first nPrefix bytes are the same as those of
+** zPrefix.  Return a pointer to the string in zStr[].
+*/
+static char *mcache_get_str_prefix(
+  McacheBuf *pBuf,
+  const char *zPrefix,
+  u64 nPrefix
+){
+  u64 v = mcache_get_varint(pBuf);
+  u64 nIn, nText;
+  int isHex;
+  char *z;
+  if( v==0 && nPrefix==0 ) return 0;
+  isHex = v>0 && (v&1)==0;
+  nIn = v>0 ? (v-1)/2 : 0;
+  nText = isHex ? nIn*2 : nIn;
+  if( pBuf->bad
+   || nIn>(u64)(pBuf->n - pBuf->i)
+   || nPrefix+nText+1>(u64)(pBuf->nStrAlloc - pBuf->iStr)
+   || (nPrefix>0 && (zPrefix==0 || nPrefix>strlen(zPrefix)))
+  ){
+    pBuf->bad = 1;
+    return 0;
+  }
+  z = &pBuf->zStr[pBuf->iStr];
+  if( nPrefix>0 ) memcpy(z, zPrefix, (size_t)nPrefix);
+  if( isHex ){
+    encode16(&pBuf->a[pBuf->i], (unsigned char*)&z[nPrefix], (int)nIn);
+  }else{
+    memcpy(&z[nPrefix], &pBuf->a[pBuf->i], (size_t)nIn);
+    z[nPrefix+nText] = 0;
+  }
+  pBuf->i += (int)nIn;
+  pBuf->iStr += (int)(nPrefix+nText+1);
+  return z;
+}
+static char *mcache_get_str(McacheBuf *pBuf){
+  return mcache_get_str_prefix(pBuf, 0, 0);
+}
+
+/*
+** Return the number of array entries that follow in the input.  Sets the
+** bad flag if that many entries cannot possibly fit in the remaining
+** input.
+*/
+static int mcache_get_count(McacheBuf *pBuf){
+  u64 n = mcache_get_varint(pBuf);
+  if( n>(u64)(pBuf->n - pBuf->i) ){
+    pBuf->bad = 1;
+    return 0;
+  }
+  return (int)n;
+}
+
+/*
+** Serialize Manifest p into pOut.
+*/
+static void mcache_encode(Manifest *p, Blob *pOut){
+  McacheBuf b;
+  Blob body;
+  const char *zPrev = "";
+  int i;
+  memset(&b, 0, sizeof(b));
+  blob_init(&body, 0, 0);
+  b.pOut = &body;
+  mcache_put_str(&b, p->zBaseline);
+  mcache_put_str(&b, p->zComment);
+  mcache_put_str(&b, p->zUser);
+  mcache_put_str(&b, p->zRepoCksum);
+  mcache_put_str(&b, p->zWiki);
+  mcache_put_str(&b, p->zWikiTitle);
+  mcache_put_str(&b, p->zMimetype);
+  mcache_put_str(&b, p->zThreadTitle);
+  mcache_put_str(&b, p->zEventId);
+  mcache_put_str(&b, p->zTicketUuid);
+  mcache_put_str(&b, p->zAttachName);
+  mcache_put_str(&b, p->zAttachSrc);
+  mcache_put_str(&b, p->zAttachTarget);
+  mcache_put_str(&b, p->zThreadRoot);
+  mcache_put_str(&b, p->zInReplyTo);
+  mcache_put_varint(&b, p->nFile);
+  for(i=0; i<p->nFile; i++){
+    const char *zName = p->aFile[i].zName;
+    int j = 0;
+    if( zName ){
+      while( zPrev[j] && zPrev[j]==zName[j] ) j++;
+      zPrev = zName;
+    }
+    mcache_put_varint(&b, j);
+    mcache_put_str(&b, zName ? zName+j : 0);
+    if( zName ) b.nStr += j;
+    mcache_put_str(&b, p->aFile[i].zUuid);
+    mcache_put_str(&b, p->aFile[i].zPerm);
+    mcache_put_str(&b, p->aFile[i].zPrior);
+  }
+  mcache_put_varint(&b, p->nParent);
+  for(i=0; i<p->nParent; i++){
+    mcache_put_str(&b, p->azParent[i]);
+  }
+  mcache_put_varint(&b, p->nCherrypick);
+  for(i=0; i<p->nCherrypick; i++){
+    mcache_put_str(&b, p->aCherrypick[i].zCPTarget);
+    mcache_put_str(&b, p->aCherrypick[i].zCPBase);
+  }
+  mcache_put_varint(&b, p->nCChild);
+  for(i=0; i<p->nCChild; i++){
+    mcache_put_str(&b, p->azCChild[i]);
+  }
+  mcache_put_varint(&b, p->nTag);
+  for(i=0; i<p->nTag; i++){
+    mcache_put_str(&b, p->aTag[i].zName);
+    mcache_put_str(&b, p->aTag[i].zUuid);
+    mcache_put_str(&b, p->aTag[i].zValue);
+  }
+  mcache_put_varint(&b, p->nField);
+  for(i=0; i<p->nField; i++){
+    mcache_put_str(&b, p->aField[i].zName);
+    mcache_put_str(&b, p->aField[i].zValue);
+  }
+  b.pOut = pOut;
+  mcache_put_varint(&b, MCACHE_FORMAT);
+  mcache_put_varint(&b, p->type);
+  mcache_put_double(&b, p->rDate);
+  mcache_put_double(&b, p->rEventDate);
+  mcache_put_varint(&b, b.nStr);
+  blob_append(pOut, blob_buffer(&body), blob_size(&body));
+  blob_reset(&body);
+}
+
+/*
+** Reconstruct a Manifest from the n bytes of serialized data in a[].
+** The strings are held in the content blob of the Manifest, and the
+** arrays are allocated separately.  Return NULL if the input is not
+** valid.
+*/
+static Manifest *mcache_decode(const unsigned char *a, int n, int rid){
+  McacheBuf b;
+  Manifest *p;
+  const char *zPrev = "";
+  u64 nStr;
+  int i;
+
+  memset(&b, 0, sizeof(b));
+  b.a = a;
+  b.n = n;
+  if( mcache_get_varint(&b)!=MCACHE_FORMAT ) return 0;
+  p = fossil_malloc( sizeof(*p) );
+  memset(p, 0, sizeof(*p));
+  p->rid = rid;
+  p->type = (int)mcache_get_varint(&b);
+  p->rDate = mcache_get_double(&b);
+  p->rEventDate = mcache_get_double(&b);
+  nStr = mcache_get_varint(&b);
+  if( b.bad || nStr>0x7fffffff ){
+    manifest_destroy(p);
+    return 0;
+  }
+  blob_zero(&p->content);
+  blob_resize(&p->content, nStr);
+  b.zStr = blob_buffer(&p->content);
+  b.nStrAlloc = (int)nStr;
+  p->zBaseline = mcache_get_str(&b);
+  p->zComment = mcache_get_str(&b);
+  p->zUser = mcache_get_str(&b);
+  p->zRepoCksum = mcache_get_str(&b);
+  p->zWiki = mcache_get_str(&b);
+  p->zWikiTitle = mcache_get_str(&b);
+  p->zMimetype = mcache_get_str(&b);
+  p->zThreadTitle = mcache_get_str(&b);
+  p->zEventId = mcache_get_str(&b);
+  p->zTicketUuid = mcache_get_str(&b);
+  p->zAttachName = mcache_get_str(&b);
+  p->zAttachSrc = mcache_get_str(&b);
+  p->zAttachTarget = mcache_get_str(&b);
+  p->zThreadRoot = mcache_get_str(&b);
+  p->zInReplyTo = mcache_get_str(&b);
+  p->nFile = p->nFileAlloc = mcache_get_count(&b);
+  p->aFile = fossil_malloc( sizeof(p->aFile[0])*(p->nFile+1) );
+  for(i=0; i<p->nFile; i++){
+    u64 nPrefix = mcache_get_varint(&b);
+    p->aFile[i].zName = mcache_get_str_prefix(&b, zPrev, nPrefix);
+    if( p->aFile[i].zName ) zPrev = p->aFile[i].zName;
+    p->aFile[i].zUuid = mcache_get_str(&b);
+    p->aFile[i].zPerm = mcache_get_str(&b);
+    p->aFile[i].zPrior = mcache_get_str(&b);
+  }
+  p->nParent = p->nParentAlloc = mcache_get_count(&b);
+  p->azParent = fossil_malloc( sizeof(p->azParent[0])*(p->nParent+1) );
+  for(i=0; i<p->nParent; i++){
+    p->azParent[i] = mcache_get_str(&b);
+  }
+  p->nCherrypick = p->nCherrypickAlloc = mcache_get_count(&b);
+  p->aCherrypick = fossil_malloc(
+                      sizeof(p->aCherrypick[0])*(p->nCherrypick+1) );
+  for(i=0; i<p->nCherrypick; i++){
+    p->aCherrypick[i].zCPTarget = mcache_get_str(&b);
+    p->aCherrypick[i].zCPBase = mcache_get_str(&b);
+  }
+  p->nCChild = p->nCChildAlloc = mcache_get_count(&b);
+  p->azCChild = fossil_malloc( sizeof(p->azCChild[0])*(p->nCChild+1) );
+  for(i=0; i<p->nCChild; i++){
+    p->azCChild[i] = mcache_get_str(&b);
+  }
+  p->nTag = p->nTagAlloc = mcache_get_count(&b);
+  p->aTag = fossil_malloc( sizeof(p->aTag[0])*(p->nTag+1) );
+  for(i=0; i<p->nTag; i++){
+    p->aTag[i].zName = mcache_get_str(&b);
+    p->aTag[i].zUuid = mcache_get_str(&b);
+    p->aTag[i].zValue = mcache_get_str(&b);
+  }
+  p->nField = p->nFieldAlloc = mcache_get_count(&b);
+  p->aField = fossil_malloc( sizeof(p->aField[0])*(p->nField+1) );
+  for(i=0; i<p->nField; i++){
+    p->aField[i].zName = mcache_get_str(&b);
+    p->aField[i].zValue = mcache_get_str(&b);
+  }
+  if( b.bad || b.i!=n || b.iStr!=b.nStrAlloc ){
+    manifest_destroy(p);
+    return 0;
+  }
+  return p;
+}
+
+/*
+** Look for manifest rid in the MCACHE table.  Return the parsed manifest
+** if it is found, or NULL if not.  The hash of the artifact is stored
+** with each entry and checked against the BLOB table, so that an entry
+** is never used for a different artifact that was given the same RID
+** after a purge.
+*/
+static Manifest *mcache_find(int rid){
+  Stmt q;
+  Manifest *p = 0;
+  if( !mcache_enabled() || !mcache.hasTable ) return 0;
+  db_prepare(&q,
+    "SELECT m.data FROM repository.mcache AS m, repository.blob AS b"
+    " WHERE m.rid=%d AND b.rid=m.rid AND b.uuid=m.uuid", rid
+  );
+  if( db_step(&q)==SQLITE_ROW ){
+    Blob x;
+    blob_zero(&x);
+    db_column_blob(&q, 0, &x);
+    if( blob_uncompress(&x, &x)==0 ){
+      p = mcache_decode((const unsigned char*)blob_buffer(&x),
+                        blob_size(&x), rid);
+    }
+    blob_reset(&x);
+  }
+  db_finalize(&q);
+  if( p ){
+    mcache.nHit++;
+  }else{
+    mcache.nMiss++;
+  }
+  return p;
+}
+
+/*
+** Save check-in manifest p in the MCACHE table, creating the table if
+** necessary, and drop the entries beyond the mcache.nKeep with the
+** largest RIDs.  The caller must make sure that the repository may be
+** written.
+*/
+static void mcache_insert(Manifest *p){
+  Blob x;
+  Stmt q;
+  if( p->type!=CFTYPE_MANIFEST || !mcache_enabled() ) return;
+  schema_mcache();
+  mcache.hasTable = 1;
+  blob_init(&x, 0, 0);
+  mcache_encode(p, &x);
+  blob_compress(&x, &x);
+  db_prepare(&q,
+    "REPLACE INTO repository.mcache(rid,uuid,data)"
+    " SELECT rid, uuid, :data FROM repository.blob WHERE rid=%d", p->rid
+  );
+  db_bind_blob(&q, ":data", &x);
+  db_step(&q);
+  db_finalize(&q);
+  blob_reset(&x);
+  db_multi_exec(
+    "DELETE FROM repository.mcache WHERE rid IN ("
+      "SELECT rid FROM repository.mcache ORDER BY rid DESC"
+      " LIMIT -1 OFFSET %d)", mcache.nKeep
+  );
+}
+
+/*
+** Return true if manifest_get() may save the manifests that it parses
+** in the MCACHE table.  They are not saved while a web request is
+** being handled, since web pages that only show information should not
+** write to the repository.
+*/
+static int mcache_can_save(void){
+  return !g.isHTTP && db_is_writeable("repository");
+}
+
+/*
+** Remove the saved manifests of the artifacts whose RIDs are in the
+** table zTab.  Used when artifacts are purged or shunned.
+*/
+void manifest_mcache_remove(const char *zTab){
+  if( db_table_exists("repository","mcache") ){
+    db_multi_exec("DELETE FROM repository.mcache WHERE rid IN \"%w\"", zTab);
+  }
+}
+
+/*
+** Append statistics about the on-disk manifest cache to pOut.
+*/
+void manifest_mcache_stats(Blob *pOut){
+  blob_appendf(pOut, "%d hits, %d misses", mcache.nHit, mcache.nMiss);
+}
+
 #ifdef FOSSIL_DONT_VERIFY_MANIFEST_MD5SUM
 # define md5sum_init(X)
 # define md5sum_step_text(X,Y)
@@ -340,6 +811,18 @@ static void remove_pgp_signature(const char **pz, int *pn){
   return;
 }
 
+/*
+** Return true if the n bytes of text at z might be a structural artifact.
+** This applies the same quick tests that manifest_parse() uses to reject
+** ordinary file content before doing any real work.  No global state is
+** touched, so this routine may be called from a worker thread.
+*/
+int manifest_might_be_artifact(const char *z, int n){
+  if( n<=0 || z[n-1]!='\n' ) return 0;
+  remove_pgp_signature(&z, &n);
+  return n>=10 && z[0]>='A' && z[0]<='Z' && z[1]==' ';
+}
+
 /*
 ** Verify the Z-card checksum on the artifact, if there is such a
 ** checksum.  Return 0 if there is no Z-card.  Return 1 if the Z-card
@@ -413,6 +896,137 @@ static char next_card(ManifestText *p){
   return c;
 }
 
+/*
+** True if manifest_parse() should allocate its arrays separately,
+** rather than together with the Manifest object.  Used for timing
+** comparisons by test-parse-all-blobs.
+*/
+static int manifestNoArena = 0;
+
+/*
+** Allocate a new, zeroed Manifest object for the n bytes of artifact
+** text in z[].  Space for the aFile[], azParent[], aCherrypick[],
+** azCChild[], aTag[] and aField[] arrays is included in the same
+** allocation, so that manifest_parse() does not need to grow those
+** arrays and manifest_destroy() frees them all at once.
+**
+** The text is scanned for card types first in order to size the arrays.
+** The counts are upper bounds.  Every line is taken to be a card, except
+** for the content of a W-card, which is skipped exactly as the parser
+** skips it, and each space on a P-card is taken to introduce a hash.
+** Once the parser finds a syntax error it stops storing cards, so the
+** counts only need to be right for a well-formed prefix of the text.
+** Should a count still be too small, manifest_leave_arena() moves the
+** arrays out before one of them is grown.
+*/
+static Manifest *manifest_new(const char *z, int n){
+  const char *zEnd = &z[n];
+  int aCnt[26];
+  Manifest *p;
+  char *pSpace;
+  i64 nByte;
+
+  memset(aCnt, 0, sizeof(aCnt));
+  while( z<zEnd ){
+    const char *zEol = memchr(z, '\n', zEnd-z);
+    char c = z[0];
+    if( zEol==0 ) break;
+    if( c=='P' ){
+      const char *zP;
+      for(zP=z+1; zP<zEol; zP++){
+        if( zP[0]==' ' ) aCnt['P'-'A']++;
+      }
+    }else if( c>='A' && c<='Z' ){
+      aCnt[c-'A']++;
+    }
+    if( c=='W' && z[1]==' ' ){
+      /* Skip the content of the W-card */
+      unsigned size = 0;
+      const char *zS;
+      for(zS=z+2; zS<zEol && zS[0]>='0' && zS[0]<='9'; zS++){
+        size = size*10 + zS[0] - '0';
+      }
+      if( (i64)size+1<zEnd-zEol-1 && zEol[1+size]=='\n' ){
+        zEol += size+1;
+      }
+    }
+    z = zEol+1;
+  }
+  nByte = sizeof(*p)
+        + aCnt['F'-'A']*(i64)sizeof(p->aFile[0])
+        + aCnt['P'-'A']*(i64)sizeof(p->azParent[0])
+        + aCnt['Q'-'A']*(i64)sizeof(p->aCherrypick[0])
+        + aCnt['M'-'A']*(i64)sizeof(p->azCChild[0])
+        + aCnt['T'-'A']*(i64)sizeof(p->aTag[0])
+        + aCnt['J'-'A']*(i64)sizeof(p->aField[0]);
+  p = fossil_malloc( nByte );
+  memset(p, 0, sizeof(*p));
+  p->bArena = 1;
+  pSpace = (char*)&p[1];
+  if( (p->nFileAlloc = aCnt['F'-'A'])>0 ){
+    p->aFile = (ManifestFile*)pSpace;
+    pSpace += p->nFileAlloc*sizeof(p->aFile[0]);
+  }
+  if( (p->nParentAlloc = aCnt['P'-'A'])>0 ){
+    p->azParent = (char**)pSpace;
+    pSpace += p->nParentAlloc*sizeof(p->azParent[0]);
+  }
+  if( (p->nCherrypickAlloc = aCnt['Q'-'A'])>0 ){
+    p->aCherrypick = (void*)pSpace;
+    pSpace += p->nCherrypickAlloc*sizeof(p->aCherrypick[0]);
+  }
+  if( (p->nCChildAlloc = aCnt['M'-'A'])>0 ){
+    p->azCChild = (char**)pSpace;
+    pSpace += p->nCChildAlloc*sizeof(p->azCChild[0]);
+  }
+  if( (p->nTagAlloc = aCnt['T'-'A'])>0 ){
+    p->aTag = (struct TagType*)pSpace;
+    pSpace += p->nTagAlloc*sizeof(p->aTag[0]);
+  }
+  if( (p->nFieldAlloc = aCnt['J'-'A'])>0 ){
+    p->aField = (void*)pSpace;
+  }
+  return p;
+}
+
+/*
+** Return a copy, in memory obtained from fossil_malloc(), of the first
+** n entries of the array a[] of entries of sz bytes each.
+*/
+static void *manifest_array_dup(const void *a, int n, size_t sz){
+  void *pNew;
+  if( n<=0 ) return 0;
+  pNew = fossil_malloc( n*sz );
+  memcpy(pNew, a, n*sz);
+  return pNew;
+}
+
+/*
+** Copy the arrays of Manifest p out of the allocation made by
+** manifest_new(), so that any of them can be grown with fossil_realloc()
+** and manifest_destroy() frees each of them.  This is a no-op if the
+** arrays are already allocated separately.
+*/
+static void manifest_leave_arena(Manifest *p){
+  if( !p->bArena ) return;
+  p->aFile = manifest_array_dup(p->aFile, p->nFile, sizeof(p->aFile[0]));
+  p->nFileAlloc = p->nFile;
+  p->azParent = manifest_array_dup(p->azParent, p->nParent,
+                                   sizeof(p->azParent[0]));
+  p->nParentAlloc = p->nParent;
+  p->aCherrypick = manifest_array_dup(p->aCherrypick, p->nCherrypick,
+                                      sizeof(p->aCherrypick[0]));
+  p->nCherrypickAlloc = p->nCherrypick;
+  p->azCChild = manifest_array_dup(p->azCChild, p->nCChild,
+                                   sizeof(p->azCChild[0]));
+  p->nCChildAlloc = p->nCChild;
+  p->aTag = manifest_array_dup(p->aTag, p->nTag, sizeof(p->aTag[0]));
+  p->nTagAlloc = p->nTag;
+  p->aField = manifest_array_dup(p->aField, p->nField, sizeof(p->aField[0]));
+  p->nFieldAlloc = p->nField;
+  p->bArena = 0;
+}
+
 /*
 ** Shorthand for a control-artifact parsing error
 */
@@ -534,8 +1148,12 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
 
   /* Allocate a Manifest object to hold the parsed control artifact.
   */
-  p = fossil_malloc( sizeof(*p) );
-  memset(p, 0, sizeof(*p));
+  if( manifestNoArena ){
+    p = fossil_malloc( sizeof(*p) );
+    memset(p, 0, sizeof(*p));
+  }else{
+    p = manifest_new(z, n);
+  }
   memcpy(&p->content, pContent, sizeof(p->content));
   p->rid = rid;
   blob_zero(pContent);
@@ -699,6 +1317,7 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
           }
         }
         if( p->nFile>=p->nFileAlloc ){
+          manifest_leave_arena(p);
           p->nFileAlloc = p->nFileAlloc*2 + 10;
           p->aFile = fossil_realloc(p->aFile,
                                     p->nFileAlloc*sizeof(p->aFile[0]) );
@@ -786,6 +1405,7 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
         if( zValue==0 ) zValue = "";
         defossilize(zValue);
         if( p->nField>=p->nFieldAlloc ){
+          manifest_leave_arena(p);
           p->nFieldAlloc = p->nFieldAlloc*2 + 10;
           p->aField = fossil_realloc(p->aField,
                                p->nFieldAlloc*sizeof(p->aField[0]) );
@@ -849,6 +1469,7 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
           SYNTAX("Invalid hash on M-card");
         }
         if( p->nCChild>=p->nCChildAlloc ){
+          manifest_leave_arena(p);
           p->nCChildAlloc = p->nCChildAlloc*2 + 10;
           p->azCChild = fossil_realloc(p->azCChild
                                  , p->nCChildAlloc*sizeof(p->azCChild[0]) );
@@ -890,6 +1511,7 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
              SYNTAX("invalid hash on P-card");
           }
           if( p->nParent>=p->nParentAlloc ){
+            manifest_leave_arena(p);
             p->nParentAlloc = p->nParentAlloc*2 + 5;
             p->azParent = fossil_realloc(p->azParent,
                                p->nParentAlloc*sizeof(char*));
@@ -914,10 +1536,13 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
         if( !hname_validate(&zUuid[1], sz-1) ){
           SYNTAX("invalid hash on Q-card");
         }
-        n = p->nCherrypick;
-        p->nCherrypick++;
-        p->aCherrypick = fossil_realloc(p->aCherrypick,
-                                 p->nCherrypick*sizeof(p->aCherrypick[0]));
+        if( p->nCherrypick>=p->nCherrypickAlloc ){
+          manifest_leave_arena(p);
+          p->nCherrypickAlloc = p->nCherrypickAlloc*2 + 2;
+          p->aCherrypick = fossil_realloc(p->aCherrypick,
+                            p->nCherrypickAlloc*sizeof(p->aCherrypick[0]));
+        }
+        n = p->nCherrypick++;
         p->aCherrypick[n].zCPTarget = zUuid;
         p->aCherrypick[n].zCPBase = zUuid = next_token(&x, &sz);
         if( zUuid && !hname_validate(zUuid,sz) ){
@@ -982,6 +1607,7 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
           SYNTAX("T-card name looks like a hexadecimal hash");
         }
         if( p->nTag>=p->nTagAlloc ){
+          manifest_leave_arena(p);
           p->nTagAlloc = p->nTagAlloc*2 + 10;
           p->aTag = fossil_realloc(p->aTag, p->nTagAlloc*sizeof(p->aTag[0]) );
         }
@@ -1150,6 +1776,9 @@ manifest_syntax_error:
 /*
 ** Get a manifest given the rid for the control artifact.  Return
 ** a pointer to the manifest on success or NULL if there is a failure.
+**
+** With the manifest-cache setting, a check-in manifest is loaded from
+** the MCACHE table if it is saved there.
 */
 Manifest *manifest_get(int rid, int cfType, Blob *pErr){
   Blob content;
@@ -1163,8 +1792,12 @@ Manifest *manifest_get(int rid, int cfType, Blob *pErr){
     }
     return p;
   }
-  content_get(rid, &content);
-  p = manifest_parse(&content, rid, pErr);
+  p = mcache_find(rid);
+  if( p==0 ){
+    content_get(rid, &content);
+    p = manifest_parse(&content, rid, pErr);
+    if( p && mcache_can_save() ) mcache_insert(p);
+  }
   if( p && cfType!=CFTYPE_ANY && cfType!=p->type ){
     manifest_destroy(p);
     p = 0;
@@ -1236,10 +1869,12 @@ int manifest_is_well_formed(const char *zIn, int nIn){
 /*
 ** COMMAND: test-parse-manifest
 **
-** Usage: %fossil test-parse-manifest FILENAME ?N?
+** Usage: %fossil test-parse-manifest FILENAME ?N? ?--no-arena?
 **
 ** Parse the manifest(s) given on the command-line and report any
 ** errors.  If the N argument is given, run the parsing N times.
+** The --no-arena option allocates the arrays of the parsed manifest
+** separately, as older versions of Fossil did.
 */
 void manifest_test_parse_cmd(void){
   Manifest *p;
@@ -1248,6 +1883,7 @@ void manifest_test_parse_cmd(void){
   int n = 1;
   int isWF;
   db_find_and_open_repository(OPEN_SUBSTITUTE|OPEN_OK_NOT_FOUND,0);
+  manifestNoArena = find_option("no-arena",0,0)!=0;
   verify_all_options();
   if( g.argc!=3 && g.argc!=4 ){
     usage("FILENAME");
@@ -1280,6 +1916,81 @@ void manifest_test_parse_cmd(void){
   blob_reset(&b);
 }
 
+/*
+** Return true if Manifest objects p1 and p2 have the same content.
+** Used to test the manifest-cache serialization.
+*/
+static int mcache_same(Manifest *p1, Manifest *p2){
+  int i;
+  if( p2==0
+   || p1->type!=p2->type
+   || p1->rDate!=p2->rDate
+   || p1->rEventDate!=p2->rEventDate
+   || fossil_strcmp(p1->zBaseline, p2->zBaseline)
+   || fossil_strcmp(p1->zComment, p2->zComment)
+   || fossil_strcmp(p1->zUser, p2->zUser)
+   || fossil_strcmp(p1->zRepoCksum, p2->zRepoCksum)
+   || fossil_strcmp(p1->zWiki, p2->zWiki)
+   || fossil_strcmp(p1->zWikiTitle, p2->zWikiTitle)
+   || fossil_strcmp(p1->zMimetype, p2->zMimetype)
+   || fossil_strcmp(p1->zThreadTitle, p2->zThreadTitle)
+   || fossil_strcmp(p1->zEventId, p2->zEventId)
+   || fossil_strcmp(p1->zTicketUuid, p2->zTicketUuid)
+   || fossil_strcmp(p1->zAttachName, p2->zAttachName)
+   || fossil_strcmp(p1->zAttachSrc, p2->zAttachSrc)
+   || fossil_strcmp(p1->zAttachTarget, p2->zAttachTarget)
+   || fossil_strcmp(p1->zThreadRoot, p2->zThreadRoot)
+   || fossil_strcmp(p1->zInReplyTo, p2->zInReplyTo)
+   || p1->nFile!=p2->nFile
+   || p1->nParent!=p2->nParent
+   || p1->nCherrypick!=p2->nCherrypick
+   || p1->nCChild!=p2->nCChild
+   || p1->nTag!=p2->nTag
+   || p1->nField!=p2->nField
+  ){
+    return 0;
+  }
+  for(i=0; i<p1->nFile; i++){
+    if( fossil_strcmp(p1->aFile[i].zName, p2->aFile[i].zName)
+     || fossil_strcmp(p1->aFile[i].zUuid, p2->aFile[i].zUuid)
+     || fossil_strcmp(p1->aFile[i].zPerm, p2->aFile[i].zPerm)
+     || fossil_strcmp(p1->aFile[i].zPrior, p2->aFile[i].zPrior)
+    ){
+      return 0;
+    }
+  }
+  for(i=0; i<p1->nParent; i++){
+    if( fossil_strcmp(p1->azParent[i], p2->azParent[i]) ) return 0;
+  }
+  for(i=0; i<p1->nCherrypick; i++){
+    if( fossil_strcmp(p1->aCherrypick[i].zCPTarget,
+                      p2->aCherrypick[i].zCPTarget)
+     || fossil_strcmp(p1->aCherrypick[i].zCPBase, p2->aCherrypick[i].zCPBase)
+    ){
+      return 0;
+    }
+  }
+  for(i=0; i<p1->nCChild; i++){
+    if( fossil_strcmp(p1->azCChild[i], p2->azCChild[i]) ) return 0;
+  }
+  for(i=0; i<p1->nTag; i++){
+    if( fossil_strcmp(p1->aTag[i].zName, p2->aTag[i].zName)
+     || fossil_strcmp(p1->aTag[i].zUuid, p2->aTag[i].zUuid)
+     || fossil_strcmp(p1->aTag[i].zValue, p2->aTag[i].zValue)
+    ){
+      return 0;
+    }
+  }
+  for(i=0; i<p1->nField; i++){
+    if( fossil_strcmp(p1->aField[i].zName, p2->aField[i].zName)
+     || fossil_strcmp(p1->aField[i].zValue, p2->aField[i].zValue)
+    ){
+      return 0;
+    }
+  }
+  return 1;
+}
+
 /*
 ** COMMAND: test-parse-all-blobs
 **
@@ -1292,6 +2003,14 @@ void manifest_test_parse_cmd(void){
 **
 ** Options:
 **   --limit N            Parse no more than N artifacts before stopping
+**   --mcache             Serialize each check-in manifest as for the
+**                        manifest-cache setting, and verify that it is
+**                        the same once deserialized
+**   --no-arena           Allocate the arrays of each parsed artifact
+**                        separately, as older versions of Fossil did
+**   --timing             Report the CPU time spent parsing and freeing
+**                        the artifacts.  Artifacts are read directly,
+**                        bypassing all manifest caches.
 **   --wellformed         Use all BLOB table entries as input, not just
 **                        those entries that are believed to be valid
 **                        artifacts, and verify that the result the
@@ -1306,12 +2025,20 @@ void manifest_test_parse_all_blobs_cmd(void){
   int nErr = 0;
   int N = 1000000000;
   int bWellFormed;
+  int bTiming;
+  int bMcache;
+  int iTimer = 0;
+  sqlite3_uint64 nUsec = 0;
   const char *z;
   db_find_and_open_repository(0, 0);
   z = find_option("limit", 0, 1);
   if( z ) N = atoi(z);
   bWellFormed = find_option("wellformed",0,0)!=0;
+  manifestNoArena = find_option("no-arena",0,0)!=0;
+  bTiming = find_option("timing",0,0)!=0;
+  bMcache = find_option("mcache",0,0)!=0;
   verify_all_options();
+  if( bTiming ) iTimer = fossil_timer_start();
   if( bWellFormed ){
     db_prepare(&q, "SELECT rid FROM blob ORDER BY rid");
   }else{
@@ -1339,6 +2066,41 @@ void manifest_test_parse_all_blobs_cmd(void){
                      "but manifest_parse() found nothing wrong.\n", id);
         nErr++;
       }
+    }else if( bTiming ){
+      Blob content;
+      content_get(id, &content);
+      fossil_timer_reset(iTimer);
+      p = manifest_parse(&content, id, &err);
+      if( p ){
+        manifest_destroy(p);
+        p = 0;
+      }else{
+        fossil_print("%d ERROR: %s\n", id, blob_str(&err));
+        nErr++;
+      }
+      nUsec += fossil_timer_fetch(iTimer);
+    }else if( bMcache ){
+      Blob content;
+      content_get(id, &content);
+      p = manifest_parse(&content, id, &err);
+      if( p==0 ){
+        fossil_print("%d ERROR: %s\n", id, blob_str(&err));
+        nErr++;
+      }else if( p->type==CFTYPE_MANIFEST ){
+        Manifest *pCopy;
+        Blob x;
+        blob_init(&x, 0, 0);
+        mcache_encode(p, &x);
+        pCopy = mcache_decode((const unsigned char*)blob_buffer(&x),
+                              blob_size(&x), id);
+        if( !mcache_same(p, pCopy) ){
+          fossil_print("%d ERROR: manifest-cache serialization differs\n",
+                       id);
+          nErr++;
+        }
+        manifest_destroy(pCopy);
+        blob_reset(&x);
+      }
     }else{
       p = manifest_get(id, CFTYPE_ANY, &err);
       if( p==0 ){
@@ -1351,6 +2113,10 @@ void manifest_test_parse_all_blobs_cmd(void){
   }
   db_finalize(&q);
   fossil_print("%d tests with %d errors\n", nTest, nErr);
+  if( bTiming ){
+    fossil_timer_stop(iTimer);
+    fossil_print("%.3f seconds of CPU time parsing\n", nUsec/1000000.0);
+  }
 }
 
 /*
@@ -2901,6 +3667,9 @@ int manifest_crosslink(int rid, Blob *pContent, int flags){
     }
   }
 
+  /* New check-ins are saved in the MCACHE table as they arrive, even
+  ** during a sync, since the repository is being written anyhow. */
+  mcache_insert(p);
   db_end_transaction(0);
   if( permitHooks ){
     rc = xfer_run_common_script();
@@ -360,6 +360,63 @@ const char *md5sum_current_state(void){
   return zResult;
 }
 
+#if INTERFACE
+/*
+** Size of the buffer needed by md5sum_save_state()
+*/
+#define MD5_STATE_SIZE 180
+#endif
+
+/*
+** Write the state of the incremental MD5 checksum into zBuf, which must
+** hold at least MD5_STATE_SIZE bytes, as text from which
+** md5sum_restore_state() can resume the computation.  Only the bytes of
+** the partial input block that are in use are written.
+*/
+void md5sum_save_state(char *zBuf){
+  static const char zEncode[] = "0123456789abcdef";
+  int nIn, i, j;
+  md5sum_step_text(0,0);
+  sqlite3_snprintf(MD5_STATE_SIZE, zBuf, "%08x%08x%08x%08x%08x%08x",
+                   incrCtx.buf[0], incrCtx.buf[1], incrCtx.buf[2],
+                   incrCtx.buf[3], incrCtx.bits[0], incrCtx.bits[1]);
+  nIn = (incrCtx.bits[0]>>3) & 0x3f;
+  for(i=0, j=48; i<nIn; i++){
+    zBuf[j++] = zEncode[(incrCtx.in[i]>>4)&0xf];
+    zBuf[j++] = zEncode[incrCtx.in[i]&0xf];
+  }
+  zBuf[j] = 0;
+}
+
+/*
+** Replace the state of the incremental MD5 checksum with one saved by
+** md5sum_save_state().  Return 0 on success, or non-zero if z is not
+** a valid saved state, in which case the checksum is unchanged.
+*/
+int md5sum_restore_state(const char *z){
+  MD5Context ctx;
+  unsigned int a[6];
+  int nIn, i;
+  if( z==0 || strlen(z)<48 || !validate16(z, 48) ) return 1;
+  for(i=0; i<6; i++){
+    char zWord[9];
+    memcpy(zWord, &z[i*8], 8);
+    zWord[8] = 0;
+    a[i] = (unsigned int)strtoul(zWord, 0, 16);
+  }
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.isInit = 1;
+  for(i=0; i<4; i++) ctx.buf[i] = a[i];
+  ctx.bits[0] = a[4];
+  ctx.bits[1] = a[5];
+  nIn = (ctx.bits[0]>>3) & 0x3f;
+  if( (int)strlen(&z[48])!=nIn*2 || !validate16(&z[48], nIn*2) ) return 1;
+  decode16((const unsigned char*)&z[48], ctx.in, nIn*2);
+  incrCtx = ctx;
+  incrInit = 1;
+  return 0;
+}
+
 /*
 ** Finish the incremental MD5 checksum.  Store the result in blob pOut
 ** if pOut!=0.  Also return a pointer to the result.
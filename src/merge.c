@@ -216,19 +216,10 @@ static void merge_info_tcl(const char *zFName, int nContext, int diffMode){
       if( rid==0 && sz>0 ){
         /* The origin file had been edited so we'll have to pull its
         ** original content out of the undo buffer */
-        Stmt q2;
-        db_prepare(&q2, 
-          "SELECT content FROM undo"
-          " WHERE pathname=%Q AND octet_length(content)=%d",
-          zFN, sz
-        );
-        blob_zero(&v1);
-        if( db_step(&q2)==SQLITE_ROW ){
-          db_column_blob(&q2, 0, &v1);
-        }else{
+        if( !undo_get_content(zFN, &v1) || blob_size(&v1)!=sz ){
+          blob_reset(&v1);
           mb.zV1 = "(local content missing)";
         }
-        db_finalize(&q2);
       }else{
         /* The origin file was unchanged when the merge first occurred */
         content_get(rid, &v1);
@@ -1392,6 +1383,7 @@ merge_next_child:
       int nc = 0;
 
       if( useUndo ) undo_save(zName);
+      sparse_materialize(idv);
       zFullPath = mprintf("%s/%s", g.zLocalRoot, zName);
       sz = file_size(zFullPath, ExtFILE);
       content_get(ridp, &p);
@@ -1527,6 +1519,7 @@ merge_next_child:
     fossil_print("RENAME %s -> %s\n", zOldName, zNewName);
     if( useUndo ) undo_save(zOldName);
     if( useUndo ) undo_save(zNewName);
+    if( !dryRunFlag ) sparse_materialize(idv);
     db_multi_exec(
       "UPDATE mergestat SET fnr=fnm WHERE fnp=%Q",
       zOldName
@@ -979,6 +979,20 @@ void fossil_error_reset(void){
 */
 static int stdoutAtBOL = 1;
 
+/*
+** If not NULL, standard output is appended to this blob instead of
+** being written.
+*/
+static Blob *pStdoutCapture = 0;
+
+/*
+** Append all further standard output to pBlob rather than writing it,
+** or write it again if pBlob is NULL.
+*/
+void fossil_capture_stdout(Blob *pBlob){
+  pStdoutCapture = pBlob;
+}
+
 /*
 ** Write to standard output or standard error.
 **
@@ -993,7 +1007,13 @@ void fossil_puts(const char *z, int toStdErr, int n){
   FILE* out = (toStdErr ? stderr : stdout);
   if( n==0 ) return;
   assert( toStdErr==0 || toStdErr==1 );
-  if( toStdErr==0 ) stdoutAtBOL = (z[n-1]=='\n');
+  if( toStdErr==0 ){
+    stdoutAtBOL = (z[n-1]=='\n');
+    if( pStdoutCapture ){
+      blob_append(pStdoutCapture, z, n);
+      return;
+    }
+  }
 #if defined(_WIN32)
   if( fossil_utf8_to_console(z, n, toStdErr) >= 0 ){
     return;
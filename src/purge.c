@@ -195,6 +195,8 @@ int purge_artifact_list(
                 "    OR origid IN \"%w\"", zTab, zTab, zTab);
   db_multi_exec("DELETE FROM backlink WHERE srctype=0 AND srcid IN \"%w\"",
                 zTab);
+  manifest_mcache_remove(zTab);
+  annotation_cache_clear();
   db_multi_exec(
     "CREATE TEMP TABLE \"%w_tickets\" AS"
     " SELECT DISTINCT tkt_uuid FROM ticket WHERE tkt_id IN"
@@ -648,6 +650,7 @@ void purge_cmd(void){
       manifest_crosslink_begin();
       purge_item_resurrect(0, 0);
       manifest_crosslink_end(0);
+      annotation_cache_clear();
       db_multi_exec("DELETE FROM purgeevent WHERE peid=%d", peid);
       db_multi_exec("DELETE FROM purgeitem WHERE peid=%d", peid);
       db_end_transaction(0);
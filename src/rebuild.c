@@ -21,6 +21,9 @@
 #include "rebuild.h"
 #include <assert.h>
 #include <errno.h>
+#ifdef FOSSIL_HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 /*
 ** Update the schema as necessary
@@ -200,16 +203,38 @@ static int cchFNamePrefix;  /* Length of directory prefix in zFNameFormat */
 static const char *zDestDir;/* Destination directory on deconstruct */
 static int prefixLength;    /* Length of directory prefix for deconstruct */
 static int fKeepRid1;       /* Flag to preserve RID=1 on de- and reconstruct */
+static int nRebuildThread = 1; /* Worker threads for "rebuild --threads" */
+static int nCheckpoint = 0;    /* Delta trees per checkpoint.  0 for none */
+static int iResumeRoot = 0;    /* Resume after this delta-tree root */
+static time_t rebuildStart;    /* Time at which rebuild_db() started */
+static int processStart;       /* Value of processCnt at rebuildStart */
 
 
 /*
 ** Draw the percent-complete message.
 ** The input is actually the permill complete.
+**
+** Once the rebuild has been running for at least a second, the
+** message also shows the number of artifacts processed per second and
+** an estimate of the time remaining, or the total elapsed time once
+** the rebuild is complete.
 */
 static void percent_complete(int permill){
   static int lastOutput = -1;
   if( permill>lastOutput ){
-    fossil_print("  %d.%d%% complete...\r", permill/10, permill%10);
+    int nSec = (int)(time(0) - rebuildStart);
+    int nRate = nSec>0 ? (processCnt - processStart)/nSec : 0;
+    if( nRate<=0 ){
+      fossil_print("  %d.%d%% complete...\r", permill/10, permill%10);
+    }else{
+      if( permill<1000 ){
+        nSec = (totalSize - processCnt)/nRate;
+      }
+      fossil_print("  %d.%d%% complete, %d artifacts/sec, %s %d:%02d:%02d  \r",
+                   permill/10, permill%10, nRate,
+                   permill<1000 ? "ETA" : "elapsed",
+                   nSec/3600, (nSec/60)%60, nSec%60);
+    }
     fflush(stdout);
     lastOutput = permill;
   }
@@ -237,6 +262,101 @@ static void rebuild_step_done(int rid){
   }
 }
 
+/*
+** Prepare pStmt to return the RID and size of every artifact that is
+** the root of a delta tree and that has a RID greater than iAfter.
+** Roots are returned in RID order so that "rebuild --resume" can
+** continue where an earlier rebuild left off.
+*/
+static void rebuild_prepare_roots(Stmt *pStmt, int iAfter){
+  db_prepare(pStmt,
+     "SELECT rid, size FROM blob /*scan*/"
+     " WHERE rid>%d"
+     "   AND NOT EXISTS(SELECT 1 FROM shun WHERE uuid=blob.uuid)"
+     "   AND NOT EXISTS(SELECT 1 FROM delta WHERE rid=blob.rid)"
+     " ORDER BY rid", iAfter
+  );
+}
+
+/*
+** Commit the work of "rebuild --checkpoint" so far.  Every delta tree
+** with a root at or below iLastRoot has been crosslinked.  pStmt is the
+** scan of delta-tree roots.  It is finalized and then prepared again
+** after the commit, since a commit finalizes all statements.
+*/
+static void rebuild_checkpoint(Stmt *pStmt, int iLastRoot){
+  assert( db_transaction_nesting_depth()==2 );
+  db_finalize(pStmt);
+  manifest_crosslink_end(MC_NONE);
+  db_set_int("rebuild-checkpoint", iLastRoot, 0);
+  db_end_transaction(0);
+  db_begin_transaction();
+  manifest_crosslink_begin();
+  rebuild_prepare_roots(pStmt, iLastRoot);
+}
+
+/*
+** Fill pChildren with the RIDs of all artifacts that are deltas
+** against artifact rid and that have not already been rebuilt.
+*/
+static void rebuild_find_children(int rid, Bag *pChildren){
+  static Stmt q1;
+  int nChild, i;
+  const int *aChild;
+
+  bag_init(pChildren);
+  nChild = delta_map_children(rid, &aChild);
+  if( nChild>=0 ){
+    for(i=0; i<nChild; i++){
+      if( !bag_find(&bagDone, aChild[i]) ){
+        bag_insert(pChildren, aChild[i]);
+      }
+    }
+  }else{
+    db_static_prepare(&q1, "SELECT rid FROM delta WHERE srcid=:rid");
+    db_bind_int(&q1, ":rid", rid);
+    while( db_step(&q1)==SQLITE_ROW ){
+      int cid = db_column_int(&q1, 0);
+      if( !bag_find(&bagDone, cid) ){
+        bag_insert(pChildren, cid);
+      }
+    }
+    db_reset(&q1);
+  }
+}
+
+/*
+** Mark every artifact in the delta tree rooted at rid as done without
+** rebuilding it.  This is used by "rebuild --resume" for trees that
+** were finished before the last checkpoint.  Phantoms and their
+** descendants are left for the final pass of rebuild_db(), just as
+** rebuild_step() would.
+*/
+static void rebuild_skip_tree(int rid){
+  int *aStack;
+  int nStack = 0;
+  int nAlloc = 20;
+  aStack = fossil_malloc( nAlloc*sizeof(int) );
+  aStack[nStack++] = rid;
+  while( nStack>0 ){
+    Bag children;
+    int cid;
+    rid = aStack[--nStack];
+    if( db_int(-1, "SELECT size FROM blob WHERE rid=%d", rid)<0 ) continue;
+    rebuild_step_done(rid);
+    rebuild_find_children(rid, &children);
+    if( nStack+bag_count(&children)>nAlloc ){
+      nAlloc = nAlloc*2 + bag_count(&children);
+      aStack = fossil_realloc(aStack, nAlloc*sizeof(int));
+    }
+    for(cid=bag_first(&children); cid; cid=bag_next(&children,cid)){
+      aStack[nStack++] = cid;
+    }
+    bag_clear(&children);
+  }
+  fossil_free(aStack);
+}
+
 /*
 ** Rebuild cross-referencing information for the artifact
 ** rid with content pBase and all of its descendants.  This
@@ -254,7 +374,6 @@ static void rebuild_step_done(int rid){
 ** artifact content from the Fossil repository.
 */
 static void rebuild_step(int rid, int size, Blob *pBase){
-  static Stmt q1;
   Bag children;
   Blob copy;
   Blob *pUse;
@@ -270,17 +389,8 @@ static void rebuild_step(int rid, int size, Blob *pBase){
     }
 
     /* Find all children of artifact rid */
-    db_static_prepare(&q1, "SELECT rid FROM delta WHERE srcid=:rid");
-    db_bind_int(&q1, ":rid", rid);
-    bag_init(&children);
-    while( db_step(&q1)==SQLITE_ROW ){
-      int cid = db_column_int(&q1, 0);
-      if( !bag_find(&bagDone, cid) ){
-        bag_insert(&children, cid);
-      }
-    }
+    rebuild_find_children(rid, &children);
     nChild = bag_count(&children);
-    db_reset(&q1);
 
     /* Crosslink the artifact */
     if( nChild==0 ){
@@ -348,6 +458,425 @@ static void rebuild_step(int rid, int size, Blob *pBase){
   }
 }
 
+#ifdef FOSSIL_HAVE_PTHREAD
+/*
+** The "rebuild --threads N" command splits the work of rebuild_db()
+** between the main thread and N worker threads.  SQLite is compiled
+** without thread support, so all database access stays on the main
+** thread.  The main thread reads the compressed content of each delta
+** tree (a full-text artifact together with every artifact that is
+** directly or indirectly a delta against it) and hands the tree to a
+** worker.  The worker uncompresses the content, applies the deltas,
+** and checks each result against its hash.  The main thread then
+** crosslinks the trees in the same order that the single-threaded
+** rebuild would have used.
+**
+** Parallelism is across delta trees only.  A single very large tree,
+** such as a long chain of check-in manifests, is handled by a single
+** worker.
+**
+** Memory is bounded in two ways.  The main thread stops reading new
+** trees while REBUILD_QUEUE_BYTES of compressed content are queued.
+** And the main thread crosslinks each artifact of a tree as soon as the
+** worker has expanded it, rather than waiting for the whole tree, with
+** the worker pausing while more than REBUILD_PENDING_BYTES of expanded
+** artifacts are waiting for the main thread.
+*/
+#define REBUILD_QUEUE_BYTES    100000000
+#define REBUILD_PENDING_BYTES   20000000
+
+/*
+** One artifact in a delta tree.
+*/
+typedef struct RebuildNode RebuildNode;
+struct RebuildNode {
+  int rid;              /* Artifact ID */
+  int size;             /* Value of blob.size */
+  int iSrc;             /* Index of the delta source in aNode[].  -1 for root */
+  int nChild;           /* Children not yet expanded by the worker */
+  int nByte;            /* Size of the expanded content */
+  int eStatus;          /* One of the RNODE_* values below */
+  char *zUuid;          /* Expected hash of the artifact */
+  Blob raw;             /* Compressed content from blob.content */
+  Blob content;         /* Expanded content */
+  Blob xlink;           /* Content handed to the main thread to crosslink */
+};
+
+/*
+** Allowed values for RebuildNode.eStatus
+*/
+#define RNODE_OK        0   /* Good content.  Not a structural artifact */
+#define RNODE_XLINK     1   /* Good content.  Might be a structural artifact */
+#define RNODE_CORRUPT   2   /* Cannot uncompress or apply the delta */
+#define RNODE_BADHASH   3   /* Content does not match its hash */
+
+/*
+** A delta tree, with its nodes in the depth-first pre-order that
+** rebuild_step() would have used to visit them.
+*/
+typedef struct RebuildTree RebuildTree;
+struct RebuildTree {
+  int nNode;            /* Number of entries in aNode[] */
+  int nAlloc;           /* Allocated size of aNode[] */
+  RebuildNode *aNode;   /* The artifacts of this tree */
+  i64 nRaw;             /* Total size of the compressed content */
+  int nExpanded;        /* aNode[0..nExpanded-1] are expanded */
+  i64 nPending;         /* Bytes expanded but not yet crosslinked */
+  int isDone;           /* True after a worker has expanded this tree */
+  RebuildTree *pNext;   /* Next tree in the queue */
+};
+
+/*
+** The queue of delta trees shared between the main thread and the
+** workers.  All fields are protected by the mutex.
+*/
+static struct {
+  pthread_mutex_t mutex;     /* Mutex for this structure */
+  pthread_cond_t workCond;   /* Signaled when a tree is queued */
+  pthread_cond_t doneCond;   /* Signaled when a worker expands an artifact */
+  pthread_cond_t roomCond;   /* Signaled when the main thread crosslinks */
+  RebuildTree *pFirst;       /* Oldest tree not yet crosslinked */
+  RebuildTree *pLast;        /* Most recently queued tree */
+  RebuildTree *pTodo;        /* First tree not yet claimed by a worker */
+  int isShutdown;            /* True to make the workers exit */
+} rebuildQueue;
+
+/*
+** Read all artifacts of the delta tree rooted at rid into a new
+** RebuildTree object.  Return NULL if the root has no content.
+*/
+static RebuildTree *rebuild_read_tree(int rid){
+  static Stmt q;
+  RebuildTree *p;
+  int *aStack = 0;    /* Stack of (rid,iSrc) pairs still to be read */
+  int nStack = 0;     /* Number of integers on aStack[] */
+  int nStackAlloc = 0;
+
+  p = fossil_malloc( sizeof(*p) );
+  memset(p, 0, sizeof(*p));
+  nStackAlloc = 20;
+  aStack = fossil_malloc( nStackAlloc*sizeof(int) );
+  aStack[nStack++] = rid;
+  aStack[nStack++] = -1;
+  db_static_prepare(&q, "SELECT content, size, uuid FROM blob WHERE rid=:rid");
+  while( nStack>0 ){
+    RebuildNode *pNode;
+    Bag children;
+    int cid, i, n, iSrc;
+
+    iSrc = aStack[--nStack];
+    rid = aStack[--nStack];
+    db_bind_int(&q, ":rid", rid);
+    if( db_step(&q)!=SQLITE_ROW || db_column_int(&q, 1)<0 ){
+      db_reset(&q);
+      continue;
+    }
+    if( p->nNode>=p->nAlloc ){
+      p->nAlloc = p->nAlloc*2 + 10;
+      p->aNode = fossil_realloc(p->aNode, p->nAlloc*sizeof(p->aNode[0]));
+    }
+    pNode = &p->aNode[p->nNode];
+    memset(pNode, 0, sizeof(*pNode));
+    pNode->rid = rid;
+    pNode->size = db_column_int(&q, 1);
+    pNode->iSrc = iSrc;
+    pNode->zUuid = fossil_strdup(db_column_text(&q, 2));
+    blob_zero(&pNode->raw);
+    blob_zero(&pNode->content);
+    blob_zero(&pNode->xlink);
+    db_column_blob(&q, 0, &pNode->raw);
+    db_reset(&q);
+    p->nRaw += blob_size(&pNode->raw);
+    if( iSrc>=0 ) p->aNode[iSrc].nChild++;
+
+    /* Push children in reverse so that the first child is read next */
+    rebuild_find_children(rid, &children);
+    n = bag_count(&children);
+    if( nStack+2*n>nStackAlloc ){
+      nStackAlloc = nStackAlloc*2 + 2*n;
+      aStack = fossil_realloc(aStack, nStackAlloc*sizeof(int));
+    }
+    nStack += 2*n;
+    for(cid=bag_first(&children), i=1; cid; cid=bag_next(&children,cid), i++){
+      aStack[nStack-2*i] = cid;
+      aStack[nStack-2*i+1] = p->nNode;
+    }
+    bag_clear(&children);
+    p->nNode++;
+  }
+  fossil_free(aStack);
+  if( p->nNode==0 ){
+    fossil_free(p);
+    return 0;
+  }
+  return p;
+}
+
+/*
+** Reconstruct and verify the content of every artifact in tree p.
+** This routine runs in a worker thread and must not touch the database.
+**
+** Expanded content is freed as soon as all children have been computed
+** from it.  The content of artifacts that might be structural is
+** handed to the main thread in RebuildNode.xlink, for
+** manifest_crosslink().  If bWait is true, pause while too much of that
+** content is waiting for the main thread.
+*/
+static void rebuild_expand_tree(RebuildTree *p, int bWait){
+  int i;
+  for(i=0; i<p->nNode; i++){
+    RebuildNode *pNode = &p->aNode[i];
+    RebuildNode *pSrc = pNode->iSrc>=0 ? &p->aNode[pNode->iSrc] : 0;
+    Blob hash;
+
+    if( blob_uncompress(&pNode->raw, &pNode->raw) ){
+      pNode->eStatus = RNODE_CORRUPT;
+    }else if( pSrc==0 ){
+      pNode->content = pNode->raw;
+      blob_zero(&pNode->raw);
+    }else if( pSrc->eStatus==RNODE_CORRUPT
+           || blob_delta_apply(&pSrc->content, &pNode->raw,
+                               &pNode->content)<0 ){
+      pNode->eStatus = RNODE_CORRUPT;
+    }
+    blob_reset(&pNode->raw);
+    if( pNode->eStatus!=RNODE_CORRUPT ){
+      if( strlen(pNode->zUuid)==HNAME_LEN_SHA1 ){
+        sha1sum_blob(&pNode->content, &hash);
+      }else{
+        sha3sum_blob(&pNode->content, 256, &hash);
+      }
+      if( fossil_strcmp(blob_str(&hash), pNode->zUuid)!=0 ){
+        pNode->eStatus = RNODE_BADHASH;
+      }else if( manifest_might_be_artifact(blob_buffer(&pNode->content),
+                                           blob_size(&pNode->content)) ){
+        pNode->eStatus = RNODE_XLINK;
+      }
+      blob_reset(&hash);
+      pNode->nByte = blob_size(&pNode->content);
+    }
+    if( pNode->eStatus==RNODE_XLINK ){
+      if( pNode->nChild>0 ){
+        blob_copy(&pNode->xlink, &pNode->content);
+      }else{
+        pNode->xlink = pNode->content;
+        blob_zero(&pNode->content);
+      }
+    }
+    if( pNode->nChild==0 ){
+      blob_reset(&pNode->content);
+    }
+    if( pSrc && --pSrc->nChild==0 ){
+      blob_reset(&pSrc->content);
+    }
+    if( bWait ){
+      i64 nXlink = blob_size(&pNode->xlink);
+      pthread_mutex_lock(&rebuildQueue.mutex);
+      p->nExpanded = i+1;
+      p->nPending += nXlink;
+      pthread_cond_broadcast(&rebuildQueue.doneCond);
+      while( p->nPending>REBUILD_PENDING_BYTES ){
+        pthread_cond_wait(&rebuildQueue.roomCond, &rebuildQueue.mutex);
+      }
+      pthread_mutex_unlock(&rebuildQueue.mutex);
+    }else{
+      p->nExpanded = i+1;
+    }
+  }
+}
+
+/*
+** Crosslink the artifacts of tree p, which is being expanded by a
+** worker thread, or has already been expanded if bWait is false.  Then
+** free p.  Return the number of errors seen.
+*/
+static int rebuild_finish_tree(RebuildTree *p, int bWait){
+  int i;
+  int nErr = 0;
+  for(i=0; i<p->nNode; i++){
+    RebuildNode *pNode = &p->aNode[i];
+    i64 nPending;
+    if( bWait ){
+      pthread_mutex_lock(&rebuildQueue.mutex);
+      while( p->nExpanded<=i ){
+        pthread_cond_wait(&rebuildQueue.doneCond, &rebuildQueue.mutex);
+      }
+      pthread_mutex_unlock(&rebuildQueue.mutex);
+    }
+    nPending = blob_size(&pNode->xlink);
+    switch( pNode->eStatus ){
+      case RNODE_CORRUPT: {
+        fossil_warning("cannot reconstruct artifact %S (rid %d)",
+                       pNode->zUuid, pNode->rid);
+        nErr++;
+        break;
+      }
+      case RNODE_BADHASH: {
+        fossil_warning("hash mismatch on artifact %S (rid %d)",
+                       pNode->zUuid, pNode->rid);
+        nErr++;
+        break;
+      }
+      default: {
+        if( pNode->nByte!=pNode->size ){
+          db_multi_exec(
+             "UPDATE blob SET size=%d WHERE rid=%d", pNode->nByte, pNode->rid
+          );
+        }
+        if( pNode->eStatus==RNODE_XLINK ){
+          manifest_crosslink(pNode->rid, &pNode->xlink, MC_NONE);
+        }
+        break;
+      }
+    }
+    blob_reset(&pNode->xlink);
+    fossil_free(pNode->zUuid);
+    rebuild_step_done(pNode->rid);
+    if( bWait && nPending>0 ){
+      pthread_mutex_lock(&rebuildQueue.mutex);
+      p->nPending -= nPending;
+      pthread_cond_broadcast(&rebuildQueue.roomCond);
+      pthread_mutex_unlock(&rebuildQueue.mutex);
+    }
+  }
+  if( bWait ){
+    /* The worker might still hold the mutex to signal the last node */
+    pthread_mutex_lock(&rebuildQueue.mutex);
+    while( !p->isDone ){
+      pthread_cond_wait(&rebuildQueue.doneCond, &rebuildQueue.mutex);
+    }
+    pthread_mutex_unlock(&rebuildQueue.mutex);
+  }
+  fossil_free(p->aNode);
+  fossil_free(p);
+  return nErr;
+}
+
+/*
+** Body of each worker thread.
+*/
+static void *rebuild_worker(void *pNotUsed){
+  pthread_mutex_lock(&rebuildQueue.mutex);
+  for(;;){
+    RebuildTree *p;
+    while( rebuildQueue.pTodo==0 && !rebuildQueue.isShutdown ){
+      pthread_cond_wait(&rebuildQueue.workCond, &rebuildQueue.mutex);
+    }
+    if( (p = rebuildQueue.pTodo)==0 ) break;
+    rebuildQueue.pTodo = p->pNext;
+    pthread_mutex_unlock(&rebuildQueue.mutex);
+    rebuild_expand_tree(p, 1);
+    pthread_mutex_lock(&rebuildQueue.mutex);
+    p->isDone = 1;
+    pthread_cond_broadcast(&rebuildQueue.doneCond);
+  }
+  pthread_mutex_unlock(&rebuildQueue.mutex);
+  return 0;
+}
+
+/*
+** Crosslink the oldest queued tree as its artifacts are expanded.
+** Return the number of errors seen.  *pnRaw is reduced by the size of
+** the compressed content of that tree.
+*/
+static int rebuild_finish_oldest(i64 *pnRaw){
+  RebuildTree *p;
+  pthread_mutex_lock(&rebuildQueue.mutex);
+  p = rebuildQueue.pFirst;
+  rebuildQueue.pFirst = p->pNext;
+  if( rebuildQueue.pFirst==0 ) rebuildQueue.pLast = 0;
+  pthread_mutex_unlock(&rebuildQueue.mutex);
+  *pnRaw -= p->nRaw;
+  return rebuild_finish_tree(p, 1);
+}
+
+/*
+** Rebuild every delta tree whose root is returned by statement pStmt,
+** using nRebuildThread worker threads.  pStmt returns the rid and size
+** of each root.  Return the number of errors seen.
+*/
+static int rebuild_trees_parallel(Stmt *pStmt){
+  pthread_t *aThread;
+  int nThread = 0;       /* Number of worker threads actually started */
+  int nQueued = 0;       /* Trees queued but not yet crosslinked */
+  i64 nRaw = 0;          /* Compressed bytes in those trees */
+  int nTree = 0;         /* Trees read since the last checkpoint */
+  int nErr = 0;
+  int i;
+
+  /* blob_uncompress() might need the compression dictionary, which must
+  ** be read from the database before any worker starts. */
+  content_compress_dict();
+  memset(&rebuildQueue, 0, sizeof(rebuildQueue));
+  pthread_mutex_init(&rebuildQueue.mutex, 0);
+  pthread_cond_init(&rebuildQueue.workCond, 0);
+  pthread_cond_init(&rebuildQueue.doneCond, 0);
+  pthread_cond_init(&rebuildQueue.roomCond, 0);
+  aThread = fossil_malloc( nRebuildThread*sizeof(aThread[0]) );
+  for(i=0; i<nRebuildThread; i++){
+    if( pthread_create(&aThread[nThread], 0, rebuild_worker, 0)==0 ){
+      nThread++;
+    }
+  }
+  while( db_step(pStmt)==SQLITE_ROW ){
+    int rid = db_column_int(pStmt, 0);
+    RebuildTree *p;
+    if( db_column_int(pStmt, 1)<0 ) continue;
+    p = rebuild_read_tree(rid);
+    if( p==0 ){
+      /* No content.  Nothing to do */
+    }else if( nThread==0 ){
+      rebuild_expand_tree(p, 0);
+      nErr += rebuild_finish_tree(p, 0);
+    }else{
+      pthread_mutex_lock(&rebuildQueue.mutex);
+      if( rebuildQueue.pLast ){
+        rebuildQueue.pLast->pNext = p;
+      }else{
+        rebuildQueue.pFirst = p;
+      }
+      rebuildQueue.pLast = p;
+      if( rebuildQueue.pTodo==0 ) rebuildQueue.pTodo = p;
+      pthread_cond_signal(&rebuildQueue.workCond);
+      pthread_mutex_unlock(&rebuildQueue.mutex);
+      nQueued++;
+      nRaw += p->nRaw;
+
+      /* Bound the memory used by trees that are waiting to be crosslinked */
+      while( nQueued>=2*nThread || (nQueued>0 && nRaw>REBUILD_QUEUE_BYTES) ){
+        nErr += rebuild_finish_oldest(&nRaw);
+        nQueued--;
+      }
+    }
+    if( nCheckpoint>0 && ++nTree>=nCheckpoint && nErr==0 ){
+      while( nQueued>0 ){
+        nErr += rebuild_finish_oldest(&nRaw);
+        nQueued--;
+      }
+      if( nErr==0 ) rebuild_checkpoint(pStmt, rid);
+      nTree = 0;
+    }
+  }
+  while( nQueued>0 ){
+    nErr += rebuild_finish_oldest(&nRaw);
+    nQueued--;
+  }
+  pthread_mutex_lock(&rebuildQueue.mutex);
+  rebuildQueue.isShutdown = 1;
+  pthread_cond_broadcast(&rebuildQueue.workCond);
+  pthread_mutex_unlock(&rebuildQueue.mutex);
+  for(i=0; i<nThread; i++){
+    pthread_join(aThread[i], 0);
+  }
+  fossil_free(aThread);
+  pthread_cond_destroy(&rebuildQueue.roomCond);
+  pthread_cond_destroy(&rebuildQueue.doneCond);
+  pthread_cond_destroy(&rebuildQueue.workCond);
+  pthread_mutex_destroy(&rebuildQueue.mutex);
+  return nErr;
+}
+#endif /* FOSSIL_HAVE_PTHREAD */
+
 /*
 ** Check to see if the "sym-trunk" tag exists.  If not, create it
 ** and attach it to the very first check-in.
@@ -381,11 +910,14 @@ int rebuild_db(int doOut, int doClustering){
   Stmt s, q;
   int errCnt = 0;
   int incrSize;
+  int nTree = 0;
   Blob sql;
 
   bag_clear(&bagDone);
   ttyOutput = doOut;
   processCnt = 0;
+  processStart = 0;
+  rebuildStart = time(0);
   if (ttyOutput && !g.fQuiet) {
     percent_complete(0);
   }
@@ -393,6 +925,11 @@ int rebuild_db(int doOut, int doClustering){
   rebuild_update_schema();
   blob_init(&sql, 0, 0);
   db_unprotect(PROTECT_ALL);
+  if( iResumeRoot>0 ){
+    /* The derived tables were already reset by the interrupted rebuild,
+    ** and everything up to the last checkpoint has been committed. */
+    goto rebuild_resume;
+  }
 #ifndef SQLITE_PREPARE_DONT_LOG
   g.dbIgnoreErrors++;
 #endif
@@ -416,6 +953,7 @@ int rebuild_db(int doOut, int doClustering){
 #endif
   db_multi_exec("%s", blob_str(&sql)/*safe-for-%s*/);
   blob_reset(&sql);
+  manifest_mcache_reset();
   db_multi_exec("%s", zRepositorySchema2/*safe-for-%s*/);
   ticket_create_table(0);
   shun_artifacts();
@@ -435,18 +973,29 @@ int rebuild_db(int doOut, int doClustering){
     "UPDATE user SET mtime=strftime('%%s','now') WHERE mtime IS NULL"
   );
 
+rebuild_resume:
   /* The following should be count(*) instead of max(rid). max(rid) is
   ** an adequate approximation, however, and is much faster for large
   ** repositories. */
   totalSize = db_int(0, "SELECT max(rid) FROM blob");
   incrSize = totalSize/100;
   totalSize += incrSize*2;
-  db_prepare(&s,
-     "SELECT rid, size FROM blob /*scan*/"
-     " WHERE NOT EXISTS(SELECT 1 FROM shun WHERE uuid=blob.uuid)"
-     "   AND NOT EXISTS(SELECT 1 FROM delta WHERE rid=blob.rid)"
-  );
+  delta_map_load();
+  if( iResumeRoot>0 ){
+    rebuild_prepare_roots(&s, 0);
+    while( db_step(&s)==SQLITE_ROW && db_column_int(&s,0)<=iResumeRoot ){
+      rebuild_skip_tree(db_column_int(&s, 0));
+    }
+    db_finalize(&s);
+    processStart = processCnt;
+  }
+  rebuild_prepare_roots(&s, iResumeRoot);
   manifest_crosslink_begin();
+#ifdef FOSSIL_HAVE_PTHREAD
+  if( nRebuildThread>1 && zFNameFormat==0 ){
+    errCnt += rebuild_trees_parallel(&s);
+  }else
+#endif
   while( db_step(&s)==SQLITE_ROW ){
     int rid = db_column_int(&s, 0);
     int size = db_column_int(&s, 1);
@@ -455,6 +1004,10 @@ int rebuild_db(int doOut, int doClustering){
       content_get(rid, &content);
       rebuild_step(rid, size, &content);
     }
+    if( nCheckpoint>0 && ++nTree>=nCheckpoint ){
+      rebuild_checkpoint(&s, rid);
+      nTree = 0;
+    }
   }
   db_finalize(&s);
   db_prepare(&s,
@@ -605,10 +1158,381 @@ static void reconstruct_private_table(void){
   fix_private_blob_dependencies(0);
 }
 
+/*
+** Compute the length of the delta chain for every artifact in the
+** repository.  Return an array indexed by rid, obtained from
+** fossil_malloc(), and write the number of entries into *pnRid.
+*/
+static int *delta_chain_depths(int *pnRid){
+  int nRid = db_int(0, "SELECT max(rid) FROM blob") + 1;
+  int *aDepth = fossil_malloc(nRid*sizeof(int));
+  int *aStack = 0;
+  int nStack, nAlloc = 0;
+  int rid;
+  memset(aDepth, 0xff, nRid*sizeof(int));
+  aDepth[0] = 0;
+  for(rid=1; rid<nRid; rid++){
+    int r = rid;
+    int d;
+    nStack = 0;
+    while( r>0 && r<nRid && aDepth[r]<0 ){
+      if( nStack>=nAlloc ){
+        if( nStack>=nRid ) fossil_panic("delta-loop in repository");
+        nAlloc = nAlloc*2 + 100;
+        aStack = fossil_realloc(aStack, nAlloc*sizeof(int));
+      }
+      aStack[nStack++] = r;
+      r = delta_source_rid(r);
+    }
+    d = (r>0 && r<nRid) ? aDepth[r] : -1;
+    while( nStack>0 ){
+      aDepth[aStack[--nStack]] = ++d;
+    }
+  }
+  fossil_free(aStack);
+  *pnRid = nRid;
+  return aDepth;
+}
+
+/*
+** Show the distribution of the delta chain lengths in aDepth[].
+*/
+static void show_chain_depths(const char *zLabel, const int *aDepth, int nRid){
+  static const int aLimit[] = { 0, 9, 24, 49, 99, 249, 499, 0x7fffffff };
+  int anCnt[count(aLimit)];
+  int i, j, mx = 0, n = 0;
+  i64 sum = 0;
+  memset(anCnt, 0, sizeof(anCnt));
+  for(i=1; i<nRid; i++){
+    if( aDepth[i]<0 ) continue;
+    for(j=0; aDepth[i]>aLimit[j]; j++){}
+    anCnt[j]++;
+    sum += aDepth[i];
+    n++;
+    if( aDepth[i]>mx ) mx = aDepth[i];
+  }
+  fossil_print("Delta chain lengths %s: max %d, average %.1f\n",
+               zLabel, mx, n ? (double)sum/n : 0.0);
+  for(j=0; j<count(aLimit); j++){
+    char zRange[30];
+    if( anCnt[j]==0 ) continue;
+    if( j==0 ){
+      sqlite3_snprintf(sizeof(zRange), zRange, "0 (full text)");
+    }else if( j==count(aLimit)-1 ){
+      sqlite3_snprintf(sizeof(zRange), zRange, "%d or more", aLimit[j-1]+1);
+    }else{
+      sqlite3_snprintf(sizeof(zRange), zRange, "%d-%d",
+                       aLimit[j-1]+1, aLimit[j]);
+    }
+    fossil_print("  %-16s %,9d\n", zRange, anCnt[j]);
+  }
+}
+
+/*
+** Rewrite delta chains that are longer than mxChain links.
+**
+** Artifacts are visited in breadth-first order down each delta tree.
+** An artifact that would end up more than mxChain links from the
+** full-text root of its tree is recomputed as a delta against one of
+** a ladder of its ancestors (those at depths mxChain-1, (mxChain-1)/2,
+** (mxChain-1)/4, ..., 0 on its current path), whichever gives the
+** smallest delta.  If none of those gives a useful delta, the artifact
+** is stored as full text and starts a new tree.
+*/
+static void rebalance_delta_chains(int mxChain){
+  int *aDepth;          /* Chain length for each rid */
+  int *aOrder;          /* Deltas in breadth-first order */
+  int nOrder = 0;
+  int nRid, i, j;
+  int nRepoint = 0;     /* Number of artifacts given a new delta source */
+  int nFull = 0;        /* Number of artifacts converted to full text */
+  int nCand;
+  int aCand[32];
+
+  delta_map_load();
+  aDepth = delta_chain_depths(&nRid);
+  show_chain_depths("before", aDepth, nRid);
+  aOrder = fossil_malloc(nRid*sizeof(int));
+  for(i=1; i<nRid; i++){
+    if( aDepth[i]!=0 ) continue;
+    j = nOrder;
+    aOrder[nOrder++] = i;
+    for(; j<nOrder; j++){
+      const int *aChild;
+      int k, nChild = delta_map_children(aOrder[j], &aChild);
+      for(k=0; k<nChild; k++) aOrder[nOrder++] = aChild[k];
+    }
+  }
+  db_begin_transaction();
+  for(i=0; i<nOrder; i++){
+    int rid = aOrder[i];
+    int pid = delta_source_rid(rid);
+    int d, a;
+    if( pid==0 ){
+      aDepth[rid] = 0;
+      continue;
+    }
+    d = aDepth[pid] + 1;
+    if( d<=mxChain ){
+      aDepth[rid] = d;
+      continue;
+    }
+    nCand = 0;
+    for(a=pid; a>0 && nCand<count(aCand); a=delta_source_rid(a)){
+      int t = mxChain - 1;
+      while( t>0 && t!=aDepth[a] ) t /= 2;
+      if( t==aDepth[a] ) aCand[nCand++] = a;
+    }
+    if( nCand>0 ) content_deltify(rid, aCand, nCand, 1);
+    if( (a = delta_source_rid(rid))!=pid ){
+      aDepth[rid] = a ? aDepth[a]+1 : 0;
+      nRepoint++;
+    }else{
+      content_undelta(rid);
+      aDepth[rid] = delta_source_rid(rid)==0 ? 0 : d;
+      nFull++;
+    }
+  }
+  db_end_transaction(0);
+  fossil_free(aOrder);
+  fossil_free(aDepth);
+  fossil_print("%,d artifacts given a closer delta source, "
+               "%,d converted to full text\n", nRepoint, nFull);
+  aDepth = delta_chain_depths(&nRid);
+  show_chain_depths("after", aDepth, nRid);
+  fossil_free(aDepth);
+}
+
+/*
+** Add the pieces of text in p to the dictpiece table, for training the
+** compression dictionary, and append them to pText.  Text is split
+** around runs of 16 or more hexadecimal digits, as hashes are not worth
+** putting in the dictionary.
+*/
+static void compress_dict_add_piece(
+  Stmt *pIns,
+  Blob *pText,
+  const char *z,
+  int n
+){
+  Blob piece;
+  if( n<=0 ) return;
+  blob_append(pText, z, n);
+  if( n<4 || n>256 ) return;
+  blob_init(&piece, z, n);
+  db_bind_blob(pIns, ":p", &piece);
+  db_step(pIns);
+  db_reset(pIns);
+}
+static void compress_dict_add_pieces(Blob *p, Stmt *pIns, Blob *pText){
+  const char *z = blob_buffer(p);
+  int n = blob_size(p);
+  int i = 0, j, iStart = 0;
+  while( i<n ){
+    for(j=i; j<n && (fossil_isdigit(z[j]) || (z[j]>='a' && z[j]<='f')); j++){}
+    if( j-i>=16 ){
+      compress_dict_add_piece(pIns, pText, &z[iStart], i-iStart);
+      iStart = i = j;
+    }else{
+      i = j>i ? j : i+1;
+    }
+  }
+  compress_dict_add_piece(pIns, pText, &z[iStart], n-iStart);
+}
+
+/*
+** Train a compression dictionary of at most 32KB (the largest that zlib
+** can use) from small full-text artifacts in the repository.
+**
+** The end of the dictionary, where zlib can reach it with the shortest
+** distance codes, holds text that occurs in more than one artifact, most
+** valuable last.  The rest is filled with the text of the most recent
+** artifacts, less their hashes, as typical examples.
+*/
+static void compress_dict_train(int mxSize, Blob *pDict){
+  Stmt q, ins;
+  int nSample = 0;
+  Blob aText[100];     /* Text of the most recent artifacts */
+  int nText = 0;       /* Number of entries in aText[] */
+  int nTextByte = 0;   /* Total size of aText[] */
+  Blob pieces;         /* Frequent text */
+  Blob junk;
+  int i;
+  db_multi_exec(
+    "CREATE TEMP TABLE dictpiece(p BLOB PRIMARY KEY, n INT) WITHOUT ROWID;"
+  );
+  db_prepare(&ins,
+    "INSERT INTO dictpiece VALUES(:p,1)"
+    " ON CONFLICT(p) DO UPDATE SET n=n+1"
+  );
+  db_prepare(&q,
+    "SELECT rid FROM blob"
+    " WHERE size>=0 AND size<%d"
+    "   AND rid NOT IN (SELECT rid FROM delta) AND rid NOT IN private"
+    " ORDER BY rid DESC LIMIT 5000", mxSize
+  );
+  blob_zero(&junk);
+  while( db_step(&q)==SQLITE_ROW ){
+    Blob content;
+    if( content_get(db_column_int(&q, 0), &content) ){
+      if( nTextByte<32768 && nText<count(aText) ){
+        blob_zero(&aText[nText]);
+        compress_dict_add_pieces(&content, &ins, &aText[nText]);
+        nTextByte += blob_size(&aText[nText++]);
+      }else{
+        compress_dict_add_pieces(&content, &ins, &junk);
+        blob_reset(&junk);
+      }
+      nSample++;
+    }
+    blob_reset(&content);
+  }
+  db_finalize(&q);
+  db_finalize(&ins);
+  blob_zero(&pieces);
+  db_prepare(&q,
+    "SELECT p FROM ("
+    "  SELECT p, n*length(p) AS w,"
+    "         sum(length(p)) OVER (ORDER BY n*length(p) DESC, p) AS tot"
+    "    FROM dictpiece WHERE n>1"
+    ") WHERE tot<=32768 ORDER BY w, p DESC"
+  );
+  while( db_step(&q)==SQLITE_ROW ){
+    blob_append(&pieces, db_column_raw(&q, 0), db_column_bytes(&q, 0));
+  }
+  db_finalize(&q);
+  db_multi_exec("DROP TABLE dictpiece");
+
+  /* Fill the space in front of the frequent text with whole examples,
+  ** oldest first */
+  blob_zero(pDict);
+  nTextByte = 32768 - blob_size(&pieces);
+  for(i=0; i<nText && (int)blob_size(&aText[i])<=nTextByte; i++){
+    nTextByte -= blob_size(&aText[i]);
+  }
+  while( i>0 ){
+    i--;
+    blob_append(pDict, blob_buffer(&aText[i]), blob_size(&aText[i]));
+  }
+  blob_append(pDict, blob_buffer(&pieces), blob_size(&pieces));
+  for(i=0; i<nText; i++) blob_reset(&aText[i]);
+  blob_reset(&pieces);
+  fossil_print("Trained a %,d-byte compression dictionary from %,d artifacts\n",
+               blob_size(pDict), nSample);
+}
+
+/*
+** Recompress the content of BLOB table rows smaller than mxSize bytes
+** using the compression dictionary of the repository if bUseDict is
+** true.  If bUseDict is false, recompress everything that uses the
+** dictionary without it, both in the BLOB table and in the graveyard.
+**
+** Report the change in size and the time needed to uncompress the
+** content before and after.
+*/
+static void compress_dict_convert(int bUseDict, int mxSize){
+  Stmt q;
+  int i, iTimer;
+  sqlite3_uint64 nUsecOld = 0, nUsecNew = 0;
+  int nRow;
+  i64 nOld, nNew;
+  db_multi_exec(
+    "CREATE TEMP TABLE dictconv("
+    "  tab INT, id INT, oldc BLOB, newc BLOB, PRIMARY KEY(tab,id)"
+    ") WITHOUT ROWID;"
+  );
+  if( bUseDict ){
+    db_prepare(&q,
+      "SELECT 0, rid, content FROM blob"
+      " WHERE size>=0 AND content<x'80' AND length(content)<%d", mxSize
+    );
+  }else if( db_table_exists("repository", "purgeitem") ){
+    db_prepare(&q,
+      "SELECT 0, rid, content FROM blob WHERE size>=0 AND content>=x'80'"
+      " UNION ALL "
+      "SELECT 1, piid, data FROM purgeitem WHERE data>=x'80'"
+    );
+  }else{
+    db_prepare(&q,
+      "SELECT 0, rid, content FROM blob WHERE size>=0 AND content>=x'80'"
+    );
+  }
+  while( db_step(&q)==SQLITE_ROW ){
+    Blob oldc, x, newc;
+    Stmt ins;
+    db_ephemeral_blob(&q, 2, &oldc);
+    if( blob_uncompress(&oldc, &x) ) continue;
+    if( bUseDict ){
+      if( (int)blob_size(&x)>=mxSize ){
+        blob_reset(&x);
+        continue;
+      }
+      blob_compress_dict(&x, &newc, content_compress_dict());
+      if( blob_size(&newc)>=blob_size(&oldc) ){
+        blob_reset(&newc);
+        continue;
+      }
+    }else{
+      blob_compress(&x, &newc);
+    }
+    db_prepare(&ins, "INSERT INTO dictconv VALUES(%d,%d,:old,:new)",
+               db_column_int(&q, 0), db_column_int(&q, 1));
+    db_bind_blob(&ins, ":old", &oldc);
+    db_bind_blob(&ins, ":new", &newc);
+    db_step(&ins);
+    db_finalize(&ins);
+    blob_reset(&newc);
+  }
+  db_finalize(&q);
+
+  /* Time how long it takes to uncompress the old and the new content */
+  for(i=0; i<6; i++){
+    db_prepare(&q, "SELECT %s FROM dictconv", i%2 ? "newc" : "oldc");
+    iTimer = fossil_timer_start();
+    while( db_step(&q)==SQLITE_ROW ){
+      Blob c, x;
+      db_ephemeral_blob(&q, 0, &c);
+      blob_uncompress(&c, &x);
+      blob_reset(&x);
+    }
+    if( i%2 ){
+      nUsecNew += fossil_timer_stop(iTimer);
+    }else{
+      nUsecOld += fossil_timer_stop(iTimer);
+    }
+    db_finalize(&q);
+  }
+
+  db_multi_exec(
+    "UPDATE blob SET content=(SELECT newc FROM dictconv WHERE tab=0 AND id=rid)"
+    " WHERE rid IN (SELECT id FROM dictconv WHERE tab=0);"
+  );
+  if( db_exists("SELECT 1 FROM dictconv WHERE tab=1") ){
+    db_multi_exec(
+      "UPDATE purgeitem SET data=(SELECT newc FROM dictconv"
+      "                            WHERE tab=1 AND id=piid)"
+      " WHERE piid IN (SELECT id FROM dictconv WHERE tab=1);"
+    );
+  }
+  nRow = db_int(0, "SELECT count(*) FROM dictconv");
+  nOld = db_int64(0, "SELECT sum(length(oldc)) FROM dictconv");
+  nNew = db_int64(0, "SELECT sum(length(newc)) FROM dictconv");
+  db_multi_exec("DROP TABLE dictconv");
+  fossil_print("%,d artifacts recompressed %s the dictionary: "
+               "%,lld bytes became %,lld bytes (%+.1f%%)\n",
+               nRow, bUseDict ? "with" : "without", nOld, nNew,
+               nOld ? 100.0*(nNew-nOld)/nOld : 0.0);
+  if( nRow>0 ){
+    fossil_print("Time to uncompress each: %.2f microseconds before, "
+                 "%.2f after\n",
+                 nUsecOld/(3.0*nRow), nUsecNew/(3.0*nRow));
+  }
+}
+
 /*
 ** COMMAND: repack
 **
-** Usage: %fossil repack ?REPOSITORY?
+** Usage: %fossil repack ?REPOSITORY? ?OPTIONS?
 **
 ** Perform extra delta-compression to try to minimize the size of the
 ** repository.  This command is simply a short-hand for:
@@ -617,12 +1541,41 @@ static void reconstruct_private_table(void){
 **
 ** The name for this command is stolen from the "git repack" command that
 ** does approximately the same thing in Git.
+**
+** Options:
+**   --rebalance       Also rewrite delta chains that are longer than
+**                     the limit so that no artifact needs more than that
+**                     many delta applications to be reconstructed.
+**                     Show the distribution of chain lengths before and
+**                     after.
+**   --max-chain N     The limit for --rebalance.  The default is the
+**                     "max-delta-chain" setting, or 50 if that setting
+**                     is not a positive number.
+**   --dictionary      Recompress artifacts and deltas that are smaller
+**                     than the "compress-dictionary" setting using a
+**                     zlib preset dictionary.  Train the dictionary
+**                     first if the repository does not have one yet.
+**                     If the setting is not a positive number, set it
+**                     to 4096.
+**   --no-dictionary   Recompress everything that uses the preset
+**                     dictionary without it, delete the dictionary, and
+**                     set "compress-dictionary" to 0.  Do this before
+**                     using the repository with older versions of
+**                     Fossil.
 */
 void repack_command(void){
   i64 nByte = 0;
   int nDelta = 0;
   int runVacuum = 0;
+  int bRebalance = find_option("rebalance",0,0)!=0;
+  const char *zMaxChain = find_option("max-chain",0,1);
+  int bDict = find_option("dictionary",0,0)!=0;
+  int bNoDict = find_option("no-dictionary",0,0)!=0;
+  int mxChain;
   verify_all_options();
+  if( bDict && bNoDict ){
+    fossil_fatal("--dictionary and --no-dictionary are mutually exclusive");
+  }
   if( g.argc==3 ){
     db_open_repository(g.argv[2]);
   }else if( g.argc==2 ){
@@ -636,6 +1589,7 @@ void repack_command(void){
     usage("?REPOSITORY-FILENAME?");
   }
   db_unprotect(PROTECT_ALL);
+  delta_map_load();
   nByte = extra_deltification(&nDelta);
   if( nDelta>0 ){
     if( nDelta==1 ){
@@ -648,6 +1602,50 @@ void repack_command(void){
     fossil_print("no new compression opportunities found\n");
     runVacuum = db_int(0, "PRAGMA repository.freelist_count")>0;
   }
+  if( bRebalance ){
+    mxChain = zMaxChain ? atoi(zMaxChain) : db_get_int("max-delta-chain", 0);
+    if( mxChain<=0 ) mxChain = 50;
+    rebalance_delta_chains(mxChain);
+    runVacuum = 1;
+  }
+  if( bDict ){
+    int mxSize = db_get_int("compress-dictionary", 0);
+    db_begin_transaction();
+    if( mxSize<=0 ){
+      mxSize = 4096;
+      db_set_int("compress-dictionary", mxSize, 0);
+    }
+    if( content_compress_dict()==0 ){
+      Blob dict;
+      Stmt ins;
+      compress_dict_train(mxSize, &dict);
+      db_prepare(&ins,
+        "REPLACE INTO config(name,value,mtime)"
+        " VALUES('compress-dict',:dict,now())"
+      );
+      db_bind_blob(&ins, ":dict", &dict);
+      db_exec(&ins);
+      db_finalize(&ins);
+      blob_reset(&dict);
+      content_compress_dict_reset();
+    }
+    if( content_compress_dict() ){
+      compress_dict_convert(1, mxSize);
+    }
+    db_end_transaction(0);
+    runVacuum = 1;
+  }
+  if( bNoDict ){
+    db_begin_transaction();
+    if( content_compress_dict() ){
+      compress_dict_convert(0, 0);
+    }
+    db_multi_exec("DELETE FROM config WHERE name='compress-dict'");
+    db_set_int("compress-dictionary", 0, 0);
+    content_compress_dict_reset();
+    db_end_transaction(0);
+    runVacuum = 1;
+  }
   if( runVacuum ){
     fossil_print("Vacuuming the database... "); fflush(stdout);
     db_multi_exec("VACUUM");
@@ -667,6 +1665,10 @@ void repack_command(void){
 **
 ** Options:
 **   --analyze         Run ANALYZE on the database after rebuilding
+**   --checkpoint N    Commit progress after every N delta trees so that
+**                     an interrupted rebuild can be continued using
+**                     --resume.  The repository is not usable until the
+**                     rebuild finishes.
 **   --cluster         Compute clusters for unclustered artifacts
 **   --compress        Strive to make the database as small as possible
 **   --compress-only   Skip the rebuilding step. Do --compress only
@@ -677,7 +1679,13 @@ void repack_command(void){
 **   --noindex         Always omit the full-text search index
 **   --pagesize N      Set the database pagesize to N (512..65536, power of 2)
 **   --quiet           Only show output if there are errors
+**   --resume          Continue a rebuild that was interrupted after one
+**                     or more checkpoints.  Implies --checkpoint 1000
+**                     unless some other --checkpoint is given.
 **   --stats           Show artifact statistics after rebuilding
+**   --threads N       Reconstruct artifact content using N worker threads.
+**                     Content hashes are verified as well.  Not available
+**                     on all platforms.
 **   --vacuum          Run VACUUM on the database after rebuilding
 **   --wal             Set Write-Ahead-Log journalling mode on the database
 */
@@ -687,6 +1695,8 @@ void rebuild_database(void){
   int omitVerify;
   int doClustering;
   const char *zPagesize;
+  const char *zThreads;
+  const char *zCheckpoint;
   int newPagesize = 0;
   int activateWal;
   int runVacuum;
@@ -699,6 +1709,8 @@ void rebuild_database(void){
   int optIndex;
   int optIfNeeded;
   int compressOnlyFlag;
+  int resumeFlag;
+  int iCheckpoint;
 
   omitVerify = find_option("noverify",0,0)!=0;
   forceFlag = find_option("force","f",0)!=0;
@@ -713,7 +1725,24 @@ void rebuild_database(void){
   optNoIndex = find_option("noindex",0,0)!=0;
   optIfNeeded = find_option("ifneeded",0,0)!=0;
   compressOnlyFlag = find_option("compress-only",0,0)!=0;
+  zThreads = find_option("threads",0,1);
+  zCheckpoint = find_option("checkpoint",0,1);
+  resumeFlag = find_option("resume",0,0)!=0;
   if( compressOnlyFlag ) runCompress = 1;
+  if( zCheckpoint ){
+    nCheckpoint = atoi(zCheckpoint);
+    if( nCheckpoint<1 ){
+      fossil_fatal("the checkpoint interval must be a positive integer");
+    }
+  }else if( resumeFlag ){
+    nCheckpoint = 1000;
+  }
+  if( zThreads ){
+    nRebuildThread = atoi(zThreads);
+    if( nRebuildThread<1 || nRebuildThread>256 ){
+      fossil_fatal("the number of threads must be between 1 and 256");
+    }
+  }
   if( zPagesize ){
     newPagesize = atoi(zPagesize);
     if( newPagesize<512 || newPagesize>65536
@@ -736,7 +1765,13 @@ void rebuild_database(void){
   runReindex = search_index_exists() && !compressOnlyFlag;
   if( optIndex ) runReindex = 1;
   if( optNoIndex ) runReindex = 0;
-  if( optIfNeeded && fossil_strcmp(db_get("aux-schema",""),AUX_SCHEMA_MAX)==0 ){
+  if( resumeFlag ){
+    iResumeRoot = db_get_int("rebuild-checkpoint", 0);
+    if( iResumeRoot<=0 ){
+      fossil_fatal("there is no interrupted rebuild to resume");
+    }
+  }else if( optIfNeeded
+         && fossil_strcmp(db_get("aux-schema",""),AUX_SCHEMA_MAX)==0 ){
     return;
   }
 
@@ -751,17 +1786,26 @@ void rebuild_database(void){
     errCnt = rebuild_db(1, doClustering);
     reconstruct_private_table();
   }
+  iCheckpoint = db_get_int("rebuild-checkpoint", 0);
   db_multi_exec(
+    "DELETE FROM config WHERE name='rebuild-checkpoint';"
     "REPLACE INTO config(name,value,mtime) VALUES('content-schema',%Q,now());"
     "REPLACE INTO config(name,value,mtime) VALUES('aux-schema',%Q,now());"
     "REPLACE INTO config(name,value,mtime) VALUES('rebuilt',%Q,now());",
     CONTENT_SCHEMA, AUX_SCHEMA_MAX, get_version()
   );
   if( errCnt && !forceFlag ){
-    fossil_print(
-      "%d errors. Rolling back changes. Use --force to force a commit.\n",
-      errCnt
-    );
+    if( iCheckpoint>0 ){
+      fossil_print(
+        "%d errors. Rolling back to the last checkpoint. "
+        "Use --resume --force to force a commit.\n", errCnt
+      );
+    }else{
+      fossil_print(
+        "%d errors. Rolling back changes. Use --force to force a commit.\n",
+        errCnt
+      );
+    }
     db_end_transaction(1);
   }else{
     if( runCompress ){
@@ -1500,6 +2544,7 @@ void deconstruct_cmd(void){
      "   AND NOT EXISTS(SELECT 1 FROM delta WHERE rid=blob.rid) %s",
      privateFlag==0 ? "AND rid NOT IN private" : ""
   );
+  delta_map_load();
   while( db_step(&s)==SQLITE_ROW ){
     int rid = db_column_int(&s, 0);
     int size = db_column_int(&s, 1);
@@ -574,6 +574,8 @@ const char zLocalSchema[] =
 @   pathname TEXT,                    -- Full pathname relative to root
 @   origname TEXT,                    -- Original pathname. NULL if unchanged
 @   mhash TEXT,                       -- Hash of mrid iff mrid!=rid
+@   fstat TEXT,                       -- Stat signature when equal to mrid
+@   cksum TEXT,                       -- Aggregate checksum state after file
 @   UNIQUE(pathname,vid)
 @ );
 @
@@ -639,3 +641,47 @@ void schema_forum(void){
     db_multi_exec("%s",zForumSchema/*safe-for-%s*/);
   }
 }
+
+/*
+** The following table holds the origin of each line of file versions
+** that have been annotated, when the annotation-cache setting is on.
+** It holds only derived data.  It is created on-demand by the
+** annotate and blame commands, and dropped by "fossil rebuild".
+*/
+static const char zAnnCacheSchema[] =
+@ CREATE TABLE repository.anncache(
+@   mid INTEGER,               -- Check-in in which the file version appears
+@   fid INTEGER,               -- The file version
+@   flags INTEGER,             -- Flags that alter the annotation
+@   origin BLOB,               -- Compressed origin of each line
+@   PRIMARY KEY(mid,fid,flags)
+@ ) WITHOUT ROWID;
+;
+
+/* Create the annotation cache schema if it does not already exist */
+void schema_anncache(void){
+  if( !db_table_exists("repository","anncache") ){
+    db_multi_exec("%s",zAnnCacheSchema/*safe-for-%s*/);
+  }
+}
+
+/*
+** The following table holds check-in manifests in parsed form, when the
+** manifest-cache setting is greater than zero.  It holds only derived
+** data.  It is created on-demand as manifests are saved in it, and
+** "fossil rebuild" drops and refills it.
+*/
+static const char zMcacheSchema[] =
+@ CREATE TABLE repository.mcache(
+@   rid INTEGER PRIMARY KEY,   -- The manifest artifact
+@   uuid TEXT,                 -- Hash of the artifact
+@   data BLOB                  -- Compressed serialization of the Manifest
+@ );
+;
+
+/* Create the manifest cache schema if it does not already exist */
+void schema_mcache(void){
+  if( !db_table_exists("repository","mcache") ){
+    db_multi_exec("%s",zMcacheSchema/*safe-for-%s*/);
+  }
+}
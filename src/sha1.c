@@ -333,6 +333,7 @@ char *sha1sum_finish(Blob *pOut){
 /*
 ** Compute the SHA1 checksum of a file on disk.  Store the resulting
 ** checksum in the blob pCksum.  pCksum is assumed to be initialized.
+** This routine is safe to call from worker threads.
 **
 ** Return the number of errors.
 */
@@ -341,8 +342,10 @@ int sha1sum_file(const char *zFilename, int eFType, Blob *pCksum){
   SHA1Context ctx;
   unsigned char zResult[20];
   char zBuf[10240];
+  int perm;
 
-  if( eFType==RepoFILE && file_islink(zFilename) ){
+  if( eFType==RepoFILE && file_stat_r(zFilename, RepoFILE, 0, 0, &perm, 0)==0
+   && perm==PERM_LNK ){
     /* Instead of file content, return sha1 of link destination path */
     Blob destinationPath;
     int rc;
@@ -544,6 +544,7 @@ char *sha3sum_finish(Blob *pOut){
 /*
 ** Compute the SHA3 checksum of a file on disk.  Store the resulting
 ** checksum in the blob pCksum.  pCksum is assumed to be initialized.
+** This routine is safe to call from worker threads.
 **
 ** Return the number of errors.
 */
@@ -551,8 +552,10 @@ int sha3sum_file(const char *zFilename, int eFType, int iSize, Blob *pCksum){
   FILE *in;
   SHA3Context ctx;
   char zBuf[10240];
+  int perm;
 
-  if( eFType==RepoFILE && file_islink(zFilename) ){
+  if( eFType==RepoFILE && file_stat_r(zFilename, RepoFILE, 0, 0, &perm, 0)==0
+   && perm==PERM_LNK ){
     /* Instead of file content, return sha3 of link destination path */
     Blob destinationPath;
     int rc;
@@ -344,6 +344,7 @@ void shun_artifacts(void){
     content_undelta(srcid);
   }
   db_finalize(&q);
+  manifest_mcache_remove("toshun");
   db_multi_exec(
      "DELETE FROM delta WHERE rid IN toshun;"
      "DELETE FROM blob WHERE rid IN toshun;"
@@ -351,6 +352,7 @@ void shun_artifacts(void){
      "DELETE FROM private "
      " WHERE NOT EXISTS (SELECT 1 FROM blob WHERE rid=private.rid);"
   );
+  annotation_cache_clear();
 }
 
 /*
@@ -0,0 +1,346 @@
+/*
+** Copyright (c) 2026 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*******************************************************************************
+**
+** This module implements sparse check-outs.  A sparse check-out only
+** writes to disk those files whose names match a list of include
+** patterns and do not match a list of exclude patterns.  Both lists
+** are kept in the VVAR table of the check-out database under the names
+** "sparse-include" and "sparse-exclude".
+**
+** Every file of the checked-out version is still present in the VFILE
+** table, so commit and merge still produce complete manifests.  A VFILE
+** entry is "hidden" if its name is excluded and it is unchanged, not
+** renamed, and neither added nor removed.  Hidden entries are not written
+** to disk, are not examined for changes, and contribute their repository
+** content to checksums.  A hidden file that must be merged or renamed
+** is first written to disk and marked as changed.
+*/
+#include "config.h"
+#include "sparse.h"
+
+/*
+** The patterns of the current check-out, loaded on first use
+*/
+static struct {
+  int isInit;           /* True once the fields below are loaded */
+  Glob *pInclude;       /* Files to be written.  NULL means all files */
+  Glob *pExclude;       /* Files never to be written */
+} sparse;
+
+/*
+** Load the sparse patterns from the check-out database, if that has
+** not already been done.
+*/
+static void sparse_load(void){
+  char *z;
+  if( sparse.isInit ) return;
+  sparse.isInit = 1;
+  if( !g.localOpen ) return;
+  z = db_lget("sparse-include", 0);
+  sparse.pInclude = glob_create(z);
+  fossil_free(z);
+  z = db_lget("sparse-exclude", 0);
+  sparse.pExclude = glob_create(z);
+  fossil_free(z);
+}
+
+/*
+** Forget the loaded patterns, so that they are read again on next use.
+** Call this after changing "sparse-include" or "sparse-exclude".
+*/
+void sparse_reset(void){
+  glob_free(sparse.pInclude);
+  glob_free(sparse.pExclude);
+  memset(&sparse, 0, sizeof(sparse));
+}
+
+/*
+** Return true if the current check-out is sparse.
+*/
+int sparse_active(void){
+  sparse_load();
+  return sparse.pInclude!=0 || sparse.pExclude!=0;
+}
+
+/*
+** Return true if zPath, or any directory that contains it, matches
+** pGlob.  So "doc" matches "doc/a/b.txt" as well as "doc" itself.
+*/
+static int sparse_match(Glob *pGlob, const char *zPath){
+  char *z;
+  int i;
+  int rc;
+  if( pGlob==0 ) return 0;
+  if( glob_match(pGlob, zPath) ) return 1;
+  z = fossil_strdup(zPath);
+  rc = 0;
+  for(i=(int)strlen(z)-1; i>0 && rc==0; i--){
+    if( z[i]=='/' ){
+      z[i] = 0;
+      rc = glob_match(pGlob, z);
+    }
+  }
+  fossil_free(z);
+  return rc;
+}
+
+/*
+** Return true if the file zPath, relative to the root of the check-out,
+** is outside of the sparse check-out.
+*/
+int sparse_excluded(const char *zPath){
+  sparse_load();
+  if( sparse.pInclude && !sparse_match(sparse.pInclude, zPath) ) return 1;
+  return sparse_match(sparse.pExclude, zPath);
+}
+
+/*
+** SQL function:
+**
+**       sparse_excluded(PATH)
+**
+** Return true if PATH is outside of the sparse check-out.
+*/
+void sparse_excluded_sql_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  const char *zPath = (const char*)sqlite3_value_text(argv[0]);
+  sqlite3_result_int(context, zPath!=0 && sparse_excluded(zPath));
+}
+
+/*
+** Return an SQL expression that is true for hidden VFILE entries.  The
+** expression refers to the table as "vfile".  It is the constant "0"
+** for check-outs that are not sparse.
+*/
+const char *sparse_hidden_sql(void){
+  if( !sparse_active() ) return "0";
+  return "(vfile.chnged=0 AND NOT vfile.deleted AND vfile.rid>0"
+         " AND vfile.origname IS NULL"
+         " AND sparse_excluded(vfile.pathname))";
+}
+
+/*
+** Write VFILE entry id to disk, unless a file of that name already
+** exists with the content of the entry.  A copy that has some other
+** content, such as one left behind by an earlier version, is
+** overwritten.  Return true if the file was written.
+*/
+static int sparse_write(int id){
+  Stmt q;
+  int rc = 0;
+  db_prepare(&q,
+    "SELECT %Q || pathname, uuid FROM vfile JOIN blob ON blob.rid=mrid"
+    " WHERE id=%d", g.zLocalRoot, id
+  );
+  if( db_step(&q)==SQLITE_ROW ){
+    const char *zFull = db_column_text(&q, 0);
+    const char *zHash = db_column_text(&q, 1);
+    if( !file_isfile_or_link(zFull)
+     || hname_verify_file_hash(zFull, zHash, db_column_bytes(&q, 1))
+          ==HNAME_ERROR
+    ){
+      vfile_to_disk(0, id, 0, 0);
+      rc = 1;
+    }
+  }
+  db_finalize(&q);
+  return rc;
+}
+
+/*
+** If VFILE entry id is hidden, write it to disk so that it can be
+** merged or renamed.  The entry is marked as changed, so that it is
+** no longer hidden.  If it turns out not to change after all, the
+** next vfile_check_signature() hides it again.
+*/
+void sparse_materialize(int id){
+  if( sparse_active()
+   && db_exists("SELECT 1 FROM vfile WHERE id=%d AND %s",
+                id, sparse_hidden_sql())
+  ){
+    sparse_write(id);
+    db_multi_exec("UPDATE vfile SET chnged=1 WHERE id=%d", id);
+  }
+}
+
+/*
+** Print the current patterns.
+*/
+static void sparse_list(void){
+  char *zInc = db_lget("sparse-include", 0);
+  char *zExc = db_lget("sparse-exclude", 0);
+  if( zInc==0 && zExc==0 ){
+    fossil_print("not a sparse check-out\n");
+  }
+  if( zInc ) fossil_print("include: %s\n", zInc);
+  if( zExc ) fossil_print("exclude: %s\n", zExc);
+  fossil_free(zInc);
+  fossil_free(zExc);
+}
+
+/*
+** COMMAND: sparse
+**
+** Usage: %fossil sparse list|include|exclude|reset ?GLOB ...?
+**
+** Restrict the current check-out to a subset of its files.  Files outside
+** of the subset are not written to disk and are not examined by "status",
+** "changes", "commit" and similar commands, which makes those commands
+** faster on large check-outs.  Commits and merges still cover every file:
+** files outside of the subset are taken as unchanged.
+**
+** A file is in the subset if its name, or the name of a directory that
+** contains it, matches one of the include patterns (or if there are no
+** include patterns), and does not match any of the exclude patterns.
+** The patterns are GLOBs, as for the ignore-glob setting.
+**
+** A file outside of the subset is written to disk again if a merge
+** changes or renames it.  Once on disk, it is treated like any other
+** file until it is committed.  Changes made to a file outside of the
+** subset without first adding it to the subset are not noticed.
+**
+** > fossil sparse list
+**
+**       Show the include and exclude patterns.  This is the default.
+**
+** > fossil sparse include GLOB ...
+**
+**       Add GLOBs to the include patterns.
+**
+** > fossil sparse exclude GLOB ...
+**
+**       Add GLOBs to the exclude patterns.
+**
+** > fossil sparse reset
+**
+**       Remove all patterns, so that every file is written to disk.
+**
+** Except for "list", each subcommand removes from disk the unchanged
+** files that leave the subset and writes the files that enter it.  A
+** file that enters the subset replaces any copy already on disk that
+** differs from the checked-out version.  Changed files are never removed.
+**
+** A file outside of the subset that is on disk anyway, for example
+** because a merge wrote it, is kept up to date by "update".
+**
+** See also: [[open]]
+*/
+void sparse_cmd(void){
+  const char *zCmd;
+  int vid;
+  int nCmd;
+  int i;
+  int nDel = 0;
+  int nWrite = 0;
+  Stmt q;
+  char *zPwd;
+
+  db_must_be_within_tree();
+  verify_all_options();
+  zCmd = g.argc>=3 ? g.argv[2] : "list";
+  nCmd = (int)strlen(zCmd);
+  if( nCmd>0 && strncmp(zCmd, "list", nCmd)==0 ){
+    sparse_list();
+    return;
+  }
+  vid = db_lget_int("checkout", 0);
+  db_begin_transaction();
+  vfile_check_signature(vid, 0);
+  db_multi_exec(
+    "CREATE TEMP TABLE sparse_old(id INTEGER PRIMARY KEY);"
+    "INSERT INTO sparse_old SELECT id FROM vfile WHERE vid=%d AND %s;",
+    vid, sparse_hidden_sql()
+  );
+  if( nCmd>0 && (strncmp(zCmd, "include", nCmd)==0
+              || strncmp(zCmd, "exclude", nCmd)==0) ){
+    const char *zVar = zCmd[0]=='i' ? "sparse-include" : "sparse-exclude";
+    char *zOld = db_lget(zVar, 0);
+    Blob list;
+    if( g.argc<4 ) usage(mprintf("%s GLOB ...", zCmd));
+    blob_init(&list, zOld, -1);
+    for(i=3; i<g.argc; i++){
+      if( blob_size(&list) ) blob_append(&list, "\n", 1);
+      blob_appendf(&list, "\"%s\"", g.argv[i]);
+    }
+    db_lset(zVar, blob_str(&list));
+    blob_reset(&list);
+    fossil_free(zOld);
+  }else if( nCmd>0 && strncmp(zCmd, "reset", nCmd)==0 ){
+    db_multi_exec(
+      "DELETE FROM vvar WHERE name IN ('sparse-include','sparse-exclude')"
+    );
+  }else{
+    usage("list|include|exclude|reset ?GLOB ...?");
+  }
+  sparse_reset();
+
+  /* Remove the files that are now hidden, and any directories that
+  ** become empty as a result */
+  sqlite3_create_function(g.db, "dirname",1,SQLITE_UTF8,0,
+                          file_dirname_sql_function, 0, 0);
+  sqlite3_create_function(g.db, "rmdir", 1, SQLITE_UTF8|SQLITE_DIRECTONLY, 0,
+                          file_rmdir_sql_function, 0, 0);
+  db_multi_exec(
+    "CREATE TEMP TABLE dir_to_delete(name TEXT %s PRIMARY KEY)WITHOUT ROWID",
+    filename_collation()
+  );
+  db_prepare(&q,
+    "SELECT %Q || pathname, pathname FROM vfile"
+    " WHERE vid=%d AND %s AND id NOT IN sparse_old",
+    g.zLocalRoot, vid, sparse_hidden_sql()
+  );
+  while( db_step(&q)==SQLITE_ROW ){
+    const char *zFull = db_column_text(&q, 0);
+    if( file_isfile_or_link(zFull) && file_delete(zFull)==0 ){
+      nDel++;
+    }
+    db_multi_exec(
+      "INSERT OR IGNORE INTO dir_to_delete(name) VALUES(dirname(%Q))",
+      db_column_text(&q, 1)
+    );
+  }
+  db_finalize(&q);
+  do{
+    db_multi_exec(
+      "INSERT OR IGNORE INTO dir_to_delete(name)"
+      " SELECT dirname(name) FROM dir_to_delete WHERE name IS NOT NULL;"
+    );
+  }while( db_changes() );
+  ensure_empty_dirs_created(1);
+  zPwd = file_getcwd(0,0);
+  db_multi_exec(
+    "SELECT rmdir(%Q||name) FROM dir_to_delete"
+    " WHERE name IS NOT NULL AND (%Q||name)<>%Q ORDER BY name DESC",
+    g.zLocalRoot, g.zLocalRoot, zPwd
+  );
+  fossil_free(zPwd);
+
+  /* Write the files that are no longer hidden */
+  db_prepare(&q,
+    "SELECT id FROM vfile"
+    " WHERE id IN sparse_old AND NOT %s", sparse_hidden_sql()
+  );
+  while( db_step(&q)==SQLITE_ROW ){
+    nWrite += sparse_write(db_column_int(&q, 0));
+  }
+  db_finalize(&q);
+  db_end_transaction(0);
+  fossil_print("%d files removed, %d files written\n", nDel, nWrite);
+}
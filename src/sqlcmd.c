@@ -96,8 +96,9 @@ static void sqlcmd_compress(
 
 /*
 ** Implementation of the "decompress(X)" SQL function.  The argument X
-** is a blob which was obtained from compress(Y).  The output will be
-** the value Y.
+** is a blob which was obtained from compress(Y), or the content of an
+** artifact, which might be compressed with the preset dictionary of
+** "fossil repack --dictionary".  The output will be the value Y.
 */
 static void sqlcmd_decompress(
   sqlite3_context *context,
@@ -105,27 +106,22 @@ static void sqlcmd_decompress(
   sqlite3_value **argv
 ){
   const unsigned char *pIn;
-  unsigned char *pOut;
   unsigned int nIn;
-  unsigned long int nOut;
-  int rc;
+  Blob x;
 
   pIn = sqlite3_value_blob(argv[0]);
   if( pIn==0 ) return;
   nIn = sqlite3_value_bytes(argv[0]);
   if( nIn<4 ) return;
-  nOut = (pIn[0]<<24) + (pIn[1]<<16) + (pIn[2]<<8) + pIn[3];
-  pOut = sqlite3_malloc( nOut+1 );
-  rc = uncompress(pOut, &nOut, &pIn[4], nIn-4);
-  if( rc==Z_OK ){
-    sqlite3_result_blob(context, pOut, nOut, sqlite3_free);
-  }else if( rc==Z_MEM_ERROR ){
-    sqlite3_free(pOut);
-    sqlite3_result_error_nomem(context);
-  }else{
-    sqlite3_free(pOut);
+  blob_init(&x, (const char*)pIn, nIn);
+  if( nIn==4 || blob_uncompress(&x, &x) ){
+    blob_reset(&x);
     sqlite3_result_error(context, "input is not zlib compressed", -1);
+    return;
   }
+  sqlite3_result_blob(context, blob_buffer(&x), blob_size(&x),
+                      SQLITE_TRANSIENT);
+  blob_reset(&x);
 }
 
 /*
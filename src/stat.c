@@ -327,6 +327,13 @@ void stat_page(void){
     @ <tr><th>Backoffice:</th>
     @ <td>Last run: %z(backoffice_last_run())</td></tr>
   }
+  if( g.perm.Admin ){
+    Blob cache;
+    blob_init(&cache, 0, 0);
+    content_cache_stats(&cache);
+    @ <tr><th>Artifact&nbsp;Cache:</th><td>%h(blob_str(&cache))</td></tr>
+    blob_reset(&cache);
+  }
   if( g.perm.Admin && alert_enabled() ){
     stats_for_email();
   }
@@ -348,7 +355,9 @@ void stat_page(void){
 **   --db-check           Run "PRAGMA quick_check" on the repository database
 **   --db-verify          Run a full verification of the repository integrity.
 **                        This involves decoding and reparsing all artifacts
-**                        and can take significant time.
+**                        and can take significant time.  The artifact-cache
+**                        line shows how well the artifact cache performed
+**                        during the verification.
 **   --omit-version-info  Omit the SQLite, Fossil, Pikchr version information
 */
 void dbstat_cmd(void){
@@ -503,6 +512,13 @@ void dbstat_cmd(void){
       test_integrity();
     }
   }
+  if( !brief ){
+    Blob cache;
+    blob_init(&cache, 0, 0);
+    content_cache_stats(&cache);
+    fossil_print("%*s%s\n", colWidth, "artifact-cache:", blob_str(&cache));
+    blob_reset(&cache);
+  }
 }
 
 /*
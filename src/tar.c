@@ -454,6 +454,64 @@ static void tar_add_file(
   }
 }
 
+/*
+** State of a file being streamed into the tarball by tar_add_artifact().
+*/
+struct TarSink {
+  int nExpect;             /* Size given in the header */
+  int nWritten;            /* Bytes written so far */
+};
+
+/*
+** DeltaSink for tar_add_artifact().  Never write more than the header
+** promised.
+*/
+static int tar_sink(void *pArg, const char *z, int n){
+  struct TarSink *p = (struct TarSink*)pArg;
+  if( n>p->nExpect-p->nWritten ) n = p->nExpect - p->nWritten;
+  if( n>0 ){
+    gzip_step(z, n);
+    p->nWritten += n;
+  }
+  return 0;
+}
+
+/*
+** Add the artifact with ID rid to the growing tarball as file zName.
+**
+** This is the same as tar_add_file() with content from content_get(),
+** except that the content is streamed into the compressor so that a
+** very large file is never held in memory all at once.
+*/
+static void tar_add_artifact(
+  const char *zName,               /* Name of the file.  nul-terminated */
+  int rid,                         /* The file content */
+  int mPerm,                       /* 1: executable file, 2: symlink */
+  unsigned int mTime               /* Last modification time of the file */
+){
+  struct TarSink x;
+  int lastPage;
+  x.nExpect = db_int(-1, "SELECT size FROM blob WHERE rid=%d", rid);
+  x.nWritten = 0;
+  if( mPerm==PERM_LNK || x.nExpect<=0 ){
+    Blob file;
+    content_get(rid, &file);
+    tar_add_file(zName, &file, mPerm, mTime);
+    blob_reset(&file);
+    return;
+  }
+  tar_add_directory_of(zName, strlen(zName), mTime);
+  tar_add_header(zName, strlen(zName), ( mPerm==PERM_EXE ) ? 0755 : 0644,
+                 mTime, x.nExpect, '0');
+  if( !content_stream(rid, tar_sink, &x) || x.nWritten<x.nExpect ){
+    fossil_fatal("unable to read the content of %s", zName);
+  }
+  lastPage = x.nExpect % 512;
+  if( lastPage!=0 ){
+    gzip_step(tball.zSpaces, 512 - lastPage);
+  }
+}
+
 /*
 ** Finish constructing the tarball.  Put the content of the tarball
 ** in Blob pOut.
@@ -530,7 +588,7 @@ void tarball_of_checkin(
   Glob *pExclude,      /* Exclude files matching this pattern */
   int listFlag         /* Show filenames on stdout */
 ){
-  Blob mfile, hash, file;
+  Blob mfile, hash;
   Manifest *pManifest;
   ManifestFile *pFile;
   Blob filename;
@@ -622,9 +680,7 @@ void tarball_of_checkin(
         zName = blob_str(&filename);
         if( listFlag ) fossil_print("%s\n", zName);
         if( pTar ){
-          content_get(fid, &file);
-          tar_add_file(zName, &file, manifest_file_mperm(pFile), mTime);
-          blob_reset(&file);
+          tar_add_artifact(zName, fid, manifest_file_mperm(pFile), mTime);
         }
       }
     }
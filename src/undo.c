@@ -31,6 +31,139 @@
 #define UNDO_TOOBIG   (4) /* File not saved, it exceeded a size limit. */
 #endif
 
+/*
+** UNDO.CONTENT is usually not a full copy of a file.  If UNDO.HASH is
+** not NULL then it names a repository artifact, normally the VFILE.MRID
+** of the file at the time it was saved, and UNDO.CONTENT is either NULL,
+** meaning that the file held exactly that artifact, or a delta against
+** that artifact.  Only files with no baseline, or with content so
+** different from their baseline that a delta does not help, are stored
+** in full.
+**
+** The UNDO.HASH column was added on 2026-10-16.  Undo tables that were
+** created before that lack the column.  This routine adds it.
+*/
+static void undo_schema_check(void){
+  static int isChecked = 0;
+  if( isChecked ) return;
+  isChecked = 1;
+  if( db_table_exists("localdb","undo")
+   && !db_table_has_column("localdb","undo","hash")
+  ){
+    db_multi_exec("ALTER TABLE undo ADD COLUMN hash TEXT");
+  }
+}
+
+/*
+** Read the file zFullname, which is zPathname relative to the root of
+** the check-out, and encode its content for storage in the undo table.
+** Write the value for UNDO.CONTENT into pOut and return the value for
+** UNDO.HASH, or NULL if pOut holds the complete content.  If the return
+** value is not NULL but pOut is empty, then UNDO.CONTENT should be NULL.
+** Space to hold the returned string is obtained from fossil_malloc().
+**
+** The file is not read at all if VFILE.FSTAT shows it to be unchanged.
+*/
+static char *undo_encode(
+  const char *zPathname,   /* Name relative to the root of the check-out */
+  const char *zFullname,   /* Full pathname of the file */
+  Blob *pOut               /* Write the encoded content here */
+){
+  Stmt q;
+  int rid = 0;
+  char *zUuid = 0;
+  Blob disk;
+
+  blob_zero(pOut);
+  db_prepare(&q,
+    "SELECT vfile.mrid, blob.uuid, vfile.fstat FROM vfile, blob"
+    " WHERE vfile.vid=%d AND vfile.pathname=%Q %s"
+    "   AND blob.rid=vfile.mrid AND blob.size>=0",
+    db_lget_int("checkout", 0), zPathname, filename_collation()
+  );
+  if( db_step(&q)==SQLITE_ROW ){
+    rid = db_column_int(&q, 0);
+    zUuid = fossil_strdup(db_column_text(&q, 1));
+    if( vfile_fstat_matches(zFullname, db_column_text(&q, 2), zUuid) ){
+      db_finalize(&q);
+      return zUuid;
+    }
+  }
+  db_finalize(&q);
+  blob_read_from_file(&disk, zFullname, RepoFILE);
+  if( zUuid ){
+    Blob orig;
+    if( hname_verify_hash(&disk, zUuid, (int)strlen(zUuid)) ){
+      blob_reset(&disk);
+      return zUuid;
+    }
+    if( content_get(rid, &orig) ){
+      blob_delta_create(&orig, &disk, pOut);
+      blob_reset(&orig);
+      if( blob_size(pOut)<blob_size(&disk) ){
+        blob_reset(&disk);
+        return zUuid;
+      }
+      blob_reset(pOut);
+    }
+    fossil_free(zUuid);
+  }
+  *pOut = disk;
+  return 0;
+}
+
+/*
+** Reconstruct the complete content of a file from column iContent,
+** an UNDO.CONTENT value, and column iHash, an UNDO.HASH value, of the
+** current row of pStmt.  Write the content into pOut.
+*/
+static void undo_decode(Stmt *pStmt, int iContent, int iHash, Blob *pOut){
+  const char *zUuid = db_column_text(pStmt, iHash);
+  blob_zero(pOut);
+  if( zUuid==0 ){
+    db_column_blob(pStmt, iContent, pOut);
+  }else{
+    int rid = db_int(0, "SELECT rid FROM blob WHERE uuid=%Q", zUuid);
+    Blob orig;
+    if( rid==0 || !content_get(rid, &orig) ){
+      fossil_fatal("undo baseline %s is missing from the repository", zUuid);
+    }
+    if( db_column_type(pStmt, iContent)==SQLITE_NULL ){
+      *pOut = orig;
+    }else{
+      Blob delta;
+      db_ephemeral_blob(pStmt, iContent, &delta);
+      if( blob_delta_apply(&orig, &delta, pOut)<0 ){
+        fossil_fatal("corrupt undo delta against %s", zUuid);
+      }
+      blob_reset(&orig);
+    }
+  }
+}
+
+/*
+** Write into pOut the content that the undo buffer holds for the file
+** zPathname, relative to the root of the check-out.  Return true on
+** success or false if the undo buffer has no content for that file.
+*/
+int undo_get_content(const char *zPathname, Blob *pOut){
+  Stmt q;
+  int rc = 0;
+  blob_zero(pOut);
+  if( !db_table_exists("localdb","undo") ) return 0;
+  undo_schema_check();
+  db_prepare(&q,
+    "SELECT content, hash FROM undo WHERE pathname=%Q AND existsflag",
+    zPathname
+  );
+  if( db_step(&q)==SQLITE_ROW ){
+    undo_decode(&q, 0, 1, pOut);
+    rc = 1;
+  }
+  db_finalize(&q);
+  return rc;
+}
+
 /*
 ** Undo the change to the file zPathname.  zPathname is the pathname
 ** of the file relative to the root of the repository.  If redoFlag is
@@ -40,8 +173,9 @@
 static void undo_one(const char *zPathname, int redoFlag){
   Stmt q;
   char *zFullname;
+  undo_schema_check();
   db_prepare(&q,
-    "SELECT content, existsflag, isExe, isLink FROM undo"
+    "SELECT content, existsflag, isExe, isLink, hash FROM undo"
     " WHERE pathname=%Q AND redoflag=%d",
      zPathname, redoFlag
   );
@@ -52,6 +186,7 @@ static void undo_one(const char *zPathname, int redoFlag){
     int new_exe;
     int new_link;
     int old_link;
+    char *zCurHash = 0;
     Blob current;
     Blob new;
     zFullname = mprintf("%s%s", g.zLocalRoot, zPathname);
@@ -59,8 +194,8 @@ static void undo_one(const char *zPathname, int redoFlag){
     new_exists = file_size(zFullname, RepoFILE)>=0;
     new_link = file_islink(0);
     if( new_exists ){
-      blob_read_from_file(&current, zFullname, RepoFILE);
       new_exe = file_isexe(0,0);
+      zCurHash = undo_encode(zPathname, zFullname, &current);
     }else{
       blob_zero(&current);
       new_exe = 0;
@@ -69,7 +204,7 @@ static void undo_one(const char *zPathname, int redoFlag){
     old_exists = db_column_int(&q, 1);
     old_exe = db_column_int(&q, 2);
     if( old_exists ){
-      db_ephemeral_blob(&q, 0, &new);
+      undo_decode(&q, 0, 4, &new);
     }
     if( file_unsafe_in_tree_path(zFullname) ){
       /* do nothing with this unsafe file */
@@ -97,15 +232,16 @@ static void undo_one(const char *zPathname, int redoFlag){
     db_finalize(&q);
     db_prepare(&q,
        "UPDATE undo SET content=:c, existsflag=%d, isExe=%d, isLink=%d,"
-             " redoflag=NOT redoflag"
+             " hash=%Q, redoflag=NOT redoflag"
        " WHERE pathname=%Q",
-       new_exists, new_exe, new_link, zPathname
+       new_exists, new_exe, new_link, zCurHash, zPathname
     );
-    if( new_exists ){
+    if( new_exists && (zCurHash==0 || blob_size(&current)>0) ){
       db_bind_blob(&q, ":c", &current);
     }
     db_step(&q);
     blob_reset(&current);
+    fossil_free(zCurHash);
   }
   db_finalize(&q);
 }
@@ -232,7 +368,8 @@ void undo_begin(void){
     @   existsflag BOOLEAN,               -- True if the file exists
     @   isExe BOOLEAN,                    -- True if the file is executable
     @   isLink BOOLEAN,                   -- True if the file is symlink
-    @   content BLOB                      -- Saved content
+    @   content BLOB,                     -- Saved content, or delta
+    @   hash TEXT                         -- Baseline of content, or NULL
     @ );
     @ CREATE TABLE localdb.undo_vfile AS SELECT * FROM vfile;
     @ CREATE TABLE localdb.undo_vmerge AS SELECT * FROM vmerge;
@@ -321,23 +458,29 @@ int undo_maybe_save(const char *zPathname, i64 limit){
   if( limit<0 || size<=limit ){
     int existsFlag = (size>=0);
     int isLink = file_islink(zFullname);
+    int isExe = file_isexe(zFullname,RepoFILE);
+    char *zHash = 0;
     Stmt q;
     Blob content;
+    blob_zero(&content);
+    if( existsFlag
+     && !db_exists("SELECT 1 FROM undo WHERE pathname=%Q", zPathname)
+    ){
+      zHash = undo_encode(zPathname, zFullname, &content);
+    }
     db_prepare(&q,
       "INSERT OR IGNORE INTO"
-      "   undo(pathname,redoflag,existsflag,isExe,isLink,content)"
-      " VALUES(%Q,0,%d,%d,%d,:c)",
-      zPathname, existsFlag, file_isexe(zFullname,RepoFILE), isLink
+      "   undo(pathname,redoflag,existsflag,isExe,isLink,content,hash)"
+      " VALUES(%Q,0,%d,%d,%d,:c,%Q)",
+      zPathname, existsFlag, isExe, isLink, zHash
     );
-    if( existsFlag ){
-      blob_read_from_file(&content, zFullname, RepoFILE);
+    if( existsFlag && (zHash==0 || blob_size(&content)>0) ){
       db_bind_blob(&q, ":c", &content);
     }
     db_step(&q);
     db_finalize(&q);
-    if( existsFlag ){
-      blob_reset(&content);
-    }
+    blob_reset(&content);
+    fossil_free(zHash);
     undoNeedRollback = 1;
     result = UNDO_SAVED_OK;
   }else{
@@ -133,7 +133,7 @@ void update_cmd(void){
   int nUpdate = 0;      /* Number of changes of any kind */
   int bNosync = 0;      /* --nosync.  Omit the auto-sync */
   int width;            /* Width of printed comment lines */
-  Stmt mtimeXfer;       /* Statement to transfer mtimes */
+  Stmt mtimeXfer;       /* Statement to transfer mtimes, fstats, cksums */
   const char *zWidth;   /* Width option string value */
   const char *zCurBrName;      /* Current branch name */
   const char *zNewBrName;      /* New branch name */
@@ -404,7 +404,8 @@ void update_cmd(void){
     "       isexe, islinkv, islinkt, deleted FROM fv ORDER BY 1"
   );
   db_prepare(&mtimeXfer,
-    "UPDATE vfile SET mtime=(SELECT mtime FROM vfile WHERE id=:idv)"
+    "UPDATE vfile SET (mtime,fstat,cksum)=(SELECT mtime, fstat, cksum"
+    "                                        FROM vfile WHERE id=:idv)"
     " WHERE id=:idt"
   );
   assert( g.zLocalRoot!=0 );
@@ -449,8 +450,12 @@ void update_cmd(void){
       nc = 1;
       zErrMsg = "duplicate file";
     }else if( idt>0 && idv==0 ){
-      /* File added in the target. */
-      if( file_isfile_or_link(zFullPath) ){
+      /* File added in the target.  It is not written to disk, nor saved
+      ** for undo, if it is outside of a sparse check-out and there is no
+      ** file of that name on disk already */
+      int hasCopy = file_isfile_or_link(zFullPath);
+      int isHidden = !hasCopy && sparse_excluded(zName);
+      if( hasCopy ){
         /* Name of backup file with Original content */
         char *zOrig = file_newname(zFullPath, "original", 1);
         /* Backup previously unmanaged file before being overwritten */
@@ -469,19 +474,25 @@ void update_cmd(void){
       }else{
         fossil_print("ADD %s\n", zName);
       }
-      if( !dryRunFlag && !internalUpdate ) undo_save(zName);
-      if( !dryRunFlag ) vfile_to_disk(0, idt, 0, 0);
+      if( !dryRunFlag && !internalUpdate && !isHidden ) undo_save(zName);
+      if( !dryRunFlag && !isHidden ) vfile_to_disk(0, idt, 0, 0);
     }else if( idt>0 && idv>0 && ridt!=ridv && (chnged==0 || deleted) ){
-      /* The file is unedited.  Change it to the target version */
+      /* The file is unedited.  Change it to the target version, unless
+      ** it is hidden by a sparse check-out and not on disk.  A copy of a
+      ** hidden file, such as one written by a merge, is kept up to date
+      ** so that it is never taken for the new version later on. */
+      int isHidden = !deleted && sparse_excluded(zName)
+                       && !file_isfile_or_link(zFullPath);
       if( deleted ){
         fossil_print("UPDATE %s - change to unmanaged file\n", zName);
       }else{
         fossil_print("UPDATE %s\n", zName);
       }
-      if( !dryRunFlag && !internalUpdate ) undo_save(zName);
-      if( !dryRunFlag ) vfile_to_disk(0, idt, 0, 0);
+      if( !dryRunFlag && !internalUpdate && !isHidden ) undo_save(zName);
+      if( !dryRunFlag && !isHidden ) vfile_to_disk(0, idt, 0, 0);
       zOp = "UPDATE";
-    }else if( idt>0 && idv>0 && !deleted && file_size(zFullPath, RepoFILE)<0 ){
+    }else if( idt>0 && idv>0 && !deleted && file_size(zFullPath, RepoFILE)<0
+           && (chnged || !sparse_excluded(zName)) ){
       /* The file missing from the local check-out. Restore it to the
       ** version that appears in the target. */
       fossil_print("UPDATE %s\n", zName);
@@ -504,7 +515,11 @@ void update_cmd(void){
         nConflict++;
       }else{
         fossil_print("REMOVE %s\n", zName);
-        if( !dryRunFlag && !internalUpdate ) undo_save(zName);
+        if( !dryRunFlag && !internalUpdate
+         && (!sparse_excluded(zName) || file_isfile_or_link(zFullPath))
+        ){
+          undo_save(zName);
+        }
         if( !dryRunFlag ){
           char *zDir;
           file_delete(zFullPath);
@@ -789,16 +804,18 @@ Manifest *historical_manifest(
 }
 
 /*
-** Get the contents of a file within the check-in "zRevision".  If
-** zRevision==NULL then get the file content for the current check-out.
+** Find the artifact that holds the content of file zFile within the
+** check-in "zRevision".  If zRevision==NULL then use the current
+** check-out.  Return the RID of that artifact if its content is
+** available, or 0 if the file or its content is missing.  If fatal is
+** nonzero, panic rather than returning 0.
 */
-int historical_blob(
+int historical_rid(
   const char *zRevision,   /* The check-in containing the file */
   const char *zFile,       /* Full treename of the file */
-  Blob *pBlob,             /* Put the content here */
   int fatal                /* If nonzero, panic if file/artifact not found */
 ){
-  int result = 0;
+  int rid = 0;
 
   /* Get the manifest for the requested check-in version.  This call unavoidably
    * panics on failure even if fatal is not set. */
@@ -817,11 +834,11 @@ int historical_blob(
       }
     }
   }else{
-    /* Get the file's contents. */
-    result = content_get(fast_uuid_to_rid(pFile->zUuid), pBlob);
+    rid = fast_uuid_to_rid(pFile->zUuid);
 
     /* Process artifact-not-found errors. */
-    if( !result && fatal ){
+    if( rid && !content_is_available(rid) ) rid = 0;
+    if( !rid && fatal ){
       if( zRevision ){
         fossil_fatal("missing artifact %s for file %s in check-in %s",
             pFile->zUuid, zFile, zRevision);
@@ -833,11 +850,70 @@ int historical_blob(
 
   /* Deallocate the parsed manifest structure. */
   manifest_destroy(pManifest);
+  return rid;
+}
+
+/*
+** Get the contents of a file within the check-in "zRevision".  If
+** zRevision==NULL then get the file content for the current check-out.
+**
+** If xSink is not NULL, the content is passed to xSink() using
+** content_stream() instead of being stored in pBlob.
+*/
+static int historical_content(
+  const char *zRevision,   /* The check-in containing the file */
+  const char *zFile,       /* Full treename of the file */
+  Blob *pBlob,             /* Put the content here */
+  DeltaSink xSink,         /* Or send it here, if not NULL */
+  void *pArg,              /* First argument to xSink */
+  int fatal                /* If nonzero, panic if file/artifact not found */
+){
+  int result = 0;
+  int rid = historical_rid(zRevision, zFile, fatal);
+
+  /* Get the file's contents. */
+  if( rid ){
+    if( xSink ){
+      result = content_stream(rid, xSink, pArg);
+    }else{
+      result = content_get(rid, pBlob);
+    }
+    if( !result && fatal ){
+      fossil_fatal("cannot read the content of %s", zFile);
+    }
+  }
 
   /* Return 1 on success and (assuming fatal is not set) 0 if not found. */
   return result;
 }
 
+/*
+** Get the contents of a file within the check-in "zRevision".  If
+** zRevision==NULL then get the file content for the current check-out.
+*/
+int historical_blob(
+  const char *zRevision,   /* The check-in containing the file */
+  const char *zFile,       /* Full treename of the file */
+  Blob *pBlob,             /* Put the content here */
+  int fatal                /* If nonzero, panic if file/artifact not found */
+){
+  return historical_content(zRevision, zFile, pBlob, 0, 0, fatal);
+}
+
+/*
+** Like historical_blob() but pass the file content to xSink() rather
+** than storing it in a blob.
+*/
+int historical_stream(
+  const char *zRevision,   /* The check-in containing the file */
+  const char *zFile,       /* Full treename of the file */
+  DeltaSink xSink,         /* Send the content here */
+  void *pArg,              /* First argument to xSink */
+  int fatal                /* If nonzero, panic if file/artifact not found */
+){
+  return historical_content(zRevision, zFile, 0, xSink, pArg, fatal);
+}
+
 /*
 ** COMMAND: revert
 **
@@ -0,0 +1,492 @@
+/*
+** Copyright (c) 2026 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+**
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*******************************************************************************
+**
+** This module uses the Linux io_uring interface to stat and read many
+** files with a single system call, and with many requests in flight at
+** once.  It sits underneath file_stat_info_batch() and file_read_batch()
+** in file.c, which fall back to ordinary system calls whenever the
+** routines here report that io_uring cannot be used.
+**
+** The ring is driven directly through the io_uring_setup(),
+** io_uring_enter() and io_uring_register() system calls, so that no
+** extra library is required.  It is only used if the checkout-io-uring
+** setting is enabled.  Whether the running kernel permits io_uring, and
+** supports the operations used here, is decided the first time a batch
+** is attempted.
+**
+** This module is a no-op unless compiled with FOSSIL_HAVE_IO_URING.
+*/
+#include "config.h"
+#include "uring.h"
+#ifdef FOSSIL_HAVE_IO_URING
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/syscall.h>
+# include <sys/sysmacros.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+/*
+** SETTING: checkout-io-uring      boolean default=off
+** If enabled on Linux, commands such as "fossil status" and "fossil
+** commit" stat and read the files of the check-out through io_uring,
+** with many requests in flight at once, instead of with one system call
+** per file.  This helps most when the files are not already cached in
+** memory, or are on a network file system.  For cached files on a local
+** disk it is usually slower.  The setting is ignored where io_uring is
+** not available.
+*/
+
+/*
+** Whether or not io_uring is used: 0 if not yet known, 1 if it is, or
+** 2 if it is not
+*/
+static int uringState = 0;
+
+
+#ifdef FOSSIL_HAVE_IO_URING
+
+/*
+** Number of submission queue entries.  This is also the largest number
+** of requests that are in flight at once.
+*/
+#define URING_DEPTH 128
+
+/*
+** An open ring
+*/
+typedef struct Uring Uring;
+struct Uring {
+  int fd;                     /* File descriptor from io_uring_setup() */
+  unsigned *sqHead;           /* Submission queue head, advanced by kernel */
+  unsigned *sqTail;           /* Submission queue tail, advanced by us */
+  unsigned sqMask;            /* Mask for submission queue indexes */
+  unsigned *sqArray;          /* Submission queue index array */
+  struct io_uring_sqe *aSqe;  /* Submission queue entries */
+  unsigned *cqHead;           /* Completion queue head, advanced by us */
+  unsigned *cqTail;           /* Completion queue tail, advanced by kernel */
+  unsigned cqMask;            /* Mask for completion queue indexes */
+  struct io_uring_cqe *aCqe;  /* Completion queue entries */
+  void *pSqRing;              /* Mapping of the submission queue */
+  size_t szSqRing;            /* Size of pSqRing */
+  void *pCqRing;              /* Mapping of the completion queue, or NULL */
+  size_t szCqRing;            /* Size of pCqRing */
+  size_t szSqe;               /* Size of the aSqe mapping */
+  unsigned nPending;          /* Entries queued but not yet submitted */
+  int nFlight;                /* Requests submitted but not yet completed */
+};
+
+/*
+** Release all resources held by ring p.
+*/
+static void uring_close(Uring *p){
+  if( p->aSqe ) munmap(p->aSqe, p->szSqe);
+  if( p->pCqRing ) munmap(p->pCqRing, p->szCqRing);
+  if( p->pSqRing ) munmap(p->pSqRing, p->szSqRing);
+  if( p->fd>=0 ) close(p->fd);
+  memset(p, 0, sizeof(*p));
+  p->fd = -1;
+}
+
+/*
+** Return true if the kernel behind ring p supports every opcode that
+** this module uses.
+*/
+static int uring_probe(Uring *p){
+  static const int aOp[] = { IORING_OP_STATX, IORING_OP_OPENAT,
+                             IORING_OP_READ };
+  struct io_uring_probe *pProbe;
+  int nOp = 64;
+  int i, ok = 1;
+  size_t sz = sizeof(*pProbe) + nOp*sizeof(struct io_uring_probe_op);
+  pProbe = fossil_malloc(sz);
+  memset(pProbe, 0, sz);
+  if( syscall(__NR_io_uring_register, p->fd, IORING_REGISTER_PROBE,
+              pProbe, nOp)<0 ){
+    fossil_free(pProbe);
+    return 0;
+  }
+  for(i=0; i<(int)(sizeof(aOp)/sizeof(aOp[0])); i++){
+    if( aOp[i]>pProbe->last_op
+     || (pProbe->ops[aOp[i]].flags & IO_URING_OP_SUPPORTED)==0
+    ){
+      ok = 0;
+    }
+  }
+  fossil_free(pProbe);
+  return ok;
+}
+
+/*
+** Set up a new ring.  Return 0 on success.  If io_uring cannot be used,
+** now or ever in this process, return non-zero.
+*/
+static int uring_setup(Uring *p){
+  struct io_uring_params params;
+  char *zSq, *zCq;
+
+  memset(p, 0, sizeof(*p));
+  p->fd = -1;
+  memset(&params, 0, sizeof(params));
+  p->fd = (int)syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+  if( p->fd<0 ) goto not_available;
+  p->szSqRing = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+  p->szCqRing = params.cq_off.cqes
+                  + params.cq_entries*sizeof(struct io_uring_cqe);
+  if( params.features & IORING_FEAT_SINGLE_MMAP ){
+    if( p->szCqRing>p->szSqRing ) p->szSqRing = p->szCqRing;
+  }
+  zSq = mmap(0, p->szSqRing, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+             p->fd, IORING_OFF_SQ_RING);
+  if( zSq==MAP_FAILED ) goto not_available;
+  p->pSqRing = zSq;
+  if( params.features & IORING_FEAT_SINGLE_MMAP ){
+    zCq = zSq;
+  }else{
+    zCq = mmap(0, p->szCqRing, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+               p->fd, IORING_OFF_CQ_RING);
+    if( zCq==MAP_FAILED ) goto not_available;
+    p->pCqRing = zCq;
+  }
+  p->szSqe = params.sq_entries*sizeof(struct io_uring_sqe);
+  p->aSqe = mmap(0, p->szSqe, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                 p->fd, IORING_OFF_SQES);
+  if( p->aSqe==MAP_FAILED ){
+    p->aSqe = 0;
+    goto not_available;
+  }
+  p->sqHead = (unsigned*)(zSq + params.sq_off.head);
+  p->sqTail = (unsigned*)(zSq + params.sq_off.tail);
+  p->sqMask = *(unsigned*)(zSq + params.sq_off.ring_mask);
+  p->sqArray = (unsigned*)(zSq + params.sq_off.array);
+  p->cqHead = (unsigned*)(zCq + params.cq_off.head);
+  p->cqTail = (unsigned*)(zCq + params.cq_off.tail);
+  p->cqMask = *(unsigned*)(zCq + params.cq_off.ring_mask);
+  p->aCqe = (struct io_uring_cqe*)(zCq + params.cq_off.cqes);
+  if( !uring_probe(p) ) goto not_available;
+  return 0;
+
+not_available:
+  uring_close(p);
+  uringState = 2;
+  return 1;
+}
+
+/*
+** Return a cleared submission queue entry, or NULL if URING_DEPTH
+** requests are already queued or in flight.  The entry is submitted
+** by the next call to uring_wait().
+*/
+static struct io_uring_sqe *uring_sqe(Uring *p){
+  unsigned tail;
+  struct io_uring_sqe *pSqe;
+  if( p->nFlight+(int)p->nPending>=URING_DEPTH ) return 0;
+  tail = *p->sqTail + p->nPending;
+  if( tail - __atomic_load_n(p->sqHead, __ATOMIC_ACQUIRE) > p->sqMask ){
+    return 0;
+  }
+  pSqe = &p->aSqe[tail & p->sqMask];
+  memset(pSqe, 0, sizeof(*pSqe));
+  p->sqArray[tail & p->sqMask] = tail & p->sqMask;
+  p->nPending++;
+  return pSqe;
+}
+
+/*
+** Submit all queued entries and wait until at least one request has
+** completed.  Return 0 on success or non-zero if the kernel refused.
+*/
+static int uring_wait(Uring *p){
+  int rc;
+  unsigned nSubmit = p->nPending;
+  __atomic_store_n(p->sqTail, *p->sqTail + nSubmit, __ATOMIC_RELEASE);
+  p->nPending = 0;
+  p->nFlight += nSubmit;
+  for(;;){
+    rc = (int)syscall(__NR_io_uring_enter, p->fd, nSubmit, 1,
+                      IORING_ENTER_GETEVENTS, 0, 0);
+    if( rc<0 ){
+      if( errno==EINTR || errno==EAGAIN || errno==EBUSY ) continue;
+      return 1;
+    }
+    if( (unsigned)rc>=nSubmit ) return 0;
+    nSubmit -= rc;
+  }
+}
+
+/*
+** Remove the next completion from the completion queue.  Return 1 and
+** set *piData and *pRes if there was one, or 0 if the queue is empty.
+*/
+static int uring_next(Uring *p, sqlite3_uint64 *piData, int *pRes){
+  unsigned head = *p->cqHead;
+  struct io_uring_cqe *pCqe;
+  if( head==__atomic_load_n(p->cqTail, __ATOMIC_ACQUIRE) ) return 0;
+  pCqe = &p->aCqe[head & p->cqMask];
+  *piData = pCqe->user_data;
+  *pRes = pCqe->res;
+  __atomic_store_n(p->cqHead, head+1, __ATOMIC_RELEASE);
+  p->nFlight--;
+  return 1;
+}
+
+/*
+** Convert a struct statx into the equivalent of what file_stat_info()
+** would have reported.
+*/
+static void uring_statx_to_info(const struct statx *pX, FileStatInfo *pInfo){
+  file_stat_info_fill(pInfo, pX->stx_mode, pX->stx_size,
+      pX->stx_mtime.tv_sec,
+      (i64)pX->stx_mtime.tv_sec*1000000000 + pX->stx_mtime.tv_nsec,
+      (i64)pX->stx_ctime.tv_sec*1000000000 + pX->stx_ctime.tv_nsec,
+      makedev(pX->stx_dev_major, pX->stx_dev_minor), pX->stx_ino);
+}
+#endif /* FOSSIL_HAVE_IO_URING */
+
+/*
+** Return true if io_uring is to be used.  The first call checks the
+** checkout-io-uring setting and, if it is on, tries to set up a ring
+** to find out whether the kernel allows it.
+*/
+int uring_available(void){
+#ifdef FOSSIL_HAVE_IO_URING
+  if( uringState==0 ){
+    Uring ring;
+    if( !db_get_boolean("checkout-io-uring", 0) ){
+      uringState = 2;
+    }else if( uring_setup(&ring)==0 ){
+      uring_close(&ring);
+      uringState = 1;
+    }
+  }
+  return uringState==1;
+#else
+  return 0;
+#endif
+}
+
+/*
+** Use io_uring in this process if bOn is true and the kernel allows it,
+** whatever the checkout-io-uring setting says.  Never use it if bOn is
+** false.  This is used by test commands.
+*/
+void uring_override(int bOn){
+  uringState = 2;
+#ifdef FOSSIL_HAVE_IO_URING
+  if( bOn ){
+    Uring ring;
+    if( uring_setup(&ring)==0 ){
+      uring_close(&ring);
+      uringState = 1;
+    }
+  }
+#endif
+}
+
+#ifdef FOSSIL_HAVE_IO_URING
+/*
+** Open a ring, if io_uring is to be used.  Return 0 on success, or
+** non-zero if io_uring is not to be used.
+*/
+static int uring_open(Uring *p){
+  if( !uring_available() ){
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+    return 1;
+  }
+  return uring_setup(p);
+}
+#endif
+
+/*
+** Fill aInfo[] with information about each of the n files named in
+** azName[], as file_stat_info() with eFType would, using io_uring.
+** Return 0 on success, or non-zero if io_uring is not available.
+*/
+int uring_stat_batch(
+  int n,                    /* Number of files */
+  const char **azName,      /* Names of the files */
+  int eFType,               /* ExtFILE, RepoFILE, or SymFILE */
+  FileStatInfo *aInfo       /* Write results here */
+){
+#ifdef FOSSIL_HAVE_IO_URING
+  Uring ring;
+  struct statx *aX;
+  int iNext = 0;
+  int flags = AT_STATX_SYNC_AS_STAT;
+  if( uring_open(&ring) ) return 1;
+  if( (eFType==RepoFILE && db_allow_symlinks()) || eFType==SymFILE ){
+    flags |= AT_SYMLINK_NOFOLLOW;
+  }
+  aX = fossil_malloc(sizeof(aX[0])*(n>0 ? n : 1));
+  while( iNext<n || ring.nFlight>0 ){
+    struct io_uring_sqe *pSqe;
+    sqlite3_uint64 iData;
+    int res;
+    while( iNext<n && (pSqe = uring_sqe(&ring))!=0 ){
+      pSqe->opcode = IORING_OP_STATX;
+      pSqe->fd = AT_FDCWD;
+      pSqe->addr = (sqlite3_uint64)(size_t)azName[iNext];
+      pSqe->len = STATX_BASIC_STATS;
+      pSqe->off = (sqlite3_uint64)(size_t)&aX[iNext];
+      pSqe->statx_flags = flags;
+      pSqe->user_data = iNext;
+      iNext++;
+    }
+    if( uring_wait(&ring) ) break;
+    while( uring_next(&ring, &iData, &res) ){
+      int i = (int)iData;
+      if( res==0 ){
+        uring_statx_to_info(&aX[i], &aInfo[i]);
+      }else if( res==-ENOENT || res==-ENOTDIR ){
+        file_stat_info_fill(&aInfo[i], 0, -1, 0, 0, 0, 0, 0);
+      }else{
+        file_stat_info(azName[i], eFType, &aInfo[i]);
+      }
+    }
+  }
+  if( ring.nFlight>0 ){
+    /* io_uring_enter() failed outright.  The kernel may still write into
+    ** aX[] for requests that were in flight, so it is not freed. */
+    uring_close(&ring);
+    uringState = 2;
+    return 1;
+  }
+  uring_close(&ring);
+  fossil_free(aX);
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+#ifdef FOSSIL_HAVE_IO_URING
+/*
+** Queue the next request for file i of a uring_read_batch(): an open
+** if aFd[i] is negative, or else a read into the unused space at the
+** end of aContent[i].  The caller guarantees that there is room in the
+** ring.
+*/
+static void uring_read_step(
+  Uring *pRing,             /* The ring */
+  int i,                    /* Index of the file */
+  const char *zName,        /* Name of the file */
+  int fd,                   /* Open descriptor for the file, or -1 */
+  Blob *pContent            /* Content read so far */
+){
+  struct io_uring_sqe *pSqe = uring_sqe(pRing);
+  assert( pSqe!=0 );
+  pSqe->user_data = i;
+  if( fd<0 ){
+    pSqe->opcode = IORING_OP_OPENAT;
+    pSqe->fd = AT_FDCWD;
+    pSqe->addr = (sqlite3_uint64)(size_t)zName;
+    pSqe->open_flags = O_RDONLY|O_CLOEXEC;
+  }else{
+    int nUsed = blob_size(pContent);
+    if( pContent->nAlloc - nUsed < 4096 ){
+      blob_reserve(pContent, pContent->nAlloc*2 + 65536);
+    }
+    pSqe->opcode = IORING_OP_READ;
+    pSqe->fd = fd;
+    pSqe->addr = (sqlite3_uint64)(size_t)(blob_buffer(pContent)+nUsed);
+    pSqe->len = pContent->nAlloc - nUsed;
+    pSqe->off = nUsed;
+  }
+}
+#endif /* FOSSIL_HAVE_IO_URING */
+
+/*
+** Read the complete content of each of the n files named in azName[]
+** into aContent[], which must be zeroed blobs, using io_uring.  Set
+** aRc[i] to 0 on success or to -1 if file i cannot be read.  Symbolic
+** links are followed.  Return 0 on success.  Return non-zero, with
+** aContent[] still zeroed, if io_uring is not available.
+**
+** Each file is opened and then read with as many requests as needed,
+** and up to URING_DEPTH files are in progress at once.
+*/
+int uring_read_batch(
+  int n,                    /* Number of files */
+  const char **azName,      /* Names of the files */
+  Blob *aContent,           /* Write file content here */
+  int *aRc                  /* Write result codes here */
+){
+#ifdef FOSSIL_HAVE_IO_URING
+  Uring ring;
+  int *aFd;                 /* Descriptor for each file, or -1 */
+  int iNext = 0;            /* Next file not yet started */
+  int i;
+  int bFail = 0;            /* True if io_uring_enter() failed */
+  if( uring_open(&ring) ) return 1;
+  aFd = fossil_malloc(sizeof(aFd[0])*(n>0 ? n : 1));
+  for(i=0; i<n; i++){
+    aFd[i] = -1;
+    aRc[i] = -1;
+  }
+  while( iNext<n || ring.nFlight>0 || ring.nPending>0 ){
+    sqlite3_uint64 iData;
+    int res;
+    while( iNext<n && ring.nFlight+(int)ring.nPending<URING_DEPTH ){
+      uring_read_step(&ring, iNext, azName[iNext], -1, 0);
+      iNext++;
+    }
+    if( uring_wait(&ring) ){
+      bFail = 1;
+      break;
+    }
+    while( uring_next(&ring, &iData, &res) ){
+      /* Each completion frees the slot that the next step for the same
+      ** file then takes */
+      i = (int)iData;
+      if( aFd[i]<0 ){
+        if( res<0 ) continue;
+        aFd[i] = res;
+      }else if( res>0 ){
+        aContent[i].nUsed += res;
+      }else{
+        /* End of file, or an error */
+        if( res==0 ) aRc[i] = 0;
+        close(aFd[i]);
+        aFd[i] = -1;
+        continue;
+      }
+      uring_read_step(&ring, i, azName[i], aFd[i], &aContent[i]);
+    }
+  }
+  uring_close(&ring);
+  if( bFail ){
+    /* io_uring_enter() failed outright.  The kernel may still write into
+    ** the buffers of requests that were in flight, so they are not
+    ** freed.  Let the caller read every file the ordinary way. */
+    for(i=0; i<n; i++){
+      if( aFd[i]>=0 ) close(aFd[i]);
+      blob_zero(&aContent[i]);
+    }
+    fossil_free(aFd);
+    uringState = 2;
+    return 1;
+  }
+  fossil_free(aFd);
+  return 0;
+#else
+  return 1;
+#endif
+}
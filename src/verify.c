@@ -62,6 +62,20 @@ static void verify_rid(int rid){
 static Bag toVerify;
 static int inFinalVerify = 0;
 
+/*
+** Records whose content was checked by the caller before it was
+** written, together with the number of bytes written to BLOB.CONTENT.
+** These only have their stored size checked prior to committing.
+*/
+static struct {
+  int n;                /* Number of entries in a[] */
+  int nAlloc;           /* Allocated size of a[] */
+  struct {
+    int rid;            /* The record */
+    int nByte;          /* Expected octet_length(BLOB.CONTENT) */
+  } *a;
+} preVerified;
+
 /*
 ** This routine is called just prior to each commit operation.
 **
@@ -70,8 +84,18 @@ static int inFinalVerify = 0;
 */
 static int verify_at_commit(void){
   int rid;
+  int i;
   content_clear_cache(0);
   inFinalVerify = 1;
+  for(i=0; i<preVerified.n; i++){
+    rid = preVerified.a[i].rid;
+    if( bag_find(&toVerify, rid) ) continue;
+    if( db_int(-1, "SELECT octet_length(content) FROM blob WHERE rid=%d",
+               rid)!=preVerified.a[i].nByte ){
+      verify_rid(rid);
+    }
+  }
+  preVerified.n = 0;
   rid = bag_first(&toVerify);
   while( rid>0 ){
     verify_rid(rid);
@@ -101,11 +125,35 @@ void verify_before_commit(int rid){
   }
 }
 
+/*
+** Record rid, which was passed to verify_before_commit() because its
+** content was just written, as one whose content the caller has already
+** checked: it has made sure that the nByte bytes written to BLOB.CONTENT
+** reproduce the artifact.  Such a record is not reconstructed and hashed
+** again prior to committing.  Only its stored size is checked, and a
+** mismatch falls back to the full verification.
+**
+** This is a no-op if rid is not waiting to be verified.
+*/
+void verify_before_commit_checked(int rid, int nByte){
+  if( !bag_find(&toVerify, rid) ) return;
+  bag_remove(&toVerify, rid);
+  if( preVerified.n>=preVerified.nAlloc ){
+    preVerified.nAlloc = preVerified.nAlloc*2 + 100;
+    preVerified.a = fossil_realloc(preVerified.a,
+                           preVerified.nAlloc*sizeof(preVerified.a[0]));
+  }
+  preVerified.a[preVerified.n].rid = rid;
+  preVerified.a[preVerified.n].nByte = nByte;
+  preVerified.n++;
+}
+
 /*
 ** Cancel all pending verification operations.
 */
 void verify_cancel(void){
   bag_clear(&toVerify);
+  preVerified.n = 0;
 }
 
 /*
@@ -21,6 +21,14 @@
 #include "vfile.h"
 #include <assert.h>
 #include <sys/types.h>
+#if defined(_WIN32)
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
+#ifdef FOSSIL_HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 /*
 ** The input is guaranteed to be a 40- or 64-character well-formed
@@ -137,6 +145,389 @@ int load_vfile_from_rid(int vid){
 
 #endif /* INTERFACE */
 
+/*
+** SETTING: checkout-threads      width=8 default=1
+** The number of threads used to examine the files of a check-out.
+** When greater than 1, commands such as "fossil status" and
+** "fossil commit" stat and hash several files at once, which is much
+** faster for large check-outs on multi-core machines.  Commands such
+** as "fossil extras", "fossil addremove" and "fossil clean" also read
+** several directories at once, which helps most on network file
+** systems.  "fossil commit" also reads, hashes and compresses several
+** changed files at once.  The database is still only accessed from a
+** single thread.
+** Values are limited to the range 1 through 64.
+*/
+
+/*
+** Return the number of threads to use for work on the files of
+** the current check-out, according to the checkout-threads setting.
+*/
+int vfile_thread_count(void){
+  int n = db_get_int("checkout-threads", 1);
+  if( n<1 ) n = 1;
+  if( n>64 ) n = 64;
+  return n;
+}
+
+/*
+** VFILE.FSTAT records that a file on disk holds the content of the
+** artifact VFILE.MRID, so that the file need not be hashed again for
+** as long as stat() says the same things about it.  The value is the
+** artifact hash, the time in nanoseconds at or before which the file
+** was stat()ed, and the FileStatInfo.zSig signature, separated by
+** spaces.
+**
+** A file that is modified soon after it is stat()ed might keep the
+** same signature if the file system timestamps are coarse.  So a
+** signature is not trusted unless the last change to the file is
+** older, by VFILE_RACY_NS, than the time at which the signature was
+** recorded.  A file with such a "racy" signature is judged as if it
+** had no signature: by its mtime, or by hashing it when the mtime cannot
+** be used.
+*/
+#define VFILE_RACY_NS ((i64)2000000000)
+
+/*
+** Write into zOut[] the VFILE.FSTAT value which records that the file
+** described by pInfo, which was stat()ed no earlier than time iNow,
+** holds the artifact zUuid.
+*/
+static void vfile_fstat_format(
+  char *zOut,                   /* Write the value here */
+  int nOut,                     /* Size of zOut[] */
+  const char *zUuid,            /* Hash of the artifact in the file */
+  i64 iNow,                     /* From file_current_time_ns() */
+  const FileStatInfo *pInfo     /* The file as seen by file_stat_info() */
+){
+  sqlite3_snprintf(nOut, zOut, "%s %lld %s", zUuid, iNow, pInfo->zSig);
+}
+
+/*
+** Possible results of vfile_fstat_state()
+*/
+#define VFILE_FSTAT_DIFFERS  0   /* No signature, or it does not match */
+#define VFILE_FSTAT_RACY     1   /* Matches, but too new to be trusted */
+#define VFILE_FSTAT_TRUSTED  2   /* The file holds the artifact */
+
+/*
+** Compare zFstat, a VFILE.FSTAT value, against the file described by
+** pInfo and the artifact zUuid.  Return one of the VFILE_FSTAT_xxx
+** values.
+*/
+static int vfile_fstat_state(
+  const char *zFstat,           /* VFILE.FSTAT.  May be NULL */
+  const char *zUuid,            /* Hash of VFILE.MRID.  May be NULL */
+  const FileStatInfo *pInfo     /* The file as seen by file_stat_info() */
+){
+  int n;
+  char *zEnd;
+  i64 iRecorded;
+  if( zFstat==0 || zUuid==0 || pInfo->zSig[0]==0 ){
+    return VFILE_FSTAT_DIFFERS;
+  }
+  n = (int)strlen(zUuid);
+  if( strncmp(zFstat, zUuid, n)!=0 || zFstat[n]!=' ' ){
+    return VFILE_FSTAT_DIFFERS;
+  }
+  iRecorded = strtoll(&zFstat[n+1], &zEnd, 10);
+  if( zEnd[0]!=' ' || strcmp(&zEnd[1], pInfo->zSig)!=0 ){
+    return VFILE_FSTAT_DIFFERS;
+  }
+  if( pInfo->iNewestNs < iRecorded - VFILE_RACY_NS ){
+    return VFILE_FSTAT_TRUSTED;
+  }
+  return VFILE_FSTAT_RACY;
+}
+
+/*
+** Return true if zFstat, a VFILE.FSTAT value, shows that the file
+** described by pInfo holds the artifact zUuid, without any need to
+** read the file.
+*/
+static int vfile_fstat_trusted(
+  const char *zFstat,           /* VFILE.FSTAT.  May be NULL */
+  const char *zUuid,            /* Hash of VFILE.MRID.  May be NULL */
+  const FileStatInfo *pInfo     /* The file as seen by file_stat_info() */
+){
+  return vfile_fstat_state(zFstat, zUuid, pInfo)==VFILE_FSTAT_TRUSTED;
+}
+
+/*
+** Return true if zFstat, a VFILE.FSTAT value, shows that the file
+** zFullname still holds the artifact zUuid.  Only the file's stat
+** signature is examined, never its content.
+*/
+int vfile_fstat_matches(
+  const char *zFullname,        /* Full pathname of the file on disk */
+  const char *zFstat,           /* VFILE.FSTAT.  May be NULL */
+  const char *zUuid             /* Hash of VFILE.MRID.  May be NULL */
+){
+  FileStatInfo info;
+  if( zFstat==0 || zUuid==0 ) return 0;
+  file_stat_info(zFullname, RepoFILE, &info);
+  return vfile_fstat_trusted(zFstat, zUuid, &info);
+}
+
+/*
+** Set VFILE.FSTAT for the entry id to record that the file described
+** by pInfo holds the artifact zUuid, or clear it if either zUuid or
+** pInfo is NULL.  iNow is a time from file_current_time_ns() taken
+** before pInfo was filled in and before the content of the file was
+** last read or written.
+*/
+void vfile_set_fstat(
+  int id,                       /* VFILE.ID */
+  const char *zUuid,            /* Hash of the artifact in the file */
+  i64 iNow,                     /* From file_current_time_ns() */
+  const FileStatInfo *pInfo     /* The file as seen by file_stat_info() */
+){
+  char zFstat[200];
+  if( zUuid==0 || pInfo==0 || pInfo->zSig[0]==0 ){
+    db_multi_exec("UPDATE vfile SET fstat=NULL WHERE id=%d", id);
+  }else{
+    vfile_fstat_format(zFstat, sizeof(zFstat), zUuid, iNow, pInfo);
+    db_multi_exec("UPDATE vfile SET fstat=%Q WHERE id=%d", zFstat, id);
+  }
+}
+
+/*
+** The number of files hashed by vfile_check_signature() since the
+** process started.  Used by the test-check-signature command.
+*/
+static int vfileNHashed = 0;
+
+/*
+** One VFILE entry being examined by vfile_check_signature().  The
+** first group of fields comes from the VFILE table.  The second group
+** is filled in by vfile_check_one(), possibly in a worker thread.
+*/
+typedef struct VfileCheck VfileCheck;
+struct VfileCheck {
+  int id;               /* VFILE.ID */
+  int rid;              /* VFILE.MRID */
+  int isDeleted;        /* VFILE.DELETED */
+  int oldChnged;        /* VFILE.CHNGED */
+  int origPerm;         /* PERM_REG, PERM_EXE, or PERM_LNK from VFILE */
+  i64 oldMtime;         /* VFILE.MTIME */
+  i64 origSize;         /* Size of the checked-out artifact */
+  char *zName;          /* Full pathname of the file */
+  char *zUuid;          /* Hash of the checked-out artifact, or NULL */
+  char *zFstat;         /* VFILE.FSTAT, or NULL */
+  const FileStatInfo *pInfo;  /* The file as stat'ed in advance, or NULL */
+  i64 iNow;             /* Time taken before pInfo was filled in */
+
+  int chnged;           /* New value of VFILE.CHNGED */
+  int didHash;          /* True if the file content was hashed */
+  int eFstat;           /* 1: set VFILE.FSTAT to zNewFstat.  2: clear it */
+  char zNewFstat[200];  /* New value of VFILE.FSTAT when eFstat==1 */
+  int notFile;          /* Exists but is not a file or allowed symlink */
+  int currentPerm;      /* Permissions of the file on disk */
+  i64 currentMtime;     /* Mtime of the file on disk.  -1 if missing */
+  i64 currentSize;      /* Size of the file on disk.  -1 if missing */
+};
+
+/*
+** Return true if the content of the file described by p has the hash
+** p->zUuid.  If it does, arrange for a new VFILE.FSTAT to be recorded
+** from pInfo and iNow.
+*/
+static int vfile_check_hash(
+  VfileCheck *p,                /* The file to hash */
+  i64 iNow,                     /* Time taken before pInfo was filled in */
+  const FileStatInfo *pInfo     /* The file as seen by file_stat_info() */
+){
+  int nUuid = p->zUuid ? (int)strlen(p->zUuid) : 0;
+  p->didHash = 1;
+  if( !hname_verify_file_hash(p->zName, p->zUuid, nUuid) ) return 0;
+  if( nUuid>0 && pInfo->zSig[0] ){
+    vfile_fstat_format(p->zNewFstat, sizeof(p->zNewFstat), p->zUuid,
+                       iNow, pInfo);
+    p->eFstat = 1;
+  }
+  return 1;
+}
+
+/*
+** Stat the file described by p, unless p->pInfo already describes it,
+** and if its size, mtime, VFILE.FSTAT or useMtime say that is necessary,
+** hash its content to decide whether or not it has changed.  If useFstat
+** is false, a matching VFILE.FSTAT is not trusted.  This routine does
+** not touch the database or any other shared state, so it may run in
+** a worker thread.
+*/
+static void vfile_check_one(VfileCheck *p, int useMtime, int useFstat){
+  FileStatInfo info;
+  i64 iNow;
+  int eFstat;           /* How VFILE.FSTAT compares.  VFILE_FSTAT_xxx */
+  int isTrusted;        /* VFILE.FSTAT shows the file to be unchanged */
+  int chnged = p->oldChnged;
+
+  if( p->pInfo ){
+    iNow = p->iNow;
+    info = *p->pInfo;
+  }else{
+    iNow = file_current_time_ns();
+    file_stat_info(p->zName, RepoFILE, &info);
+  }
+  p->currentSize = info.size;
+  p->currentMtime = info.mtime;
+  p->currentPerm = info.perm;
+  eFstat = useFstat ? vfile_fstat_state(p->zFstat, p->zUuid, &info)
+                   : VFILE_FSTAT_DIFFERS;
+  isTrusted = eFstat==VFILE_FSTAT_TRUSTED;
+  if( chnged==0 && (p->isDeleted || p->rid==0) ){
+    /* "fossil rm" or "fossil add" always change the file */
+    chnged = 1;
+  }else if( !info.isFileOrLink && p->currentSize>=0 ){
+    p->notFile = 1;
+    chnged = 1;
+  }
+  if( p->origSize!=p->currentSize ){
+    if( chnged!=1 ){
+      /* A file size change is definitive - the file has changed.  No
+      ** need to check the mtime or hash */
+      chnged = 1;
+    }
+  }else if( chnged==1 && p->rid!=0 && !p->isDeleted ){
+    /* File is believed to have changed but it is the same size.
+    ** Double check that it really has changed by looking at content. */
+    if( isTrusted || vfile_check_hash(p, iNow, &info) ) chnged = 0;
+  }else if( (chnged==0 || chnged==2 || chnged==4)
+         && (useMtime==0 || p->currentMtime!=p->oldMtime
+             || (p->zFstat && eFstat==VFILE_FSTAT_DIFFERS)) ){
+    /* For files that were formerly believed to be unchanged or that were
+    ** changed by merging, if their mtime changes, or if their recorded
+    ** stat signature no longer matches, or unconditionally if --hash is
+    ** used, check to see if they have been edited by looking at their
+    ** artifact hashes.  A signature that matches but was racy, as is
+    ** usual for files just written by a check-out, does not force a hash
+    ** by itself: the mtime decides, as it would without a signature. */
+    if( !isTrusted && !vfile_check_hash(p, iNow, &info) ) chnged = 1;
+  }
+  if( p->eFstat==0 && p->zFstat && eFstat==VFILE_FSTAT_DIFFERS ){
+    /* Forget a stat signature that no longer describes the file */
+    p->eFstat = 2;
+  }
+  p->chnged = chnged;
+}
+
+#ifdef FOSSIL_HAVE_PTHREAD
+/*
+** Work shared by the threads of vfile_check_signature()
+*/
+typedef struct VfileCheckPool VfileCheckPool;
+struct VfileCheckPool {
+  pthread_mutex_t mutex;  /* Protects iNext */
+  VfileCheck *a;          /* Entries to examine */
+  int n;                  /* Number of entries in a[] */
+  int iNext;              /* Next entry not yet claimed by any thread */
+  int useMtime;           /* Passed through to vfile_check_one() */
+  int useFstat;           /* Passed through to vfile_check_one() */
+};
+
+/*
+** Claim and examine batches of entries until none are left.  This is
+** the body of each worker thread, and the main thread runs it too.
+*/
+static void *vfile_check_worker(void *pArg){
+  VfileCheckPool *pPool = (VfileCheckPool*)pArg;
+  for(;;){
+    int i, iEnd;
+    pthread_mutex_lock(&pPool->mutex);
+    i = pPool->iNext;
+    iEnd = pPool->iNext = i+16<pPool->n ? i+16 : pPool->n;
+    pthread_mutex_unlock(&pPool->mutex);
+    if( i>=iEnd ) break;
+    for(; i<iEnd; i++){
+      vfile_check_one(&pPool->a[i], pPool->useMtime, pPool->useFstat);
+    }
+  }
+  return 0;
+}
+#endif /* FOSSIL_HAVE_PTHREAD */
+
+/*
+** Run vfile_check_one() on all n entries of a[], using up to nThread
+** threads.
+*/
+static void vfile_check_range(
+  VfileCheck *a,          /* Entries to examine */
+  int n,                  /* Number of entries in a[] */
+  int useMtime,           /* Passed through to vfile_check_one() */
+  int useFstat,           /* Passed through to vfile_check_one() */
+  int nThread             /* Maximum number of threads to use */
+){
+  int i;
+#ifdef FOSSIL_HAVE_PTHREAD
+  if( nThread>1 && n>1 ){
+    VfileCheckPool pool;
+    pthread_t aThread[64];
+    int nStarted = 0;
+    pthread_mutex_init(&pool.mutex, 0);
+    pool.a = a;
+    pool.n = n;
+    pool.iNext = 0;
+    pool.useMtime = useMtime;
+    pool.useFstat = useFstat;
+    while( nStarted<nThread-1
+        && pthread_create(&aThread[nStarted], 0, vfile_check_worker, &pool)==0
+    ){
+      nStarted++;
+    }
+    vfile_check_worker(&pool);
+    for(i=0; i<nStarted; i++) pthread_join(aThread[i], 0);
+    pthread_mutex_destroy(&pool.mutex);
+    return;
+  }
+#endif
+  for(i=0; i<n; i++) vfile_check_one(&a[i], useMtime, useFstat);
+}
+
+/*
+** Number of files stat'ed together by vfile_check_all()
+*/
+#define VFILE_STAT_BATCH 4096
+
+/*
+** Run vfile_check_one() on all n entries of a[].  Where batched stat is
+** cheap (io_uring on Linux) the files are stat'ed in large batches by
+** file_stat_info_batch() first, and only those that need hashing keep
+** the worker threads busy.  Otherwise each thread stats its own files.
+*/
+static void vfile_check_all(
+  VfileCheck *a,          /* Entries to examine */
+  int n,                  /* Number of entries in a[] */
+  int useMtime,           /* Passed through to vfile_check_one() */
+  int useFstat,           /* Passed through to vfile_check_one() */
+  int nThread             /* Maximum number of threads to use */
+){
+  FileStatInfo *aInfo;
+  const char **azName;
+  int i, j, k;
+  if( n<2 || !file_batch_available() ){
+    vfile_check_range(a, n, useMtime, useFstat, nThread);
+    return;
+  }
+  k = n<VFILE_STAT_BATCH ? n : VFILE_STAT_BATCH;
+  aInfo = fossil_malloc(sizeof(aInfo[0])*k);
+  azName = fossil_malloc(sizeof(azName[0])*k);
+  for(i=0; i<n; i+=k){
+    int nBatch = n-i<k ? n-i : k;
+    i64 iNow = file_current_time_ns();
+    for(j=0; j<nBatch; j++) azName[j] = a[i+j].zName;
+    file_stat_info_batch(nBatch, azName, RepoFILE, aInfo);
+    for(j=0; j<nBatch; j++){
+      a[i+j].pInfo = &aInfo[j];
+      a[i+j].iNow = iNow;
+    }
+    vfile_check_range(&a[i], nBatch, useMtime, useFstat, nThread);
+    for(j=0; j<nBatch; j++) a[i+j].pInfo = 0;
+  }
+  fossil_free(aInfo);
+  fossil_free(azName);
+}
+
 /*
 ** Look at every VFILE entry with the given vid and update VFILE.CHNGED field
 ** according to whether or not the file has changed.
@@ -169,123 +560,626 @@ int load_vfile_from_rid(int vid){
 ** If the mtime is used, it is used only to determine if files are the same.
 ** If the mtime of a file has changed, we still examine the on-disk content
 ** to see whether or not the edit was a null-edit.
+**
+** Whenever the content of a file is found to be unchanged, a signature
+** of everything that stat() says about the file is saved in VFILE.FSTAT.
+** Unless CKSIG_HASH is set, a file whose signature still matches and
+** which was not modified just before the signature was taken is known
+** to be unchanged without hashing it, even if its mtime has changed or
+** the mtime-changes setting is false.  A file whose signature does not
+** match is hashed even if its mtime has not changed.  A signature that
+** matches but was taken just after the file was modified is treated as
+** if there were no signature.
+**
+** The files are examined, and hashed where necessary, by the number of
+** threads given by the checkout-threads setting.  The VFILE table is
+** read beforehand and updated afterwards by the main thread alone.
+**
+** If an fsmonitor daemon is watching the check-out, and a token from
+** an earlier call for the same vid is available, then only the files
+** that the daemon reports as changed since that token are examined,
+** together with those that are already known to be added, removed,
+** renamed or changed.  See fsmonitor.c.
+**
+** Unchanged files that are outside of a sparse check-out are not on
+** disk and are not examined.  See sparse.c.
 */
 void vfile_check_signature(int vid, unsigned int cksigFlags){
   int nErr = 0;
   Stmt q;
+  VfileCheck *a = 0;
+  int n = 0, nAlloc = 0;
+  int i;
   int useMtime = (cksigFlags & CKSIG_HASH)==0
                     && db_get_boolean("mtime-changes", 1);
+  int eMonitor = 0;       /* Result of fsmonitor_query() */
+  char *zToken = 0;       /* New fsmonitor token */
 
   db_begin_transaction();
+  if( (cksigFlags & (CKSIG_HASH|CKSIG_SETMTIME))==0 ){
+    Blob changed;
+    char *zOld = db_lget("fsmonitor-token", 0);
+    char *zPrefix = mprintf("%d ", vid);
+    int nPrefix = (int)strlen(zPrefix);
+    if( zOld && strncmp(zOld, zPrefix, nPrefix)!=0 ){
+      /* A token saved for some other check-out version is useless */
+      fossil_free(zOld);
+      zOld = 0;
+    }
+    eMonitor = fsmonitor_query(zOld ? zOld+nPrefix : 0, &changed, &zToken);
+    if( eMonitor==2 ){
+      const char *z = blob_buffer(&changed);
+      int n = blob_size(&changed);
+      db_multi_exec(
+        "CREATE TEMP TABLE IF NOT EXISTS fsm_file(name TEXT PRIMARY KEY);"
+        "CREATE TEMP TABLE IF NOT EXISTS fsm_dir(name TEXT PRIMARY KEY);"
+        "DELETE FROM fsm_file; DELETE FROM fsm_dir;"
+      );
+      while( n>0 ){
+        int k = (int)strlen(z);
+        if( k>0 ){
+          db_multi_exec("INSERT OR IGNORE INTO %s VALUES(%Q)",
+                        z[k-1]=='/' ? "fsm_dir" : "fsm_file", z);
+        }
+        z += k+1;
+        n -= k+1;
+      }
+    }
+    blob_reset(&changed);
+    fossil_free(zPrefix);
+    fossil_free(zOld);
+  }
   db_prepare(&q, "SELECT id, %Q || pathname,"
                  "       vfile.mrid, deleted, chnged, uuid, size, mtime,"
-                 "      CASE WHEN isexe THEN %d WHEN islink THEN %d ELSE %d END"
+                 "      CASE WHEN isexe THEN %d WHEN islink THEN %d ELSE %d END,"
+                 "       fstat"
                  "  FROM vfile LEFT JOIN blob ON vfile.mrid=blob.rid"
-                 " WHERE vid=%d ", g.zLocalRoot, PERM_EXE, PERM_LNK, PERM_REG,
-                 vid);
+                 " WHERE vid=%d AND NOT %s %s",
+                 g.zLocalRoot, PERM_EXE, PERM_LNK, PERM_REG,
+                 vid, sparse_hidden_sql(), eMonitor!=2 ? "" :
+                 "   AND (chnged OR deleted OR vfile.mrid=0"
+                 "        OR origname IS NOT NULL"
+                 "        OR pathname IN (SELECT name FROM fsm_file)"
+                 "        OR EXISTS(SELECT 1 FROM fsm_dir"
+                 "             WHERE substr(pathname,1,length(fsm_dir.name))"
+                 "                   =fsm_dir.name))");
   while( db_step(&q)==SQLITE_ROW ){
-    int id, rid, isDeleted;
-    const char *zName;
-    int chnged = 0;
-    int oldChnged;
-#ifndef _WIN32
-    int origPerm;
-    int currentPerm;
-#endif
-    i64 oldMtime;
-    i64 currentMtime;
-    i64 origSize;
-    i64 currentSize;
-
-    id = db_column_int(&q, 0);
-    zName = db_column_text(&q, 1);
-    rid = db_column_int(&q, 2);
-    isDeleted = db_column_int(&q, 3);
-    oldChnged = chnged = db_column_int(&q, 4);
-    oldMtime = db_column_int64(&q, 7);
-    origSize = db_column_int64(&q, 6);
-    currentSize = file_size(zName, RepoFILE);
-    currentMtime = file_mtime(0, 0);
-#ifndef _WIN32
-    origPerm = db_column_int(&q, 8);
-    currentPerm = file_perm(zName, RepoFILE);
-#endif
-    if( chnged==0 && (isDeleted || rid==0) ){
-      /* "fossil rm" or "fossil add" always change the file */
-      chnged = 1;
-    }else if( !file_isfile_or_link(0) && currentSize>=0 ){
-      if( cksigFlags & CKSIG_ENOTFILE ){
-        fossil_warning("not an ordinary file: %s", zName);
-        nErr++;
-      }
-      chnged = 1;
+    VfileCheck *p;
+    if( n>=nAlloc ){
+      nAlloc = nAlloc*2 + 100;
+      a = fossil_realloc(a, nAlloc*sizeof(a[0]));
     }
-    if( origSize!=currentSize ){
-      if( chnged!=1 ){
-        /* A file size change is definitive - the file has changed.  No
-        ** need to check the mtime or hash */
-        chnged = 1;
-      }
-    }else if( chnged==1 && rid!=0 && !isDeleted ){
-      /* File is believed to have changed but it is the same size.
-      ** Double check that it really has changed by looking at content. */
-      const char *zUuid = db_column_text(&q, 5);
-      int nUuid = db_column_bytes(&q, 5);
-      assert( origSize==currentSize );
-      if( hname_verify_file_hash(zName, zUuid, nUuid) ) chnged = 0;
-    }else if( (chnged==0 || chnged==2 || chnged==4)
-           && (useMtime==0 || currentMtime!=oldMtime) ){
-      /* For files that were formerly believed to be unchanged or that were
-      ** changed by merging, if their mtime changes, or unconditionally
-      ** if --hash is used, check to see if they have been edited by
-      ** looking at their artifact hashes */
-      const char *zUuid = db_column_text(&q, 5);
-      int nUuid = db_column_bytes(&q, 5);
-      assert( origSize==currentSize );
-      if( !hname_verify_file_hash(zName, zUuid, nUuid) ) chnged = 1;
+    p = &a[n++];
+    memset(p, 0, sizeof(*p));
+    p->id = db_column_int(&q, 0);
+    p->zName = fossil_strdup(db_column_text(&q, 1));
+    p->rid = db_column_int(&q, 2);
+    p->isDeleted = db_column_int(&q, 3);
+    p->oldChnged = db_column_int(&q, 4);
+    p->zUuid = fossil_strdup(db_column_text(&q, 5));
+    p->origSize = db_column_int64(&q, 6);
+    p->oldMtime = db_column_int64(&q, 7);
+    p->origPerm = db_column_int(&q, 8);
+    p->zFstat = fossil_strdup(db_column_text(&q, 9));
+  }
+  db_finalize(&q);
+
+  vfile_check_all(a, n, useMtime, (cksigFlags & CKSIG_HASH)==0,
+                  vfile_thread_count());
+
+  for(i=0; i<n; i++){
+    VfileCheck *p = &a[i];
+    int chnged = p->chnged;
+    i64 currentMtime = p->currentMtime;
+    if( p->notFile && (cksigFlags & CKSIG_ENOTFILE) ){
+      fossil_warning("not an ordinary file: %s", p->zName);
+      nErr++;
     }
     if( (cksigFlags & CKSIG_SETMTIME) && (chnged==0 || chnged==2 || chnged==4)){
       i64 desiredMtime;
-      if( mtime_of_manifest_file(vid,rid,&desiredMtime)==0 ){
+      if( mtime_of_manifest_file(vid,p->rid,&desiredMtime)==0 ){
         if( currentMtime!=desiredMtime ){
-          file_set_mtime(zName, desiredMtime);
-          currentMtime = file_mtime(zName, RepoFILE);
+          file_set_mtime(p->zName, desiredMtime);
+          currentMtime = file_mtime(p->zName, RepoFILE);
         }
       }
     }
 #ifndef _WIN32
-    if( origPerm!=PERM_LNK && currentPerm==PERM_LNK ){
+    if( p->origPerm!=PERM_LNK && p->currentPerm==PERM_LNK ){
        /* Changing to a symlink takes priority over all other change types. */
        chnged = 7;
-    }else if( origPerm==PERM_LNK && currentPerm!=PERM_LNK ){
+    }else if( p->origPerm==PERM_LNK && p->currentPerm!=PERM_LNK ){
       /* Ditto, other direction */
       chnged = 9;
     }else if( chnged==0 || chnged==6 || chnged==7 || chnged==8 || chnged==9 ){
        /* Confirm metadata change types. */
-      if( origPerm==currentPerm ){
+      if( p->origPerm==p->currentPerm ){
         chnged = 0;
-      }else if( currentPerm==PERM_EXE ){
+      }else if( p->currentPerm==PERM_EXE ){
         chnged = 6;
-      }else if( origPerm==PERM_EXE ){
+      }else if( p->origPerm==PERM_EXE ){
         chnged = 8;
-      }else if( origPerm==PERM_LNK ){
+      }else if( p->origPerm==PERM_LNK ){
         chnged = 9;
       }
     }
 #endif
-    if( currentMtime!=oldMtime || chnged!=oldChnged ){
+    if( p->eFstat ){
+      db_multi_exec(
+        "UPDATE vfile SET mtime=%lld, chnged=%d, fstat=%Q WHERE id=%d",
+        currentMtime, chnged, p->eFstat==1 ? p->zNewFstat : 0, p->id);
+    }else if( currentMtime!=p->oldMtime || chnged!=p->oldChnged ){
       db_multi_exec("UPDATE vfile SET mtime=%lld, chnged=%d WHERE id=%d",
-                    currentMtime, chnged, id);
+                    currentMtime, chnged, p->id);
     }
+    vfileNHashed += p->didHash;
+    fossil_free(p->zName);
+    fossil_free(p->zUuid);
+    fossil_free(p->zFstat);
   }
-  db_finalize(&q);
+  fossil_free(a);
   if( nErr ) fossil_fatal("abort due to prior errors");
+  if( zToken ){
+    char *zSave = mprintf("%d %s", vid, zToken);
+    db_lset("fsmonitor-token", zSave);
+    fossil_free(zSave);
+    fossil_free(zToken);
+  }
   db_end_transaction(0);
 }
 
+/*
+** SETTING: checkout-fsync         boolean default=off
+** If enabled, each file that commands such as "fossil open", "fossil
+** checkout" and "fossil update" write into the check-out is flushed to
+** stable storage before the command moves on.  This makes those commands
+** slower, especially on large check-outs, but the new content of the
+** files is not lost if the machine crashes shortly afterwards.
+*/
+
+/*
+** One file to be written by vfile_to_disk()
+*/
+typedef struct VfileOut VfileOut;
+struct VfileOut {
+  int id;               /* VFILE.ID */
+  int rid;              /* VFILE.MRID */
+  int isExe;            /* VFILE.ISEXE */
+  int isLink;           /* VFILE.ISLINK */
+  char *zName;          /* Full pathname of the file */
+  char *zUuid;          /* Hash of artifact rid */
+  int iGroup;           /* Files with the same delta root share a group */
+  int nDepth;           /* Number of deltas between rid and its root */
+  int iOrder;           /* Position in pathname order */
+  int isWritten;        /* True if the file was written */
+};
+
+/*
+** Comparison functions for qsort() used by vfile_delta_order() and
+** vfile_to_disk()
+*/
+static int vfile_out_cmp_order(const void *pA, const void *pB){
+  return ((const VfileOut*)pA)->iOrder - ((const VfileOut*)pB)->iOrder;
+}
+static int vfile_out_cmp_root(const void *pA, const void *pB){
+  const VfileOut *a = (const VfileOut*)pA;
+  const VfileOut *b = (const VfileOut*)pB;
+  if( a->iGroup!=b->iGroup ) return a->iGroup<b->iGroup ? -1 : 1;
+  return a->iOrder - b->iOrder;
+}
+static int vfile_out_cmp_group(const void *pA, const void *pB){
+  const VfileOut *a = (const VfileOut*)pA;
+  const VfileOut *b = (const VfileOut*)pB;
+  if( a->iGroup!=b->iGroup ) return a->iGroup - b->iGroup;
+  if( a->nDepth!=b->nDepth ) return a->nDepth - b->nDepth;
+  return a->iOrder - b->iOrder;
+}
+
+/*
+** Reorder the n files of a[], which are initially in pathname order,
+** so that files whose artifacts are deltas of the same full-text
+** artifact are written one after another, shallowest delta first.
+** The intermediate artifacts that content_get() caches while building
+** one of them can then be reused for the next.  Files whose artifacts
+** share no delta chain with any other stay in pathname order, so that
+** files in the same directory are still written together.
+**
+** On entry, iGroup holds the root of the delta chain of each file and
+** nDepth its distance from that root.
+*/
+static void vfile_delta_order(VfileOut *a, int n){
+  int i, j;
+  qsort(a, n, sizeof(a[0]), vfile_out_cmp_root);
+  for(i=0; i<n; i=j){
+    int iFirst = a[i].iOrder;
+    for(j=i+1; j<n && a[j].iGroup==a[i].iGroup; j++){}
+    while( i<j ) a[i++].iGroup = iFirst;
+  }
+  qsort(a, n, sizeof(a[0]), vfile_out_cmp_group);
+}
+
+/*
+** Write the content of pBlob into the file zName, replacing any prior
+** content.  The directory that holds zName must already exist.  If
+** doSync is true, wait for the content to reach stable storage.
+**
+** This routine does not use the cached file status or call
+** fossil_fatal(), so that it is safe to call from worker threads.
+** Return NULL on success or a description of the failure.
+*/
+static const char *vfile_write_content(
+  Blob *pBlob,                  /* Content to write */
+  const char *zName,            /* Name of the file to write */
+  int doSync                    /* True to fsync() the file */
+){
+  FILE *out = fossil_fopen(zName, "wb");
+  size_t nWrote;
+  int rc;
+  if( out==0 ) return "unable to open file for writing";
+  nWrote = fwrite(blob_buffer(pBlob), 1, blob_size(pBlob), out);
+  rc = fflush(out);
+  if( doSync && rc==0 ){
+#if defined(_WIN32)
+    rc = _commit(_fileno(out));
+#else
+    rc = fsync(fileno(out));
+#endif
+  }
+  if( fclose(out)!=0 ) rc = 1;
+  if( nWrote!=blob_size(pBlob) || rc!=0 ) return "short write";
+  return 0;
+}
+
+/*
+** Write the content pContent of the VFILE entry p to disk, unless the
+** file already holds that content or the user declines to overwrite it.
+** Record the outcome in VFILE.MTIME and VFILE.FSTAT, and set p->isWritten
+** if the file was written.  The content is freed.
+*/
+static void vfile_to_disk_one(
+  VfileOut *p,                  /* The file to write */
+  Blob *pContent,               /* Content of artifact p->rid */
+  int *pPromptFlag,             /* Prompt user to confirm overwrites */
+  int doSync                    /* Flush the content to stable storage */
+){
+  const char *zName = p->zName;
+  FileStatInfo info;
+  i64 iNow;
+
+  iNow = file_current_time_ns();
+  file_stat_info(zName, RepoFILE, &info);
+  if( file_is_the_same(pContent, zName) ){
+    blob_reset(pContent);
+    if( file_setexe(zName, p->isExe) ){
+      db_multi_exec("UPDATE vfile SET mtime=%lld WHERE id=%d",
+                    file_mtime(zName, RepoFILE), p->id);
+      file_stat_info(zName, RepoFILE, &info);
+    }
+    vfile_set_fstat(p->id, p->zUuid, iNow, &info);
+    return;
+  }
+  if( *pPromptFlag && file_size(zName, RepoFILE)>=0 ){
+    Blob ans;
+    char *zMsg;
+    char cReply;
+    zMsg = mprintf("overwrite %s (a=always/y/N)? ", zName);
+    prompt_user(zMsg, &ans);
+    free(zMsg);
+    cReply = blob_str(&ans)[0];
+    blob_reset(&ans);
+    if( cReply=='a' || cReply=='A' ){
+      *pPromptFlag = 0;
+    } else if( cReply!='y' && cReply!='Y' ){
+      blob_reset(pContent);
+      return;
+    }
+  }
+  p->isWritten = 1;
+  if( file_isdir(zName, RepoFILE)==1 ){
+    /*TODO(dchest): remove directories? */
+    fossil_fatal("%s is directory, cannot overwrite", zName);
+  }
+  if( file_size(zName, RepoFILE)>=0 && (p->isLink || file_islink(0)) ){
+    file_delete(zName);
+  }
+  iNow = file_current_time_ns();
+  if( p->isLink ){
+    symlink_create(blob_str(pContent), zName);
+  }else if( doSync ){
+    const char *zErr;
+    file_mkfolder(zName, ExtFILE, 1, 0);
+    zErr = vfile_write_content(pContent, zName, 1);
+    if( zErr ) fossil_fatal("%s: \"%s\"", zErr, zName);
+  }else{
+    blob_write_to_file(pContent, zName);
+  }
+  file_setexe(zName, p->isExe);
+  blob_reset(pContent);
+  file_stat_info(zName, RepoFILE, &info);
+  db_multi_exec("UPDATE vfile SET mtime=%lld WHERE id=%d",
+                info.mtime, p->id);
+  vfile_set_fstat(p->id, p->zUuid, iNow, &info);
+}
+
+#ifdef FOSSIL_HAVE_PTHREAD
+/*
+** A file handed to the writer threads of vfile_to_disk_parallel()
+*/
+typedef struct VfileWrite VfileWrite;
+struct VfileWrite {
+  VfileOut *pOut;       /* The file to write */
+  Blob content;         /* Its content.  Kept only for VFILE_WRITE_DEFER */
+  i64 nSize;            /* Size of the content */
+  int eResult;          /* One of the VFILE_WRITE_xxx values */
+  const char *zErr;     /* Error message for VFILE_WRITE_ERROR */
+  int exeChanged;       /* True if the execute permission was changed */
+  i64 iNow;             /* Time taken before info was filled in */
+  FileStatInfo info;    /* The file after it was written */
+  VfileWrite *pNext;    /* Next entry on the same list */
+};
+
+/*
+** Allowed values for VfileWrite.eResult
+*/
+#define VFILE_WRITE_SAME   1    /* The file already had the right content */
+#define VFILE_WRITE_DONE   2    /* The file was written */
+#define VFILE_WRITE_DEFER  3    /* The main thread must deal with it */
+#define VFILE_WRITE_ERROR  4    /* The file could not be written */
+
+/*
+** State shared by the threads of vfile_to_disk_parallel()
+*/
+typedef struct VfileWritePool VfileWritePool;
+struct VfileWritePool {
+  pthread_mutex_t mutex;  /* Protects all of the fields below */
+  pthread_cond_t cond;    /* Signaled whenever any list changes */
+  VfileWrite *pHead;      /* First file waiting to be written */
+  VfileWrite *pTail;      /* Last file waiting to be written */
+  VfileWrite *pDone;      /* Files written, waiting for the main thread */
+  int nPending;           /* Files handed over but not yet on pDone */
+  i64 nBytes;             /* Content bytes of those pending files */
+  int isFinished;         /* True when no more files will be handed over */
+  int doSync;             /* True to fsync() each file */
+};
+
+/*
+** Return true if the regular file zName, which is n bytes in size,
+** holds exactly the content of pContent.  Safe for worker threads.
+*/
+static int vfile_same_content(const char *zName, i64 n, Blob *pContent){
+  FILE *in;
+  char zBuf[16384];
+  const char *z = blob_buffer(pContent);
+  i64 i = 0;
+  int same = 1;
+  if( n!=blob_size(pContent) ) return 0;
+  in = fossil_fopen(zName, "rb");
+  if( in==0 ) return 0;
+  while( same && i<n ){
+    size_t got = fread(zBuf, 1, sizeof(zBuf), in);
+    if( got==0 || i+(i64)got>n || memcmp(zBuf, &z[i], got)!=0 ) same = 0;
+    i += got;
+  }
+  if( same && fread(zBuf, 1, 1, in)!=0 ) same = 0;
+  fclose(in);
+  return same;
+}
+
+/*
+** Do the work of vfile_to_disk_one() for the ordinary file of p, as far
+** as that can be done without the database.  Anything out of the
+** ordinary on disk, such as a directory or a symlink where the file
+** should be, is left for the main thread.
+*/
+static void vfile_write_one(VfileWrite *p, int doSync){
+  const char *zName = p->pOut->zName;
+  FileStatInfo old;
+  p->iNow = file_current_time_ns();
+  if( file_stat_info(zName, RepoFILE, &old)==0 ){
+    if( !old.isFileOrLink || old.perm==PERM_LNK ){
+      p->eResult = VFILE_WRITE_DEFER;
+      return;
+    }
+    if( vfile_same_content(zName, old.size, &p->content) ){
+      blob_reset(&p->content);
+      p->exeChanged = file_setexe(zName, p->pOut->isExe);
+      if( p->exeChanged ){
+        file_stat_info(zName, RepoFILE, &p->info);
+      }else{
+        p->info = old;
+      }
+      p->eResult = VFILE_WRITE_SAME;
+      return;
+    }
+  }
+  p->iNow = file_current_time_ns();
+  p->zErr = vfile_write_content(&p->content, zName, doSync);
+  blob_reset(&p->content);
+  if( p->zErr ){
+    p->eResult = VFILE_WRITE_ERROR;
+    return;
+  }
+  file_setexe(zName, p->pOut->isExe);
+  file_stat_info(zName, RepoFILE, &p->info);
+  p->eResult = VFILE_WRITE_DONE;
+}
+
+/*
+** Write files handed over by the main thread until it says that there
+** will be no more.  This is the body of each writer thread.
+*/
+static void *vfile_write_worker(void *pArg){
+  VfileWritePool *pPool = (VfileWritePool*)pArg;
+  pthread_mutex_lock(&pPool->mutex);
+  for(;;){
+    VfileWrite *p;
+    while( pPool->pHead==0 && !pPool->isFinished ){
+      pthread_cond_wait(&pPool->cond, &pPool->mutex);
+    }
+    p = pPool->pHead;
+    if( p==0 ) break;
+    pPool->pHead = p->pNext;
+    if( pPool->pHead==0 ) pPool->pTail = 0;
+    pthread_mutex_unlock(&pPool->mutex);
+    vfile_write_one(p, pPool->doSync);
+    pthread_mutex_lock(&pPool->mutex);
+    p->pNext = pPool->pDone;
+    pPool->pDone = p;
+    pthread_cond_broadcast(&pPool->cond);
+  }
+  pthread_mutex_unlock(&pPool->mutex);
+  return 0;
+}
+
+/*
+** Record in the database the outcome of the files on list p, which the
+** writer threads have finished with, and free the list.
+*/
+static void vfile_write_finish(
+  VfileWrite *p,                /* List of files finished with */
+  int doSync                    /* Flush the content to stable storage */
+){
+  while( p ){
+    VfileWrite *pNext = p->pNext;
+    VfileOut *pOut = p->pOut;
+    switch( p->eResult ){
+      case VFILE_WRITE_SAME: {
+        if( p->exeChanged ){
+          db_multi_exec("UPDATE vfile SET mtime=%lld WHERE id=%d",
+                        p->info.mtime, pOut->id);
+        }
+        vfile_set_fstat(pOut->id, pOut->zUuid, p->iNow, &p->info);
+        break;
+      }
+      case VFILE_WRITE_DONE: {
+        pOut->isWritten = 1;
+        db_multi_exec("UPDATE vfile SET mtime=%lld WHERE id=%d",
+                      p->info.mtime, pOut->id);
+        vfile_set_fstat(pOut->id, pOut->zUuid, p->iNow, &p->info);
+        break;
+      }
+      case VFILE_WRITE_DEFER: {
+        int promptFlag = 0;
+        vfile_to_disk_one(pOut, &p->content, &promptFlag, doSync);
+        break;
+      }
+      default: {
+        fossil_fatal("%s: \"%s\"", p->zErr, pOut->zName);
+      }
+    }
+    fossil_free(p);
+    p = pNext;
+  }
+}
+
+/*
+** Write the n files of a[] to disk like vfile_to_disk_one(), with no
+** prompting.  The main thread reads each artifact from the repository,
+** in the order of a[], and hands it to nThread-1 writer threads, which
+** compare it against the file on disk and write it if necessary.
+** Symlinks are created by the main thread.
+*/
+static void vfile_to_disk_parallel(
+  VfileOut *a,                  /* Files to write */
+  int n,                        /* Number of entries in a[] */
+  int doSync,                   /* Flush the content to stable storage */
+  int nThread                   /* Number of threads to use */
+){
+  VfileWritePool pool;
+  pthread_t aThread[64];
+  int nStarted = 0;
+  int i;
+  char *zLastDir = 0;           /* Directory most recently created */
+
+  memset(&pool, 0, sizeof(pool));
+  pthread_mutex_init(&pool.mutex, 0);
+  pthread_cond_init(&pool.cond, 0);
+  pool.doSync = doSync;
+  while( nStarted<nThread-1
+      && pthread_create(&aThread[nStarted], 0, vfile_write_worker, &pool)==0
+  ){
+    nStarted++;
+  }
+  for(i=0; i<n; i++){
+    VfileOut *pOut = &a[i];
+    VfileWrite *p;
+    VfileWrite *pDone;
+    Blob content;
+    int nDir;
+    if( file_unsafe_in_tree_path(pOut->zName) ) continue;
+    content_get(pOut->rid, &content);
+    if( pOut->isLink || nStarted==0 ){
+      int promptFlag = 0;
+      vfile_to_disk_one(pOut, &content, &promptFlag, doSync);
+      continue;
+    }
+
+    /* The writer threads cannot create directories, as file_mkfolder()
+    ** uses the cached file status.  Files in the same directory tend to
+    ** come together, so remember the most recent one. */
+    nDir = (int)(strrchr(pOut->zName, '/') - pOut->zName);
+    if( zLastDir==0 || (int)strlen(zLastDir)!=nDir
+     || memcmp(zLastDir, pOut->zName, nDir)!=0
+    ){
+      fossil_free(zLastDir);
+      zLastDir = mprintf("%.*s", nDir, pOut->zName);
+      file_mkfolder(pOut->zName, ExtFILE, 1, 0);
+    }
+
+    p = fossil_malloc_zero(sizeof(*p));
+    p->pOut = pOut;
+    p->content = content;
+    p->nSize = blob_size(&content);
+    pthread_mutex_lock(&pool.mutex);
+    if( pool.pTail ){
+      pool.pTail->pNext = p;
+    }else{
+      pool.pHead = p;
+    }
+    pool.pTail = p;
+    pool.nPending++;
+    pool.nBytes += p->nSize;
+    pthread_cond_broadcast(&pool.cond);
+
+    /* Keep no more than a bounded amount of content in memory */
+    while( pool.pDone==0
+        && (pool.nPending>=256 || pool.nBytes>=64*1024*1024)
+    ){
+      pthread_cond_wait(&pool.cond, &pool.mutex);
+    }
+    pDone = pool.pDone;
+    pool.pDone = 0;
+    for(p=pDone; p; p=p->pNext){
+      pool.nPending--;
+      pool.nBytes -= p->nSize;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    vfile_write_finish(pDone, doSync);
+  }
+  fossil_free(zLastDir);
+
+  /* Wait for the writer threads to finish everything */
+  pthread_mutex_lock(&pool.mutex);
+  pool.isFinished = 1;
+  pthread_cond_broadcast(&pool.cond);
+  pthread_mutex_unlock(&pool.mutex);
+  for(i=0; i<nStarted; i++) pthread_join(aThread[i], 0);
+  vfile_write_finish(pool.pDone, doSync);
+  pthread_cond_destroy(&pool.cond);
+  pthread_mutex_destroy(&pool.mutex);
+}
+#endif /* FOSSIL_HAVE_PTHREAD */
+
 /*
 ** Write all files from vid to the disk.  Or if vid==0 and id!=0
-** write just the specific file where VFILE.ID=id.
+** write just the specific file where VFILE.ID=id.  VFILE.FSTAT is set
+** for each file written, or found to be already correct.  Files that
+** are outside of a sparse check-out are skipped when writing all files.
+**
+** When writing all files without prompting, they are taken in an order
+** that lets content_get() reuse delta bases, and they are written by the
+** number of threads given by the checkout-threads setting.  The names of
+** the files written are listed afterwards, in pathname order.
 */
 void vfile_to_disk(
   int vid,               /* vid to write to disk */
@@ -294,94 +1188,106 @@ void vfile_to_disk(
   int promptFlag         /* Prompt user to confirm overwrites */
 ){
   Stmt q;
-  Blob content;
-  int nRepos = strlen(g.zLocalRoot);
+  VfileOut *a = 0;
+  int n = 0, nAlloc = 0;
+  int i;
+  int doSync = db_get_boolean("checkout-fsync", 0);
 
   if( vid>0 && id==0 ){
-    db_prepare(&q, "SELECT id, %Q || pathname, mrid, isexe, islink"
-                   "  FROM vfile"
-                   " WHERE vid=%d AND mrid>0",
-                   g.zLocalRoot, vid);
+    /* Also find the root of the delta chain of each file, and its depth,
+    ** for use by vfile_delta_order() */
+    db_prepare(&q,
+      "WITH RECURSIVE chain(rid, src, depth) AS ("
+      "  SELECT DISTINCT mrid, mrid, 0 FROM vfile"
+      "   WHERE vid=%d AND mrid>0 AND NOT %s"
+      "  UNION ALL"
+      "  SELECT chain.rid, delta.srcid, chain.depth+1"
+      "    FROM chain JOIN delta ON delta.rid=chain.src"
+      "   WHERE chain.depth<100000"
+      "), root(rid, src, depth) AS ("
+      "  SELECT rid, src, max(depth) FROM chain GROUP BY rid"
+      ")"
+      "SELECT id, %Q || pathname, mrid, isexe, islink,"
+      "       (SELECT uuid FROM blob WHERE blob.rid=vfile.mrid),"
+      "       root.src, root.depth"
+      "  FROM vfile JOIN root ON root.rid=vfile.mrid"
+      " WHERE vid=%d AND mrid>0 AND NOT %s"
+      " ORDER BY pathname",
+      vid, sparse_hidden_sql(), g.zLocalRoot, vid, sparse_hidden_sql());
   }else{
     assert( vid==0 && id>0 );
-    db_prepare(&q, "SELECT id, %Q || pathname, mrid, isexe, islink"
+    db_prepare(&q, "SELECT id, %Q || pathname, mrid, isexe, islink,"
+                   "       (SELECT uuid FROM blob WHERE blob.rid=vfile.mrid),"
+                   "       mrid, 0"
                    "  FROM vfile"
                    " WHERE id=%d AND mrid>0",
                    g.zLocalRoot, id);
   }
   while( db_step(&q)==SQLITE_ROW ){
-    int id, rid, isExe, isLink;
-    const char *zName;
-
-    id = db_column_int(&q, 0);
-    zName = db_column_text(&q, 1);
-    rid = db_column_int(&q, 2);
-    isExe = db_column_int(&q, 3);
-    isLink = db_column_int(&q, 4);
-    if( file_unsafe_in_tree_path(zName) ){
-      continue;
-    }
-    content_get(rid, &content);
-    if( file_is_the_same(&content, zName) ){
-      blob_reset(&content);
-      if( file_setexe(zName, isExe) ){
-        db_multi_exec("UPDATE vfile SET mtime=%lld WHERE id=%d",
-                      file_mtime(zName, RepoFILE), id);
-      }
-      continue;
+    VfileOut *p;
+    if( n>=nAlloc ){
+      nAlloc = nAlloc*2 + 100;
+      a = fossil_realloc(a, nAlloc*sizeof(a[0]));
     }
-    if( promptFlag && file_size(zName, RepoFILE)>=0 ){
-      Blob ans;
-      char *zMsg;
-      char cReply;
-      zMsg = mprintf("overwrite %s (a=always/y/N)? ", zName);
-      prompt_user(zMsg, &ans);
-      free(zMsg);
-      cReply = blob_str(&ans)[0];
-      blob_reset(&ans);
-      if( cReply=='a' || cReply=='A' ){
-        promptFlag = 0;
-      } else if( cReply!='y' && cReply!='Y' ){
-        blob_reset(&content);
-        continue;
-      }
-    }
-    if( verbose ) fossil_print("%s\n", &zName[nRepos]);
-    if( file_isdir(zName, RepoFILE)==1 ){
-      /*TODO(dchest): remove directories? */
-      fossil_fatal("%s is directory, cannot overwrite", zName);
-    }
-    if( file_size(zName, RepoFILE)>=0 && (isLink || file_islink(0)) ){
-      file_delete(zName);
-    }
-    if( isLink ){
-      symlink_create(blob_str(&content), zName);
-    }else{
-      blob_write_to_file(&content, zName);
-    }
-    file_setexe(zName, isExe);
-    blob_reset(&content);
-    db_multi_exec("UPDATE vfile SET mtime=%lld WHERE id=%d",
-                  file_mtime(zName, RepoFILE), id);
+    p = &a[n++];
+    memset(p, 0, sizeof(*p));
+    p->id = db_column_int(&q, 0);
+    p->zName = fossil_strdup(db_column_text(&q, 1));
+    p->rid = db_column_int(&q, 2);
+    p->isExe = db_column_int(&q, 3);
+    p->isLink = db_column_int(&q, 4);
+    p->zUuid = fossil_strdup(db_column_text(&q, 5));
+    p->iGroup = db_column_int(&q, 6);
+    p->nDepth = db_column_int(&q, 7);
+    p->iOrder = n-1;
   }
   db_finalize(&q);
+  if( n>1 && !promptFlag ) vfile_delta_order(a, n);
+
+#ifdef FOSSIL_HAVE_PTHREAD
+  if( n>1 && !promptFlag && vfile_thread_count()>1 ){
+    vfile_to_disk_parallel(a, n, doSync, vfile_thread_count());
+  }else
+#endif
+  for(i=0; i<n; i++){
+    Blob content;
+    if( file_unsafe_in_tree_path(a[i].zName) ) continue;
+    content_get(a[i].rid, &content);
+    vfile_to_disk_one(&a[i], &content, &promptFlag, doSync);
+  }
+  if( verbose ){
+    int nRepos = (int)strlen(g.zLocalRoot);
+    qsort(a, n, sizeof(a[0]), vfile_out_cmp_order);
+    for(i=0; i<n; i++){
+      if( a[i].isWritten ) fossil_print("%s\n", &a[i].zName[nRepos]);
+    }
+  }
+  for(i=0; i<n; i++){
+    fossil_free(a[i].zName);
+    fossil_free(a[i].zUuid);
+  }
+  fossil_free(a);
 }
 
 /*
 ** Check to see if the directory named in zPath is the top of a check-out.
 ** In other words, check to see if directory pPath contains a file named
 ** "_FOSSIL_" or ".fslckout".  Return true or false.
+**
+** This routine does not use the cached file status, so that it is safe
+** to call from worker threads.
 */
 int vfile_top_of_checkout(const char *zPath){
   char *zFile;
   int fileFound = 0;
+  i64 sz;
 
   zFile = mprintf("%s/_FOSSIL_", zPath);
-  fileFound = file_size(zFile, ExtFILE)>=1024;
+  fileFound = file_stat_r(zFile, ExtFILE, &sz, 0, 0, 0)==0 && sz>=1024;
   fossil_free(zFile);
   if( !fileFound ){
     zFile = mprintf("%s/.fslckout", zPath);
-    fileFound = file_size(zFile, ExtFILE)>=1024;
+    fileFound = file_stat_r(zFile, ExtFILE, &sz, 0, 0, 0)==0 && sz>=1024;
     fossil_free(zFile);
   }
 
@@ -392,7 +1298,7 @@ int vfile_top_of_checkout(const char *zPath){
   */
   if( !fileFound ){
     zFile = mprintf("%s/.fos", zPath);
-    fileFound = file_size(zFile, ExtFILE)>=1024;
+    fileFound = file_stat_r(zFile, ExtFILE, &sz, 0, 0, 0)==0 && sz>=1024;
     fossil_free(zFile);
   }
   return fileFound;
@@ -442,6 +1348,368 @@ static int is_temporary_file(const char *zName){
 #define SCAN_ISEXE  0x020    /* Populate isexe column */
 #endif /* INTERFACE */
 
+#ifdef FOSSIL_HAVE_PTHREAD
+/*
+** A file found by vfile_scan_parallel()
+*/
+typedef struct VfileScanFile VfileScanFile;
+struct VfileScanFile {
+  char *zName;              /* Name with the first nPrefix+1 bytes removed */
+  i64 mtime;                /* Modification time, if SCAN_MTIME */
+  i64 size;                 /* Size, if SCAN_SIZE */
+  int isExe;                /* True if executable, if SCAN_ISEXE */
+};
+
+/*
+** A directory to be read by vfile_scan_parallel(), or the files that
+** were found in one.
+*/
+typedef struct VfileScanItem VfileScanItem;
+struct VfileScanItem {
+  char *zPath;              /* Full name of the directory */
+  VfileScanFile *aFile;     /* Files found in the directory */
+  int nFile;                /* Number of entries in aFile[] */
+  int nAlloc;               /* Allocated size of aFile[] */
+  VfileScanItem *pNext;     /* Next item on the same list */
+};
+
+/*
+** State shared by the threads of vfile_scan_parallel()
+*/
+typedef struct VfileScanPool VfileScanPool;
+struct VfileScanPool {
+  pthread_mutex_t mutex;    /* Protects all of the fields below */
+  pthread_cond_t cond;      /* Signaled when pTodo or nBusy changes */
+  VfileScanItem *pTodo;     /* Directories not yet claimed by any thread */
+  VfileScanItem *pDone;     /* Directories read, whose files are unsaved */
+  int nBusy;                /* Number of threads reading a directory */
+  int nPrefix;              /* Bytes of directory name to omit */
+  unsigned scanFlags;       /* Zero or more SCAN_xxx flags */
+  Glob *pIgnore1;           /* Omit files and directories matching this */
+  Glob *pIgnore2;           /* Omit files and directories matching this */
+  int eFType;               /* RepoFILE or SymFILE */
+};
+
+/*
+** Return a copy of zDir with "/" and zName appended.
+*/
+static char *vfile_scan_join(const char *zDir, const char *zName){
+  size_t nDir = strlen(zDir);
+  size_t nName = strlen(zName);
+  char *z = fossil_malloc(nDir + nName + 2);
+  memcpy(z, zDir, nDir);
+  z[nDir] = '/';
+  memcpy(&z[nDir+1], zName, nName+1);
+  return z;
+}
+
+/*
+** Read the directory pItem->zPath.  Record the files in it that pass
+** the filters of pPool in pItem->aFile[], and prepend a new item to
+** *ppDirs for each subdirectory that ought to be scanned.  This does
+** the same work for one directory as vfile_scan() but without using
+** the database or the cached file status, so it is run by the worker
+** threads.
+*/
+static void vfile_scan_one_dir(
+  VfileScanPool *pPool,     /* Filters and flags for the scan */
+  VfileScanItem *pItem,     /* The directory to read */
+  VfileScanItem **ppDirs    /* Prepend subdirectories to this list */
+){
+  const int nPrefix = pPool->nPrefix;
+  const unsigned scanFlags = pPool->scanFlags;
+  const int eFType = pPool->eFType;
+  DIR *d;
+  struct dirent *pEntry;
+  void *zNative;
+
+  zNative = fossil_utf8_to_path(pItem->zPath, 1);
+  d = opendir(zNative);
+  if( d ){
+    while( (pEntry=readdir(d))!=0 ){
+      char *zPath;
+      char *zUtf8;
+      int isDir, isFile;
+      FileStatInfo info;
+      int eInfo = -1;       /* The eFType with which info was filled in */
+      if( pEntry->d_name[0]=='.' ){
+        if( (scanFlags & SCAN_ALL)==0 ) continue;
+        if( pEntry->d_name[1]==0 ) continue;
+        if( pEntry->d_name[1]=='.' && pEntry->d_name[2]==0 ) continue;
+      }
+      zUtf8 = fossil_path_to_utf8(pEntry->d_name);
+      zPath = vfile_scan_join(pItem->zPath, zUtf8);
+      if( glob_match(pPool->pIgnore1, &zPath[nPrefix+1]) ||
+          glob_match(pPool->pIgnore2, &zPath[nPrefix+1]) ){
+        isDir = isFile = 0;
+#ifdef _DIRENT_HAVE_D_TYPE
+      }else if( pEntry->d_type!=DT_UNKNOWN && pEntry->d_type!=DT_LNK ){
+        isDir = pEntry->d_type==DT_DIR;
+        isFile = pEntry->d_type==DT_REG;
+#endif
+      }else{
+        file_stat_info(zPath, eFType, &info);
+        eInfo = eFType;
+        isDir = info.isDir;
+        isFile = 0;
+        if( !isDir ){
+          if( eInfo!=RepoFILE ){
+            file_stat_info(zPath, RepoFILE, &info);
+            eInfo = RepoFILE;
+          }
+          isFile = info.isFileOrLink;
+        }
+      }
+      if( isDir ){
+        char *zSlash = vfile_scan_join(&zPath[nPrefix+1], "");
+        if( !glob_match(pPool->pIgnore1, zSlash)
+         && !glob_match(pPool->pIgnore2, zSlash)
+         && !vfile_top_of_checkout(zPath)
+        ){
+          VfileScanItem *pSub = fossil_malloc_zero(sizeof(*pSub));
+          pSub->zPath = zPath;
+          zPath = 0;
+          pSub->pNext = *ppDirs;
+          *ppDirs = pSub;
+        }
+        fossil_free(zSlash);
+      }else if( isFile ){
+        if( (scanFlags & SCAN_TEMP)==0 || is_temporary_file(zUtf8) ){
+          VfileScanFile *pFile;
+          if( pItem->nFile>=pItem->nAlloc ){
+            pItem->nAlloc = pItem->nAlloc*2 + 20;
+            pItem->aFile = fossil_realloc(pItem->aFile,
+                                 pItem->nAlloc*sizeof(pItem->aFile[0]));
+          }
+          pFile = &pItem->aFile[pItem->nFile++];
+          memset(pFile, 0, sizeof(*pFile));
+          pFile->zName = fossil_strdup(&zPath[nPrefix+1]);
+          if( scanFlags & (SCAN_MTIME|SCAN_SIZE|SCAN_ISEXE) ){
+            if( eInfo!=eFType ) file_stat_info(zPath, eFType, &info);
+            pFile->mtime = info.mtime;
+            pFile->size = info.size;
+            pFile->isExe = info.perm==PERM_EXE;
+          }
+        }
+      }
+      fossil_free(zPath);
+      fossil_path_free(zUtf8);
+    }
+    closedir(d);
+  }
+  fossil_path_free(zNative);
+}
+
+/*
+** Claim directories from pPool and read them until there are none
+** left and no other thread is still reading one that might contain
+** more.  Each directory read goes onto pPool->pDone.  This is the body
+** of each worker thread of vfile_scan_parallel().
+*/
+static void *vfile_scan_worker(void *pArg){
+  VfileScanPool *pPool = (VfileScanPool*)pArg;
+  pthread_mutex_lock(&pPool->mutex);
+  for(;;){
+    VfileScanItem *pItem, *pDirs = 0;
+    while( pPool->pTodo==0 && pPool->nBusy>0 ){
+      pthread_cond_wait(&pPool->cond, &pPool->mutex);
+    }
+    pItem = pPool->pTodo;
+    if( pItem==0 ) break;
+    pPool->pTodo = pItem->pNext;
+    pPool->nBusy++;
+    pthread_mutex_unlock(&pPool->mutex);
+    vfile_scan_one_dir(pPool, pItem, &pDirs);
+    pthread_mutex_lock(&pPool->mutex);
+    while( pDirs ){
+      VfileScanItem *pNext = pDirs->pNext;
+      pDirs->pNext = pPool->pTodo;
+      pPool->pTodo = pDirs;
+      pDirs = pNext;
+    }
+    pItem->pNext = pPool->pDone;
+    pPool->pDone = pItem;
+    pPool->nBusy--;
+    pthread_cond_broadcast(&pPool->cond);
+  }
+  pthread_mutex_unlock(&pPool->mutex);
+  return 0;
+}
+
+/*
+** Number of rows inserted into SFILE by each multi-row INSERT
+** statement of vfile_scan_parallel()
+*/
+#define VFILE_SCAN_BATCH 50
+
+/*
+** Prepare a statement that inserts nRow files into SFILE, binding
+** parameters ?1 through ?4 for the first row, ?5 through ?8 for the
+** second, and so forth.  The mtime, size and isexe columns are only
+** set if requested by scanFlags, but their parameters are always
+** counted.
+*/
+static void vfile_scan_prepare(Stmt *pStmt, int nRow, unsigned scanFlags){
+  Blob sql;
+  int i;
+  blob_init(&sql, 0, 0);
+  blob_append_sql(&sql,
+    "INSERT OR IGNORE INTO sfile(pathname%s%s%s)"
+    " SELECT * FROM (VALUES",
+    scanFlags & SCAN_MTIME ? ",mtime"  : "",
+    scanFlags & SCAN_SIZE  ? ",size"   : "",
+    scanFlags & SCAN_ISEXE ? ",isexe"  : ""
+  );
+  for(i=0; i<nRow; i++){
+    blob_append_sql(&sql, "%s(?%d", i ? "," : "", i*4+1);
+    if( scanFlags & SCAN_MTIME ) blob_append_sql(&sql, ",?%d", i*4+2);
+    if( scanFlags & SCAN_SIZE )  blob_append_sql(&sql, ",?%d", i*4+3);
+    if( scanFlags & SCAN_ISEXE ) blob_append_sql(&sql, ",?%d", i*4+4);
+    blob_append_sql(&sql, ")");
+  }
+  blob_append_sql(&sql,
+    ") WHERE NOT EXISTS(SELECT 1 FROM vfile WHERE pathname=column1 %s)",
+    filename_collation()
+  );
+  db_prepare_blob(pStmt, &sql);
+}
+
+/*
+** Insert the nRow files of aFile[] into SFILE using pStmt, which was
+** prepared by vfile_scan_prepare() for nRow rows, then free the names.
+*/
+static void vfile_scan_insert(
+  Stmt *pStmt,              /* The INSERT statement */
+  VfileScanFile *aFile,     /* Files to insert */
+  int nRow,                 /* Number of entries in aFile[] */
+  unsigned scanFlags        /* Zero or more SCAN_xxx flags */
+){
+  int i;
+  for(i=0; i<nRow; i++){
+    sqlite3_bind_text(pStmt->pStmt, i*4+1, aFile[i].zName, -1, SQLITE_STATIC);
+    if( scanFlags & SCAN_MTIME ){
+      sqlite3_bind_int64(pStmt->pStmt, i*4+2, aFile[i].mtime);
+    }
+    if( scanFlags & SCAN_SIZE ){
+      sqlite3_bind_int64(pStmt->pStmt, i*4+3, aFile[i].size);
+    }
+    if( scanFlags & SCAN_ISEXE ){
+      sqlite3_bind_int(pStmt->pStmt, i*4+4, aFile[i].isExe);
+    }
+  }
+  db_step(pStmt);
+  db_reset(pStmt);
+  for(i=0; i<nRow; i++) fossil_free(aFile[i].zName);
+}
+
+/*
+** Do the same as vfile_scan() for a RepoFILE or SymFILE scan, but read
+** the directories using nThread threads.  Each thread claims the next
+** directory from a shared list, and adds the subdirectories that it
+** finds to that same list, so that all threads stay busy however the
+** tree is shaped.  Glob filtering and stat() calls happen in the
+** threads.  The main thread reads directories too, and between them
+** it saves the files found so far into SFILE, VFILE_SCAN_BATCH rows
+** at a time.
+*/
+static void vfile_scan_parallel(
+  const char *zPath,        /* Directory to be scanned */
+  int nPrefix,              /* Number of bytes in directory name */
+  unsigned scanFlags,       /* Zero or more SCAN_xxx flags */
+  Glob *pIgnore1,           /* Do not add files that match this GLOB */
+  Glob *pIgnore2,           /* Omit files matching this GLOB too */
+  int eFType,               /* RepoFILE or SymFILE */
+  int nThread               /* Number of threads to use */
+){
+  VfileScanPool pool;
+  pthread_t aThread[64];
+  int nStarted = 0;
+  int i;
+  Stmt insBatch, insOne;
+  VfileScanFile aPending[VFILE_SCAN_BATCH];
+  int nPending = 0;
+
+  memset(&pool, 0, sizeof(pool));
+  pthread_mutex_init(&pool.mutex, 0);
+  pthread_cond_init(&pool.cond, 0);
+  pool.nPrefix = nPrefix;
+  pool.scanFlags = scanFlags;
+  pool.pIgnore1 = pIgnore1;
+  pool.pIgnore2 = pIgnore2;
+  pool.eFType = eFType;
+  pool.pTodo = fossil_malloc_zero(sizeof(VfileScanItem));
+  pool.pTodo->zPath = fossil_strdup(zPath);
+  vfile_scan_prepare(&insBatch, VFILE_SCAN_BATCH, scanFlags);
+  vfile_scan_prepare(&insOne, 1, scanFlags);
+
+  while( nStarted<nThread-1
+      && pthread_create(&aThread[nStarted], 0, vfile_scan_worker, &pool)==0
+  ){
+    nStarted++;
+  }
+
+  /* The main thread reads one directory at a time, like the workers,
+  ** and then saves everything that has been found so far. */
+  for(;;){
+    VfileScanItem *pItem, *pDirs = 0, *pDone;
+    int isLast;
+    pthread_mutex_lock(&pool.mutex);
+    pItem = pool.pTodo;
+    if( pItem ){
+      pool.pTodo = pItem->pNext;
+      pool.nBusy++;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    if( pItem ) vfile_scan_one_dir(&pool, pItem, &pDirs);
+    pthread_mutex_lock(&pool.mutex);
+    while( pDirs ){
+      VfileScanItem *pNext = pDirs->pNext;
+      pDirs->pNext = pool.pTodo;
+      pool.pTodo = pDirs;
+      pDirs = pNext;
+    }
+    if( pItem ){
+      pItem->pNext = pool.pDone;
+      pool.pDone = pItem;
+      pool.nBusy--;
+      pthread_cond_broadcast(&pool.cond);
+    }else{
+      while( pool.pTodo==0 && pool.pDone==0 && pool.nBusy>0 ){
+        pthread_cond_wait(&pool.cond, &pool.mutex);
+      }
+    }
+    pDone = pool.pDone;
+    pool.pDone = 0;
+    isLast = pool.pTodo==0 && pool.nBusy==0;
+    pthread_mutex_unlock(&pool.mutex);
+    while( pDone ){
+      VfileScanItem *pNext = pDone->pNext;
+      for(i=0; i<pDone->nFile; i++){
+        aPending[nPending++] = pDone->aFile[i];
+        if( nPending==VFILE_SCAN_BATCH ){
+          vfile_scan_insert(&insBatch, aPending, nPending, scanFlags);
+          nPending = 0;
+        }
+      }
+      fossil_free(pDone->aFile);
+      fossil_free(pDone->zPath);
+      fossil_free(pDone);
+      pDone = pNext;
+    }
+    if( isLast ) break;
+  }
+  for(i=0; i<nPending; i++){
+    vfile_scan_insert(&insOne, &aPending[i], 1, scanFlags);
+  }
+
+  for(i=0; i<nStarted; i++) pthread_join(aThread[i], 0);
+  pthread_cond_destroy(&pool.cond);
+  pthread_mutex_destroy(&pool.mutex);
+  db_finalize(&insOne);
+  db_finalize(&insBatch);
+}
+#endif /* FOSSIL_HAVE_PTHREAD */
+
 /*
 ** Load into table SFILE the name of every ordinary file in
 ** the directory pPath.   Omit the first nPrefix characters of
@@ -457,6 +1725,9 @@ static int is_temporary_file(const char *zName){
 ** Any files or directories that match the glob patterns pIgnore*
 ** are excluded from the scan.  Name matching occurs after the
 ** first nPrefix characters are elided from the filename.
+**
+** Unless eFType==ExtFILE, the directories are read by the number of
+** threads given by the checkout-threads setting.
 */
 void vfile_scan(
   Blob *pPath,           /* Directory to be scanned */
@@ -483,6 +1754,17 @@ void vfile_scan(
   }
   if( skipAll ) return;
 
+#ifdef FOSSIL_HAVE_PTHREAD
+  if( depth==0 && eFType!=ExtFILE ){
+    int nThread = vfile_thread_count();
+    if( nThread>1 ){
+      vfile_scan_parallel(blob_str(pPath), nPrefix, scanFlags,
+                          pIgnore1, pIgnore2, eFType, nThread);
+      return;
+    }
+  }
+#endif
+
   if( depth==0 ){
     if( eFType==ExtFILE ){
       db_prepare(&ins,
@@ -696,6 +1978,233 @@ int vfile_dir_scan(
   return result;
 }
 
+/*
+** VFILE.CKSUM caches the progress of the aggregate checksum, which is a
+** single MD5 over the name, size and content of every file in name order.
+** The value is "FP STATE".  STATE is the state of the incremental MD5
+** checksum, from md5sum_save_state(), just after the file was added.  FP
+** is the MD5 hash of the state just before the file was added, of the
+** name under which it was added, and of the artifact hash of its content.
+** Whenever an aggregate checksum comes to a file with a matching FP, it
+** jumps to STATE without reading the file.
+**
+** So an aggregate checksum only reads the files from the first one that
+** differs from the previous computation onwards.  Only the checksum of
+** the disk image that "fossil commit" records on the R-card uses this
+** cache.  The self-checks that follow the commit, and those of "fossil
+** checkout", compute their checksums from scratch, so that they can catch
+** errors in the cache itself.
+*/
+
+/*
+** Write into zFp the FP value that VFILE.CKSUM must have for the file
+** named zName, with content whose artifact hash is zKey, to be added to
+** the aggregate checksum in its current state.  zFp must hold 33 bytes.
+*/
+static void vfile_cksum_fp(const char *zName, const char *zKey, char *zFp){
+  char zState[MD5_STATE_SIZE];
+  Blob x, hash;
+  md5sum_save_state(zState);
+  blob_init(&x, 0, 0);
+  blob_appendf(&x, "%s\n%s\n%s", zState, zName, zKey);
+  md5sum_blob(&x, &hash);
+  memcpy(zFp, blob_buffer(&hash), 32);
+  zFp[32] = 0;
+  blob_reset(&hash);
+  blob_reset(&x);
+}
+
+/*
+** If zCksum, a VFILE.CKSUM value, has an FP of zFp, move the aggregate
+** checksum past the file and return true.  Otherwise return false.
+*/
+static int vfile_cksum_skip(const char *zCksum, const char *zFp){
+  return zCksum!=0 && strncmp(zCksum, zFp, 32)==0 && zCksum[32]==' '
+      && md5sum_restore_state(&zCksum[33])==0;
+}
+
+/*
+** Record in VFILE.CKSUM of entry id that a file with FP value zFp has
+** just been added to the aggregate checksum.
+*/
+static void vfile_cksum_save(int id, const char *zFp){
+  static Stmt q;
+  char zCksum[MD5_STATE_SIZE+40];
+  sqlite3_snprintf(34, zCksum, "%s ", zFp);
+  md5sum_save_state(&zCksum[33]);
+  db_static_prepare(&q, "UPDATE vfile SET cksum=:cksum WHERE id=:id");
+  db_bind_text(&q, ":cksum", zCksum);
+  db_bind_int(&q, ":id", id);
+  db_step(&q);
+  db_reset(&q);
+}
+
+/*
+** Add the file zName, with content pContent, to the aggregate checksum.
+** If zFp is not NULL, record the result in VFILE.CKSUM of entry id.
+*/
+static void vfile_cksum_add(
+  int id,                       /* VFILE.ID, or 0 if none */
+  const char *zName,            /* Name of the file */
+  Blob *pContent,               /* Content of the file */
+  const char *zFp               /* FP value for VFILE.CKSUM, or NULL */
+){
+  char zBuf[100];
+  md5sum_step_text(zName, -1);
+  sqlite3_snprintf(sizeof(zBuf), zBuf, " %d\n", blob_size(pContent));
+  md5sum_step_text(zBuf, -1);
+  md5sum_step_blob(pContent);
+  if( zFp && id>0 ) vfile_cksum_save(id, zFp);
+}
+
+/*
+** One file for vfile_aggregate_checksum_disk()
+*/
+typedef struct VfileSum VfileSum;
+struct VfileSum {
+  char *zFullpath;      /* Full pathname of the file */
+  char *zName;          /* VFILE.PATHNAME */
+  char *zOrigName;      /* VFILE.ORIGNAME, or NULL */
+  int isSelected;       /* Use the disk image */
+  int id;               /* VFILE.ID */
+  int rid;              /* VFILE.RID */
+  char *zUuid;          /* Hash of VFILE.RID */
+  char *zMUuid;         /* Hash of VFILE.MRID */
+  char *zFstat;         /* VFILE.FSTAT */
+  char *zCksum;         /* VFILE.CKSUM */
+  int isLink;           /* The disk image is a symlink */
+  int isTrusted;        /* VFILE.FSTAT shows the disk image to be MRID */
+  int isRead;           /* content and rc are filled in */
+  int rc;               /* 0 if content was read.  -1 if it could not be */
+  FileStatInfo info;    /* The disk image as seen by file_stat_info() */
+  Blob content;         /* Content of the disk image */
+};
+
+/*
+** Largest number of files, and of bytes, that
+** vfile_aggregate_checksum_disk() reads at once
+*/
+#define VFILE_SUM_FILES  256
+#define VFILE_SUM_BYTES  (16*1024*1024)
+
+/*
+** Stat the disk images of the selected files among the first few of
+** the n entries in a[].  Return the number of entries dealt with,
+** which is always at least one.
+*/
+static int vfile_sum_stat(VfileSum *a, int n){
+  const char *azName[VFILE_SUM_FILES];
+  FileStatInfo aInfo[VFILE_SUM_FILES];
+  int i, nStat = 0;
+
+  if( n>VFILE_SUM_FILES ) n = VFILE_SUM_FILES;
+  for(i=0; i<n; i++){
+    if( a[i].isSelected ) azName[nStat++] = a[i].zFullpath;
+  }
+  file_stat_info_batch(nStat, azName, RepoFILE, aInfo);
+  nStat = 0;
+  for(i=0; i<n; i++){
+    if( !a[i].isSelected ) continue;
+    a[i].info = aInfo[nStat++];
+    a[i].isLink = a[i].info.perm==PERM_LNK;
+    a[i].isTrusted = vfile_fstat_trusted(a[i].zFstat, a[i].zMUuid,
+                                         &a[i].info);
+  }
+  return n;
+}
+
+/*
+** Read the disk images of the selected files, other than symlinks,
+** among the first few of the n entries in a[], which have already been
+** passed to vfile_sum_stat().  Return the number of entries dealt with,
+** which is always at least one.
+*/
+static int vfile_sum_read(VfileSum *a, int n){
+  const char *azName[VFILE_SUM_FILES];
+  Blob aContent[VFILE_SUM_FILES];
+  int aRc[VFILE_SUM_FILES];
+  int aIdx[VFILE_SUM_FILES];
+  int i, nRead = 0;
+  i64 nByte = 0;
+
+  if( n>VFILE_SUM_FILES ) n = VFILE_SUM_FILES;
+  for(i=0; i<n; i++){
+    if( !a[i].isSelected || a[i].isLink || a[i].isRead ) continue;
+    if( nRead>0 && nByte+a[i].info.size>VFILE_SUM_BYTES ) break;
+    if( a[i].info.size>0 ) nByte += a[i].info.size;
+    aIdx[nRead] = i;
+    azName[nRead++] = a[i].zFullpath;
+  }
+  n = i;
+  file_read_batch(nRead, azName, aContent, aRc);
+  for(i=0; i<nRead; i++){
+    a[aIdx[i]].content = aContent[i];
+    a[aIdx[i]].rc = aRc[i];
+    a[aIdx[i]].isRead = 1;
+  }
+  return n;
+}
+
+/*
+** Add the file a[0] to the aggregate checksum for
+** vfile_aggregate_checksum_disk(), unless useCache is true and
+** VFILE.CKSUM shows that it need not be read.  a[1] through a[n-1] are
+** the following files that have been passed to vfile_sum_stat(), which
+** may be read at the same time.
+*/
+static void vfile_sum_one(VfileSum *a, int n, int useCache){
+  VfileSum *p = &a[0];
+  const char *zName;
+  const char *zKey;
+  char zFp[33];
+  Blob content;
+  Blob hash;
+
+  if( p->isSelected ){
+    zName = p->zName;
+    zKey = p->isTrusted ? p->zMUuid : 0;
+  }else if( p->rid>0 ){
+    zName = p->zOrigName ? p->zOrigName : p->zName;
+    zKey = p->zUuid;
+  }else{
+    return;
+  }
+  if( useCache && zKey ){
+    vfile_cksum_fp(zName, zKey, zFp);
+    if( vfile_cksum_skip(p->zCksum, zFp) ) return;
+  }
+  blob_zero(&hash);
+  if( !p->isSelected ){
+    content_get(p->rid, &content);
+  }else if( p->isLink ){
+    /* Instead of file content, use link destination path */
+    blob_read_link(&content, p->zFullpath);
+  }else{
+    if( !p->isRead ) vfile_sum_read(a, n);
+    content = p->content;
+    blob_zero(&p->content);
+    if( p->rc<0 ){
+      /* A missing file.  Leave VFILE.CKSUM alone */
+      md5sum_step_text(zName, -1);
+      md5sum_step_text(" 0\n", -1);
+      blob_reset(&content);
+      return;
+    }
+  }
+  if( !useCache ){
+    vfile_cksum_add(0, zName, &content, 0);
+  }else{
+    if( zKey==0 ){
+      hname_hash(&content, 0, &hash);
+      zKey = blob_str(&hash);
+      vfile_cksum_fp(zName, zKey, zFp);
+    }
+    vfile_cksum_add(p->id, zName, &content, zFp);
+  }
+  blob_reset(&content);
+  blob_reset(&hash);
+}
+
 /*
 ** Compute an aggregate MD5 checksum over the disk image of every
 ** file in vid.  The file names are part of the checksum.  The resulting
@@ -715,76 +2224,83 @@ int vfile_dir_scan(
 ** Renamed files use their new name if they are in Global.aCommitFile[]
 ** and their original name if they are not in Global.aCommitFile[]
 **
+** Unchanged files outside of a sparse check-out also use the repository
+** image, since they are not on disk.
+**
+** If useCache is true, files are only read from the first one whose name
+** or content differs from the previous computation recorded in
+** VFILE.CKSUM.  A disk image is taken to hold the content of VFILE.MRID
+** when VFILE.FSTAT says so.  Other disk images are hashed to decide their
+** place in VFILE.CKSUM.  If useCache is false, every file is read and
+** VFILE.CKSUM is neither used nor changed, as is needed for checksums
+** that verify the outcome of an operation.
+**
+** Disk images are stat'ed and read a batch at a time, so that where
+** io_uring is available many requests are in flight at once.
+**
 ** Return the resulting checksum in blob pOut.
 */
-void vfile_aggregate_checksum_disk(int vid, Blob *pOut){
-  FILE *in;
+void vfile_aggregate_checksum_disk(int vid, Blob *pOut, int useCache){
   Stmt q;
-  char zBuf[4096];
+  VfileSum *a = 0;
+  int n = 0, nAlloc = 0;
+  int i;
 
   db_must_be_within_tree();
   db_prepare(&q,
-      "SELECT %Q || pathname, pathname, origname, is_selected(id), rid"
+      "SELECT %Q || pathname, pathname, origname,"
+      "       is_selected(id) AND NOT %s, rid, id,"
+      "       (SELECT uuid FROM blob WHERE blob.rid=vfile.rid),"
+      "       (SELECT uuid FROM blob WHERE blob.rid=vfile.mrid),"
+      "       fstat, cksum"
       "  FROM vfile"
       " WHERE (NOT deleted OR NOT is_selected(id)) AND vid=%d"
       " ORDER BY if_selected(id, pathname, origname) /*scan*/",
-      g.zLocalRoot, vid
+      g.zLocalRoot, sparse_hidden_sql(), vid
   );
-  md5sum_init();
   while( db_step(&q)==SQLITE_ROW ){
-    const char *zFullpath = db_column_text(&q, 0);
-    const char *zName = db_column_text(&q, 1);
-    int isSelected = db_column_int(&q, 3);
-
-    if( isSelected ){
-      md5sum_step_text(zName, -1);
-      if( file_islink(zFullpath) ){
-        /* Instead of file content, use link destination path */
-        Blob pathBuf;
-
-        sqlite3_snprintf(sizeof(zBuf), zBuf, " %ld\n",
-                         blob_read_link(&pathBuf, zFullpath));
-        md5sum_step_text(zBuf, -1);
-        md5sum_step_text(blob_str(&pathBuf), -1);
-        blob_reset(&pathBuf);
-      }else{
-        in = fossil_fopen(zFullpath,"rb");
-        if( in==0 ){
-          md5sum_step_text(" 0\n", -1);
-          continue;
-        }
-        fseek(in, 0L, SEEK_END);
-        sqlite3_snprintf(sizeof(zBuf), zBuf, " %ld\n", ftell(in));
-        fseek(in, 0L, SEEK_SET);
-        md5sum_step_text(zBuf, -1);
-        /*printf("%s %s %s",md5sum_current_state(),zName,zBuf);fflush(stdout);*/
-        for(;;){
-          int n;
-          n = fread(zBuf, 1, sizeof(zBuf), in);
-          if( n<=0 ) break;
-          md5sum_step_text(zBuf, n);
-        }
-        fclose(in);
-      }
-    }else{
-      int rid = db_column_int(&q, 4);
-      const char *zOrigName = db_column_text(&q, 2);
-      char zBuf[100];
-      Blob file;
-
-      if( zOrigName ) zName = zOrigName;
-      if( rid>0 ){
-        md5sum_step_text(zName, -1);
-        blob_zero(&file);
-        content_get(rid, &file);
-        sqlite3_snprintf(sizeof(zBuf), zBuf, " %d\n", blob_size(&file));
-        md5sum_step_text(zBuf, -1);
-        md5sum_step_blob(&file);
-        blob_reset(&file);
-      }
+    VfileSum *p;
+    if( n>=nAlloc ){
+      nAlloc = nAlloc*2 + 100;
+      a = fossil_realloc(a, nAlloc*sizeof(a[0]));
     }
+    p = &a[n++];
+    memset(p, 0, sizeof(*p));
+    p->zFullpath = fossil_strdup(db_column_text(&q, 0));
+    p->zName = fossil_strdup(db_column_text(&q, 1));
+    p->zOrigName = fossil_strdup(db_column_text(&q, 2));
+    p->isSelected = db_column_int(&q, 3);
+    p->rid = db_column_int(&q, 4);
+    p->id = db_column_int(&q, 5);
+    p->zUuid = fossil_strdup(db_column_text(&q, 6));
+    p->zMUuid = fossil_strdup(db_column_text(&q, 7));
+    p->zFstat = fossil_strdup(db_column_text(&q, 8));
+    p->zCksum = fossil_strdup(db_column_text(&q, 9));
+    blob_zero(&p->content);
   }
   db_finalize(&q);
+
+  db_begin_transaction();
+  md5sum_init();
+  for(i=0; i<n; ){
+    int nBatch = vfile_sum_stat(&a[i], n-i);
+    int j;
+    for(j=i; j<i+nBatch; j++){
+      VfileSum *p = &a[j];
+      vfile_sum_one(p, i+nBatch-j, useCache);
+      blob_reset(&p->content);
+      fossil_free(p->zFullpath);
+      fossil_free(p->zName);
+      fossil_free(p->zOrigName);
+      fossil_free(p->zUuid);
+      fossil_free(p->zMUuid);
+      fossil_free(p->zFstat);
+      fossil_free(p->zCksum);
+    }
+    i += nBatch;
+  }
+  db_end_transaction(0);
+  fossil_free(a);
   md5sum_finish(pOut);
 }
 
@@ -816,9 +2332,9 @@ void vfile_compare_repository_to_disk(int vid){
   db_must_be_within_tree();
   db_prepare(&q,
       "SELECT %Q || pathname, pathname, rid FROM vfile"
-      " WHERE NOT deleted AND vid=%d AND is_selected(id)"
+      " WHERE NOT deleted AND vid=%d AND is_selected(id) AND NOT %s"
       " ORDER BY if_selected(id, pathname, origname) /*scan*/",
-      g.zLocalRoot, vid
+      g.zLocalRoot, vid, sparse_hidden_sql()
   );
   md5sum_init();
   while( db_step(&q)==SQLITE_ROW ){
@@ -962,23 +2478,91 @@ void vfile_aggregate_checksum_manifest(int vid, Blob *pOut, Blob *pManOut){
 ** different ways.  The aggregate checksum is used during "fossil commit"
 ** to double-check that the information about to be committed to the
 ** repository exactly matches the information currently in the check-out.
+**
+** Options:
+**   --forget             Forget the checksum states cached in VFILE.CKSUM
+**                        first, so that every file is read
+**   --uring              Read the disk images using io_uring, if the
+**                        kernel allows it
+**   --no-uring           Do not use io_uring
 */
 void test_agg_cksum_cmd(void){
   int vid;
   Blob hash, hash2;
+  i64 iStart;
+  int bForget;
+  if( find_option("uring",0,0)!=0 ) uring_override(1);
+  if( find_option("no-uring",0,0)!=0 ) uring_override(0);
+  bForget = find_option("forget",0,0)!=0;
   db_must_be_within_tree();
+  verify_all_options();
+  if( bForget ) db_multi_exec("UPDATE vfile SET cksum=NULL");
   vid = db_lget_int("checkout", 0);
-  vfile_aggregate_checksum_disk(vid, &hash);
-  printf("disk:     %s\n", blob_str(&hash));
+  iStart = file_current_time_ns();
+  vfile_aggregate_checksum_disk(vid, &hash, 1);
+  printf("disk:     %s  (%.3f ms)\n", blob_str(&hash),
+         (file_current_time_ns() - iStart)/1000000.0);
+  blob_reset(&hash);
+  iStart = file_current_time_ns();
+  vfile_aggregate_checksum_disk(vid, &hash, 0);
+  printf("uncached: %s  (%.3f ms)\n", blob_str(&hash),
+         (file_current_time_ns() - iStart)/1000000.0);
   blob_reset(&hash);
+  iStart = file_current_time_ns();
   vfile_aggregate_checksum_repository(vid, &hash);
-  printf("archive:  %s\n", blob_str(&hash));
+  printf("archive:  %s  (%.3f ms)\n", blob_str(&hash),
+         (file_current_time_ns() - iStart)/1000000.0);
   blob_reset(&hash);
+  iStart = file_current_time_ns();
   vfile_aggregate_checksum_manifest(vid, &hash, &hash2);
-  printf("manifest: %s\n", blob_str(&hash));
+  printf("manifest: %s  (%.3f ms)\n", blob_str(&hash),
+         (file_current_time_ns() - iStart)/1000000.0);
   printf("recorded: %s\n", blob_str(&hash2));
 }
 
+/*
+** COMMAND: test-check-signature
+**
+** Usage: %fossil test-check-signature ?OPTIONS?
+**
+** Run the change detection that "fossil status" does, several times
+** over, and report the wall-clock time of each run and the number of
+** files that were hashed.  The first run is "cold" if --forget is used,
+** and the later ones show how well the saved stat signatures of
+** unchanged files work.
+**
+** Options:
+**   --forget             Forget all saved stat signatures first
+**   --hash               Verify file status using hashing rather than
+**                        relying on stat signatures or file mtimes
+**   --uring              Stat files using io_uring, if the kernel
+**                        allows it
+**   --no-uring           Do not use io_uring
+**   -n|--repeat N        Run N times.  Default: 2
+*/
+void test_check_signature_cmd(void){
+  int vid;
+  int i;
+  int nRepeat = 2;
+  int bForget = find_option("forget",0,0)!=0;
+  unsigned int flags = find_option("hash",0,0)!=0 ? CKSIG_HASH : 0;
+  const char *zRepeat = find_option("repeat","n",1);
+  if( zRepeat ) nRepeat = atoi(zRepeat);
+  if( find_option("uring",0,0)!=0 ) uring_override(1);
+  if( find_option("no-uring",0,0)!=0 ) uring_override(0);
+  db_must_be_within_tree();
+  verify_all_options();
+  vid = db_lget_int("checkout", 0);
+  if( bForget ) db_multi_exec("UPDATE vfile SET fstat=NULL");
+  for(i=1; i<=nRepeat; i++){
+    i64 iStart = file_current_time_ns();
+    int nHashed = vfileNHashed;
+    vfile_check_signature(vid, flags);
+    fossil_print("run %d: %.3f ms, %d files hashed\n", i,
+        (file_current_time_ns() - iStart)/1000000.0, vfileNHashed - nHashed);
+  }
+}
+
 /*
 ** This routine recomputes certain columns of the vfile and vmerge tables
 ** when the associated repository is swapped out for a clone of the same
@@ -283,6 +283,13 @@ static void xfer_accept_compressed_file(
     blob_reset(&content);
     return;
   }
+  if( blob_size(&content)>4 && (blob_buffer(&content)[0]&0x80)!=0 ){
+    /* Content compressed with the sender's dictionary cannot be used */
+    blob_appendf(&pXfer->err, "cfile %b uses an unknown compression",
+                 &pXfer->aToken[1]);
+    blob_reset(&content);
+    return;
+  }
   if( pXfer->nToken==5 ){
     srcid = rid_from_uuid(&pXfer->aToken[2], 1, isPriv);
     pXfer->nDeltaRcvd++;
@@ -626,6 +633,10 @@ static void send_file(Xfer *pXfer, int rid, Blob *pUuid, int nativeDelta){
 ** Send the file identified by rid as a compressed artifact.  Basically,
 ** send the content exactly as it appears in the BLOB table using
 ** a "cfile" card.
+**
+** Content that was compressed using the repository dictionary (see the
+** "compress-dictionary" setting) cannot be decoded by the receiver, so
+** it is uncompressed and compressed again without the dictionary.
 */
 static void send_compressed_file(Xfer *pXfer, int rid){
   const char *zContent;
@@ -636,6 +647,7 @@ static void send_compressed_file(Xfer *pXfer, int rid){
   int rc;
   int isPrivate;
   int srcIsPrivate;
+  int bRecompress = 0;
   static Stmt q1;
   Blob fullContent;
 
@@ -672,6 +684,16 @@ static void send_compressed_file(Xfer *pXfer, int rid){
       szC = blob_size(&fullContent);
       zContent = blob_buffer(&fullContent);
       zDelta = 0;
+      bRecompress = 1;
+    }else if( szC>4 && (zContent[0]&0x80)!=0 ){
+      blob_init(&fullContent, zContent, szC);
+      if( blob_uncompress(&fullContent, &fullContent) ){
+        fossil_fatal("cannot uncompress artifact %s", zUuid);
+      }
+      blob_compress(&fullContent, &fullContent);
+      szC = blob_size(&fullContent);
+      zContent = blob_buffer(&fullContent);
+      bRecompress = 1;
     }
     if( zDelta ){
       blob_appendf(pXfer->pOut, "%s ", zDelta);
@@ -684,7 +706,7 @@ static void send_compressed_file(Xfer *pXfer, int rid){
     if( blob_buffer(pXfer->pOut)[blob_size(pXfer->pOut)-1]!='\n' ){
       blob_append(pXfer->pOut, "\n", 1);
     }
-    if( !isPrivate && srcIsPrivate ){
+    if( bRecompress ){
       blob_reset(&fullContent);
     }
   }
@@ -98,6 +98,7 @@ set src {
   foci
   forum
   fshell
+  fsmonitor
   fusefs
   fuzz
   glob
@@ -168,6 +169,7 @@ set src {
   sitemap
   skins
   smtp
+  sparse
   sqlcmd
   stash
   stat
@@ -185,6 +187,7 @@ set src {
   unicode
   unversioned
   update
+  uring
   url
   user
   utf8